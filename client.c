@@ -12,14 +12,41 @@
 
 // Network Programming
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__linux__)
+    #include <linux/vm_sockets.h>
+#endif
+
+// TLS, built when the build finds OpenSSL and defines HAVE_OPENSSL
+#if defined(HAVE_OPENSSL)
+    #include <openssl/err.h>
+    #include <openssl/pem.h>
+    #include <openssl/ssl.h>
+    #include <openssl/x509v3.h>
+    #include <signal.h>
+    #include <sys/stat.h>
+#endif
+
+// Compression, built when the build finds zlib and defines HAVE_ZLIB
+#if defined(HAVE_ZLIB)
+    #define ZLIB_CONST
+    #include <zlib.h>
+#endif
 
 // Standard Library
 #include <getopt.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 // Macros
@@ -27,12 +54,288 @@
 #define BASE_TEN 10
 #define LINE_LENGTH 1024
 
+// Client Modes
+#define MODE_SINGLE 0
+#define MODE_SESSION 1
+#define MODE_PIPELINE 2
+#define MODE_BATCH 3
+
+// Session Protocol
+#define SESSION_MARKER 0
+#define FRAME_HEADER_LEN 9    // Type, request ID and payload length
+#define FRAME_COMMAND 1
+#define FRAME_OUTPUT 2
+#define FRAME_EXIT 3
+#define FRAME_ERROR 4
+#define FRAME_BUSY 7    // The server turned the command away, the payload is how many milliseconds to wait before retrying
+#define FRAME_COMMAND_TIMEOUT 8    // A command whose payload starts with how many milliseconds it may run
+#define TIMEOUT_EXIT_CODE 124    // What the server reports for a command it stopped at its deadline, as timeout(1) does
+#define FRAME_PIPELINE 9    // A timeout, then each stage's arguments NUL-terminated and closed by an empty one
+#define FRAME_PIPELINE_EXIT 10    // A pipeline's trailer, one exit code per stage in order
+#define MAX_PIPELINE_STAGES 16    // The server's limit for a pipeline
+#define PIPE_SEPARATOR '|'    // On its own between spaces, splits a command into pipeline stages
+#define FRAME_BATCH 11    // A timeout and how many of its commands may run at once, then the commands, each NUL-terminated
+#define FRAME_BATCH_RESULT 12    // One batch command's index, exit code, run time and flags, after its output
+#define MAX_BATCH_COMMANDS 64    // The server's limit for a batch
+#define MAX_BATCH_PARALLELISM 16    // The most commands of a batch the server runs at once
+#define BATCH_RESULT_LEN 20    // Index, exit code, microseconds run, high half first, and flags
+#define BATCH_OUTPUT_TRUNCATED 1    // Result flag: the server dropped part of the command's output
+#define MAX_COMMAND_LEN 4096    // The server's limit for a session command
+#define FRAME_FETCH 13    // A byte offset and length, high halves first, then the path of a file the server sends
+#define FETCH_HEADER_LEN 16
+#define FETCH_RANGE_SEPARATOR ':'    // Between the offset and length given to -o
+#define FRAME_USAGE 14    // Empty, asks for usage reports; otherwise a request's usage, ahead of its trailer
+#define USAGE_FIELDS 7    // Wall, user and system microseconds, max RSS in KiB, voluntary and involuntary switches, output bytes
+#define USAGE_LEN (USAGE_FIELDS * 2 * sizeof(uint32_t))    // Each field a high then a low 32-bit half
+#define USAGE_FORMAT_NONE 0
+#define USAGE_FORMAT_TEXT 1    // A line per request for people
+#define USAGE_FORMAT_JSON 2    // A JSON object per line for scripts
+
+// Socket Options
+#define SOCKET_NODELAY (1U << 0)     // Send every write straight away instead of waiting on Nagle's algorithm
+#define SOCKET_FASTOPEN (1U << 1)    // Send the request in the SYN once the server has handed out a cookie
+
+// Local Transports
+#define UNIX_PREFIX "unix:"      // Followed by the path of the server's Unix socket
+#define VSOCK_PREFIX "vsock:"    // Followed by the server's context ID
+#define ADDRESS_STR_LEN (sizeof(UNIX_PREFIX) + sizeof(((struct sockaddr_un *)NULL)->sun_path))
+
+// TLS, matching what the server accepts
+#if defined(HAVE_OPENSSL)
+    #define TLS_RELAY_CHUNK_LEN 16384    // The most plaintext one TLS record carries
+    #define TLS_CIPHERS "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305"
+    #if !defined(SSL_OP_ENABLE_KTLS)
+        #define SSL_OP_ENABLE_KTLS 0    // Older OpenSSL turns kTLS on by itself when it was built with it
+    #endif
+#endif
+
+// Output Compression
+#if defined(HAVE_ZLIB)
+    #define MAX_COMPRESSION_LEVEL 9
+    #define FRAME_COMPRESS 5
+    #define FRAME_OUTPUT_DEFLATE 6
+    #define COMPRESSION_DEFLATE 1
+    #define INFLATE_CHUNK_LEN 65536
+#endif
+
+// Benchmark
+#define BENCH_DEFAULT_CONNECTIONS 1
+#define BENCH_DEFAULT_REQUESTS 1000
+#define BENCH_MAX_CONNECTIONS 4096
+#define BENCH_IDLE 0
+#define BENCH_CONNECTING 1
+#define BENCH_SENDING 2
+#define BENCH_RECEIVING 3
+#define BENCH_DISCARD_LEN 65536
+#define MICROSECONDS_PER_SECOND 1000000
+#define MICROSECONDS_PER_MILLISECOND 1000
+#define NANOSECONDS_PER_MICROSECOND 1000
+#define PERCENT 100.0
+#define PERCENTILE_MEDIAN 50.0
+#define PERCENTILE_90 90.0
+#define PERCENTILE_99 99.0
+#define PERCENTILE_999 99.9
+#if defined(MSG_NOSIGNAL)
+    #define BENCH_SEND_FLAGS (MSG_DONTWAIT | MSG_NOSIGNAL)
+#else
+    #define BENCH_SEND_FLAGS MSG_DONTWAIT
+#endif
+
+// Fan-out
+#define FANOUT_DEFAULT_CONNECTIONS 64
+#define FANOUT_CONNECT_TIMEOUT 10000    // Milliseconds a host gets to accept the connection
+#define FANOUT_MAX_RESOLVERS 16    // Threads blocking in getaddrinfo, so a slow name server holds up one host rather than the list
+#define FANOUT_PENDING 0
+#define FANOUT_RESOLVING 1
+#define FANOUT_CONNECTING 2
+#define FANOUT_SENDING 3
+#define FANOUT_RECEIVING 4
+#define FANOUT_DONE 5
+#define FANOUT_CHUNK_LEN 65536
+#define FANOUT_STATUS_LEN 128
+
+// Latency Histogram
+#define HISTOGRAM_SUB_BUCKET_BITS 7    // 128 sub-buckets per power of two, under 2% error
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAGNITUDES 32    // Enough for days of latency in microseconds
+
+// ----- Data Types -----
+
+/**
+ * The output collected so far for one pipelined command.
+ */
+struct pipelined_reply
+{
+    char    *output;
+    size_t   len;
+    size_t   capacity;
+#if defined(HAVE_ZLIB)
+    z_stream inflate;
+    int      inflating;    // The inflate stream is set up, on the first compressed frame
+#endif
+};
+
+/**
+ * What the server answered for one command of a batch.
+ */
+struct batch_result
+{
+    struct pipelined_reply output;
+    int                    answered;
+    int                    exit_code;
+    uint64_t               run;    // Microseconds
+    uint32_t               flags;
+    int                    has_usage;
+    uint64_t               usage[USAGE_FIELDS];
+};
+
+/**
+ * What to run when benchmarking.
+ */
+struct benchmark_options
+{
+    int         enabled;
+    const char *connections_str;
+    const char *requests_str;
+    const char *rate_str;
+    size_t      connections;
+    uint64_t    requests;
+    uint64_t    rate;    // Requests per second across every connection, 0 to send as fast as possible
+};
+
+/**
+ * How to reach a server that speaks TLS.
+ */
+struct tls_options
+{
+    const char *ca_path;         // NULL to connect without TLS
+    const char *session_path;    // Where the session is kept between runs, NULL to start a new one every time
+};
+
+/**
+ * Everything the command line asks for, apart from the server's address and port.
+ */
+struct client_options
+{
+    char                   **commands;
+    int                      command_count;
+    int                      mode;    // One of the MODE_ values, a single command may still be upgraded to a session
+    struct benchmark_options benchmark;
+    struct tls_options       tls;
+    const char              *hosts_path;    // NULL unless fanning out with -f
+    const char              *compress_str;
+    const char              *timeout_str;
+    const char              *fetch_str;
+    const char              *socket_str;
+    const char              *usage_str;
+    int                      compress_level;    // 0 for uncompressed output
+    uint32_t                 timeout;           // Milliseconds, 0 for the server's limit
+    size_t                   fanout_connections;
+    uint32_t                 batch_parallelism;    // 0 to leave it to the server
+    uint64_t                 fetch_offset;
+    uint64_t                 fetch_length;    // 0 for the rest of the file
+    unsigned int             socket_options;
+    int                      usage_format;    // One of the USAGE_FORMAT_ values
+};
+
+#if defined(HAVE_OPENSSL)
+/**
+ * Moves plaintext between a TLS connection and the socket pair the client reads and writes,
+ * for connections the kernel could not take the keys for.
+ */
+struct tls_relay
+{
+    SSL      *ssl;
+    int       sockfd;
+    int       local_fd;
+    pthread_t thread;    // Joined by tls_close, so the SSL object is freed before the client exits
+};
+#endif
+
+/**
+ * Counts of recorded values in log-linear buckets, in the style of an HDR histogram: every
+ * power of two is split into the same number of linear sub-buckets, so the relative error
+ * stays the same from microseconds to minutes.
+ */
+struct latency_histogram
+{
+    uint64_t counts[HISTOGRAM_MAGNITUDES][HISTOGRAM_SUB_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+};
+
+/**
+ * One benchmark connection and the request it is working on.
+ */
+struct bench_connection
+{
+    int      fd;
+    int      state;
+    uint8_t  request[1 + FRAME_HEADER_LEN + MAX_COMMAND_LEN];
+    size_t   request_len;
+    size_t   request_sent;
+    uint8_t  header[FRAME_HEADER_LEN];
+    size_t   header_len;
+    uint32_t payload_left;
+    uint32_t id;
+    uint64_t started;    // When the request was due to start, in microseconds
+};
+
+/**
+ * One host of a fan-out and how far its command has got.
+ */
+struct fanout_host
+{
+    char                    name[NI_MAXHOST];    // The entry from the host list, every output line is prefixed with it
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    int                     fd;
+    int                     state;
+    size_t                  request_sent;
+    uint8_t                 header[FRAME_HEADER_LEN];
+    size_t                  header_len;
+    uint32_t                payload_left;
+    uint8_t                 payload[FANOUT_STATUS_LEN];    // The start of a frame other than output
+    size_t                  payload_len;
+    char                   *line;    // Output after the last newline
+    size_t                  line_len;
+    size_t                  line_capacity;
+    uint64_t                deadline;    // When connecting gives up, in microseconds
+    int                     exit_code;
+    char                    status[FANOUT_STATUS_LEN];    // Why the command did not run to completion, empty if it did
+};
+
+/**
+ * The threads that resolve fan-out hosts once they have a connection slot. Both queues only
+ * grow, as every host is resolved at most once.
+ */
+struct fanout_resolver
+{
+    pthread_mutex_t     lock;
+    pthread_cond_t      queued;
+    struct fanout_host *hosts;
+    in_port_t           port;
+    size_t             *pending;    // Hosts waiting for a thread
+    size_t              pending_count;
+    size_t              pending_taken;
+    size_t             *resolved;    // Hosts with an address or a status, in the order they finished
+    size_t              resolved_count;
+    int                 wake_fds[2];    // The poll loop watches the first, a byte is written to the second for each result
+    int                 stopping;
+    pthread_t           threads[FANOUT_MAX_RESOLVERS];
+    size_t              thread_count;
+};
+
 // ----- Function Headers -----
 
 // Argument Parsing
-static void      parse_arguments(int argc, char *argv[], char **ip_address, char **port, char **command);
-static void      handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, const char *command, in_port_t *port);
-static in_port_t parse_in_port_t(const char *binary_name, const char *port_str);
+static void         parse_arguments(int argc, char *argv[], char **ip_address, char **port, struct client_options *options);
+static void         handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, in_port_t *port, struct client_options *options);
+static in_port_t    parse_in_port_t(const char *binary_name, const char *port_str);
+static uint64_t     parse_count(const char *binary_name, const char *count_str, uint64_t default_value, uint64_t max_value, const char *message);
+static void         parse_fetch_range(const char *binary_name, const char *fetch_str, uint64_t *offset, uint64_t *length);
+static unsigned int parse_socket_options(const char *binary_name, const char *socket_str);
 
 // Error Handling
 _Noreturn static void usage(const char *program_name, int exit_code, const char *message);
@@ -40,47 +343,281 @@ _Noreturn static void usage(const char *program_name, int exit_code, const char
 // Network Handling
 static void convert_address(const char *address, struct sockaddr_storage *addr);
 static int  socket_create(int domain, int type, int protocol);
-static void socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t port);
+static void socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t port, unsigned int socket_options);
+static int  tune_socket(int sockfd, unsigned int socket_options);
+static socklen_t set_address_port(struct sockaddr_storage *addr, in_port_t port);
 static void socket_close(int sockfd);
-static void write_to_socket(int sockfd, const char *command);
-static void read_from_socket(int sockfd);
+static void write_to_socket(int sockfd, const char *command, int session, uint32_t id, uint32_t timeout, int output_fd);
+static int  read_from_socket(int sockfd, int session, uint64_t *output_len, const char *command, int usage_format);
+
+// TLS
+#if defined(HAVE_OPENSSL)
+static int          tls_connect(int sockfd, const char *address, const struct tls_options *tls, struct tls_relay **relay);
+static void         tls_close(struct tls_relay *relay);
+static SSL_SESSION *tls_load_session(const char *session_path);
+static void         tls_save_session(SSL *ssl, const char *session_path);
+static int          tls_start_relay(SSL *ssl, int sockfd, struct tls_relay **relay);
+static void        *tls_relay_thread(void *arg);
+#endif
+
+// Session Protocol
+static void   open_session(int sockfd);
+static int    run_command(int sockfd, const char *command, int session, uint32_t id, uint32_t timeout, int output_fd, int usage_format);
+static int    fetch_file(int sockfd, const char *path, uint64_t offset, uint64_t length);
+static int    pipeline_commands(int sockfd, char **commands, int command_count, uint32_t timeout, int usage_format);
+static int    run_batch(int sockfd, char **commands, int command_count, uint32_t timeout, uint32_t parallelism, int usage_format);
+static char **read_command_lines(int *command_count);
+static void   release_reply(struct pipelined_reply *reply);
+static void   request_usage(int sockfd);
+static int    decode_usage(const uint8_t *payload, size_t len, uint64_t *fields);
+static void   print_usage(int format, uint32_t id, const char *command, const uint64_t *fields);
+static void   print_json_string(FILE *stream, const char *string);
+#if defined(HAVE_ZLIB)
+static void   request_compression(int sockfd, int level);
+static void   inflate_output(int sockfd, uint32_t len, struct pipelined_reply *reply);
+#endif
+static void   encode_frame_header(uint8_t *header, uint8_t type, uint32_t id, size_t len);
+static size_t encode_command_frame(uint8_t *frame, uint32_t id, const char *command, uint32_t timeout);
+static size_t command_frame_len(const char *command, uint32_t timeout);
+static int    is_pipeline(const char *command);
+static size_t encode_pipeline_stages(uint8_t *payload, const char *command);
+static int    pipeline_exit_code(const uint8_t *payload, size_t len, int report);
+static void   read_frame_header(int sockfd, uint8_t *type, uint32_t *id, uint32_t *len);
+static int    read_fully(int sockfd, void *buffer, size_t len);
+static int    write_fully(int sockfd, const void *buffer, size_t len);
+
+// Benchmark
+static int      run_benchmark(struct sockaddr_storage *addr, in_port_t port, char **commands, int command_count, const struct benchmark_options *benchmark, int session, unsigned int socket_options);
+static int      bench_start(struct bench_connection *connection, const struct sockaddr_storage *addr, socklen_t addr_len, const char *command, int session, uint32_t id, unsigned int socket_options);
+static int      bench_send(struct bench_connection *connection);
+static int      bench_receive(struct bench_connection *connection, int session);
+static void     bench_close(struct bench_connection *connection);
+static uint64_t now_microseconds(void);
+static void     histogram_record(struct latency_histogram *histogram, uint64_t value);
+static uint64_t histogram_percentile(const struct latency_histogram *histogram, double percentile);
+static void     print_benchmark_report(const struct latency_histogram *histogram, uint64_t completed, uint64_t failed, uint64_t elapsed);
+
+// Fan-out
+static int                 run_fanout(const char *hosts_path, in_port_t port, const char *command, size_t connections, uint32_t timeout, unsigned int socket_options);
+static struct fanout_host *read_host_list(const char *hosts_path, size_t *host_count);
+static void                fanout_resolver_start(struct fanout_resolver *resolver, struct fanout_host *hosts, size_t host_count, in_port_t port, size_t thread_count);
+static void                fanout_resolver_submit(struct fanout_resolver *resolver, size_t index);
+static size_t              fanout_resolver_collect(struct fanout_resolver *resolver);
+static void                fanout_resolver_stop(struct fanout_resolver *resolver);
+static void               *fanout_resolver_thread(void *arg);
+static int                 fanout_resolve(struct fanout_host *host, in_port_t port);
+static int                 fanout_start(struct fanout_host *host, unsigned int socket_options);
+static int                 fanout_send(struct fanout_host *host, const uint8_t *request, size_t request_len);
+static int                 fanout_receive(struct fanout_host *host);
+static int                 fanout_end_frame(struct fanout_host *host);
+static void                fanout_print_output(struct fanout_host *host, const char *output, size_t len);
+static void                fanout_finish(struct fanout_host *host);
+static int                 print_fanout_summary(const struct fanout_host *hosts, size_t host_count);
 
 int main(int argc, char *argv[])
 {
-    char                   *command;
+    char                  **lines;
+    int                     exit_code;
     char                   *ip_address;
     char                   *port_str;
     in_port_t               port;
     int                     sockfd;
     struct sockaddr_storage addr;
+    struct client_options   options;
+    int                     output_fd;
+#if defined(HAVE_OPENSSL)
+    struct tls_relay       *relay;
+#endif
 
     ip_address = NULL;
-    command    = NULL;
     port_str   = NULL;
+    lines      = NULL;
+    exit_code  = EXIT_SUCCESS;
+    memset(&options, 0, sizeof(options));
+    options.mode = MODE_SINGLE;
 
     // Set up client
-    parse_arguments(argc, argv, &ip_address, &port_str, &command);
-    handle_arguments(argv[0], ip_address, port_str, command, &port);
+    parse_arguments(argc, argv, &ip_address, &port_str, &options);
+    handle_arguments(argv[0], ip_address, port_str, &port, &options);
+
+    if(options.hosts_path != NULL)
+    {
+        return run_fanout(options.hosts_path, port, options.commands[0], options.fanout_connections, options.timeout, options.socket_options);
+    }
+
     convert_address(ip_address, &addr);
+
+    // The -S options are all TCP's, a local transport has nothing to tune
+    if(addr.ss_family != AF_INET && addr.ss_family != AF_INET6)
+    {
+        options.socket_options = 0;
+
+        if(options.tls.ca_path != NULL)
+        {
+            usage(argv[0], EXIT_FAILURE, "TLS needs an IP address, local transports are not encrypted.");
+        }
+    }
+
+    if(options.benchmark.enabled)
+    {
+        // The command mix comes from stdin when none is given
+        if(options.command_count == 0)
+        {
+            lines            = read_command_lines(&options.command_count);
+            options.commands = lines;
+        }
+
+        if(options.command_count == 0)
+        {
+            usage(argv[0], EXIT_FAILURE, "The benchmark needs at least one command.");
+        }
+
+        exit_code = run_benchmark(&addr, port, options.commands, options.command_count, &options.benchmark, options.mode == MODE_SESSION, options.socket_options);
+
+        for(int i = 0; lines != NULL && i < options.command_count; i++)
+        {
+            free(lines[i]);
+        }
+
+        free((void *)lines);
+        return exit_code;
+    }
+
     sockfd = socket_create(addr.ss_family, SOCK_STREAM, 0);
-    socket_connect(sockfd, &addr, port);
+    socket_connect(sockfd, &addr, port, options.socket_options);
+
+#if defined(HAVE_OPENSSL)
+    relay = NULL;
+
+    if(options.tls.ca_path != NULL)
+    {
+        sockfd = tls_connect(sockfd, ip_address, &options.tls, &relay);
+    }
+#endif
+
+    // Only a session can ask for part of a file
+    if(options.fetch_str != NULL)
+    {
+        open_session(sockfd);
+        exit_code = fetch_file(sockfd, options.commands[0], options.fetch_offset, options.fetch_length);
+        socket_close(sockfd);
+#if defined(HAVE_OPENSSL)
+        tls_close(relay);
+#endif
+        return exit_code;
+    }
+
+    // A legacy request's length is a single byte, so a longer command has to go over a session,
+    // and only sessions can ask for compressed output, a timeout, a pipeline or usage reports
+    if(options.mode == MODE_SINGLE && options.command_count > 0 && (strlen(options.commands[0]) > UINT8_MAX || options.compress_level > 0 || options.timeout > 0 || options.usage_format != USAGE_FORMAT_NONE || is_pipeline(options.commands[0])))
+    {
+        options.mode = MODE_SESSION;
+    }
+
+    if(options.mode != MODE_SINGLE)
+    {
+        open_session(sockfd);
+    }
+
+    // Over a Unix socket the command gets our stdout to write to, so its output skips the server and this client
+    output_fd = options.mode == MODE_SINGLE && addr.ss_family == AF_UNIX ? STDOUT_FILENO : -1;
+
+#if defined(HAVE_ZLIB)
+    if(options.compress_level > 0)
+    {
+        request_compression(sockfd, options.compress_level);
+    }
+#endif
+
+    if(options.usage_format != USAGE_FORMAT_NONE)
+    {
+        request_usage(sockfd);
+    }
+
+    if(options.mode == MODE_PIPELINE || options.mode == MODE_BATCH)
+    {
+        // Session with no commands on the command line, take one per line from stdin
+        if(options.command_count == 0)
+        {
+            lines            = read_command_lines(&options.command_count);
+            options.commands = lines;
+        }
+
+        if(options.mode == MODE_BATCH)
+        {
+            exit_code = run_batch(sockfd, options.commands, options.command_count, options.timeout, options.batch_parallelism, options.usage_format);
+        }
+        else
+        {
+            exit_code = pipeline_commands(sockfd, options.commands, options.command_count, options.timeout, options.usage_format);
+        }
+    }
+    else if(options.command_count == 0)
+    {
+        char    *line;
+        size_t   line_size;
+        uint32_t id;
+
+        // Session with no commands on the command line, take one per line from stdin
+        line      = NULL;
+        line_size = 0;
+        id        = 0;
+
+        while(getline(&line, &line_size, stdin) != -1)
+        {
+            int command_code;
+
+            line[strcspn(line, "\n")] = '\0';
+
+            if(line[0] != '\0' && (command_code = run_command(sockfd, line, 1, id++, options.timeout, -1, options.usage_format)) != 0)
+            {
+                exit_code = command_code;
+            }
+        }
+
+        free(line);
+    }
+
+    // Like a shell, the client exits with the command's own status, the last one that failed of several
+    for(int i = 0; options.mode != MODE_PIPELINE && options.mode != MODE_BATCH && i < options.command_count; i++)
+    {
+        int command_code;
+
+        command_code = run_command(sockfd, options.commands[i], options.mode == MODE_SESSION, (uint32_t)i, options.timeout, output_fd, options.usage_format);
+
+        if(command_code != 0)
+        {
+            exit_code = command_code;
+        }
+    }
+
+    if(lines != NULL)
+    {
+        for(int i = 0; i < options.command_count; i++)
+        {
+            free(lines[i]);
+        }
+
+        free((void *)lines);
+    }
 
-    write_to_socket(sockfd, command);
-    read_from_socket(sockfd);
     socket_close(sockfd);
-    return 0;
+#if defined(HAVE_OPENSSL)
+    tls_close(relay);
+#endif
+    return exit_code;
 }
 
 // ----- Function Definitions -----
 
 // Argument Parsing Functions
-static void parse_arguments(const int argc, char *argv[], char **ip_address, char **port, char **command)
+static void parse_arguments(const int argc, char *argv[], char **ip_address, char **port, struct client_options *options)
 {
     int opt;
     opterr = 0;
 
     // Option parsing
-    while((opt = getopt(argc, argv, "h:")) != -1)
+    while((opt = getopt(argc, argv, "hspxbc:f:k:K:n:o:r:S:t:u:z:")) != -1)
     {
         switch(opt)
         {
@@ -88,6 +625,81 @@ static void parse_arguments(const int argc, char *argv[], char **ip_address, cha
             {
                 usage(argv[0], EXIT_SUCCESS, NULL);
             }
+            case 's':
+            {
+                options->mode = MODE_SESSION;
+                break;
+            }
+            case 'p':
+            {
+                options->mode = MODE_PIPELINE;
+                break;
+            }
+            case 'x':
+            {
+                options->mode = MODE_BATCH;
+                break;
+            }
+            case 'b':
+            {
+                options->benchmark.enabled = 1;
+                break;
+            }
+            case 'c':
+            {
+                options->benchmark.connections_str = optarg;
+                break;
+            }
+            case 'f':
+            {
+                options->hosts_path = optarg;
+                break;
+            }
+            case 'k':
+            {
+                options->tls.ca_path = optarg;
+                break;
+            }
+            case 'K':
+            {
+                options->tls.session_path = optarg;
+                break;
+            }
+            case 'n':
+            {
+                options->benchmark.requests_str = optarg;
+                break;
+            }
+            case 'o':
+            {
+                options->fetch_str = optarg;
+                break;
+            }
+            case 'r':
+            {
+                options->benchmark.rate_str = optarg;
+                break;
+            }
+            case 'S':
+            {
+                options->socket_str = optarg;
+                break;
+            }
+            case 't':
+            {
+                options->timeout_str = optarg;
+                break;
+            }
+            case 'u':
+            {
+                options->usage_str = optarg;
+                break;
+            }
+            case 'z':
+            {
+                options->compress_str = optarg;
+                break;
+            }
             case '?':
             {
                 char message[UNKNOWN_OPTION_MESSAGE_LEN];
@@ -103,25 +715,30 @@ static void parse_arguments(const int argc, char *argv[], char **ip_address, cha
     }
 
     // Check for sufficient args
-    if(argc < 4)
+    if(argc - optind < 2)
     {
         usage(argv[0], EXIT_FAILURE, "Error: Too few arguments.");
     }
 
-    // Check for extra args
-    if(argc > 4)
+    // The hosts come from the list, so a fan-out starts with the port
+    if(options->hosts_path != NULL)
     {
-        usage(argv[0], EXIT_FAILURE, "Error: Too many arguments.");
+        *ip_address            = NULL;
+        *port                  = argv[optind];
+        options->commands      = &argv[optind + 1];
+        options->command_count = argc - optind - 1;
+        return;
     }
 
-    *ip_address = argv[optind];
-    *port       = argv[optind + 1];
-    *command    = argv[optind + 2];
+    *ip_address            = argv[optind];
+    *port                  = argv[optind + 1];
+    options->commands      = &argv[optind + 2];
+    options->command_count = argc - optind - 2;
 }
 
-static void handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, const char *command, in_port_t *port)
+static void handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, in_port_t *port, struct client_options *options)
 {
-    if(ip_address == NULL)
+    if(ip_address == NULL && options->hosts_path == NULL)
     {
         usage(binary_name, EXIT_FAILURE, "The ip address is required.");
     }
@@ -131,12 +748,145 @@ static void handle_arguments(const char *binary_name, const char *ip_address, co
         usage(binary_name, EXIT_FAILURE, "The port is required.");
     }
 
-    if(command == NULL)
+    if(options->tls.session_path != NULL && options->tls.ca_path == NULL)
+    {
+        usage(binary_name, EXIT_FAILURE, "The -K option needs -k.");
+    }
+
+    if(options->tls.ca_path != NULL)
+    {
+#if defined(HAVE_OPENSSL)
+        if(options->hosts_path != NULL || options->benchmark.enabled)
+        {
+            usage(binary_name, EXIT_FAILURE, "The benchmark and the fan-out do not speak TLS.");
+        }
+#else
+        usage(binary_name, EXIT_FAILURE, "This client was built without OpenSSL, so it cannot speak TLS.");
+#endif
+    }
+
+    options->fanout_connections = 0;
+    options->batch_parallelism  = 0;
+    options->fetch_offset       = 0;
+    options->fetch_length       = 0;
+
+    if(options->fetch_str != NULL)
+    {
+        if(options->hosts_path != NULL || options->benchmark.enabled || options->mode == MODE_PIPELINE || options->mode == MODE_BATCH || options->compress_str != NULL || options->timeout_str != NULL)
+        {
+            usage(binary_name, EXIT_FAILURE, "The -o option does not go with -b, -f, -p, -t, -x or -z.");
+        }
+
+        if(options->command_count != 1)
+        {
+            usage(binary_name, EXIT_FAILURE, "The -o option fetches exactly one file.");
+        }
+
+        parse_fetch_range(binary_name, options->fetch_str, &options->fetch_offset, &options->fetch_length);
+    }
+
+    if(options->hosts_path != NULL)
+    {
+        if(options->benchmark.enabled || options->mode != MODE_SINGLE || options->compress_str != NULL || options->benchmark.requests_str != NULL || options->benchmark.rate_str != NULL)
+        {
+            usage(binary_name, EXIT_FAILURE, "The -f option only goes with -c and -t.");
+        }
+
+        if(options->command_count != 1)
+        {
+            usage(binary_name, EXIT_FAILURE, "The fan-out runs exactly one command on every host.");
+        }
+
+        options->fanout_connections = (size_t)parse_count(binary_name, options->benchmark.connections_str, FANOUT_DEFAULT_CONNECTIONS, BENCH_MAX_CONNECTIONS, "The connection count must be between 1 and 4096.");
+    }
+    else if(options->mode == MODE_BATCH && !options->benchmark.enabled)
+    {
+        if(options->benchmark.requests_str != NULL || options->benchmark.rate_str != NULL)
+        {
+            usage(binary_name, EXIT_FAILURE, "The -n and -r options need -b.");
+        }
+
+        options->batch_parallelism = (uint32_t)parse_count(binary_name, options->benchmark.connections_str, 0, MAX_BATCH_PARALLELISM, "The batch parallelism must be between 1 and 16.");
+    }
+    else if(!options->benchmark.enabled && (options->benchmark.connections_str != NULL || options->benchmark.requests_str != NULL || options->benchmark.rate_str != NULL))
+    {
+        usage(binary_name, EXIT_FAILURE, "The -c, -n, and -r options need -b.");
+    }
+
+    if(options->benchmark.enabled)
+    {
+        if(options->mode == MODE_PIPELINE || options->mode == MODE_BATCH)
+        {
+            usage(binary_name, EXIT_FAILURE, "The benchmark runs single requests or sessions, not -p or -x.");
+        }
+
+        options->benchmark.connections = (size_t)parse_count(binary_name, options->benchmark.connections_str, BENCH_DEFAULT_CONNECTIONS, BENCH_MAX_CONNECTIONS, "The connection count must be between 1 and 4096.");
+        options->benchmark.requests    = parse_count(binary_name, options->benchmark.requests_str, BENCH_DEFAULT_REQUESTS, UINT32_MAX, "The request count must be a positive number.");
+        options->benchmark.rate        = options->benchmark.rate_str == NULL ? 0 : parse_count(binary_name, options->benchmark.rate_str, 0, MICROSECONDS_PER_SECOND, "The rate must be between 1 and 1000000 requests per second.");
+    }
+    else if(options->command_count == 0 && options->mode == MODE_SINGLE)
     {
         usage(binary_name, EXIT_FAILURE, "The command is required.");
     }
 
-    *port = parse_in_port_t(binary_name, port_str);
+    // Check for extra args
+    if(options->command_count > 1 && options->mode == MODE_SINGLE && !options->benchmark.enabled)
+    {
+        usage(binary_name, EXIT_FAILURE, "Error: Too many arguments, use -s, -p or -x to run several commands.");
+    }
+
+    *port           = parse_in_port_t(binary_name, port_str);
+    options->compress_level = 0;
+    options->timeout        = 0;
+
+    if(options->timeout_str != NULL)
+    {
+        if(options->benchmark.enabled)
+        {
+            usage(binary_name, EXIT_FAILURE, "The benchmark does not send timeouts.");
+        }
+
+        options->timeout = (uint32_t)parse_count(binary_name, options->timeout_str, 0, UINT32_MAX, "The timeout must be a positive number of milliseconds.");
+    }
+
+    if(options->compress_str != NULL)
+    {
+#if defined(HAVE_ZLIB)
+        if(options->benchmark.enabled)
+        {
+            usage(binary_name, EXIT_FAILURE, "The benchmark does not ask for compressed output.");
+        }
+
+        options->compress_level = (int)parse_count(binary_name, options->compress_str, 0, MAX_COMPRESSION_LEVEL, "The compression level must be between 1 and 9.");
+#else
+        usage(binary_name, EXIT_FAILURE, "This client was built without zlib, so it cannot ask for compressed output.");
+#endif
+    }
+
+    options->usage_format = USAGE_FORMAT_NONE;
+
+    if(options->usage_str != NULL)
+    {
+        if(options->hosts_path != NULL || options->benchmark.enabled || options->fetch_str != NULL)
+        {
+            usage(binary_name, EXIT_FAILURE, "The -u option does not go with -b, -f or -o.");
+        }
+
+        if(strcmp(options->usage_str, "text") == 0)
+        {
+            options->usage_format = USAGE_FORMAT_TEXT;
+        }
+        else if(strcmp(options->usage_str, "json") == 0)
+        {
+            options->usage_format = USAGE_FORMAT_JSON;
+        }
+        else
+        {
+            usage(binary_name, EXIT_FAILURE, "The usage format must be text or json.");
+        }
+    }
+
+    options->socket_options = parse_socket_options(binary_name, options->socket_str);
 }
 
 static in_port_t parse_in_port_t(const char *binary_name, const char *port_str)
@@ -169,32 +919,206 @@ static in_port_t parse_in_port_t(const char *binary_name, const char *port_str)
     return (in_port_t)parsed_value;
 }
 
-// Error Handling Functions
-
-_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+/**
+ * Parses a positive count given to a benchmark option.
+ * @param binary_name   the name of the program, for the usage message
+ * @param count_str     the option's argument, or NULL if it was not given
+ * @param default_value the value to use when the option was not given
+ * @param max_value     the largest count allowed
+ * @param message       the usage message for a count that can not be used
+ * @return              the parsed count
+ */
+static uint64_t parse_count(const char *binary_name, const char *count_str, uint64_t default_value, uint64_t max_value, const char *message)
 {
-    if(message)
+    char     *endptr;
+    uintmax_t parsed_value;
+
+    if(count_str == NULL)
     {
-        fprintf(stderr, "%s\n", message);
+        return default_value;
     }
 
-    fprintf(stderr, "Usage: %s [-h] <ip address> <port> <command>\n", program_name);
-    fputs("Options:\n", stderr);
-    fputs(" -h Display this help message\n", stderr);
-    exit(exit_code);
-}
+    errno        = 0;
+    parsed_value = strtoumax(count_str, &endptr, BASE_TEN);
 
-// Network Handling Functions
+    if(errno != 0 || *endptr != '\0' || endptr == count_str || parsed_value == 0 || parsed_value > max_value)
+    {
+        usage(binary_name, EXIT_FAILURE, message);
+    }
+
+    return (uint64_t)parsed_value;
+}
+
+/**
+ * Parses the offset[:length] given to -o. The offset may be 0, a missing length means the
+ * rest of the file.
+ * @param binary_name the name of the program, for the usage message
+ * @param fetch_str   the option's argument
+ * @param offset      where the byte offset is stored
+ * @param length      where the length is stored, 0 for the rest of the file
+ */
+static void parse_fetch_range(const char *binary_name, const char *fetch_str, uint64_t *offset, uint64_t *length)
+{
+    char     *endptr;
+    uintmax_t parsed_value;
+
+    errno        = 0;
+    parsed_value = strtoumax(fetch_str, &endptr, BASE_TEN);
+
+    if(errno != 0 || endptr == fetch_str || fetch_str[0] < '0' || fetch_str[0] > '9' || parsed_value > INT64_MAX || (*endptr != '\0' && *endptr != FETCH_RANGE_SEPARATOR))
+    {
+        usage(binary_name, EXIT_FAILURE, "The -o option takes a byte offset, optionally followed by :length.");
+    }
+
+    *offset = (uint64_t)parsed_value;
+    *length = *endptr == '\0' ? 0 : parse_count(binary_name, &endptr[1], 0, UINT64_MAX, "The fetch length must be a positive number of bytes.");
+}
+
+static unsigned int parse_socket_options(const char *binary_name, const char *socket_str)
+{
+    const char *option;
+    unsigned int socket_options;
+
+    socket_options = 0;
+
+    if(socket_str == NULL)
+    {
+        return socket_options;
+    }
+
+    option = socket_str;
+
+    while(1)
+    {
+        size_t option_len;
+
+        option_len = strcspn(option, ",");
+
+        if(option_len == strlen("nodelay") && strncmp(option, "nodelay", option_len) == 0)
+        {
+            socket_options |= SOCKET_NODELAY;
+        }
+        else if(option_len == strlen("fastopen") && strncmp(option, "fastopen", option_len) == 0)
+        {
+#if !defined(TCP_FASTOPEN_CONNECT)
+            usage(binary_name, EXIT_FAILURE, "This platform cannot connect with TCP Fast Open.");
+#endif
+            socket_options |= SOCKET_FASTOPEN;
+        }
+        else
+        {
+            usage(binary_name, EXIT_FAILURE, "Unknown socket option, expected nodelay or fastopen.");
+        }
+
+        if(option[option_len] == '\0')
+        {
+            break;
+        }
+
+        option += option_len + 1;
+    }
+
+    return socket_options;
+}
+
+// Error Handling Functions
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-s | -p | -x [-c parallelism]] [-t ms] [-z level] [-b [-c connections] [-n requests] [-r rate]] [-S options] [-u format] [-k ca [-K session]] <address> <port> <command> [command...]\n", program_name);
+    fprintf(stderr, "       %s -f <hosts> [-c connections] [-t ms] [-S options] <port> <command>\n", program_name);
+    fprintf(stderr, "       %s -o <offset>[:length] [-k ca [-K session]] <address> <port> <file>\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs(" -h Display this help message\n", stderr);
+    fputs(" -s Run every command over one session, reading them from stdin if none are given\n", stderr);
+    fputs(" -p Like -s, but send every command at once and print results as they complete\n", stderr);
+    fputs(" -x Like -s, but send every command in one batch and print the outputs in order once all are done\n", stderr);
+    fputs("    A line per command with its exit code and run time goes to stderr\n", stderr);
+    fputs(" -b Benchmark the server by replaying the commands, one connection per request or one session per connection with -s\n", stderr);
+    fputs(" -c The number of concurrent benchmark connections (default: 1), fan-out connections (default: 64), or batch commands (default: the server's, up to 16)\n", stderr);
+    fputs(" -f Run the command on every host in this file, - for stdin, one host[:port] or [address]:port per line\n", stderr);
+    fputs("    Output lines are prefixed with their host, and a summary of every host's exit status goes to stderr\n", stderr);
+    fputs(" -k Speak TLS 1.2, trusting the server's certificate if this CA file signed it for the address\n", stderr);
+    fputs(" -K Keep the TLS session in this file, so the next run resumes it instead of a full handshake\n", stderr);
+    fputs(" -n The total number of benchmark requests (default: 1000)\n", stderr);
+    fputs(" -o Fetch this part of a file the server serves with -f, up to its end when no length is given\n", stderr);
+    fputs("    The offset to fetch from next goes to stderr, for following a growing log\n", stderr);
+    fputs(" -r The total requests per second to send, instead of as fast as the server answers\n", stderr);
+    fputs(" -S Tune the connection, as nodelay,fastopen: send writes straight away, and send the request in the SYN\n", stderr);
+    fputs(" -t Ask the server to stop each command that runs longer than this many milliseconds\n", stderr);
+    fputs(" -u Report what each command used on stderr, as text or json: wall and CPU time, max RSS, context switches and output bytes\n", stderr);
+    fputs(" -z Ask the server to compress output at this level, from 1 (fastest) to 9 (smallest)\n", stderr);
+    fputs("Commands:\n", stderr);
+    fputs(" A command with a | on its own between stages runs as a pipeline the server connects itself, without a shell\n", stderr);
+    fputs(" Over a session the client exits with the command's status, a pipeline's last stage's, or the last failing one's of several\n", stderr);
+    fputs(" A plain request carries no status, use -s to get it\n", stderr);
+    fputs("Addresses:\n", stderr);
+    fputs(" An IPv4 or IPv6 address, unix:<path> for a Unix socket, where the port is not used, or vsock:<cid>\n", stderr);
+    fputs(" Over a Unix socket a single command writes straight to this client's stdout\n", stderr);
+    exit(exit_code);
+}
+
+// Network Handling Functions
 
 /**
  * Converts the address from a human-readable string into a binary representation.
- * @param address string IP address in human-readable format (e.g., "192.168.0.1")
+ * @param address string IP address in human-readable format (e.g., "192.168.0.1"), unix:<path> or vsock:<cid>
  * @param addr    pointer to the struct sockaddr_storage where the binary representation will be stored
  */
 static void convert_address(const char *address, struct sockaddr_storage *addr)
 {
     memset(addr, 0, sizeof(*addr));
 
+    // A server on the same host or in a neighbouring VM is reached without TCP
+    if(strncmp(address, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0)
+    {
+        struct sockaddr_un *unix_addr;
+        const char         *path;
+
+        unix_addr = (struct sockaddr_un *)addr;
+        path      = &address[strlen(UNIX_PREFIX)];
+
+        if(path[0] == '\0' || strlen(path) >= sizeof(unix_addr->sun_path))
+        {
+            fprintf(stderr, "%s is not a usable Unix socket path\n", path);
+            exit(EXIT_FAILURE);
+        }
+
+        unix_addr->sun_family = AF_UNIX;
+        strcpy(unix_addr->sun_path, path);
+        return;
+    }
+
+#if defined(__linux__)
+    if(strncmp(address, VSOCK_PREFIX, strlen(VSOCK_PREFIX)) == 0)
+    {
+        struct sockaddr_vm *vsock_addr;
+        const char         *cid;
+        char               *endptr;
+        uintmax_t           parsed_value;
+
+        vsock_addr   = (struct sockaddr_vm *)addr;
+        cid          = &address[strlen(VSOCK_PREFIX)];
+        errno        = 0;
+        parsed_value = strtoumax(cid, &endptr, BASE_TEN);
+
+        if(errno != 0 || cid[0] == '\0' || *endptr != '\0' || parsed_value >= VMADDR_CID_ANY)
+        {
+            fprintf(stderr, "%s is not a vsock context ID\n", cid);
+            exit(EXIT_FAILURE);
+        }
+
+        vsock_addr->svm_family = AF_VSOCK;
+        vsock_addr->svm_cid    = (unsigned int)parsed_value;
+        return;
+    }
+#endif
+
     // Converts the str address to binary address and checks for IPv4 or IPv6
     if(inet_pton(AF_INET, address, &(((struct sockaddr_in *)addr)->sin_addr)) == 1)
     {
@@ -209,7 +1133,7 @@ static void convert_address(const char *address, struct sockaddr_storage *addr)
     }
     else
     {
-        fprintf(stderr, "%s is not an IPv4 or IPv6 address\n", address);
+        fprintf(stderr, "%s is not an IPv4, IPv6, unix: or vsock: address\n", address);
         exit(EXIT_FAILURE);
     }
 }
@@ -238,24 +1162,95 @@ static int socket_create(int domain, int type, int protocol)
 
 /**
  * Establishes a network connection to a remote address and port using a given socket.
- * @param sockfd the file descriptor of the socket for the connection
- * @param addr   a pointer to a struct sockaddr_storage containing the remote address
- * @param port   the port to which the connection should be established
+ * @param sockfd         the file descriptor of the socket for the connection
+ * @param addr           a pointer to a struct sockaddr_storage containing the remote address
+ * @param port           the port to which the connection should be established
+ * @param socket_options the SOCKET_ options to set before connecting
  */
-static void socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t port)
+static void socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t port, unsigned int socket_options)
 {
-    char      addr_str[INET6_ADDRSTRLEN];    // Array to store human-readable IP address for either IPv4 or IPv6
-    in_port_t net_port;                      // Stores network byte order representation of port number
-    socklen_t addr_len;                      // Stores the address length
+    char      addr_str[ADDRESS_STR_LEN];    // Array to store the human-readable address, with its port
+    char      ip_str[INET6_ADDRSTRLEN];     // Array to store human-readable IP address for either IPv4 or IPv6
+    socklen_t addr_len;                     // Stores the address length
 
-    // Converts binary IP address (IPv4 or IPv6) to a human-readable string, stores it in addr_str, and handles errors
-    if(inet_ntop(addr->ss_family, addr->ss_family == AF_INET ? (void *)&(((struct sockaddr_in *)addr)->sin_addr) : (void *)&(((struct sockaddr_in6 *)addr)->sin6_addr), addr_str, sizeof(addr_str)) == NULL)
+    if(addr->ss_family == AF_UNIX)
+    {
+        snprintf(addr_str, sizeof(addr_str), UNIX_PREFIX "%s", ((struct sockaddr_un *)addr)->sun_path);
+    }
+#if defined(__linux__)
+    else if(addr->ss_family == AF_VSOCK)
+    {
+        snprintf(addr_str, sizeof(addr_str), VSOCK_PREFIX "%u:%u", ((struct sockaddr_vm *)addr)->svm_cid, port);
+    }
+#endif
+    // Converts binary IP address (IPv4 or IPv6) to a human-readable string, stores it in ip_str, and handles errors
+    else if(inet_ntop(addr->ss_family, addr->ss_family == AF_INET ? (void *)&(((struct sockaddr_in *)addr)->sin_addr) : (void *)&(((struct sockaddr_in6 *)addr)->sin6_addr), ip_str, sizeof(ip_str)) == NULL)
     {
         perror("inet_ntop");
         exit(EXIT_FAILURE);
     }
+    else
+    {
+        snprintf(addr_str, sizeof(addr_str), "%s:%u", ip_str, port);
+    }
+
+    printf("Connecting to %s\n", addr_str);
+    addr_len = set_address_port(addr, port);
+
+    if(tune_socket(sockfd, socket_options) == -1)
+    {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    // Connect to server
+    if(connect(sockfd, (struct sockaddr *)addr, addr_len) == -1)
+    {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Connected to: %s\n", addr_str);
+}
+
+/**
+ * Sets the -S options on a socket that is about to connect.
+ * @param sockfd         the socket
+ * @param socket_options the SOCKET_ options
+ * @return               0 on success, -1 with errno set if an option could not be set
+ */
+static int tune_socket(int sockfd, unsigned int socket_options)
+{
+    int enable;
+
+    enable = 1;
+
+    if((socket_options & SOCKET_NODELAY) && setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) == -1)
+    {
+        return -1;
+    }
+
+#if defined(TCP_FASTOPEN_CONNECT)
+    // connect() returns at once and the SYN goes out with the first write, carrying it if a cookie is cached
+    if((socket_options & SOCKET_FASTOPEN) && setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &enable, sizeof(enable)) == -1)
+    {
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * Stores the port in an address. A Unix socket has none, its path is all there is.
+ * @param addr a pointer to a struct sockaddr_storage containing the remote address
+ * @param port the port to store
+ * @return     the length of the address
+ */
+static socklen_t set_address_port(struct sockaddr_storage *addr, in_port_t port)
+{
+    in_port_t net_port;    // Stores network byte order representation of port number
 
-    printf("Connecting to %s:%u\n", addr_str, port);
     net_port = htons(port);    // Convert port number to network byte order (big endian)
 
     // Handle IPv4
@@ -265,31 +1260,36 @@ static void socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t
 
         ipv4_addr           = (struct sockaddr_in *)addr;
         ipv4_addr->sin_port = net_port;
-        addr_len            = sizeof(struct sockaddr_in);
+        return sizeof(struct sockaddr_in);
     }
+
     // Handle IPv6
-    else if(addr->ss_family == AF_INET6)
+    if(addr->ss_family == AF_INET6)
     {
         struct sockaddr_in6 *ipv6_addr;
 
         ipv6_addr            = (struct sockaddr_in6 *)addr;
         ipv6_addr->sin6_port = net_port;
-        addr_len             = sizeof(struct sockaddr_in6);
+        return sizeof(struct sockaddr_in6);
     }
-    else
+
+    // Handle Unix sockets
+    if(addr->ss_family == AF_UNIX)
     {
-        fprintf(stderr, "Internal error: addr->ss_family must be AF_INET or AF_INET6, was: %d\n", addr->ss_family);
-        exit(EXIT_FAILURE);
+        return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + strlen(((struct sockaddr_un *)addr)->sun_path) + 1);
     }
 
-    // Connect to server
-    if(connect(sockfd, (struct sockaddr *)addr, addr_len) == -1)
+#if defined(__linux__)
+    // Handle vsock, whose ports are 32 bits in host byte order
+    if(addr->ss_family == AF_VSOCK)
     {
-        perror("connect");
-        exit(EXIT_FAILURE);
+        ((struct sockaddr_vm *)addr)->svm_port = port;
+        return sizeof(struct sockaddr_vm);
     }
+#endif
 
-    printf("Connected to: %s:%u\n", addr_str, port);
+    fprintf(stderr, "Internal error: addr->ss_family must be AF_INET, AF_INET6, AF_UNIX or AF_VSOCK, was: %d\n", addr->ss_family);
+    exit(EXIT_FAILURE);
 }
 
 /**
@@ -307,34 +1307,3237 @@ static void socket_close(int sockfd)
 
 /**
  * Writes a command string to a socket.
- * @param sockfd   the file descriptor of the socket to write to
- * @param command  the command string to write to the socket
+ * @param sockfd    the file descriptor of the socket to write to
+ * @param command   the command string to write to the socket
+ * @param session   non-zero to send the command as a session frame
+ * @param id        the request ID of the session frame
+ * @param timeout   milliseconds the server may run the command for, 0 for its default
+ * @param output_fd a descriptor to send along with a legacy request over a Unix socket for the
+ *                  command to write to, or -1 to get the output back over the socket
  */
-static void write_to_socket(int sockfd, const char *command)
+static void write_to_socket(int sockfd, const char *command, int session, uint32_t id, uint32_t timeout, int output_fd)
 {
     size_t  command_len;
+    size_t  frame_len;
     uint8_t size;
+    uint8_t frame[FRAME_HEADER_LEN + MAX_COMMAND_LEN];
 
     command_len = strlen(command);
-    size        = (uint8_t)command_len;
 
-    send(sockfd, &size, sizeof(uint8_t), 0);    // Send the size of the command
-    write(sockfd, command, command_len);        // Write the command string
+    if(!session)
+    {
+        union
+        {
+            char           buffer[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+
+        struct msghdr message;
+        struct iovec  iov[2];
+
+        size            = (uint8_t)command_len;
+        iov[0].iov_base = &size;    // The size of the command, then the command string
+        iov[0].iov_len  = sizeof(size);
+        iov[1].iov_base = (void *)(uintptr_t)command;
+        iov[1].iov_len  = command_len;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov    = iov;
+        message.msg_iovlen = 2;
+
+        if(output_fd != -1)
+        {
+            struct cmsghdr *header;
+
+            // What was printed so far has to come out ahead of the command's output
+            fflush(stdout);
+            memset(&control, 0, sizeof(control));
+            message.msg_control    = control.buffer;
+            message.msg_controllen = sizeof(control.buffer);
+            header                 = CMSG_FIRSTHDR(&message);
+            header->cmsg_level     = SOL_SOCKET;
+            header->cmsg_type      = SCM_RIGHTS;
+            header->cmsg_len       = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(header), &output_fd, sizeof(output_fd));
+        }
+
+        if(sendmsg(sockfd, &message, 0) == -1)
+        {
+            perror("sendmsg");
+            exit(EXIT_FAILURE);
+        }
+
+        return;
+    }
+
+    if(command_frame_len(command, timeout) > FRAME_HEADER_LEN + MAX_COMMAND_LEN)
+    {
+        fprintf(stderr, "Command is too long: %s\n", command);
+        exit(EXIT_FAILURE);
+    }
+
+    // Header and command go out in one write so they are not split across segments
+    frame_len = encode_command_frame(frame, id, command, timeout);
+
+    if(write_fully(sockfd, frame, frame_len) == -1)
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
 }
 
-static void read_from_socket(int sockfd)
+/**
+ * Reads the response to one command and writes its output to stdout.
+ * Legacy responses end at EOF, session responses end with an exit or error frame.
+ * @param sockfd       the file descriptor of the socket to read from
+ * @param session      non-zero if the response is framed
+ * @param output_len   where the number of output bytes written is stored, or NULL
+ * @param command      the command, for its usage report
+ * @param usage_format how to print the usage the server reports, if it was asked to
+ * @return             the exit code of the command, or EXIT_FAILURE if the server reported an error
+ */
+static int read_from_socket(int sockfd, int session, uint64_t *output_len, const char *command, int usage_format)
 {
-    ssize_t bytes_read;
-    char    buffer[LINE_LENGTH];
+    ssize_t                bytes_read;
+    char                   buffer[LINE_LENGTH];
+    struct pipelined_reply reply;
+    uint64_t               unused_len;
+
+    if(output_len == NULL)
+    {
+        output_len = &unused_len;
+    }
 
-    while((bytes_read = read(sockfd, buffer, sizeof(buffer))) > 0)
+    *output_len = 0;
+
+    if(!session)
     {
-        // Write to the terminal
-        if(write(STDOUT_FILENO, buffer, (size_t)bytes_read) == -1)
+        while((bytes_read = read(sockfd, buffer, sizeof(buffer))) > 0)
         {
-            perror("write");
-            close(sockfd);
-            exit(EXIT_FAILURE);
+            // Write to the terminal
+            if(write(STDOUT_FILENO, buffer, (size_t)bytes_read) == -1)
+            {
+                perror("write");
+                close(sockfd);
+                exit(EXIT_FAILURE);
+            }
+
+            *output_len += (uint64_t)bytes_read;
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    memset(&reply, 0, sizeof(reply));
+
+    while(1)
+    {
+        uint8_t  type;
+        uint32_t id;
+        uint32_t len;
+
+        read_frame_header(sockfd, &type, &id, &len);
+
+        switch(type)
+        {
+            case FRAME_OUTPUT:
+            {
+                // Stream the chunk through without holding all of it in memory
+                while(len > 0)
+                {
+                    size_t chunk_len;
+
+                    chunk_len = len < sizeof(buffer) ? len : sizeof(buffer);
+
+                    if(read_fully(sockfd, buffer, chunk_len) == -1 || write_fully(STDOUT_FILENO, buffer, chunk_len) == -1)
+                    {
+                        perror("output");
+                        exit(EXIT_FAILURE);
+                    }
+
+                    len -= (uint32_t)chunk_len;
+                    *output_len += chunk_len;
+                }
+
+                break;
+            }
+#if defined(HAVE_ZLIB)
+            case FRAME_OUTPUT_DEFLATE:
+            {
+                inflate_output(sockfd, len, &reply);
+
+                if(write_fully(STDOUT_FILENO, reply.output, reply.len) == -1)
+                {
+                    perror("output");
+                    exit(EXIT_FAILURE);
+                }
+
+                *output_len += reply.len;
+                reply.len    = 0;
+                break;
+            }
+#endif
+            case FRAME_USAGE:
+            {
+                uint64_t fields[USAGE_FIELDS];
+
+                if(len > sizeof(buffer) || read_fully(sockfd, buffer, len) == -1 || decode_usage((const uint8_t *)buffer, len, fields) == -1)
+                {
+                    fprintf(stderr, "Malformed usage frame\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                print_usage(usage_format, id, command, fields);
+                break;
+            }
+            case FRAME_EXIT:
+            {
+                uint32_t net_code;
+
+                if(len != sizeof(net_code) || read_fully(sockfd, &net_code, sizeof(net_code)) == -1)
+                {
+                    fprintf(stderr, "Malformed exit frame\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                release_reply(&reply);
+                return (int)ntohl(net_code);
+            }
+            case FRAME_PIPELINE_EXIT:
+            {
+                uint8_t codes[MAX_PIPELINE_STAGES * sizeof(uint32_t)];
+                int     exit_code;
+
+                if(len > sizeof(codes) || read_fully(sockfd, codes, len) == -1 || (exit_code = pipeline_exit_code(codes, len, 1)) == -1)
+                {
+                    fprintf(stderr, "Malformed exit frame\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                release_reply(&reply);
+                return exit_code;
+            }
+            case FRAME_ERROR:
+            {
+                if(len >= sizeof(buffer) || read_fully(sockfd, buffer, len) == -1)
+                {
+                    fprintf(stderr, "Malformed error frame\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                buffer[len] = '\0';
+                fprintf(stderr, "%s\n", buffer);
+                release_reply(&reply);
+                return EXIT_FAILURE;
+            }
+            case FRAME_BUSY:
+            {
+                uint32_t net_retry_after;
+
+                if(len != sizeof(net_retry_after) || read_fully(sockfd, &net_retry_after, sizeof(net_retry_after)) == -1)
+                {
+                    fprintf(stderr, "Malformed busy frame\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                fprintf(stderr, "Server busy, retry after %u ms.\n", ntohl(net_retry_after));
+                release_reply(&reply);
+                return EXIT_FAILURE;
+            }
+            default:
+            {
+                fprintf(stderr, "Unexpected frame type %u\n", type);
+                exit(EXIT_FAILURE);
+            }
         }
     }
 }
+
+// TLS Functions
+
+#if defined(HAVE_OPENSSL)
+/**
+ * Runs the client side of a TLS handshake on a connected socket and checks the server's
+ * certificate against the address it was reached on. When the kernel takes the keys the socket
+ * carries plaintext from then on; otherwise a relay thread encrypts for it. Either way the
+ * caller gets a descriptor it reads and writes as if there were no TLS.
+ * @param sockfd  the connected socket
+ * @param address the server's address, as given on the command line
+ * @param tls     the CA file and the file the session is kept in
+ * @param relay   where the relay is stored for tls_close, NULL when the kernel took the keys
+ * @return        the descriptor to talk to the server on
+ */
+static int tls_connect(int sockfd, const char *address, const struct tls_options *tls, struct tls_relay **relay)
+{
+    SSL_CTX     *context;
+    SSL         *ssl;
+    SSL_SESSION *session;
+    int          kernel;
+
+    // A server that goes away mid-write is reported by SSL_write, not by a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    *relay  = NULL;
+    context = SSL_CTX_new(TLS_client_method());
+
+    if(context == NULL || SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION) != 1 || SSL_CTX_set_max_proto_version(context, TLS1_2_VERSION) != 1 || SSL_CTX_set_cipher_list(context, TLS_CIPHERS) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(context);
+        exit(EXIT_FAILURE);
+    }
+
+    if(SSL_CTX_load_verify_locations(context, tls->ca_path, NULL) != 1)
+    {
+        fprintf(stderr, "Unable to load the CA certificates in %s\n", tls->ca_path);
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(context);
+        exit(EXIT_FAILURE);
+    }
+
+    // A legacy request ends when the server closes the connection, without a close_notify
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+    ssl = SSL_new(context);
+
+    if(ssl == NULL || SSL_set_fd(ssl, sockfd) != 1 || X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), address) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        SSL_CTX_free(context);
+        exit(EXIT_FAILURE);
+    }
+
+    session = tls->session_path != NULL ? tls_load_session(tls->session_path) : NULL;
+
+    if(session != NULL)
+    {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+
+    if(SSL_connect(ssl) != 1)
+    {
+        fprintf(stderr, "TLS handshake failed\n");
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        SSL_CTX_free(context);
+        exit(EXIT_FAILURE);
+    }
+
+    if(tls->session_path != NULL && !SSL_session_reused(ssl))
+    {
+        tls_save_session(ssl, tls->session_path);
+    }
+
+    kernel = BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    printf("TLS: %s, %s session, %s\n", SSL_get_cipher_name(ssl), SSL_session_reused(ssl) ? "resumed" : "new", kernel ? "kernel TLS" : "relayed");
+    SSL_CTX_free(context);
+
+    if(kernel)
+    {
+        // The records are the kernel's now, so the SSL object goes and the socket stays open
+        SSL_free(ssl);
+        return sockfd;
+    }
+
+    return tls_start_relay(ssl, sockfd, relay);
+}
+
+/**
+ * Waits for the relay to finish once the client has closed its end, so the connection's SSL
+ * object is freed before the client exits.
+ * @param relay the relay tls_connect started, or NULL if there is none
+ */
+static void tls_close(struct tls_relay *relay)
+{
+    if(relay == NULL)
+    {
+        return;
+    }
+
+    pthread_join(relay->thread, NULL);
+    free(relay);
+}
+
+/**
+ * Reads the session a previous run kept, so the handshake can resume it from its ticket.
+ * @param session_path the file the session is kept in
+ * @return             the session, or NULL if there is none yet
+ */
+static SSL_SESSION *tls_load_session(const char *session_path)
+{
+    FILE        *file;
+    SSL_SESSION *session;
+
+    file = fopen(session_path, "r");
+
+    if(file == NULL)
+    {
+        return NULL;
+    }
+
+    session = PEM_read_SSL_SESSION(file, NULL, NULL, NULL);
+    fclose(file);
+    ERR_clear_error();
+
+    return session;
+}
+
+/**
+ * Keeps a new session for the next run. The file holds the session's keys, so only its owner can read it.
+ * @param ssl          the connection the session was made on
+ * @param session_path the file to keep it in
+ */
+static void tls_save_session(SSL *ssl, const char *session_path)
+{
+    SSL_SESSION *session;
+    FILE        *file;
+    int          fd;
+
+    session = SSL_get1_session(ssl);
+    fd      = open(session_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    file    = fd != -1 ? fdopen(fd, "w") : NULL;
+
+    if(session == NULL || file == NULL || PEM_write_SSL_SESSION(file, session) != 1)
+    {
+        fprintf(stderr, "Unable to keep the TLS session in %s\n", session_path);
+    }
+
+    if(file != NULL)
+    {
+        fclose(file);
+    }
+    else if(fd != -1)
+    {
+        close(fd);
+    }
+
+    SSL_SESSION_free(session);
+}
+
+/**
+ * Starts the thread that encrypts and decrypts for a connection the kernel could not take.
+ * @param ssl    the finished TLS connection, owned by the relay from here on
+ * @param sockfd the connected socket, closed with the relay
+ * @param out    where the relay is stored, for tls_close to wait for
+ * @return       the local end of the relay
+ */
+static int tls_start_relay(SSL *ssl, int sockfd, struct tls_relay **out)
+{
+    struct tls_relay *relay;
+    int               pair[2];
+    int               flags;
+    int               result;
+
+    relay = (struct tls_relay *)malloc(sizeof(*relay));
+
+    if(relay == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    // The relay waits in poll(), so it is never stuck on half a record
+    flags = fcntl(sockfd, F_GETFL);
+    if(flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+
+    relay->ssl      = ssl;
+    relay->sockfd   = sockfd;
+    relay->local_fd = pair[1];
+
+    result = pthread_create(&relay->thread, NULL, tls_relay_thread, relay);
+
+    if(result != 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        SSL_free(ssl);
+        exit(EXIT_FAILURE);
+    }
+
+    *out = relay;
+
+    return pair[0];
+}
+
+/**
+ * Decrypts what the server sends into the local socket and encrypts what this client writes to
+ * it. The server closing the connection ends the local socket's reading side, which is how a
+ * legacy request's output ends.
+ * @param arg the tls_relay, freed by tls_close
+ * @return    NULL
+ */
+static void *tls_relay_thread(void *arg)
+{
+    struct tls_relay *relay;
+    struct pollfd     fds[2];
+    char              buffer[TLS_RELAY_CHUNK_LEN];
+    int               done;
+
+    relay         = (struct tls_relay *)arg;
+    fds[0].fd     = relay->sockfd;
+    fds[0].events = POLLIN;
+    fds[1].fd     = relay->local_fd;
+    fds[1].events = POLLIN;
+    done          = 0;
+
+    while(!done)
+    {
+        // Records already decrypted inside OpenSSL do not show up in poll()
+        if(fds[0].fd != -1 && SSL_pending(relay->ssl) > 0)
+        {
+            fds[0].revents = POLLIN;
+            fds[1].revents = 0;
+        }
+        else if(poll(fds, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            break;
+        }
+
+        if(fds[0].revents != 0)
+        {
+            int len;
+
+            len = SSL_read(relay->ssl, buffer, sizeof(buffer));
+
+            if(len > 0)
+            {
+                if(write_fully(relay->local_fd, buffer, (size_t)len) == -1)
+                {
+                    break;
+                }
+            }
+            else if(SSL_get_error(relay->ssl, len) != SSL_ERROR_WANT_READ)
+            {
+                shutdown(relay->local_fd, SHUT_WR);
+                fds[0].fd = -1;
+            }
+        }
+
+        if(fds[1].revents != 0)
+        {
+            ssize_t len;
+            int     sent;
+
+            len = read(relay->local_fd, buffer, sizeof(buffer));
+
+            if(len <= 0)
+            {
+                break;
+            }
+
+            // Without partial writes, a write that would block is retried with the same bytes
+            while((sent = SSL_write(relay->ssl, buffer, (int)len)) <= 0)
+            {
+                struct pollfd writable;
+                int           error;
+
+                error = SSL_get_error(relay->ssl, sent);
+
+                if(error != SSL_ERROR_WANT_WRITE && error != SSL_ERROR_WANT_READ)
+                {
+                    done = 1;
+                    break;
+                }
+
+                writable.fd     = relay->sockfd;
+                writable.events = error == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN;
+                poll(&writable, 1, -1);
+            }
+        }
+    }
+
+    SSL_shutdown(relay->ssl);
+    SSL_free(relay->ssl);
+    close(relay->sockfd);
+    close(relay->local_fd);
+
+    return NULL;
+}
+#endif
+
+// Session Protocol Functions
+
+/**
+ * Tells the server this connection carries a stream of command frames.
+ * @param sockfd the file descriptor of the connected socket
+ */
+static void open_session(int sockfd)
+{
+    uint8_t marker;
+
+    marker = SESSION_MARKER;
+
+    if(write_fully(sockfd, &marker, sizeof(marker)) == -1)
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Sends a command and waits for its response.
+ * @param sockfd       the file descriptor of the connected socket
+ * @param command      the command to run
+ * @param session      non-zero if the connection is a session
+ * @param id           the request ID of the command
+ * @param timeout      milliseconds the server may run the command for, 0 for its default
+ * @param output_fd    where a legacy command over a Unix socket writes its output itself, or -1
+ * @param usage_format how to print the usage the server reports, if it was asked to
+ * @return             the exit code of the command, TIMEOUT_EXIT_CODE if it ran out of time
+ */
+static int run_command(int sockfd, const char *command, int session, uint32_t id, uint32_t timeout, int output_fd, int usage_format)
+{
+    int exit_code;
+
+    write_to_socket(sockfd, command, session, id, timeout, output_fd);
+    exit_code = read_from_socket(sockfd, session, NULL, command, usage_format);
+
+    // The status alone cannot tell a timeout from a command that exits with 124 itself
+    if(timeout > 0 && exit_code == TIMEOUT_EXIT_CODE)
+    {
+        fprintf(stderr, "Timed out after %" PRIu32 " ms: %s\n", timeout, command);
+    }
+
+    return exit_code;
+}
+
+/**
+ * Asks the server for part of a file and writes it to stdout. On success the offset just
+ * past the last byte received goes to stderr, so the next call can pick up from there.
+ * @param sockfd the file descriptor of the connected session
+ * @param path   the path of the file on the server
+ * @param offset the byte offset to start at
+ * @param length the most bytes to fetch, 0 for the rest of the file
+ * @return       EXIT_SUCCESS if the file was sent, EXIT_FAILURE if the server refused it
+ */
+static int fetch_file(int sockfd, const char *path, uint64_t offset, uint64_t length)
+{
+    uint8_t  frame[FRAME_HEADER_LEN + MAX_COMMAND_LEN];
+    uint32_t halves[4];
+    uint64_t received;
+    size_t   path_len;
+    int      exit_code;
+
+    path_len = strlen(path) + 1;
+
+    if(FETCH_HEADER_LEN + path_len > MAX_COMMAND_LEN)
+    {
+        fprintf(stderr, "Path is too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    halves[0] = htonl((uint32_t)(offset >> 32));
+    halves[1] = htonl((uint32_t)offset);
+    halves[2] = htonl((uint32_t)(length >> 32));
+    halves[3] = htonl((uint32_t)length);
+    encode_frame_header(frame, FRAME_FETCH, 0, FETCH_HEADER_LEN + path_len);
+    memcpy(&frame[FRAME_HEADER_LEN], halves, sizeof(halves));
+    memcpy(&frame[FRAME_HEADER_LEN + FETCH_HEADER_LEN], path, path_len);
+
+    if(write_fully(sockfd, frame, FRAME_HEADER_LEN + FETCH_HEADER_LEN + path_len) == -1)
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+
+    exit_code = read_from_socket(sockfd, 1, &received, path, USAGE_FORMAT_NONE);
+
+    if(exit_code == EXIT_SUCCESS)
+    {
+        fprintf(stderr, "Next offset: %" PRIu64 "\n", offset + received);
+    }
+
+    return exit_code;
+}
+
+/**
+ * Sends every command without waiting, then prints each command's output as soon as its
+ * trailer arrives. Results come back in completion order, not submission order.
+ * @param sockfd        the file descriptor of the connected session
+ * @param commands      the commands to run, the index of each is its request ID
+ * @param command_count the number of commands
+ * @param timeout       milliseconds the server may run each command for, 0 for its default
+ * @param usage_format  how to print the usage the server reports, if it was asked to
+ * @return              EXIT_SUCCESS if every command exited with 0, EXIT_FAILURE otherwise
+ */
+static int pipeline_commands(int sockfd, char **commands, int command_count, uint32_t timeout, int usage_format)
+{
+    struct pipelined_reply *replies;
+    uint8_t                *requests;
+    size_t                  requests_len;
+    size_t                  offset;
+    size_t                  sent;
+    int                     remaining;
+    int                     exit_code;
+
+    // Encode the whole batch up front so it leaves in as few writes as possible
+    requests_len = 0;
+
+    for(int i = 0; i < command_count; i++)
+    {
+        size_t frame_len;
+
+        frame_len = command_frame_len(commands[i], timeout);
+
+        if(frame_len > FRAME_HEADER_LEN + MAX_COMMAND_LEN)
+        {
+            fprintf(stderr, "Command is too long: %s\n", commands[i]);
+            exit(EXIT_FAILURE);
+        }
+
+        requests_len += frame_len;
+    }
+
+    requests = (uint8_t *)malloc(requests_len + 1);
+    replies  = (struct pipelined_reply *)calloc((size_t)command_count + 1, sizeof(*replies));
+
+    if(requests == NULL || replies == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    offset = 0;
+
+    for(int i = 0; i < command_count; i++)
+    {
+        offset += encode_command_frame(&requests[offset], (uint32_t)i, commands[i], timeout);
+    }
+
+    sent      = 0;
+    remaining = command_count;
+    exit_code = EXIT_SUCCESS;
+
+    // Keep reading while sending so a large batch never deadlocks against full socket buffers
+    while(remaining > 0)
+    {
+        struct pollfd pfd;
+        uint8_t       type;
+        uint32_t      id;
+        uint32_t      len;
+
+        pfd.fd      = sockfd;
+        pfd.events  = (short)(sent < requests_len ? POLLIN | POLLOUT : POLLIN);
+        pfd.revents = 0;
+
+        if(poll(&pfd, 1, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        if(pfd.revents & POLLOUT)
+        {
+            ssize_t bytes_sent;
+
+            bytes_sent = send(sockfd, &requests[sent], requests_len - sent, MSG_DONTWAIT);
+
+            if(bytes_sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("send");
+                exit(EXIT_FAILURE);
+            }
+
+            if(bytes_sent > 0)
+            {
+                sent += (size_t)bytes_sent;
+            }
+        }
+
+        if(!(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            continue;
+        }
+
+        read_frame_header(sockfd, &type, &id, &len);
+
+        if(id >= (uint32_t)command_count)
+        {
+            fprintf(stderr, "Response for unknown request %u\n", id);
+            exit(EXIT_FAILURE);
+        }
+
+        switch(type)
+        {
+            case FRAME_OUTPUT:
+            {
+                struct pipelined_reply *reply;
+
+                reply = &replies[id];
+
+                if(reply->len + len > reply->capacity)
+                {
+                    char *output;
+
+                    output = (char *)realloc(reply->output, reply->len + len);
+
+                    if(output == NULL)
+                    {
+                        perror("realloc");
+                        exit(EXIT_FAILURE);
+                    }
+
+                    reply->output   = output;
+                    reply->capacity = reply->len + len;
+                }
+
+                if(read_fully(sockfd, &reply->output[reply->len], len) == -1)
+                {
+                    fprintf(stderr, "Connection closed by server\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                reply->len += len;
+                break;
+            }
+#if defined(HAVE_ZLIB)
+            case FRAME_OUTPUT_DEFLATE:
+            {
+                inflate_output(sockfd, len, &replies[id]);
+                break;
+            }
+#endif
+            case FRAME_USAGE:
+            {
+                uint8_t  payload[USAGE_LEN];
+                uint64_t fields[USAGE_FIELDS];
+
+                if(len != sizeof(payload) || read_fully(sockfd, payload, len) == -1 || decode_usage(payload, len, fields) == -1)
+                {
+                    fprintf(stderr, "Malformed usage frame\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                print_usage(usage_format, id, commands[id], fields);
+                break;
+            }
+            case FRAME_EXIT:
+            case FRAME_PIPELINE_EXIT:
+            case FRAME_ERROR:
+            case FRAME_BUSY:
+            {
+                char buffer[LINE_LENGTH];
+
+                if(len >= sizeof(buffer) || read_fully(sockfd, buffer, len) == -1)
+                {
+                    fprintf(stderr, "Malformed trailer frame\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                if(write_fully(STDOUT_FILENO, replies[id].output, replies[id].len) == -1)
+                {
+                    perror("write");
+                    exit(EXIT_FAILURE);
+                }
+
+                release_reply(&replies[id]);
+                remaining--;
+
+                if(type == FRAME_ERROR)
+                {
+                    buffer[len] = '\0';
+                    fprintf(stderr, "%s\n", buffer);
+                    exit_code = EXIT_FAILURE;
+                }
+                else if(type == FRAME_BUSY)
+                {
+                    uint32_t net_retry_after;
+
+                    memcpy(&net_retry_after, buffer, sizeof(net_retry_after));
+                    fprintf(stderr, "Server busy, retry after %u ms.\n", len == sizeof(net_retry_after) ? ntohl(net_retry_after) : 0);
+                    exit_code = EXIT_FAILURE;
+                }
+                else if(type == FRAME_PIPELINE_EXIT)
+                {
+                    if(pipeline_exit_code((const uint8_t *)buffer, len, 1) != 0)
+                    {
+                        exit_code = EXIT_FAILURE;
+                    }
+                }
+                else
+                {
+                    uint32_t net_code;
+
+                    memcpy(&net_code, buffer, sizeof(net_code));
+
+                    if(len != sizeof(net_code) || ntohl(net_code) != 0)
+                    {
+                        exit_code = EXIT_FAILURE;
+                    }
+                }
+
+                break;
+            }
+            default:
+            {
+                fprintf(stderr, "Unexpected frame type %u\n", type);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    free(requests);
+    free(replies);
+
+    return exit_code;
+}
+
+/**
+ * Sends every command in one batch frame and waits for the single response. The server runs
+ * up to parallelism of them at once and answers each with its output and a result frame.
+ * The outputs are printed in command order once all have arrived, and a line per command with
+ * its exit code and run time goes to stderr.
+ * @param sockfd        the file descriptor of the connected session
+ * @param commands      the commands to run
+ * @param command_count the number of commands
+ * @param timeout       milliseconds the server may run each command for, 0 for its default
+ * @param parallelism   how many commands the server may run at once, 0 for its default
+ * @param usage_format  how to print the usage the server reports, if it was asked to
+ * @return              EXIT_SUCCESS if every command exited with 0, EXIT_FAILURE otherwise
+ */
+static int run_batch(int sockfd, char **commands, int command_count, uint32_t timeout, uint32_t parallelism, int usage_format)
+{
+    struct batch_result    *results;
+    struct pipelined_reply  current;
+    uint64_t                current_usage[USAGE_FIELDS];
+    int                     has_usage;
+    uint8_t                 frame[FRAME_HEADER_LEN + MAX_COMMAND_LEN];
+    uint32_t                net_value;
+    size_t                  offset;
+    int                     exit_code;
+
+    if(command_count == 0 || command_count > MAX_BATCH_COMMANDS)
+    {
+        fprintf(stderr, "A batch holds between 1 and %d commands.\n", MAX_BATCH_COMMANDS);
+        return EXIT_FAILURE;
+    }
+
+    offset    = FRAME_HEADER_LEN;
+    net_value = htonl(timeout);
+    memcpy(&frame[offset], &net_value, sizeof(net_value));
+    offset   += sizeof(net_value);
+    net_value = htonl(parallelism);
+    memcpy(&frame[offset], &net_value, sizeof(net_value));
+    offset   += sizeof(net_value);
+
+    for(int i = 0; i < command_count; i++)
+    {
+        size_t command_len;
+
+        command_len = strlen(commands[i]);
+
+        if(command_len == 0 || is_pipeline(commands[i]))
+        {
+            fprintf(stderr, "A batch can only hold single commands: %s\n", commands[i]);
+            return EXIT_FAILURE;
+        }
+
+        if(offset + command_len + 1 > sizeof(frame))
+        {
+            fputs("The batch is too long.\n", stderr);
+            return EXIT_FAILURE;
+        }
+
+        memcpy(&frame[offset], commands[i], command_len + 1);
+        offset += command_len + 1;
+    }
+
+    encode_frame_header(frame, FRAME_BATCH, 0, offset - FRAME_HEADER_LEN);
+
+    if(write_fully(sockfd, frame, offset) == -1)
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+
+    results = (struct batch_result *)calloc((size_t)command_count, sizeof(*results));
+
+    if(results == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&current, 0, sizeof(current));
+    memset(current_usage, 0, sizeof(current_usage));
+    has_usage = 0;
+    exit_code = -1;
+
+    // Output and usage frames belong to the command whose result frame comes next
+    while(exit_code == -1)
+    {
+        uint8_t  type;
+        uint32_t id;
+        uint32_t len;
+        uint8_t  payload[LINE_LENGTH];
+
+        read_frame_header(sockfd, &type, &id, &len);
+
+        if(type == FRAME_OUTPUT)
+        {
+            if(current.len + len > current.capacity)
+            {
+                char *output;
+
+                output = (char *)realloc(current.output, current.len + len);
+
+                if(output == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+
+                current.output   = output;
+                current.capacity = current.len + len;
+            }
+
+            if(read_fully(sockfd, &current.output[current.len], len) == -1)
+            {
+                fprintf(stderr, "Connection closed by server\n");
+                exit(EXIT_FAILURE);
+            }
+
+            current.len += len;
+            continue;
+        }
+
+#if defined(HAVE_ZLIB)
+        if(type == FRAME_OUTPUT_DEFLATE)
+        {
+            inflate_output(sockfd, len, &current);
+            continue;
+        }
+#endif
+
+        if(len >= sizeof(payload) || read_fully(sockfd, payload, len) == -1)
+        {
+            fprintf(stderr, "Malformed batch response\n");
+            exit(EXIT_FAILURE);
+        }
+
+        switch(type)
+        {
+            case FRAME_BATCH_RESULT:
+            {
+                struct batch_result *result;
+                uint32_t             net_run_high;
+
+                memcpy(&net_value, payload, sizeof(net_value));
+
+                if(len != BATCH_RESULT_LEN || ntohl(net_value) >= (uint32_t)command_count)
+                {
+                    fprintf(stderr, "Malformed batch result\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                result = &results[ntohl(net_value)];
+                release_reply(&result->output);
+                result->output   = current;
+                result->answered = 1;
+                memcpy(&net_value, &payload[sizeof(uint32_t)], sizeof(net_value));
+                result->exit_code = (int)ntohl(net_value);
+                memcpy(&net_run_high, &payload[2 * sizeof(uint32_t)], sizeof(net_run_high));
+                memcpy(&net_value, &payload[3 * sizeof(uint32_t)], sizeof(net_value));
+                result->run = (uint64_t)ntohl(net_run_high) << 32 | ntohl(net_value);
+                memcpy(&net_value, &payload[4 * sizeof(uint32_t)], sizeof(net_value));
+                result->flags = ntohl(net_value);
+                memset(&current, 0, sizeof(current));
+                result->has_usage = has_usage;
+                memcpy(result->usage, current_usage, sizeof(current_usage));
+                has_usage = 0;
+                break;
+            }
+            case FRAME_USAGE:
+            {
+                if(decode_usage(payload, len, current_usage) == -1)
+                {
+                    fprintf(stderr, "Malformed usage frame\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                has_usage = 1;
+                break;
+            }
+            case FRAME_EXIT:
+            {
+                memcpy(&net_value, payload, sizeof(net_value));
+                exit_code = len == sizeof(net_value) && ntohl(net_value) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                break;
+            }
+            case FRAME_ERROR:
+            {
+                fprintf(stderr, "%.*s\n", (int)len, (const char *)payload);
+                exit_code = EXIT_FAILURE;
+                break;
+            }
+            case FRAME_BUSY:
+            {
+                memcpy(&net_value, payload, sizeof(net_value));
+                fprintf(stderr, "Server busy, retry after %u ms.\n", len == sizeof(net_value) ? ntohl(net_value) : 0);
+                exit_code = EXIT_FAILURE;
+                break;
+            }
+            default:
+            {
+                fprintf(stderr, "Unexpected frame type %u\n", type);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    for(int i = 0; i < command_count; i++)
+    {
+        if(write_fully(STDOUT_FILENO, results[i].output.output, results[i].output.len) == -1)
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(int i = 0; i < command_count; i++)
+    {
+        if(!results[i].answered)
+        {
+            fprintf(stderr, "%3d  no result           %s\n", i, commands[i]);
+            exit_code = EXIT_FAILURE;
+        }
+        else
+        {
+            fprintf(stderr, "%3d  exit %-3d %9.3f ms  %s%s\n", i, results[i].exit_code, (double)results[i].run / MICROSECONDS_PER_MILLISECOND, commands[i], (results[i].flags & BATCH_OUTPUT_TRUNCATED) != 0 ? " (output truncated)" : "");
+        }
+
+        if(results[i].has_usage)
+        {
+            print_usage(usage_format, (uint32_t)i, commands[i], results[i].usage);
+        }
+
+        release_reply(&results[i].output);
+    }
+
+    release_reply(&current);
+    free(results);
+
+    return exit_code;
+}
+
+/**
+ * Reads every non-empty line from stdin.
+ * @param command_count where the number of lines is stored
+ * @return              the lines, each allocated separately
+ */
+static char **read_command_lines(int *command_count)
+{
+    char  **lines;
+    size_t  capacity;
+    char   *line;
+    size_t  line_size;
+
+    lines     = NULL;
+    capacity  = 0;
+    line      = NULL;
+    line_size = 0;
+
+    *command_count = 0;
+
+    while(getline(&line, &line_size, stdin) != -1)
+    {
+        line[strcspn(line, "\n")] = '\0';
+
+        if(line[0] == '\0')
+        {
+            continue;
+        }
+
+        if((size_t)*command_count == capacity)
+        {
+            char **grown;
+
+            capacity = capacity == 0 ? LINE_LENGTH / sizeof(char *) : capacity * 2;
+            grown    = (char **)realloc((void *)lines, capacity * sizeof(char *));
+
+            if(grown == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+
+            lines = grown;
+        }
+
+        lines[(*command_count)++] = line;
+        line                      = NULL;
+        line_size                 = 0;
+    }
+
+    free(line);
+
+    return lines;
+}
+
+/**
+ * Frees a reply's output and its inflate stream, leaving it empty for reuse.
+ * @param reply the reply
+ */
+static void release_reply(struct pipelined_reply *reply)
+{
+#if defined(HAVE_ZLIB)
+    if(reply->inflating)
+    {
+        inflateEnd(&reply->inflate);
+    }
+#endif
+
+    free(reply->output);
+    memset(reply, 0, sizeof(*reply));
+}
+
+/**
+ * Asks the server to send what each request used ahead of its trailer. A server that does
+ * not know the request answers with an error frame, and the session carries on without reports.
+ * @param sockfd the file descriptor of the connected session
+ */
+static void request_usage(int sockfd)
+{
+    uint8_t  frame[FRAME_HEADER_LEN];
+    char     reply[LINE_LENGTH];
+    uint8_t  type;
+    uint32_t id;
+    uint32_t len;
+
+    encode_frame_header(frame, FRAME_USAGE, 0, 0);
+
+    if(write_fully(sockfd, frame, sizeof(frame)) == -1)
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+
+    read_frame_header(sockfd, &type, &id, &len);
+
+    if((type != FRAME_USAGE && type != FRAME_ERROR) || len >= sizeof(reply) || read_fully(sockfd, reply, len) == -1)
+    {
+        fprintf(stderr, "Malformed reply to the usage request\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(type != FRAME_USAGE)
+    {
+        fprintf(stderr, "The server does not report usage, continuing without it\n");
+    }
+}
+
+/**
+ * Decodes a usage frame's payload.
+ * @param payload the payload, each field a high then a low 32-bit half
+ * @param len     the length of the payload
+ * @param fields  where the USAGE_FIELDS values are stored
+ * @return        0 on success, -1 if the payload is the wrong length
+ */
+static int decode_usage(const uint8_t *payload, size_t len, uint64_t *fields)
+{
+    if(len != USAGE_LEN)
+    {
+        return -1;
+    }
+
+    for(size_t i = 0; i < USAGE_FIELDS; i++)
+    {
+        uint32_t net_high;
+        uint32_t net_low;
+
+        memcpy(&net_high, &payload[2 * i * sizeof(uint32_t)], sizeof(net_high));
+        memcpy(&net_low, &payload[(2 * i + 1) * sizeof(uint32_t)], sizeof(net_low));
+        fields[i] = (uint64_t)ntohl(net_high) << 32 | ntohl(net_low);
+    }
+
+    return 0;
+}
+
+/**
+ * Writes what a request used to stderr, so it never mixes with the command's output.
+ * @param format  USAGE_FORMAT_TEXT or USAGE_FORMAT_JSON
+ * @param id      the request ID
+ * @param command the command the usage belongs to
+ * @param fields  wall, user and system microseconds, max RSS in KiB, voluntary and
+ *                involuntary context switches, and output bytes
+ */
+static void print_usage(int format, uint32_t id, const char *command, const uint64_t *fields)
+{
+    if(format == USAGE_FORMAT_JSON)
+    {
+        fprintf(stderr, "{\"id\":%u,\"command\":", id);
+        print_json_string(stderr, command);
+        fprintf(stderr, ",\"wall_us\":%" PRIu64 ",\"user_us\":%" PRIu64 ",\"system_us\":%" PRIu64 ",\"max_rss_kib\":%" PRIu64 ",\"voluntary_switches\":%" PRIu64 ",\"involuntary_switches\":%" PRIu64 ",\"output_bytes\":%" PRIu64 "}\n", fields[0], fields[1], fields[2], fields[3], fields[4], fields[5], fields[6]);
+    }
+    else if(format == USAGE_FORMAT_TEXT)
+    {
+        fprintf(stderr, "%3u  wall %9.3f ms  user %8.3f ms  sys %8.3f ms  rss %7" PRIu64 " KiB  switches %" PRIu64 "/%" PRIu64 "  output %" PRIu64 " B  %s\n", id, (double)fields[0] / MICROSECONDS_PER_MILLISECOND, (double)fields[1] / MICROSECONDS_PER_MILLISECOND, (double)fields[2] / MICROSECONDS_PER_MILLISECOND, fields[3], fields[4], fields[5], fields[6], command);
+    }
+}
+
+/**
+ * Writes a string as a JSON string literal, escaping quotes, backslashes and control characters.
+ * @param stream where to write it
+ * @param string the string to write
+ */
+static void print_json_string(FILE *stream, const char *string)
+{
+    fputc('"', stream);
+
+    for(const unsigned char *c = (const unsigned char *)string; *c != '\0'; c++)
+    {
+        if(*c == '"' || *c == '\\')
+        {
+            fprintf(stream, "\\%c", *c);
+        }
+        else if(*c < ' ')
+        {
+            fprintf(stream, "\\u%04x", *c);
+        }
+        else
+        {
+            fputc(*c, stream);
+        }
+    }
+
+    fputc('"', stream);
+}
+
+#if defined(HAVE_ZLIB)
+/**
+ * Asks the server to deflate output chunks for the rest of the session. A server that does
+ * not know the request answers with an error frame, and one built without zlib declines it,
+ * so in both cases the session simply carries on uncompressed.
+ * @param sockfd the file descriptor of the connected session
+ * @param level  the deflate level, from 1 to 9
+ */
+static void request_compression(int sockfd, int level)
+{
+    uint8_t  frame[FRAME_HEADER_LEN + 2];
+    char     reply[LINE_LENGTH];
+    uint8_t  type;
+    uint32_t id;
+    uint32_t len;
+
+    encode_frame_header(frame, FRAME_COMPRESS, 0, 2);
+    frame[FRAME_HEADER_LEN]     = COMPRESSION_DEFLATE;
+    frame[FRAME_HEADER_LEN + 1] = (uint8_t)level;
+
+    if(write_fully(sockfd, frame, sizeof(frame)) == -1)
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+
+    read_frame_header(sockfd, &type, &id, &len);
+
+    if((type != FRAME_COMPRESS && type != FRAME_ERROR) || len >= sizeof(reply) || read_fully(sockfd, reply, len) == -1)
+    {
+        fprintf(stderr, "Malformed reply to the compression request\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(type != FRAME_COMPRESS || len < 1 || (uint8_t)reply[0] != COMPRESSION_DEFLATE)
+    {
+        fprintf(stderr, "The server does not compress output, continuing without it\n");
+    }
+}
+
+/**
+ * Reads a compressed output frame and appends what it inflates to in the reply's output.
+ * Every request has its own stream, continued from one frame to the next.
+ * @param sockfd the file descriptor of the connected session
+ * @param len    the length of the compressed payload
+ * @param reply  the reply the output belongs to
+ */
+static void inflate_output(int sockfd, uint32_t len, struct pipelined_reply *reply)
+{
+    uint8_t   input[LINE_LENGTH];
+    z_stream *stream;
+
+    stream = &reply->inflate;
+
+    if(!reply->inflating)
+    {
+        if(inflateInit(stream) != Z_OK)
+        {
+            fprintf(stderr, "inflateInit failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+        reply->inflating = 1;
+    }
+
+    while(len > 0)
+    {
+        size_t chunk_len;
+
+        chunk_len = len < sizeof(input) ? len : sizeof(input);
+
+        if(read_fully(sockfd, input, chunk_len) == -1)
+        {
+            fprintf(stderr, "Connection closed by server\n");
+            exit(EXIT_FAILURE);
+        }
+
+        len              -= (uint32_t)chunk_len;
+        stream->next_in  = input;
+        stream->avail_in = (uInt)chunk_len;
+
+        // Inflate may hold back output when the buffer fills, so go again until it had room to spare
+        do
+        {
+            int result;
+
+            if(reply->capacity - reply->len < INFLATE_CHUNK_LEN)
+            {
+                char *output;
+
+                output = (char *)realloc(reply->output, reply->capacity + INFLATE_CHUNK_LEN);
+
+                if(output == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+
+                reply->output    = output;
+                reply->capacity += INFLATE_CHUNK_LEN;
+            }
+
+            stream->next_out  = (Bytef *)&reply->output[reply->len];
+            stream->avail_out = (uInt)(reply->capacity - reply->len);
+            result            = inflate(stream, Z_SYNC_FLUSH);
+
+            if(result != Z_OK && result != Z_BUF_ERROR)
+            {
+                fprintf(stderr, "Corrupt compressed output\n");
+                exit(EXIT_FAILURE);
+            }
+
+            reply->len = reply->capacity - stream->avail_out;
+
+            if(result == Z_BUF_ERROR)
+            {
+                break;
+            }
+        } while(stream->avail_in > 0 || stream->avail_out == 0);
+    }
+}
+#endif
+
+/**
+ * Fills in a frame header: a type byte, then the request ID and payload length as 32-bit big-endian integers.
+ * @param header the FRAME_HEADER_LEN bytes to fill in
+ * @param type   the frame type
+ * @param id     the request ID
+ * @param len    the payload length
+ */
+static void encode_frame_header(uint8_t *header, uint8_t type, uint32_t id, size_t len)
+{
+    uint32_t net_id;
+    uint32_t net_len;
+
+    net_id    = htonl(id);
+    net_len   = htonl((uint32_t)len);
+    header[0] = type;
+    memcpy(&header[1], &net_id, sizeof(net_id));
+    memcpy(&header[1 + sizeof(net_id)], &net_len, sizeof(net_len));
+}
+
+/**
+ * Encodes a command frame, with the timeout in front of the command if there is one. A
+ * pipeline is sent as its stages, always with a timeout.
+ * @param frame   where the frame is written, command_frame_len() bytes
+ * @param id      the request ID
+ * @param command the command to run
+ * @param timeout milliseconds the server may run the command for, 0 for its default
+ * @return        the length of the frame
+ */
+static size_t encode_command_frame(uint8_t *frame, uint32_t id, const char *command, uint32_t timeout)
+{
+    size_t   command_len;
+    size_t   offset;
+    uint32_t net_timeout;
+
+    offset = FRAME_HEADER_LEN;
+
+    if(is_pipeline(command))
+    {
+        net_timeout = htonl(timeout);
+        memcpy(&frame[offset], &net_timeout, sizeof(net_timeout));
+        offset += sizeof(net_timeout);
+        offset += encode_pipeline_stages(&frame[offset], command);
+        encode_frame_header(frame, FRAME_PIPELINE, id, offset - FRAME_HEADER_LEN);
+
+        return offset;
+    }
+
+    command_len = strlen(command);
+
+    if(timeout > 0)
+    {
+        net_timeout = htonl(timeout);
+        memcpy(&frame[offset], &net_timeout, sizeof(net_timeout));
+        offset += sizeof(net_timeout);
+    }
+
+    encode_frame_header(frame, timeout > 0 ? FRAME_COMMAND_TIMEOUT : FRAME_COMMAND, id, offset - FRAME_HEADER_LEN + command_len);
+    memcpy(&frame[offset], command, command_len);
+
+    return offset + command_len;
+}
+
+/**
+ * Works out how long the frame for a command is.
+ * @param command the command to run
+ * @param timeout milliseconds the server may run the command for, 0 for its default
+ * @return        the length of the header and payload
+ */
+static size_t command_frame_len(const char *command, uint32_t timeout)
+{
+    if(is_pipeline(command))
+    {
+        return FRAME_HEADER_LEN + sizeof(uint32_t) + encode_pipeline_stages(NULL, command);
+    }
+
+    return FRAME_HEADER_LEN + (timeout > 0 ? sizeof(uint32_t) : 0) + strlen(command);
+}
+
+/**
+ * Checks whether a command is a pipeline, with a separator on its own between spaces.
+ * @param command the command to run
+ * @return        non-zero if it is a pipeline
+ */
+static int is_pipeline(const char *command)
+{
+    for(const char *token = command; *token != '\0'; token += strcspn(token, " "))
+    {
+        token += strspn(token, " ");
+
+        if(token[0] == PIPE_SEPARATOR && (token[1] == ' ' || token[1] == '\0'))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Encodes a pipeline's stages the way the server reads them: every argument NUL-terminated,
+ * and each stage closed by an empty one where its separator or the end of the line was.
+ * Repeated spaces are dropped, as the server does for a single command.
+ * @param payload where the stages are written, NULL to only work out their length
+ * @param command the pipeline
+ * @return        the length of the stages in bytes
+ */
+static size_t encode_pipeline_stages(uint8_t *payload, const char *command)
+{
+    const char *token;
+    size_t      len;
+
+    len   = 0;
+    token = command + strspn(command, " ");
+
+    while(*token != '\0')
+    {
+        size_t token_len;
+
+        token_len = strcspn(token, " ");
+
+        // A separator becomes the empty argument that closes its stage
+        if(token_len != 1 || token[0] != PIPE_SEPARATOR)
+        {
+            if(payload != NULL)
+            {
+                memcpy(&payload[len], token, token_len);
+            }
+
+            len += token_len;
+        }
+
+        if(payload != NULL)
+        {
+            payload[len] = '\0';
+        }
+
+        len++;
+        token += token_len;
+        token += strspn(token, " ");
+    }
+
+    if(payload != NULL)
+    {
+        payload[len] = '\0';
+    }
+
+    return len + 1;
+}
+
+/**
+ * Reads a pipeline's exit codes. Like a shell, the pipeline's status is its last stage's,
+ * and the others are only reported when one failed.
+ * @param payload the trailer's payload, one exit code per stage
+ * @param len     the length of the payload
+ * @param report  non-zero to print every stage's exit code to stderr if an earlier stage failed
+ * @return        the exit code of the last stage, or -1 if the trailer is malformed
+ */
+static int pipeline_exit_code(const uint8_t *payload, size_t len, int report)
+{
+    uint32_t net_code;
+    size_t   stage_count;
+    int      failed;
+
+    stage_count = len / sizeof(net_code);
+    failed      = 0;
+
+    if(stage_count == 0 || stage_count > MAX_PIPELINE_STAGES || len % sizeof(net_code) != 0)
+    {
+        return -1;
+    }
+
+    for(size_t i = 0; i + 1 < stage_count; i++)
+    {
+        memcpy(&net_code, &payload[i * sizeof(net_code)], sizeof(net_code));
+        failed |= net_code != 0;
+    }
+
+    if(report && failed)
+    {
+        fputs("Stage exit codes:", stderr);
+
+        for(size_t i = 0; i < stage_count; i++)
+        {
+            memcpy(&net_code, &payload[i * sizeof(net_code)], sizeof(net_code));
+            fprintf(stderr, " %u", ntohl(net_code));
+        }
+
+        fputc('\n', stderr);
+    }
+
+    memcpy(&net_code, &payload[len - sizeof(net_code)], sizeof(net_code));
+
+    return (int)ntohl(net_code);
+}
+
+/**
+ * Reads the header of the next frame from the server, exiting if the connection closed.
+ * @param sockfd the file descriptor of the connected session
+ * @param type   where the frame type is stored
+ * @param id     where the request ID is stored
+ * @param len    where the payload length is stored
+ */
+static void read_frame_header(int sockfd, uint8_t *type, uint32_t *id, uint32_t *len)
+{
+    uint8_t  header[FRAME_HEADER_LEN];
+    uint32_t net_id;
+    uint32_t net_len;
+
+    if(read_fully(sockfd, header, sizeof(header)) == -1)
+    {
+        fprintf(stderr, "Connection closed by server\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(&net_id, &header[1], sizeof(net_id));
+    memcpy(&net_len, &header[1 + sizeof(net_id)], sizeof(net_len));
+    *type = header[0];
+    *id   = ntohl(net_id);
+    *len  = ntohl(net_len);
+}
+
+/**
+ * Reads exactly len bytes from a socket, retrying after short reads.
+ * @param sockfd the file descriptor to read from
+ * @param buffer where the bytes are stored
+ * @param len    the number of bytes to read
+ * @return       0 on success, -1 on EOF or error
+ */
+static int read_fully(int sockfd, void *buffer, size_t len)
+{
+    char  *bytes;
+    size_t total;
+
+    bytes = (char *)buffer;
+    total = 0;
+
+    while(total < len)
+    {
+        ssize_t bytes_read;
+
+        bytes_read = read(sockfd, bytes + total, len - total);
+
+        if(bytes_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(bytes_read <= 0)
+        {
+            return -1;
+        }
+
+        total += (size_t)bytes_read;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes exactly len bytes to a file descriptor, retrying after short writes.
+ * @param sockfd the file descriptor to write to
+ * @param buffer the bytes to write
+ * @param len    the number of bytes to write
+ * @return       0 on success, -1 on error
+ */
+static int write_fully(int sockfd, const void *buffer, size_t len)
+{
+    const char *bytes;
+    size_t      total;
+
+    bytes = (const char *)buffer;
+    total = 0;
+
+    while(total < len)
+    {
+        ssize_t bytes_written;
+
+        bytes_written = write(sockfd, bytes + total, len - total);
+
+        if(bytes_written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(bytes_written <= 0)
+        {
+            return -1;
+        }
+
+        total += (size_t)bytes_written;
+    }
+
+    return 0;
+}
+
+// Benchmark Functions
+
+/**
+ * Replays the commands against the server over many connections and reports the throughput
+ * and latency percentiles. With a rate the requests are sent on a fixed schedule and latency is
+ * measured from when each one was due, so a stalled server is not hidden by requests that were
+ * never sent.
+ * @param addr          the server's address
+ * @param port          the server's port
+ * @param commands      the commands to replay in turn
+ * @param command_count the number of commands
+ * @param benchmark     the connection count, request count, and rate
+ * @param session        keep one session open per connection instead of connecting for every request
+ * @param socket_options the SOCKET_ options every connection gets
+ * @return               EXIT_SUCCESS if every request completed, EXIT_FAILURE otherwise
+ */
+static int run_benchmark(struct sockaddr_storage *addr, in_port_t port, char **commands, int command_count, const struct benchmark_options *benchmark, int session, unsigned int socket_options)
+{
+    struct bench_connection  *connections;
+    struct pollfd            *pfds;
+    size_t                   *pfd_owners;
+    struct latency_histogram *histogram;
+    socklen_t                 addr_len;
+    uint64_t                  issued;
+    uint64_t                  completed;
+    uint64_t                  failed;
+    uint64_t                  start;
+
+    for(int i = 0; i < command_count; i++)
+    {
+        size_t command_len;
+
+        command_len = strlen(commands[i]);
+
+        if(command_len > MAX_COMMAND_LEN || (!session && command_len > UINT8_MAX))
+        {
+            fprintf(stderr, "Command is too long%s: %s\n", session ? "" : ", use -s", commands[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    addr_len    = set_address_port(addr, port);
+    connections = (struct bench_connection *)calloc(benchmark->connections, sizeof(*connections));
+    pfds        = (struct pollfd *)calloc(benchmark->connections, sizeof(*pfds));
+    pfd_owners  = (size_t *)calloc(benchmark->connections, sizeof(*pfd_owners));
+    histogram   = (struct latency_histogram *)calloc(1, sizeof(*histogram));
+
+    if(connections == NULL || pfds == NULL || pfd_owners == NULL || histogram == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for(size_t i = 0; i < benchmark->connections; i++)
+    {
+        connections[i].fd    = -1;
+        connections[i].state = BENCH_IDLE;
+    }
+
+    printf("Benchmarking %" PRIu64 " requests over %zu %s\n", benchmark->requests, benchmark->connections, session ? "sessions" : "connections");
+    issued    = 0;
+    completed = 0;
+    failed    = 0;
+    start     = now_microseconds();
+
+    while(completed + failed < benchmark->requests)
+    {
+        uint64_t now;
+        nfds_t   nfds;
+        int      timeout;
+        int      idle;
+
+        now  = now_microseconds();
+        idle = 0;
+
+        // Hand the next due requests to idle connections
+        for(size_t i = 0; i < benchmark->connections; i++)
+        {
+            uint64_t due;
+
+            if(connections[i].state != BENCH_IDLE)
+            {
+                continue;
+            }
+
+            idle = 1;
+
+            if(issued == benchmark->requests)
+            {
+                break;
+            }
+
+            due = benchmark->rate == 0 ? now : start + issued * MICROSECONDS_PER_SECOND / benchmark->rate;
+
+            if(due > now)
+            {
+                break;
+            }
+
+            connections[i].started = due;
+
+            if(bench_start(&connections[i], addr, addr_len, commands[issued % (uint64_t)command_count], session, (uint32_t)issued, socket_options) == -1)
+            {
+                bench_close(&connections[i]);
+                failed++;
+            }
+
+            issued++;
+        }
+
+        nfds = 0;
+
+        for(size_t i = 0; i < benchmark->connections; i++)
+        {
+            if(connections[i].state == BENCH_IDLE)
+            {
+                continue;
+            }
+
+            pfds[nfds].fd      = connections[i].fd;
+            pfds[nfds].events  = (short)(connections[i].state == BENCH_RECEIVING ? POLLIN : POLLOUT);
+            pfds[nfds].revents = 0;
+            pfd_owners[nfds]   = i;
+            nfds++;
+        }
+
+        // Sleep until the next request is due if a connection is free to send it
+        timeout = -1;
+
+        if(idle && issued < benchmark->requests && benchmark->rate != 0)
+        {
+            uint64_t due;
+
+            due     = start + issued * MICROSECONDS_PER_SECOND / benchmark->rate;
+            timeout = due > now ? (int)((due - now + MICROSECONDS_PER_MILLISECOND - 1) / MICROSECONDS_PER_MILLISECOND) : 0;
+        }
+
+        if(nfds == 0 && timeout == -1)
+        {
+            continue;
+        }
+
+        if(poll(pfds, nfds, timeout) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        for(nfds_t i = 0; i < nfds; i++)
+        {
+            struct bench_connection *connection;
+            int                      result;
+
+            if(pfds[i].revents == 0)
+            {
+                continue;
+            }
+
+            connection = &connections[pfd_owners[i]];
+            result     = 0;
+
+            if(connection->state == BENCH_CONNECTING)
+            {
+                int       error;
+                socklen_t error_len;
+
+                error     = 0;
+                error_len = sizeof(error);
+
+                if(getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0)
+                {
+                    result = -1;
+                }
+                else
+                {
+                    connection->state = BENCH_SENDING;
+                }
+            }
+
+            if(result == 0 && connection->state == BENCH_SENDING)
+            {
+                result = bench_send(connection);
+                result = result == 1 ? 0 : result;
+            }
+            else if(result == 0 && connection->state == BENCH_RECEIVING)
+            {
+                result = bench_receive(connection, session);
+            }
+
+            if(result == -1)
+            {
+                bench_close(connection);
+                failed++;
+            }
+            else if(result == 1)
+            {
+                histogram_record(histogram, now_microseconds() - connection->started);
+                completed++;
+
+                // A legacy request ends with the connection, a session stays open for the next one
+                if(!session)
+                {
+                    bench_close(connection);
+                }
+
+                connection->state = BENCH_IDLE;
+            }
+        }
+    }
+
+    print_benchmark_report(histogram, completed, failed, now_microseconds() - start);
+
+    for(size_t i = 0; i < benchmark->connections; i++)
+    {
+        bench_close(&connections[i]);
+    }
+
+    free(histogram);
+    free(pfd_owners);
+    free(pfds);
+    free(connections);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Starts a request on a benchmark connection, connecting first if it has no open session.
+ * @param connection the idle connection
+ * @param addr       the server's address
+ * @param addr_len   the length of the address
+ * @param command    the command to run
+ * @param session    send the command as a session frame instead of a legacy request
+ * @param id             the session request id
+ * @param socket_options the SOCKET_ options for a new connection
+ * @return               0 on success, -1 if the connection could not be started
+ */
+static int bench_start(struct bench_connection *connection, const struct sockaddr_storage *addr, socklen_t addr_len, const char *command, int session, uint32_t id, unsigned int socket_options)
+{
+    size_t command_len;
+
+    command_len              = strlen(command);
+    connection->request_len  = 0;
+    connection->request_sent = 0;
+    connection->header_len   = 0;
+    connection->payload_left = 0;
+    connection->id           = id;
+
+    if(connection->fd == -1)
+    {
+        int flags;
+
+        connection->fd = socket(addr->ss_family, SOCK_STREAM, 0);
+
+        if(connection->fd == -1)
+        {
+            return -1;
+        }
+
+        flags = fcntl(connection->fd, F_GETFL);
+
+        if(flags == -1 || fcntl(connection->fd, F_SETFL, flags | O_NONBLOCK) == -1 || tune_socket(connection->fd, socket_options) == -1)
+        {
+            return -1;
+        }
+
+        connection->state = BENCH_SENDING;
+
+        if(connect(connection->fd, (const struct sockaddr *)addr, addr_len) == -1)
+        {
+            if(errno != EINPROGRESS)
+            {
+                return -1;
+            }
+
+            connection->state = BENCH_CONNECTING;
+        }
+
+        // A new connection has to open its session before the first frame
+        if(session)
+        {
+            connection->request[connection->request_len++] = SESSION_MARKER;
+        }
+    }
+    else
+    {
+        connection->state = BENCH_SENDING;
+    }
+
+    if(session)
+    {
+        encode_frame_header(&connection->request[connection->request_len], FRAME_COMMAND, id, command_len);
+        connection->request_len += FRAME_HEADER_LEN;
+    }
+    else
+    {
+        connection->request[connection->request_len++] = (uint8_t)command_len;
+    }
+
+    memcpy(&connection->request[connection->request_len], command, command_len);
+    connection->request_len += command_len;
+
+    return 0;
+}
+
+/**
+ * Sends as much of the pending request as the socket takes.
+ * @param connection the sending connection
+ * @return           1 once the whole request is sent, 0 if more is left, -1 on error
+ */
+static int bench_send(struct bench_connection *connection)
+{
+    while(connection->request_sent < connection->request_len)
+    {
+        ssize_t bytes_sent;
+
+        bytes_sent = send(connection->fd, &connection->request[connection->request_sent], connection->request_len - connection->request_sent, BENCH_SEND_FLAGS);
+
+        if(bytes_sent == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        connection->request_sent += (size_t)bytes_sent;
+    }
+
+    connection->state = BENCH_RECEIVING;
+    return 1;
+}
+
+/**
+ * Reads whatever the server has sent for the current request, discarding the output.
+ * @param connection the receiving connection
+ * @param session    the reply is framed, and ends at its EXIT frame instead of at end of file
+ * @return           1 once the request is complete, 0 if more is expected, -1 on error
+ */
+static int bench_receive(struct bench_connection *connection, int session)
+{
+    uint8_t discard[BENCH_DISCARD_LEN];
+
+    for(;;)
+    {
+        ssize_t  bytes_received;
+        size_t   wanted;
+        uint8_t *target;
+
+        // A legacy reply is everything up to end of file, a session reply is read frame by frame
+        if(!session)
+        {
+            target = discard;
+            wanted = sizeof(discard);
+        }
+        else if(connection->header_len < FRAME_HEADER_LEN)
+        {
+            target = &connection->header[connection->header_len];
+            wanted = FRAME_HEADER_LEN - connection->header_len;
+        }
+        else
+        {
+            target = discard;
+            wanted = connection->payload_left < sizeof(discard) ? connection->payload_left : sizeof(discard);
+        }
+
+        bytes_received = recv(connection->fd, target, wanted, 0);
+
+        if(bytes_received == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        if(bytes_received == 0)
+        {
+            return session ? -1 : 1;
+        }
+
+        if(!session)
+        {
+            continue;
+        }
+
+        if(connection->header_len < FRAME_HEADER_LEN)
+        {
+            uint32_t net_id;
+            uint32_t net_len;
+
+            connection->header_len += (size_t)bytes_received;
+
+            if(connection->header_len < FRAME_HEADER_LEN)
+            {
+                continue;
+            }
+
+            memcpy(&net_id, &connection->header[1], sizeof(net_id));
+            memcpy(&net_len, &connection->header[1 + sizeof(net_id)], sizeof(net_len));
+
+            if(ntohl(net_id) != connection->id)
+            {
+                return -1;
+            }
+
+            connection->payload_left = ntohl(net_len);
+        }
+        else
+        {
+            connection->payload_left -= (uint32_t)bytes_received;
+        }
+
+        if(connection->payload_left > 0)
+        {
+            continue;
+        }
+
+        // The frame is done, only an EXIT or ERROR frame ends the request
+        switch(connection->header[0])
+        {
+            case FRAME_OUTPUT:
+            {
+                connection->header_len = 0;
+                break;
+            }
+            case FRAME_EXIT:
+            case FRAME_PIPELINE_EXIT:
+            {
+                return 1;
+            }
+            default:
+            {
+                return -1;
+            }
+        }
+    }
+}
+
+/**
+ * Closes a benchmark connection so its next request connects again.
+ * @param connection the connection to close
+ */
+static void bench_close(struct bench_connection *connection)
+{
+    if(connection->fd != -1)
+    {
+        close(connection->fd);
+    }
+
+    connection->fd    = -1;
+    connection->state = BENCH_IDLE;
+}
+
+/**
+ * Reads the monotonic clock.
+ * @return the current time in microseconds
+ */
+static uint64_t now_microseconds(void)
+{
+    struct timespec now;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+    {
+        perror("clock_gettime");
+        exit(EXIT_FAILURE);
+    }
+
+    return (uint64_t)now.tv_sec * MICROSECONDS_PER_SECOND + (uint64_t)now.tv_nsec / NANOSECONDS_PER_MICROSECOND;
+}
+
+/**
+ * Records one value in a histogram.
+ * @param histogram the histogram
+ * @param value     the value to record
+ */
+static void histogram_record(struct latency_histogram *histogram, uint64_t value)
+{
+    size_t magnitude;
+
+    // Values below the sub-bucket count are exact, larger ones keep the top bits
+    magnitude = 0;
+
+    while((value >> magnitude) >= HISTOGRAM_SUB_BUCKETS && magnitude < HISTOGRAM_MAGNITUDES - 1)
+    {
+        magnitude++;
+    }
+
+    if((value >> magnitude) >= HISTOGRAM_SUB_BUCKETS)
+    {
+        value = ((uint64_t)HISTOGRAM_SUB_BUCKETS << magnitude) - 1;
+    }
+
+    histogram->counts[magnitude][value >> magnitude]++;
+
+    if(histogram->total == 0 || value < histogram->min)
+    {
+        histogram->min = value;
+    }
+
+    if(value > histogram->max)
+    {
+        histogram->max = value;
+    }
+
+    histogram->total++;
+}
+
+/**
+ * Finds the value below which a percentage of the recorded values fall.
+ * @param histogram  the histogram
+ * @param percentile the percentage, from 0 to 100
+ * @return           the highest value in the bucket holding the percentile
+ */
+static uint64_t histogram_percentile(const struct latency_histogram *histogram, double percentile)
+{
+    uint64_t target;
+    uint64_t seen;
+
+    target = (uint64_t)((double)histogram->total * percentile / PERCENT);
+    target = target == 0 ? 1 : target;
+    seen   = 0;
+
+    for(size_t magnitude = 0; magnitude < HISTOGRAM_MAGNITUDES; magnitude++)
+    {
+        for(size_t bucket = 0; bucket < HISTOGRAM_SUB_BUCKETS; bucket++)
+        {
+            seen += histogram->counts[magnitude][bucket];
+
+            if(seen >= target)
+            {
+                uint64_t value;
+
+                value = (((uint64_t)bucket + 1) << magnitude) - 1;
+                return value < histogram->max ? value : histogram->max;
+            }
+        }
+    }
+
+    return histogram->max;
+}
+
+/**
+ * Prints the benchmark's throughput and latency.
+ * @param histogram the latency of every completed request
+ * @param completed the number of completed requests
+ * @param failed    the number of failed requests
+ * @param elapsed   how long the benchmark ran, in microseconds
+ */
+static void print_benchmark_report(const struct latency_histogram *histogram, uint64_t completed, uint64_t failed, uint64_t elapsed)
+{
+    static const double percentiles[] = {PERCENTILE_MEDIAN, PERCENTILE_90, PERCENTILE_99, PERCENTILE_999};
+    double              seconds;
+
+    seconds = (double)elapsed / MICROSECONDS_PER_SECOND;
+    printf("Requests: %" PRIu64 " completed, %" PRIu64 " failed in %.3f s\n", completed, failed, seconds);
+    printf("Throughput: %.1f requests/s\n", seconds > 0 ? (double)completed / seconds : 0.0);
+
+    if(completed == 0)
+    {
+        return;
+    }
+
+    printf("Latency (ms): min %.3f", (double)histogram->min / MICROSECONDS_PER_MILLISECOND);
+
+    for(size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+    {
+        uint64_t value;
+
+        value = histogram_percentile(histogram, percentiles[i]);
+        printf(", p%g %.3f", percentiles[i], (double)value / MICROSECONDS_PER_MILLISECOND);
+    }
+
+    printf(", max %.3f\n", (double)histogram->max / MICROSECONDS_PER_MILLISECOND);
+}
+
+// Fan-out Functions
+
+/**
+ * Runs one command on every host in a list, keeping up to a number of hosts going at once from
+ * a single poll loop. A host is resolved once it has a slot, by a resolver thread, so names are
+ * looked up while other hosts connect. Each line of output is printed as soon as it is complete,
+ * prefixed with its host, and every host's exit status is summarised at the end.
+ * @param hosts_path  the host list, - for stdin
+ * @param port        the port of hosts that do not name one
+ * @param command     the command to run
+ * @param connections how many hosts may be connected at once
+ * @param timeout        milliseconds each server may run the command for, 0 for its default
+ * @param socket_options the SOCKET_ options every connection gets
+ * @return               EXIT_SUCCESS if the command exited with 0 on every host, EXIT_FAILURE otherwise
+ */
+static int run_fanout(const char *hosts_path, in_port_t port, const char *command, size_t connections, uint32_t timeout, unsigned int socket_options)
+{
+    struct fanout_host    *hosts;
+    struct fanout_resolver resolver;
+    struct pollfd         *pfds;
+    size_t                *active;
+    uint8_t                request[1 + FRAME_HEADER_LEN + MAX_COMMAND_LEN];
+    size_t                 request_len;
+    size_t                 host_count;
+    size_t                 active_count;
+    size_t                 next;
+    size_t                 collected;
+    int                    exit_code;
+
+    if(command_frame_len(command, timeout) > FRAME_HEADER_LEN + MAX_COMMAND_LEN)
+    {
+        fprintf(stderr, "Command is too long: %s\n", command);
+        return EXIT_FAILURE;
+    }
+
+    // Every host gets the same bytes: the session marker, then the command
+    request[0]  = SESSION_MARKER;
+    request_len = 1 + encode_command_frame(&request[1], 0, command, timeout);
+    hosts       = read_host_list(hosts_path, &host_count);
+    pfds        = (struct pollfd *)calloc(connections + 1, sizeof(*pfds));
+    active      = (size_t *)calloc(connections, sizeof(*active));
+
+    if(pfds == NULL || active == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // More threads than slots would have nothing to resolve
+    fanout_resolver_start(&resolver, hosts, host_count, port, connections < FANOUT_MAX_RESOLVERS ? connections : FANOUT_MAX_RESOLVERS);
+    active_count = 0;
+    next         = 0;
+    collected    = 0;
+
+    while(next < host_count || active_count > 0)
+    {
+        uint64_t now;
+        nfds_t   nfds;
+        int      wait_ms;
+        size_t   kept;
+
+        // Fill the free connection slots, a host holds its slot while it is being resolved
+        while(active_count < connections && next < host_count)
+        {
+            fanout_resolver_submit(&resolver, next);
+            active[active_count++] = next++;
+        }
+
+        if(active_count == 0)
+        {
+            continue;
+        }
+
+        now     = now_microseconds();
+        wait_ms = -1;
+
+        for(size_t i = 0; i < active_count; i++)
+        {
+            const struct fanout_host *host;
+
+            // A host being resolved has no socket yet, poll skips a negative descriptor
+            host            = &hosts[active[i]];
+            pfds[i].fd      = host->state == FANOUT_RESOLVING ? -1 : host->fd;
+            pfds[i].events  = (short)(host->state == FANOUT_RECEIVING ? POLLIN : POLLOUT);
+            pfds[i].revents = 0;
+
+            // Only connecting is timed here, how long a command may run is up to its server
+            if(host->state == FANOUT_CONNECTING)
+            {
+                int remaining;
+
+                remaining = host->deadline > now ? (int)((host->deadline - now + MICROSECONDS_PER_MILLISECOND - 1) / MICROSECONDS_PER_MILLISECOND) : 0;
+                wait_ms   = wait_ms == -1 || remaining < wait_ms ? remaining : wait_ms;
+            }
+        }
+
+        pfds[active_count].fd      = resolver.wake_fds[0];
+        pfds[active_count].events  = POLLIN;
+        pfds[active_count].revents = 0;
+        nfds                       = (nfds_t)active_count + 1;
+
+        if(poll(pfds, nfds, wait_ms) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        now = now_microseconds();
+
+        for(size_t i = 0; i < active_count; i++)
+        {
+            struct fanout_host *host;
+            int                 result;
+
+            host   = &hosts[active[i]];
+            result = 0;
+
+            if(pfds[i].revents == 0)
+            {
+                if(host->state == FANOUT_CONNECTING && host->deadline <= now)
+                {
+                    snprintf(host->status, sizeof(host->status), "connect timed out");
+                    fanout_finish(host);
+                }
+
+                continue;
+            }
+
+            if(host->state == FANOUT_CONNECTING)
+            {
+                int       error;
+                socklen_t error_len;
+
+                error     = 0;
+                error_len = sizeof(error);
+
+                if(getsockopt(host->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1)
+                {
+                    error = errno;
+                }
+
+                if(error != 0)
+                {
+                    snprintf(host->status, sizeof(host->status), "connect failed: %s", strerror(error));
+                    result = -1;
+                }
+                else
+                {
+                    host->state = FANOUT_SENDING;
+                }
+            }
+
+            if(result == 0 && host->state == FANOUT_SENDING)
+            {
+                result = fanout_send(host, request, request_len);
+            }
+            else if(result == 0 && host->state == FANOUT_RECEIVING)
+            {
+                result = fanout_receive(host);
+            }
+
+            if(result != 0)
+            {
+                fanout_finish(host);
+            }
+        }
+
+        // Resolved hosts start connecting in the slots they already hold, a failed one has its status
+        if(pfds[active_count].revents != 0)
+        {
+            size_t resolved_count;
+
+            resolved_count = fanout_resolver_collect(&resolver);
+
+            for(; collected < resolved_count; collected++)
+            {
+                struct fanout_host *host;
+
+                host = &hosts[resolver.resolved[collected]];
+
+                if(host->status[0] != '\0' || fanout_start(host, socket_options) == -1)
+                {
+                    fanout_finish(host);
+                }
+            }
+        }
+
+        // Drop the hosts that are done from the active slots
+        kept = 0;
+
+        for(size_t i = 0; i < active_count; i++)
+        {
+            if(hosts[active[i]].state != FANOUT_DONE)
+            {
+                active[kept++] = active[i];
+            }
+        }
+
+        active_count = kept;
+    }
+
+    fanout_resolver_stop(&resolver);
+    fflush(stdout);
+    exit_code = print_fanout_summary(hosts, host_count);
+    free(active);
+    free(pfds);
+    free(hosts);
+
+    return exit_code;
+}
+
+/**
+ * Reads the host list, leaving every host to be resolved once it gets a connection slot. Blank
+ * lines and lines starting with # are skipped.
+ * @param hosts_path the host list, - for stdin
+ * @param host_count where the number of hosts is stored
+ * @return           the hosts, in the order they were listed
+ */
+static struct fanout_host *read_host_list(const char *hosts_path, size_t *host_count)
+{
+    FILE               *file;
+    struct fanout_host *hosts;
+    size_t              count;
+    size_t              capacity;
+    char               *line;
+    size_t              line_size;
+
+    file = strcmp(hosts_path, "-") == 0 ? stdin : fopen(hosts_path, "r");
+
+    if(file == NULL)
+    {
+        perror(hosts_path);
+        exit(EXIT_FAILURE);
+    }
+
+    hosts     = NULL;
+    count     = 0;
+    capacity  = 0;
+    line      = NULL;
+    line_size = 0;
+
+    while(getline(&line, &line_size, file) != -1)
+    {
+        struct fanout_host *host;
+        char               *entry;
+        size_t              entry_len;
+
+        entry     = &line[strspn(line, " \t")];
+        entry_len = strcspn(entry, " \t\r\n");
+
+        if(entry_len == 0 || entry[0] == '#')
+        {
+            continue;
+        }
+
+        entry[entry_len] = '\0';
+
+        if(entry_len >= sizeof(hosts->name))
+        {
+            fprintf(stderr, "Skipping a host entry that is too long: %s\n", entry);
+            continue;
+        }
+
+        if(count == capacity)
+        {
+            struct fanout_host *grown;
+
+            capacity = capacity == 0 ? FANOUT_DEFAULT_CONNECTIONS : capacity * 2;
+            grown    = (struct fanout_host *)realloc(hosts, capacity * sizeof(*hosts));
+
+            if(grown == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+
+            hosts = grown;
+        }
+
+        host = &hosts[count++];
+        memset(host, 0, sizeof(*host));
+        host->fd    = -1;
+        host->state = FANOUT_PENDING;
+        memcpy(host->name, entry, entry_len + 1);
+    }
+
+    free(line);
+
+    if(file != stdin)
+    {
+        fclose(file);
+    }
+
+    if(hosts == NULL || count == 0)
+    {
+        fprintf(stderr, "The host list is empty\n");
+        exit(EXIT_FAILURE);
+    }
+
+    *host_count = count;
+    return hosts;
+}
+
+/**
+ * Starts the threads that resolve fan-out hosts, along with the pipe they wake the poll loop on.
+ * @param resolver     the resolver to set up
+ * @param hosts        the hosts, each is resolved in place
+ * @param host_count   the number of hosts
+ * @param port         the port of hosts that do not name one
+ * @param thread_count how many threads to start, at most FANOUT_MAX_RESOLVERS
+ */
+static void fanout_resolver_start(struct fanout_resolver *resolver, struct fanout_host *hosts, size_t host_count, in_port_t port, size_t thread_count)
+{
+    memset(resolver, 0, sizeof(*resolver));
+    resolver->hosts    = hosts;
+    resolver->port     = port;
+    resolver->pending  = (size_t *)calloc(host_count, sizeof(*resolver->pending));
+    resolver->resolved = (size_t *)calloc(host_count, sizeof(*resolver->resolved));
+
+    if(resolver->pending == NULL || resolver->resolved == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if(pipe(resolver->wake_fds) == -1)
+    {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    // Neither end may block: the loop drains every byte, and a thread skips a wake-up while the pipe is full
+    for(size_t i = 0; i < 2; i++)
+    {
+        int flags;
+
+        flags = fcntl(resolver->wake_fds[i], F_GETFL);
+
+        if(flags == -1 || fcntl(resolver->wake_fds[i], F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            perror("fcntl");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_mutex_init(&resolver->lock, NULL);
+    pthread_cond_init(&resolver->queued, NULL);
+
+    for(; resolver->thread_count < thread_count; resolver->thread_count++)
+    {
+        int result;
+
+        result = pthread_create(&resolver->threads[resolver->thread_count], NULL, fanout_resolver_thread, resolver);
+
+        if(result != 0)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(result));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Hands a host to the resolver threads. The host is theirs until fanout_resolver_collect returns it.
+ * @param resolver the resolver
+ * @param index    the host's index in the host list
+ */
+static void fanout_resolver_submit(struct fanout_resolver *resolver, size_t index)
+{
+    resolver->hosts[index].state = FANOUT_RESOLVING;
+    pthread_mutex_lock(&resolver->lock);
+    resolver->pending[resolver->pending_count++] = index;
+    pthread_cond_signal(&resolver->queued);
+    pthread_mutex_unlock(&resolver->lock);
+}
+
+/**
+ * Drains the wake-up pipe and returns how many hosts are resolved so far. The entries of
+ * resolver->resolved below that count are final and may be read without the lock.
+ * @param resolver the resolver
+ * @return         the number of hosts resolved, successfully or not
+ */
+static size_t fanout_resolver_collect(struct fanout_resolver *resolver)
+{
+    char   drain[FANOUT_MAX_RESOLVERS];
+    size_t resolved_count;
+
+    while(read(resolver->wake_fds[0], drain, sizeof(drain)) > 0)
+    {
+    }
+
+    pthread_mutex_lock(&resolver->lock);
+    resolved_count = resolver->resolved_count;
+    pthread_mutex_unlock(&resolver->lock);
+
+    return resolved_count;
+}
+
+/**
+ * Stops the resolver threads once they are idle and frees the resolver.
+ * @param resolver the resolver, with every submitted host collected
+ */
+static void fanout_resolver_stop(struct fanout_resolver *resolver)
+{
+    pthread_mutex_lock(&resolver->lock);
+    resolver->stopping = 1;
+    pthread_cond_broadcast(&resolver->queued);
+    pthread_mutex_unlock(&resolver->lock);
+
+    for(size_t i = 0; i < resolver->thread_count; i++)
+    {
+        pthread_join(resolver->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&resolver->queued);
+    pthread_mutex_destroy(&resolver->lock);
+    close(resolver->wake_fds[0]);
+    close(resolver->wake_fds[1]);
+    free(resolver->resolved);
+    free(resolver->pending);
+}
+
+/**
+ * Resolves submitted hosts one at a time until the resolver stops.
+ * @param arg the resolver
+ * @return    NULL
+ */
+static void *fanout_resolver_thread(void *arg)
+{
+    struct fanout_resolver *resolver;
+
+    resolver = (struct fanout_resolver *)arg;
+    pthread_mutex_lock(&resolver->lock);
+
+    for(;;)
+    {
+        size_t index;
+
+        while(resolver->pending_taken == resolver->pending_count && !resolver->stopping)
+        {
+            pthread_cond_wait(&resolver->queued, &resolver->lock);
+        }
+
+        if(resolver->pending_taken == resolver->pending_count)
+        {
+            break;
+        }
+
+        index = resolver->pending[resolver->pending_taken++];
+        pthread_mutex_unlock(&resolver->lock);
+
+        // The host's status says whether it failed, so the result itself is not kept
+        (void)fanout_resolve(&resolver->hosts[index], resolver->port);
+
+        pthread_mutex_lock(&resolver->lock);
+        resolver->resolved[resolver->resolved_count++] = index;
+
+        // A full pipe already has the loop awake, so a failed write loses nothing
+        if(write(resolver->wake_fds[1], "", 1) == -1 && errno != EAGAIN)
+        {
+            perror("write");
+        }
+    }
+
+    pthread_mutex_unlock(&resolver->lock);
+
+    return NULL;
+}
+
+/**
+ * Works out a host's address from its entry: host, host:port, [address] or [address]:port.
+ * An entry with more than one colon and no brackets is taken for a bare IPv6 address. Runs on
+ * a resolver thread, so it only touches the host's address and status.
+ * @param host the host, with its entry as its name
+ * @param port the port to use if the entry names none
+ * @return     0 with the host's address set, -1 with the reason as its status if it cannot be resolved
+ */
+static int fanout_resolve(struct fanout_host *host, in_port_t port)
+{
+    struct addrinfo  hints;
+    struct addrinfo *result;
+    char             node[NI_MAXHOST];
+    char             service[sizeof("65535")];
+    const char      *start;
+    const char      *separator;
+    size_t           node_len;
+    int              error;
+
+    snprintf(service, sizeof(service), "%u", port);
+    start = host->name;
+
+    if(host->name[0] == '[' && strchr(host->name, ']') != NULL)
+    {
+        const char *close;
+
+        close     = strchr(host->name, ']');
+        start     = &host->name[1];
+        node_len  = (size_t)(close - start);
+        separator = close[1] == ':' ? &close[1] : NULL;
+    }
+    else
+    {
+        separator = strchr(host->name, ':');
+        separator = separator != NULL && strchr(&separator[1], ':') == NULL ? separator : NULL;
+        node_len  = separator != NULL ? (size_t)(separator - host->name) : strlen(host->name);
+    }
+
+    if(node_len >= sizeof(node) || (separator != NULL && strlen(&separator[1]) >= sizeof(service)))
+    {
+        snprintf(host->status, sizeof(host->status), "cannot resolve: entry is too long");
+        return -1;
+    }
+
+    memcpy(node, start, node_len);
+    node[node_len] = '\0';
+
+    if(separator != NULL)
+    {
+        memcpy(service, &separator[1], strlen(&separator[1]) + 1);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_NUMERICSERV;
+    error             = getaddrinfo(node, service, &hints, &result);
+
+    if(error != 0)
+    {
+        snprintf(host->status, sizeof(host->status), "cannot resolve: %s", gai_strerror(error));
+        return -1;
+    }
+
+    memcpy(&host->addr, result->ai_addr, result->ai_addrlen);
+    host->addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    return 0;
+}
+
+/**
+ * Starts connecting to a host without waiting for the connection.
+ * @param host           the host
+ * @param socket_options the SOCKET_ options for the connection
+ * @return               0 once the connection is underway, -1 with the host's status set if it failed
+ */
+static int fanout_start(struct fanout_host *host, unsigned int socket_options)
+{
+    int flags;
+
+    host->fd       = socket(host->addr.ss_family, SOCK_STREAM, 0);
+    host->deadline = now_microseconds() + (uint64_t)FANOUT_CONNECT_TIMEOUT * MICROSECONDS_PER_MILLISECOND;
+
+    if(host->fd == -1)
+    {
+        snprintf(host->status, sizeof(host->status), "socket failed: %s", strerror(errno));
+        return -1;
+    }
+
+    flags = fcntl(host->fd, F_GETFL);
+
+    if(flags == -1 || fcntl(host->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        snprintf(host->status, sizeof(host->status), "fcntl failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if(tune_socket(host->fd, socket_options) == -1)
+    {
+        snprintf(host->status, sizeof(host->status), "setsockopt failed: %s", strerror(errno));
+        return -1;
+    }
+
+    host->state = FANOUT_SENDING;
+
+    if(connect(host->fd, (const struct sockaddr *)&host->addr, host->addr_len) == -1)
+    {
+        if(errno != EINPROGRESS)
+        {
+            snprintf(host->status, sizeof(host->status), "connect failed: %s", strerror(errno));
+            return -1;
+        }
+
+        host->state = FANOUT_CONNECTING;
+    }
+
+    return 0;
+}
+
+/**
+ * Sends as much of the request as the host's socket takes.
+ * @param host        the connected host
+ * @param request     the session marker and command frame every host gets
+ * @param request_len the length of the request
+ * @return            0 while the request is being sent, -1 with the host's status set on error
+ */
+static int fanout_send(struct fanout_host *host, const uint8_t *request, size_t request_len)
+{
+    while(host->request_sent < request_len)
+    {
+        ssize_t bytes_sent;
+
+        bytes_sent = send(host->fd, &request[host->request_sent], request_len - host->request_sent, BENCH_SEND_FLAGS);
+
+        if(bytes_sent == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            if(errno == EAGAIN)
+            {
+                return 0;
+            }
+
+            snprintf(host->status, sizeof(host->status), "send failed: %s", strerror(errno));
+            return -1;
+        }
+
+        host->request_sent += (size_t)bytes_sent;
+    }
+
+    host->state = FANOUT_RECEIVING;
+    return 0;
+}
+
+/**
+ * Reads whatever a host has sent and handles every frame completed by it.
+ * @param host the receiving host
+ * @return     0 if more is expected, 1 once the command has exited, -1 with the host's status set on error
+ */
+static int fanout_receive(struct fanout_host *host)
+{
+    uint8_t chunk[FANOUT_CHUNK_LEN];
+
+    for(;;)
+    {
+        ssize_t bytes_received;
+        size_t  offset;
+
+        bytes_received = recv(host->fd, chunk, sizeof(chunk), 0);
+
+        if(bytes_received == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            if(errno == EAGAIN)
+            {
+                return 0;
+            }
+
+            snprintf(host->status, sizeof(host->status), "receive failed: %s", strerror(errno));
+            return -1;
+        }
+
+        if(bytes_received == 0)
+        {
+            snprintf(host->status, sizeof(host->status), "connection closed before the command finished");
+            return -1;
+        }
+
+        offset = 0;
+
+        while(offset < (size_t)bytes_received)
+        {
+            size_t available;
+            size_t taken;
+
+            available = (size_t)bytes_received - offset;
+
+            if(host->header_len < FRAME_HEADER_LEN)
+            {
+                taken = FRAME_HEADER_LEN - host->header_len < available ? FRAME_HEADER_LEN - host->header_len : available;
+                memcpy(&host->header[host->header_len], &chunk[offset], taken);
+                host->header_len += taken;
+
+                if(host->header_len == FRAME_HEADER_LEN)
+                {
+                    uint32_t net_len;
+
+                    memcpy(&net_len, &host->header[1 + sizeof(uint32_t)], sizeof(net_len));
+                    host->payload_left = ntohl(net_len);
+                    host->payload_len  = 0;
+                }
+            }
+            else
+            {
+                taken = host->payload_left < available ? host->payload_left : available;
+
+                // Output is printed as it arrives, anything else is small and kept until the frame ends
+                if(host->header[0] == FRAME_OUTPUT)
+                {
+                    fanout_print_output(host, (const char *)&chunk[offset], taken);
+                }
+                else if(host->payload_len < sizeof(host->payload))
+                {
+                    size_t kept;
+
+                    kept = sizeof(host->payload) - host->payload_len < taken ? sizeof(host->payload) - host->payload_len : taken;
+                    memcpy(&host->payload[host->payload_len], &chunk[offset], kept);
+                    host->payload_len += kept;
+                }
+
+                host->payload_left -= (uint32_t)taken;
+            }
+
+            offset += taken;
+
+            if(host->header_len == FRAME_HEADER_LEN && host->payload_left == 0)
+            {
+                int result;
+
+                result = fanout_end_frame(host);
+
+                if(result != 0)
+                {
+                    return result;
+                }
+
+                host->header_len = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Handles a frame from a host once all of it has arrived.
+ * @param host the host
+ * @return     0 if more frames are expected, 1 once the command has exited, -1 with the host's status set on error
+ */
+static int fanout_end_frame(struct fanout_host *host)
+{
+    switch(host->header[0])
+    {
+        case FRAME_OUTPUT:
+        {
+            return 0;
+        }
+        case FRAME_EXIT:
+        {
+            uint32_t net_code;
+
+            if(host->payload_len != sizeof(net_code))
+            {
+                snprintf(host->status, sizeof(host->status), "malformed exit frame");
+                return -1;
+            }
+
+            memcpy(&net_code, host->payload, sizeof(net_code));
+            host->exit_code = (int)ntohl(net_code);
+            return 1;
+        }
+        case FRAME_PIPELINE_EXIT:
+        {
+            host->exit_code = pipeline_exit_code(host->payload, host->payload_len, 0);
+
+            if(host->exit_code == -1)
+            {
+                snprintf(host->status, sizeof(host->status), "malformed exit frame");
+                return -1;
+            }
+
+            return 1;
+        }
+        case FRAME_ERROR:
+        {
+            snprintf(host->status, sizeof(host->status), "%.*s", (int)host->payload_len, (const char *)host->payload);
+            return -1;
+        }
+        case FRAME_BUSY:
+        {
+            uint32_t net_retry_after;
+
+            memcpy(&net_retry_after, host->payload, sizeof(net_retry_after));
+            snprintf(host->status, sizeof(host->status), "server busy, retry after %u ms", host->payload_len == sizeof(net_retry_after) ? ntohl(net_retry_after) : 0);
+            return -1;
+        }
+        default:
+        {
+            snprintf(host->status, sizeof(host->status), "unexpected frame type %u", host->header[0]);
+            return -1;
+        }
+    }
+}
+
+/**
+ * Prints every line an output chunk completes, prefixed with the host. The rest is kept until
+ * its line is complete.
+ * @param host   the host the output came from
+ * @param output the chunk
+ * @param len    the length of the chunk
+ */
+static void fanout_print_output(struct fanout_host *host, const char *output, size_t len)
+{
+    while(len > 0)
+    {
+        const char *newline;
+        size_t      segment_len;
+
+        newline = (const char *)memchr(output, '\n', len);
+
+        if(newline == NULL)
+        {
+            if(host->line_len + len > host->line_capacity)
+            {
+                char  *grown;
+                size_t capacity;
+
+                capacity = host->line_capacity == 0 ? LINE_LENGTH : host->line_capacity;
+
+                while(capacity < host->line_len + len)
+                {
+                    capacity *= 2;
+                }
+
+                grown = (char *)realloc(host->line, capacity);
+
+                if(grown == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+
+                host->line          = grown;
+                host->line_capacity = capacity;
+            }
+
+            memcpy(&host->line[host->line_len], output, len);
+            host->line_len += len;
+            return;
+        }
+
+        // A whole line goes out in one formatted write, so lines from different hosts never mix
+        segment_len = (size_t)(newline - output);
+        printf("%s: %.*s%.*s\n", host->name, (int)host->line_len, host->line_len > 0 ? host->line : "", (int)segment_len, output);
+        host->line_len = 0;
+        output += segment_len + 1;
+        len -= segment_len + 1;
+    }
+}
+
+/**
+ * Closes a host's connection and prints what is left of its output.
+ * @param host the host
+ */
+static void fanout_finish(struct fanout_host *host)
+{
+    if(host->line_len > 0)
+    {
+        printf("%s: %.*s\n", host->name, (int)host->line_len, host->line);
+        host->line_len = 0;
+    }
+
+    if(host->fd != -1)
+    {
+        close(host->fd);
+    }
+
+    free(host->line);
+    host->line          = NULL;
+    host->line_capacity = 0;
+    host->fd            = -1;
+    host->state         = FANOUT_DONE;
+}
+
+/**
+ * Prints every host's exit status, or why it has none, to stderr so stdout only has output.
+ * @param hosts      the hosts
+ * @param host_count the number of hosts
+ * @return           EXIT_SUCCESS if the command exited with 0 on every host, EXIT_FAILURE otherwise
+ */
+static int print_fanout_summary(const struct fanout_host *hosts, size_t host_count)
+{
+    size_t succeeded;
+    int    width;
+
+    succeeded = 0;
+    width     = 0;
+
+    for(size_t i = 0; i < host_count; i++)
+    {
+        int name_len;
+
+        name_len = (int)strlen(hosts[i].name);
+        width    = name_len > width ? name_len : width;
+    }
+
+    for(size_t i = 0; i < host_count; i++)
+    {
+        if(hosts[i].status[0] != '\0')
+        {
+            fprintf(stderr, "%-*s  failed: %s\n", width, hosts[i].name, hosts[i].status);
+            continue;
+        }
+
+        fprintf(stderr, "%-*s  exit %d\n", width, hosts[i].name, hosts[i].exit_code);
+
+        if(hosts[i].exit_code == 0)
+        {
+            succeeded++;
+        }
+    }
+
+    fprintf(stderr, "%zu of %zu hosts succeeded\n", succeeded, host_count);
+
+    return succeeded == host_count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -108,6 +108,18 @@ generate_cmake_content() {
   echo ")" >> "$output_file"
   echo "" >> "$output_file"
 
+  # The server resolves client host names on a background thread
+  echo "find_package(Threads REQUIRED)" >> "$output_file"
+  echo "" >> "$output_file"
+
+  # Session output compression is only built when zlib is installed
+  echo "find_package(ZLIB)" >> "$output_file"
+  echo "" >> "$output_file"
+
+  # TLS is only built when OpenSSL is installed
+  echo "find_package(OpenSSL)" >> "$output_file"
+  echo "" >> "$output_file"
+
   # Loop through targets and set compile options and libraries
   for target in "${targets[@]}"; do
     # Set compiler flags for the target
@@ -121,7 +133,15 @@ generate_cmake_content() {
     echo ")" >> "$output_file"
 
     echo "# Add target_link_libraries for $target" >> "$output_file"
-    echo "target_link_libraries($target PRIVATE \${SANITIZER_FLAGS_STRING})" >> "$output_file"
+    echo "target_link_libraries($target PRIVATE \${SANITIZER_FLAGS_STRING} Threads::Threads)" >> "$output_file"
+    echo "if (ZLIB_FOUND)" >> "$output_file"
+    echo "    target_compile_definitions($target PRIVATE HAVE_ZLIB)" >> "$output_file"
+    echo "    target_link_libraries($target PRIVATE ZLIB::ZLIB)" >> "$output_file"
+    echo "endif ()" >> "$output_file"
+    echo "if (OPENSSL_FOUND)" >> "$output_file"
+    echo "    target_compile_definitions($target PRIVATE HAVE_OPENSSL)" >> "$output_file"
+    echo "    target_link_libraries($target PRIVATE OpenSSL::SSL)" >> "$output_file"
+    echo "endif ()" >> "$output_file"
     echo "" >> "$output_file"
   done
 
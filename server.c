@@ -5,6 +5,7 @@
 
 // Data Types and Limits
 #include <inttypes.h>
+#include <limits.h>
 #include <stdint.h>
 
 // Error Handling
@@ -14,30 +15,1084 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#if defined(__linux__)
+    #include <linux/vm_sockets.h>
+#endif
+
+// Process Handling
+#include <spawn.h>
+#if defined(__linux__)
+    #include <sched.h>
+    #include <sys/prctl.h>
+#endif
 
 // Signal Handling
 #include <signal.h>
 
+// Threads
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+// Shared Memory
+#include <sys/mman.h>
+
+// Event Handling
+#include <poll.h>
+#if defined(__linux__)
+    #include <sys/epoll.h>
+    #include <sys/ioctl.h>
+    #include <sys/signalfd.h>
+    #include <sys/syscall.h>
+    #include <sys/timerfd.h>
+#endif
+
+// The io_uring engine is built whenever the kernel headers have it, define NO_IO_URING to leave it out
+#if defined(__linux__) && !defined(NO_IO_URING) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+        #if defined(__NR_io_uring_setup) && defined(IORING_ACCEPT_MULTISHOT)
+            #define HAVE_IO_URING
+            #define URING_ENTRIES 256
+        #endif
+    #endif
+#endif
+
+// Compression, built when the build finds zlib and defines HAVE_ZLIB
+#if defined(HAVE_ZLIB)
+    #define ZLIB_CONST
+    #include <zlib.h>
+#endif
+
+// TLS, built when the build finds OpenSSL and defines HAVE_OPENSSL
+#if defined(HAVE_OPENSSL)
+    #include <openssl/err.h>
+    #include <openssl/ssl.h>
+    #include <poll.h>
+#endif
+
+// File System
+#include <dirent.h>
+#if defined(__linux__)
+    #include <sys/inotify.h>
+    #include <sys/sendfile.h>
+#endif
+#include <sys/stat.h>
+
 // Standard Library
 #include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 // Macros
 #define UNKNOWN_OPTION_MESSAGE_LEN 24
 #define BASE_TEN 10
 #define LINE_LENGTH 1024
+#define MAX_EVENTS 64
+
+// Server Modes
+#define MODE_SERIAL 0
+#define MODE_EPOLL 1
+#define MODE_URING 2
+
+// Spawn Backends
+#define SPAWN_FORK 0
+#define SPAWN_VFORK 1
+#define SPAWN_POSIX 2
+
+// Session Protocol
+#define SESSION_MARKER 0    // A legacy request never has a zero length, so a zero opens a session
+#define FRAME_HEADER_LEN 9    // Type, request ID and payload length
+#define FRAME_COMMAND 1
+#define FRAME_OUTPUT 2
+#define FRAME_EXIT 3
+#define FRAME_ERROR 4
+#define FRAME_COMPRESS 5    // Asks for compressed output, answered with the algorithm the server will use
+#if defined(HAVE_ZLIB)
+    #define FRAME_OUTPUT_DEFLATE 6    // An output chunk from the request's deflate stream
+#endif
+#define FRAME_BUSY 7    // The request was turned away, the payload is how many milliseconds to wait before retrying
+#define FRAME_COMMAND_TIMEOUT 8    // A command whose payload starts with how many milliseconds it may run
+#define FRAME_PIPELINE 9    // A timeout like FRAME_COMMAND_TIMEOUT's, then each stage's arguments NUL-terminated and closed by an empty one
+#define FRAME_PIPELINE_EXIT 10    // A pipeline's trailer, one exit code per stage in order
+#define MAX_PIPELINE_STAGES 16
+#define FRAME_BATCH 11    // A timeout and how many of its commands may run at once, then the commands, each NUL-terminated
+#define FRAME_BATCH_RESULT 12    // One batch command's index, exit code, run time and flags, after its output
+#define FRAME_FETCH 13    // A byte offset and length, each a high then a low 32-bit half, then the path of a file to send
+#define FRAME_USAGE 14    // Empty, asks for and acknowledges usage reports; otherwise a request's usage, ahead of its trailer
+#define USAGE_FIELDS 7    // Wall, user and system microseconds, max RSS in KiB, voluntary and involuntary switches, output bytes
+#define USAGE_LEN (USAGE_FIELDS * 2 * sizeof(uint32_t))    // Each field a high then a low 32-bit half
+#define OUTPUT_CHUNK_LEN 16384
+#define MAX_COMMAND_LEN 4096    // Legacy requests are capped at 255 bytes by their length byte
+#define FRAME_BUFFER_LEN (FRAME_HEADER_LEN + MAX_COMMAND_LEN + 1)    // One spare byte to NUL-terminate any payload
+#define OUTPUT_BLOCK_LEN (FRAME_HEADER_LEN + OUTPUT_CHUNK_LEN)    // Room in a block of queued output, longer writes get a block of their own
+#define MAX_QUEUED_OUTPUT 8388608    // Bytes held for a client that stopped reading, past it the client is given up on
+
+// Batches
+#define MAX_BATCH_COMMANDS 64
+#define MAX_BATCH_PARALLELISM 16
+#define BATCH_DEFAULT_PARALLELISM 4
+#define BATCH_MAX_OUTPUT 1048576    // Output held for one command until it exits, the rest is dropped
+#define BATCH_OUTPUT_TRUNCATED 1    // Result flag: the command wrote more than BATCH_MAX_OUTPUT
+#define BATCH_RESULT_LEN 20         // Index, exit code, microseconds run, high half first, and flags
+#define NOT_EXECUTABLE_EXIT_CODE 126
+#define NOT_FOUND_EXIT_CODE 127
+
+// File Serving
+#define MAX_FILE_ROOTS 8
+#define MAX_SERVED_FILES 16      // Files one cat may name and still be sent without running it
+#define FILE_CHUNK_LEN 262144    // Sent from one file per turn of the event loop, so a large file cannot hold up the rest
+#define FETCH_HEADER_LEN 16      // The offset and length in front of a fetched path
+
+// Memory
+#define SLAB_BLOCK_OBJECTS 64    // How many objects a slab carves out of each block it allocates
+#define SCRATCH_LEN 32768        // Room for the longest command's arguments, cache key, path and receive buffer
+
+// Output Compression
+#define COMPRESSION_NONE 0
+#if defined(HAVE_ZLIB)
+    #define COMPRESSION_DEFLATE 1
+#endif
+#define COMPRESS_DEFAULT_THRESHOLD 256    // Smaller chunks cost more to frame compressed than they save
+
+// Frame Parser Results
+#define PARSE_ERROR (-1)
+#define PARSE_INCOMPLETE 0
+#define PARSE_COMMAND 1
+#define PARSE_SESSION 2
+#define SIGNAL_EXIT_BASE 128
+
+// Event Sources
+#define SOURCE_LISTENER 0
+#define SOURCE_SIGNAL 1
+#define SOURCE_CLIENT 2
+#define SOURCE_OUTPUT 3
+#define SOURCE_PATH_WATCH 4
+#define SOURCE_WARM_CONTROL 5
+#define SOURCE_WARM_OUTPUT 6
+#define SOURCE_TIMER 7
+#if defined(HAVE_OPENSSL)
+    #define SOURCE_TLS 8
+#endif
+#define SOURCE_WRITABLE 9    // io_uring's poll for room in a client socket with output queued
+#define SOURCE_HANDOFF 10    // The readiness pipe of a new server being handed the listener
+
+// Timeouts
+#define MAX_TIMEOUT 86400           // Seconds
+#define CANCEL_KILL_DELAY 1000      // Milliseconds from SIGTERM to SIGKILL for a group that does not exit
+#define TIMEOUT_EXIT_CODE 124       // What timeout(1) exits with
+
+// Path Cache
+#define PATH_CACHE_BUCKETS 1024
+#define PATH_CACHE_MAX_ENTRIES 8192
+#define PATH_CACHE_TTL 60    // Seconds, also catches changes inotify cannot see
+#define HASH_OFFSET_BASIS 2166136261U
+#define HASH_PRIME 16777619U
+
+// Result Cache
+#define RESULT_CACHE_BUCKETS 256
+#define RESULT_CACHE_MAX_ENTRIES 1024
+#define RESULT_CACHE_MAX_OUTPUT 65536    // Longer output is still shared with the requests waiting on it, but not kept
+#define RESULT_CACHE_DEFAULT_TTL 1       // Seconds
+#define RESULT_CACHE_MAX_TTL 3600
+#define MAX_CACHE_RULES 64
+
+// Warm Workers
+#define WARM_PYTHON 0
+#define WARM_BASH 1
+#define MAX_WARM_POOLS 8
+#define WARM_MAX_WORKERS 64
+#define WARM_DEFAULT_WORKERS 2
+#define WARM_DEFAULT_USES 100    // Jobs a worker runs before it is replaced, so state a script leaves behind cannot pile up
+#define WARM_MAX_USES 1000000
+#define WARM_NAME_LEN 64
+#define WARM_STATUS_LEN 16
+#define WARM_CONTROL_FD 3    // Where a worker finds its end of the control socket
+
+// Admission Control
+#define ADMISSION_PEER_BUCKETS 256
+#define ADMISSION_MAX_LIMIT 65536
+#define ADMISSION_DEFAULT_QUEUE 64
+#define ADMISSION_MAX_QUEUE 65536
+#define RUN_TIME_WEIGHT 8    // The average run time moves an eighth of the way towards each new run
+#define RETRY_AFTER_MIN 1        // Milliseconds
+#define RETRY_AFTER_DEFAULT 100    // Until a run has been timed
+#define RETRY_AFTER_MAX 60000
+
+// Name Resolution
+#define RESOLVER_CACHE_SIZE 256
+#define RESOLVER_QUEUE_LEN 64
+
+// Worker Pool
+#define MAX_WORKERS 1024
+#define WORKER_RESTART_DELAY 1    // Seconds, so a worker that dies on startup is not restarted in a tight loop
+
+// Handoff
+#define HANDOFF_LISTENERS_ENV "SERVER_LISTENERS"           // The listening sockets a new server takes over, as fd,fd,...
+#define HANDOFF_METRICS_ENV "SERVER_METRICS_LISTENER"      // The metrics endpoint's listening socket
+#define HANDOFF_READY_ENV "SERVER_READY_FD"                // Where the new server writes its process ID once it is accepting
+#define HANDOFF_FD_LEN 12          // An int in decimal and a separator
+#define HANDOFF_TIMEOUT 30         // Seconds the old server waits for the new one before carrying on itself
+#define HANDOFF_POLL_INTERVAL 100  // Milliseconds the supervisor waits on a new server before checking on its workers
+#define DRAIN_TIMEOUT 60           // Seconds a draining server waits for its requests before leaving them to finish on their own
+#define DRAIN_POLL_INTERVAL 10     // Milliseconds between checks on handshakes still running while draining
+
+// Metrics
+#define STAGE_ACCEPT 0    // Setting up and logging an accepted connection
+#define STAGE_READ 1      // From accept until a legacy request has fully arrived
+#define STAGE_LOOKUP 2    // Resolving the command to an executable
+#define STAGE_SPAWN 3     // Creating the child, as seen by the server
+#define STAGE_RUN 4       // From spawning the child until it is reaped
+#define STAGE_DRAIN 5     // From reaping the child until its output has been forwarded
+#define STAGE_QUEUE 6     // From being queued for admission until the command is started
+#define STAGE_COUNT 7
+#define METRICS_BUCKETS 19
+#define METRICS_RESPONSE_LEN 65536
+#define METRICS_REQUEST_LEN 1024
+#define METRICS_READ_TIMEOUT 1    // Seconds, so a scraper that never sends its request cannot hold the endpoint
+#define METRICS_LABEL_LEN 64
+#define BYTES_PER_KIB 1024    // ru_maxrss is in KiB
+#define MICROSECONDS_PER_SECOND 1000000
+#define NANOSECONDS_PER_MICROSECOND 1000
+#define MICROSECONDS_PER_MILLISECOND 1000
+#define MILLISECONDS_PER_SECOND 1000
+
+// Socket Tuning
+#define TUNING_MAX_BUFFER 268435456    // Bytes, 256 MiB
+#define TUNING_VALUE_LEN 16             // Digits of a value, with room to spare
+#define TUNING_DEFAULT_FASTOPEN_QUEUE 256
+#define TUNING_MAX_FASTOPEN_QUEUE 65536
+#if defined(MSG_MORE)
+    #define SEND_MORE MSG_MORE    // More follows straight away, so do not send a short segment yet
+#else
+    #define SEND_MORE 0
+#endif
+
+// Logging
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+#define LOG_RING_LEN 4096            // Records waiting for the log thread, a power of two
+#define LOG_WAKE_RECORDS 256         // Records between early wake-ups of the log thread, a power of two
+#define LOG_FLUSH_INTERVAL 50        // Milliseconds the log thread sleeps when nothing wakes it
+#define LOG_BATCH_LEN 65536          // Bytes the log thread gathers into one write
+#define LOG_MESSAGE_LEN 256
+#define LOG_COMMAND_LEN 256          // Longer commands are logged cut short
+#define LOG_PEER_LEN (INET6_ADDRSTRLEN + NI_MAXSERV)
+#define LOG_LINE_MAX ((LOG_MESSAGE_LEN + LOG_COMMAND_LEN + LOG_PEER_LEN) * 4 + 256)    // Escaping at most quadruples a string
+#define LOG_PEER (1U << 0)
+#define LOG_COMMAND (1U << 1)
+#define LOG_PID (1U << 2)
+#define LOG_DURATION (1U << 3)
+#define LOG_BYTES (1U << 4)
+#define LOG_STATUS (1U << 5)
+#define SECONDS_PER_DAY 86400
+#define YEAR_BASE 1900    // struct tm counts years from here
+
+// Local Transports
+#define MAX_PASSED_FDS 4    // Descriptors a Unix socket client may send at once, only the first is used
+#if defined(MSG_CMSG_CLOEXEC)
+    #define RECV_CLOEXEC MSG_CMSG_CLOEXEC
+#else
+    #define RECV_CLOEXEC 0
+#endif
+#define UNIX_PREFIX "unix:"      // Followed by the path of a Unix socket
+#define VSOCK_PREFIX "vsock:"    // Followed by a context ID, or any
+#define VSOCK_ANY "any"
+#define ADDRESS_STR_LEN (sizeof(UNIX_PREFIX) + sizeof(((struct sockaddr_un *)NULL)->sun_path))    // The longest address a listener is logged with
+
+// TLS
+#if defined(HAVE_OPENSSL)
+    #define TLS_HANDSHAKE_TIMEOUT 5      // Seconds a client gets to finish its handshake
+    #define TLS_MAX_HANDSHAKES 256       // Handshakes running at once, connections over it are turned away
+    #define TLS_RELAY_CHUNK_LEN 16384    // The most plaintext one TLS record carries
+    // Only ciphers the kernel can take the keys for, and no TLS 1.3: OpenSSL 3.0 cannot hand the kernel
+    // its receive keys, and its session tickets arrive after the handshake, where kTLS would trip over them
+    #define TLS_CIPHERS "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305"
+    #define TLS_KEY_SEPARATOR ','    // Between the certificate and key given to -k
+    #if !defined(SSL_OP_ENABLE_KTLS)
+        #define SSL_OP_ENABLE_KTLS 0    // Older OpenSSL turns kTLS on by itself when it was built with it
+    #endif
+#endif
+
+// Client Protocols
+#define PROTOCOL_UNKNOWN 0
+#define PROTOCOL_LEGACY 1
+#define PROTOCOL_SESSION 2
+
+// ----- Data Types -----
+
+/**
+ * A command whose results may be cached, and for how long.
+ */
+struct cache_rule
+{
+    const char *command;    // Points into the -c argument, not NUL-terminated
+    size_t      command_len;
+    uint64_t    ttl;        // Microseconds
+};
+
+/**
+ * An interpreter that gets a pool of warm workers.
+ */
+struct warm_rule
+{
+    char   interpreter[WARM_NAME_LEN];    // The command name clients use
+    int    flavor;                        // Which bootstrap the workers run, WARM_PYTHON or WARM_BASH
+    size_t workers;
+};
+
+/**
+ * A directory whose files are sent with sendfile() instead of running cat.
+ */
+struct file_root
+{
+    char   path[LINE_LENGTH];    // Resolved, so it can be compared with where an opened file really is
+    size_t len;
+};
+
+/**
+ * Socket options set on the listening socket, which every accepted connection inherits.
+ * Zero leaves an option as the kernel has it.
+ */
+struct socket_tuning
+{
+    int nodelay;           // Send small writes straight away instead of waiting for the last one to be acknowledged
+    int cork;              // Hold back a finished command's last output so it leaves with the exit trailer
+    int send_buffer;       // SO_SNDBUF bytes
+    int receive_buffer;    // SO_RCVBUF bytes, set before listen() so the window scale is offered to match
+    int fastopen;          // The TCP_FASTOPEN queue length
+    int notsent_lowat;     // TCP_NOTSENT_LOWAT bytes, how much unsent output a socket holds before it stops being writable
+};
+
+/**
+ * Options given on the command line, as strings from getopt and once parsed.
+ */
+struct server_options
+{
+    const char          *mode_str;
+    const char          *spawn_str;
+    const char          *workers_str;
+    const char          *metrics_port_str;
+    const char          *compress_str;
+    const char          *cache_str;
+    const char          *warm_str;
+    const char          *warm_uses_str;
+    const char          *child_limit_str;
+    const char          *peer_limit_str;
+    const char          *queue_str;
+    const char          *timeout_str;
+    const char          *files_str;
+    const char          *log_str;
+    const char          *log_level_str;
+    const char          *tuning_str;
+    const char          *tls_str;
+    int                  mode;
+    int                  spawn_backend;
+    size_t               workers;          // 0 runs the server in this process
+    int                  resolve_names;    // Look up client host names in the background for logging
+    int                  serve_metrics;
+    in_port_t            metrics_port;
+    size_t               compress_threshold;    // Output chunks smaller than this are never compressed
+    struct cache_rule    cache_rules[MAX_CACHE_RULES];
+    size_t               cache_rule_count;
+    struct warm_rule     warm_rules[MAX_WARM_POOLS];
+    size_t               warm_rule_count;
+    uint64_t             warm_uses;
+    size_t               child_limit;    // Commands running at once, 0 for no limit
+    size_t               peer_limit;     // Commands running or queued at once for one client address, 0 for no limit
+    size_t               queue_len;      // Commands waiting for one of the child_limit slots
+    uint32_t             max_timeout;    // Milliseconds a command may run, and the limit on what clients ask for, 0 for no limit
+    struct file_root     file_roots[MAX_FILE_ROOTS];
+    size_t               file_root_count;
+    int                  log_level;    // Records below this level are dropped before they are queued
+    struct socket_tuning tuning;
+    struct tls_server   *tls;    // NULL unless clients have to speak TLS
+    char               **argv;                 // What the server is started again with when it hands its listeners over
+    int                 *inherited;            // Listening sockets taken over from the server this one replaces
+    size_t               inherited_count;
+    int                  inherited_metrics;    // The metrics listener taken over, -1 for none
+    int                  metrics_fd;           // The metrics listener, handed over with the others, -1 without the endpoint
+    int                  ready_fd;             // Where to report being ready to the server this one replaces, -1 for none
+    uint64_t             started;              // Monotonic microseconds when the process started
+};
+
+/**
+ * Latencies of one request stage, stored as plain per-bucket counts and only made
+ * cumulative when they are rendered.
+ */
+struct stage_histogram
+{
+    _Atomic uint64_t buckets[METRICS_BUCKETS + 1];    // The last bucket is everything above the largest bound
+    _Atomic uint64_t sum;                            // Microseconds
+};
+
+/**
+ * Counters for the metrics endpoint. They live in shared memory so the workers of a pool all
+ * count into the same place, and are only ever updated with relaxed atomic adds so no stage
+ * ever waits on a lock or on another worker.
+ */
+struct server_metrics
+{
+    _Atomic uint64_t       connections_accepted;
+    _Atomic int64_t        connections_open;
+    _Atomic uint64_t       requests;
+    _Atomic uint64_t       commands_not_found;
+    _Atomic uint64_t       spawn_failures;
+    _Atomic int64_t        children_running;
+    _Atomic uint64_t       output_bytes;
+    _Atomic uint64_t       compressed_bytes;
+    _Atomic uint64_t       path_cache_hits;
+    _Atomic uint64_t       path_cache_misses;
+    _Atomic uint64_t       path_cache_invalidations;
+    _Atomic uint64_t       result_cache_hits;
+    _Atomic uint64_t       result_cache_coalesced;
+    _Atomic uint64_t       result_cache_misses;
+    _Atomic uint64_t       warm_requests;
+    _Atomic uint64_t       warm_recycles;
+    _Atomic uint64_t       admission_queued;
+    _Atomic uint64_t       admission_rejected;
+    _Atomic int64_t        admission_queue_depth;
+    _Atomic uint64_t       accept_pauses;
+    _Atomic uint64_t       timeouts;
+    _Atomic uint64_t       cancellations;
+    _Atomic int64_t        connection_memory;
+    _Atomic uint64_t       files_served;
+    _Atomic uint64_t       tls_handshakes;
+    _Atomic uint64_t       tls_resumptions;
+    _Atomic uint64_t       tls_kernel;    // Connections whose records the kernel encrypts and decrypts
+    _Atomic uint64_t       tls_failures;
+    struct stage_histogram stages[STAGE_COUNT];
+    _Atomic uint64_t       child_user_time;      // Microseconds, summed over every reaped child
+    _Atomic uint64_t       child_system_time;    // Microseconds
+    _Atomic uint64_t       child_voluntary_switches;
+    _Atomic uint64_t       child_involuntary_switches;
+    struct stage_histogram child_cpu;    // User and system time of each reaped child, in microseconds
+    struct stage_histogram child_rss;    // Peak resident set of each reaped child, in KiB
+};
+
+/**
+ * The structured fields of a log record. Only those named in present are written.
+ */
+struct log_fields
+{
+    unsigned int present;    // LOG_PEER, LOG_COMMAND and so on
+    const char  *peer;
+    const char  *command;
+    pid_t        pid;
+    uint64_t     duration;    // Microseconds
+    uint64_t     bytes;
+    int          status;
+};
+
+/**
+ * One queued log record. Its sequence says whose turn it is, as in a spawn_cell: a writer's
+ * while it equals the position, the log thread's once it is one past it. The strings are
+ * copied in, so nothing a record points to has to outlive the call that logged it.
+ */
+struct log_record
+{
+    _Atomic size_t  sequence;
+    int             level;
+    unsigned int    present;
+    struct timespec time;
+    pid_t           pid;
+    uint64_t        duration;
+    uint64_t        bytes;
+    int             status;
+    char            peer[LOG_PEER_LEN];
+    char            command[LOG_COMMAND_LEN];
+    char            message[LOG_MESSAGE_LEN];
+};
+
+/**
+ * The server's log. Any thread formats its record straight into a slot of the ring and never
+ * takes a lock or makes a system call, unless it is the one that wakes the log thread early.
+ * The log thread turns what has been queued into logfmt lines and writes them in batches. A
+ * record that finds the ring full is dropped and counted, so logging never holds up a request.
+ */
+struct server_log
+{
+    struct log_record *records;
+    size_t             mask;
+    _Atomic size_t     tail;       // The next position to fill
+    size_t             head;       // The next position the log thread writes, only it moves this
+    _Atomic uint64_t   dropped;    // Records lost to a full ring since the last report
+    int                level;
+    int                fd;         // The sink, stderr unless -o named a file
+    sem_t              wake;
+    _Atomic int        stopping;
+    pthread_t          thread;
+    char               batch[LOG_BATCH_LEN];
+};
+
+/**
+ * The thread answering metrics scrapes on the admin port.
+ */
+struct metrics_server
+{
+    struct server_metrics *metrics;
+    int                    fd;
+    pthread_t              thread;
+};
+
+/**
+ * A free object in a slab. The link is kept in the object itself.
+ */
+struct slab_object
+{
+    struct slab_object *next;
+};
+
+/**
+ * One allocation a slab carved into objects, kept so the slab can give it back.
+ */
+struct slab_block
+{
+    struct slab_block *next;
+    max_align_t        objects[];
+};
+
+/**
+ * Fixed-size objects handed out from blocks of SLAB_BLOCK_OBJECTS. A freed object goes back on
+ * the free list as it is and is not cleared when it is handed out again, so whoever takes one
+ * sets every field it uses. Blocks are only freed with the slab.
+ */
+struct slab
+{
+    size_t              object_size;    // Rounded up so every object stays aligned
+    struct slab_object *free_list;
+    struct slab_block  *blocks;
+};
+
+/**
+ * A bump allocator for what is only needed while a request is being started, like its argument
+ * vector. Nothing is freed on its own, the whole arena is emptied at once.
+ */
+struct arena
+{
+    char  *base;
+    size_t size;
+    size_t used;
+};
+
+/**
+ * A connection's receive buffer. Requests are parsed where they were received and handed
+ * out in place, so a command is never copied on its way to the child.
+ */
+struct frame_parser
+{
+    char  *buffer;       // FRAME_BUFFER_LEN bytes, NULL while an event loop client has nothing buffered
+    size_t start;        // The first byte not parsed yet
+    size_t end;          // One past the last byte received
+    size_t borrowed;     // Where the last payload's terminator went, 0 if nowhere
+    char   saved;        // The byte the terminator replaced
+    int    passed_fd;    // What a Unix socket client sent with its request for the output to go to, -1 for nothing
+};
+
+/**
+ * One request taken from a frame_parser. The payload points into the parser's buffer and
+ * stays valid until the parser is next used.
+ */
+struct parsed_frame
+{
+    uint8_t  type;
+    uint32_t id;
+    char    *payload;    // NUL-terminated
+    size_t   len;
+};
+
+/**
+ * A resolved command. Commands that are not on the PATH are cached too, with no full path.
+ */
+struct path_cache_entry
+{
+    char                    *command;
+    char                    *full_path;
+    time_t                   expires;
+    struct path_cache_entry *next;
+    char                     storage[];    // command, then full_path
+};
+
+/**
+ * Maps command names to the executable find_binary_executable() would pick from the PATH.
+ * The whole cache is dropped when a PATH directory changes, and entries expire after a TTL.
+ */
+struct path_cache
+{
+    struct path_cache_entry *buckets[PATH_CACHE_BUCKETS];
+    size_t                   entries;
+    int                      watch_fd;    // inotify watching the PATH directories, -1 if unavailable
+    struct server_metrics   *metrics;
+    uint64_t                 hits;
+    uint64_t                 misses;
+    uint64_t                 invalidations;
+};
+
+/**
+ * A request waiting on a command that is already running for another identical request.
+ */
+struct result_waiter
+{
+    struct client_connection *client;
+    uint32_t                  id;
+    struct result_waiter     *next;
+};
+
+/**
+ * The output of one command line. While the command runs the entry collects its output and
+ * the requests sharing the run, once it has exited the entry answers new requests until it
+ * expires.
+ */
+struct result_cache_entry
+{
+    char                      *key;    // The arguments joined by single spaces
+    uint64_t                   ttl;    // Microseconds
+    uint64_t                   expires;    // Monotonic microseconds, once the command is done
+    char                      *output;
+    size_t                     output_len;
+    size_t                     output_capacity;
+    int                        exit_code;
+    int                        complete;     // 0 while the command is still running
+    int                        oversized;    // The output outgrew the cache, lookups pass the entry by until it is freed
+    struct result_waiter      *waiters;
+    struct result_cache_entry *next;
+    char                       storage[];    // key
+};
+
+/**
+ * Recent results of the commands allowed by -c, and the runs still producing them, so identical
+ * requests share a single child.
+ */
+struct result_cache
+{
+    struct result_cache_entry *buckets[RESULT_CACHE_BUCKETS];
+    size_t                     entries;
+    uint64_t                   hits;
+    uint64_t                   coalesced;
+    uint64_t                   misses;
+};
+
+/**
+ * A client address and the host name it resolved to, kept in most recently used order.
+ */
+struct resolver_entry
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    char                    host[NI_MAXHOST];
+    int                     resolved;    // 0 while the lookup is still queued or running
+    struct resolver_entry  *prev;
+    struct resolver_entry  *next;
+};
+
+/**
+ * Reverse DNS lookups done on a background thread so a slow resolver never stalls accept().
+ * Results are only used for logging: a connection whose address is not cached yet is logged
+ * numerically and its name is logged once the lookup finishes.
+ */
+struct resolver
+{
+    pthread_mutex_t         lock;
+    pthread_cond_t          wake;
+    pthread_t               thread;
+    int                     stopping;
+    struct resolver_entry  *queue[RESOLVER_QUEUE_LEN];    // Entries waiting for a lookup
+    size_t                  queue_head;
+    size_t                  queue_count;
+    struct resolver_entry   entries[RESOLVER_CACHE_SIZE];
+    size_t                  entries_used;
+    struct resolver_entry  *most_recent;
+    struct resolver_entry  *least_recent;
+};
+
+/**
+ * Something registered with epoll. The owner is the structure the file descriptor belongs to.
+ */
+struct event_source
+{
+    int                  type;
+    int                  fd;
+    void                *owner;
+    uint32_t             events;         // What the io_uring engine should keep waiting for, 0 while paused
+    int                  in_flight;      // An io_uring operation on this source has not completed yet
+    struct event_source *next_paused;    // In a client's list while what is read from it waits for the client to catch up
+};
+
+/**
+ * A connected client. Legacy clients send one command and read until EOF, session
+ * clients send a stream of command frames and get framed output back. Session
+ * commands run concurrently and their frames are tagged with the request ID.
+ */
+struct client_connection
+{
+    struct event_source       source;
+    struct frame_parser       parser;
+    int                       protocol;
+    int                       read_closed;
+    int                       write_failed;
+    int                       active_requests;
+    int                       compression_level;    // 0 unless the client asked for compressed output
+    int                       report_usage;         // The session asked for a FRAME_USAGE ahead of every trailer
+    int                       polled;               // What io_uring has in flight is a poll, not a receive into the buffer
+    uint64_t                  accepted;             // Monotonic microseconds
+    char                      peer[INET6_ADDRSTRLEN];    // The client's address, what the per-client limit counts by
+    struct queued_output     *queued;               // What the socket had no room for, oldest first, NULL while it keeps up
+    struct queued_output     *queued_tail;
+    size_t                    queued_bytes;
+    struct event_source       writable;             // io_uring's poll for room in the socket, epoll adds EPOLLOUT to source instead
+    struct event_source      *paused;               // Output pipes not read until the queue has drained
+    struct file_transfer     *paused_transfers;     // Taken off the loop's list until the queue has drained
+    int                       closing;              // Closed once the queue has drained, nothing more is read
+    struct client_connection *prev;
+    struct client_connection *next;
+};
+
+/**
+ * Bytes a client's socket had no room for. Small writes are appended to the last block while
+ * it has room, so a client that falls behind on many short frames costs few allocations.
+ */
+struct queued_output
+{
+    struct queued_output *next;
+    size_t                start;    // The first byte not sent yet
+    size_t                end;
+    size_t                capacity;
+    char                  data[];
+};
+
+/**
+ * A running command. For session clients the output is the read end of the child's stdout
+ * pipe, for legacy clients the child writes to the socket directly and the fd is -1.
+ */
+struct command_request
+{
+    struct event_source        output;
+    struct client_connection  *client;
+    uint32_t                   id;
+    pid_t                      pid;
+    int                        exited;
+    int                        exit_code;
+    int                        copy_output;    // splice() failed once, copy through userspace instead
+    uint64_t                   bytes_forwarded;
+    uint64_t                   started;    // Monotonic microseconds, taken just before the child was spawned
+    uint64_t                   reaped;     // Monotonic microseconds, when the child was reaped
+    struct rusage              usage;      // Summed over every child of the request as it is reaped
+#if defined(HAVE_ZLIB)
+    z_stream                   deflate;
+    int                        deflating;    // The deflate stream is set up, on the first chunk big enough to compress
+#endif
+    struct result_cache_entry *shared;    // Answers every request waiting on the run instead of client, which is NULL
+    int                        admitted;    // Counted against the admission limits until the child exits
+    struct admission_peer     *peer;        // The address it counts against, NULL without a per-client limit
+    pid_t                      group;       // The process group cancelling kills, the warm worker's for its jobs
+    uint64_t                   deadline;    // Monotonic microseconds when the next signal goes out, 0 for none
+    int                        signalled;   // The last signal sent to the group, 0 while it runs undisturbed
+    int                        timed_out;
+    struct pipeline_stage     *stages;            // Every stage of a pipeline, NULL for a single command
+    size_t                     stage_count;
+    size_t                     stages_running;
+    struct command_batch      *batch;             // Holds the output for the batch's result instead of sending it, or NULL
+    size_t                     batch_index;
+    struct command_request    *next;
+};
+
+/**
+ * One command of a pipeline. They all run in the process group of the first.
+ */
+struct pipeline_stage
+{
+    pid_t pid;
+    int   exit_code;
+    int   exited;
+};
+
+/**
+ * One command of a batch, and its output until it exits.
+ */
+struct batch_item
+{
+    char  *command;    // Into the batch's copy of the commands
+    char  *output;
+    size_t output_len;
+    size_t output_capacity;
+    int    truncated;
+};
+
+/**
+ * A FRAME_BATCH being run. Its commands start in order, at most parallelism of them at once,
+ * and each one's output is held until it exits, then sent ahead of its result frame. The
+ * batch is done once every command has been answered, and always has one running until then.
+ */
+struct command_batch
+{
+    struct client_connection *client;
+    uint32_t                  id;
+    uint32_t                  timeout;
+    size_t                    parallelism;
+    size_t                    count;
+    size_t                    next;       // The first command not started yet
+    size_t                    running;
+    uint32_t                  failed;
+    struct batch_item         items[MAX_BATCH_COMMANDS];
+    char                      commands[];    // NUL-terminated one after another
+};
+
+/**
+ * Where a child's standard streams go, and which process group it joins.
+ */
+struct child_io
+{
+    int   input_fd;     // -1 to keep the server's stdin
+    int   output_fd;
+    int   error_fd;
+    pid_t group;        // 0 to lead a group of its own
+};
+
+/**
+ * Commands one client address has running or waiting for admission.
+ */
+struct admission_peer
+{
+    char                   address[INET6_ADDRSTRLEN];
+    size_t                 running;
+    size_t                 queued;
+    struct admission_peer *next;
+};
+
+/**
+ * A command waiting for a slot under the -l limit. It keeps its client open, and is put
+ * through event_loop_run_command again once admitted, so it may still be answered from the
+ * result cache by then. Pipelines and batches go back through their own functions.
+ */
+struct pending_request
+{
+    struct client_connection *client;
+    uint32_t                  id;
+    uint32_t                  timeout;    // Milliseconds the client asked for, 0 for the server's limit
+    uint64_t                  queued;    // Monotonic microseconds
+    uint8_t                   type;    // FRAME_COMMAND, or a FRAME_PIPELINE or FRAME_BATCH whose payload line holds as it was sent
+    size_t                    line_len;
+    struct pending_request   *next;
+    char                      line[];    // The command line, rejoined with single spaces
+};
+
+/**
+ * What the admission limits count. Commands are queued in arrival order once child_limit
+ * of them are running, and turned away once the queue is full too.
+ */
+struct admission
+{
+    struct admission_peer  *peers[ADMISSION_PEER_BUCKETS];
+    struct pending_request *head;
+    struct pending_request *tail;
+    size_t                  queued;
+    size_t                  running;
+    uint64_t                average_run;    // Microseconds, what the retry hint is based on
+    int                     draining;       // Commands taken from the queue skip ahead of it
+};
+
+/**
+ * A pre-started interpreter running a bootstrap that waits for jobs on its control socket.
+ * For each job it forks, runs the script in the child with stdout and stderr on the output
+ * pipe, and reports the exit code on the control socket once the child is done. Everything
+ * the job wrote is in the pipe by then, so the server drains it before finishing the request.
+ */
+struct warm_worker
+{
+    struct event_source     control;    // A stream socket, job arguments out and exit codes back
+    struct event_source     output;     // The read end of the pipe every job writes to
+    struct warm_pool       *pool;
+    size_t                  slot;
+    pid_t                   pid;
+    uint64_t                uses;
+    struct command_request *request;    // The job running, NULL while the worker is idle
+    char                    status[WARM_STATUS_LEN];
+    size_t                  status_len;
+    struct warm_worker     *next;    // In the retired list
+};
+
+/**
+ * The warm workers of one interpreter.
+ */
+struct warm_pool
+{
+    const struct warm_rule *rule;
+    char                    full_path[LINE_LENGTH];
+    struct warm_worker     *workers[WARM_MAX_WORKERS];    // NULL where a worker died on startup and was not replaced
+};
+
+#if defined(HAVE_IO_URING)
+/**
+ * The shared submission and completion rings of an io_uring instance, driven through raw
+ * system calls.
+ */
+struct uring
+{
+    int                  fd;
+    void                *rings;    // Both rings share one mapping (IORING_FEAT_SINGLE_MMAP)
+    size_t               rings_size;
+    struct io_uring_sqe *sqes;
+    size_t               sqes_size;
+    unsigned int         sq_entries;
+    unsigned int        *sq_head;
+    unsigned int        *sq_tail;
+    unsigned int        *sq_mask;
+    unsigned int        *sq_array;
+    unsigned int        *cq_head;
+    unsigned int        *cq_tail;
+    unsigned int        *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int         unsubmitted;
+};
+#endif
+
+/**
+ * Files being sent to a client with sendfile() in place of running cat, one chunk per turn
+ * of the event loop. Session output still goes out as output frames, each header written
+ * ahead of the bytes sendfile() moves.
+ */
+struct file_transfer
+{
+    struct client_connection *client;
+    uint32_t                  id;
+    int                       fds[MAX_SERVED_FILES];
+    size_t                    count;
+    size_t                    current;       // The file being sent
+    off_t                     offset;        // Into the current file
+    uint64_t                  remaining;     // Bytes still to send, UINT64_MAX for everything up to the end
+    uint64_t                  bytes_sent;
+    struct file_transfer     *next;
+};
+
+#if defined(HAVE_OPENSSL)
+/**
+ * What every connection's handshake starts from. The context and its session ticket keys are
+ * made before the workers fork, so a ticket one worker issued resumes on any other.
+ */
+struct tls_server
+{
+    SSL_CTX               *context;
+    _Atomic size_t         handshakes;    // Running at once, at most TLS_MAX_HANDSHAKES
+    struct server_metrics *metrics;
+};
+
+/**
+ * A connection whose handshake finished, written whole to the loop's handoff pipe. It is
+ * smaller than PIPE_BUF, so the writes from different handshake threads never interleave.
+ */
+struct tls_handoff
+{
+    int                     fd;    // The socket itself with kTLS, otherwise the local end of a relay
+    struct sockaddr_storage addr;
+};
+
+/**
+ * A handshake running on its own thread, so a slow client does not hold up the event loop.
+ */
+struct tls_handshake
+{
+    struct tls_server *tls;
+    int                handoff_fd;    // Where the connection goes once it is ready
+    struct tls_handoff connection;
+};
+
+/**
+ * Moves plaintext between a TLS connection and the socket pair the server reads and writes,
+ * for connections the kernel could not take the keys for.
+ */
+struct tls_relay
+{
+    SSL *ssl;
+    int  sockfd;
+    int  local_fd;
+};
+#endif
+
+/**
+ * A new server being handed the listening sockets, waited for until it reports that it is
+ * accepting or HANDOFF_TIMEOUT passes, while this one carries on serving.
+ */
+struct handoff
+{
+    int        ready_fd;     // Read end of the readiness pipe, -1 while no handoff is in progress
+    uint64_t   started;      // Monotonic microseconds
+    uint64_t   deadline;     // Monotonic microseconds
+    const int *listeners;
+    size_t     count;
+    int       *flags;        // The listeners' file status flags, restored if the new server fails
+};
+
+/**
+ * State shared by the event-driven modes.
+ */
+struct event_loop
+{
+    const struct server_options *options;
+    struct path_cache           *path_cache;
+    struct resolver             *resolver;
+    struct server_metrics       *metrics;
+    struct result_cache          result_cache;
+    struct warm_pool             warm_pools[MAX_WARM_POOLS];
+    struct warm_worker          *retired;    // Workers freed once the current batch of events is handled
+    struct admission             admission;
+    struct slab                  client_slab;
+    struct slab                  request_slab;
+    struct slab                  buffer_slab;    // Receive buffers, only held while part of a request is buffered
+    struct arena                 scratch;        // What starting the current command needs, emptied for the next one
+    struct file_transfer        *transfers;      // While any are left the loop only polls for events between chunks
+    struct event_source          timer;            // A timerfd, set for the earliest deadline
+    uint64_t                     next_deadline;    // Monotonic microseconds, 0 while the timer is not set
+    int                          epoll_fd;    // -1 when the io_uring engine is used instead
+#if defined(HAVE_IO_URING)
+    struct uring                 ring;    // Its fd is -1 unless the io_uring engine is used
+#endif
+    struct event_source          listener;
+    struct event_source          signal;
+    struct event_source          path_watch;
+    struct event_source          tls;               // Read end of the handoff pipe, -1 without TLS
+    int                          tls_handoff_fd;    // Where handshake threads write finished connections
+    struct client_connection    *clients;
+    struct client_connection    *closed;    // Freed once the current batch of events is handled
+    struct command_request      *running;
+    uint64_t                     drain_deadline;    // Monotonic microseconds, 0 until the loop stops accepting
+    struct handoff               handoff;
+    struct event_source          handoff_ready;     // Watches handoff.ready_fd
+    int                          handed_off;        // The listener went to a new server before the loop drained
+};
 
 // ----- Function Headers -----
 
 // Argument Parsing
-static void      parse_arguments(int argc, char *argv[], char **ip_address, char **port);
-static void      handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, in_port_t *port);
+static void      parse_arguments(int argc, char *argv[], char **ip_address, char **port, struct server_options *options);
+static void      handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, in_port_t *port, struct server_options *options);
 static in_port_t parse_in_port_t(const char *binary_name, const char *port_str);
+static int       parse_mode(const char *binary_name, const char *mode_str);
+static int       parse_spawn_backend(const char *binary_name, const char *spawn_str);
+static size_t    parse_workers(const char *binary_name, const char *workers_str);
+static size_t    parse_compress_threshold(const char *binary_name, const char *compress_str);
+static void      parse_cache_rules(const char *binary_name, const char *cache_str, struct server_options *options);
+static void      parse_warm_rules(const char *binary_name, const char *warm_str, struct server_options *options);
+static uint64_t  parse_warm_uses(const char *binary_name, const char *warm_uses_str);
+static size_t    parse_limit(const char *binary_name, const char *limit_str, size_t fallback, size_t max, const char *message);
+static uint32_t  parse_timeout(const char *binary_name, const char *timeout_str);
+static void      parse_file_roots(const char *binary_name, const char *files_str, struct server_options *options);
+static int       parse_log_level(const char *binary_name, const char *level_str);
+static void      parse_socket_tuning(const char *binary_name, const char *tuning_str, struct socket_tuning *tuning);
+static int       parse_tuning_value(const char *binary_name, const char *value, size_t len, int fallback, int max, const char *message);
 
 // Error Handling
 _Noreturn static void usage(const char *program_name, int exit_code, const char *message);
@@ -47,587 +1102,11105 @@ static void convert_address(const char *address, struct sockaddr_storage *addr);
 static int  socket_create(int domain, int type, int protocol);
 static void socket_bind(int sockfd, struct sockaddr_storage *addr, in_port_t port);
 static void start_listening(int server_fd, int backlog);
-static int  socket_accept_connection(int server_fd, struct sockaddr_storage *client_addr, socklen_t *client_addr_len);
-static void read_from_socket(int client_sockfd, struct sockaddr_storage *client_addr, char *buffer);
+static int  open_listener(struct sockaddr_storage *addr, in_port_t port, int reuse_port, const struct socket_tuning *tuning);
+static int  is_tcp_address(const struct sockaddr_storage *addr);
+static void tune_listener(int sockfd, const struct socket_tuning *tuning);
+static int  socket_accept_connection(int server_fd, struct sockaddr_storage *client_addr, socklen_t *client_addr_len, struct resolver *resolver, struct server_metrics *metrics);
+static void log_connection(int client_fd, const struct sockaddr_storage *client_addr, socklen_t client_addr_len, struct resolver *resolver);
+static int  describe_local_peer(int client_fd, const struct sockaddr_storage *client_addr, char *peer, size_t size, pid_t *pid);
+static int  read_request(int client_sockfd, struct frame_parser *parser, struct parsed_frame *frame);
 static void socket_close(int sockfd);
-static void redirect_stdout(int fd);
-static void reset_stdout(int stdout_copy);
+
+// Session Protocol
+static int  write_fully(int sockfd, const void *buffer, size_t len);
+static void encode_frame_header(uint8_t *header, uint8_t type, uint32_t id, size_t len);
+
+// Frame Parser
+static ssize_t frame_parser_fill(struct frame_parser *parser, int sockfd, int flags);
+static size_t  frame_parser_reserve(struct frame_parser *parser);
+static int     frame_parser_next(struct frame_parser *parser, int protocol, struct parsed_frame *frame);
+static void    frame_parser_restore(struct frame_parser *parser);
+static int  write_frame(int sockfd, uint8_t type, uint32_t id, const void *payload, size_t len);
+static int  exit_code_from_status(int status);
+
+// Memory
+static void  slab_init(struct slab *slab, size_t object_size);
+static void *slab_alloc(struct slab *slab);
+static void  slab_free(struct slab *slab, void *object);
+static void  slab_destroy(struct slab *slab);
+static void  arena_init(struct arena *arena, size_t size);
+static void *arena_alloc(struct arena *arena, size_t size);
+static void  arena_reset(struct arena *arena);
+static void  arena_destroy(struct arena *arena);
+
+// Server Loops
+static int  serve(int server_fd, int ready_fd, const struct server_options *options, struct server_metrics *metrics);
+static int  run_serial_loop(int server_fd, int ready_fd, const struct server_options *options, struct path_cache *path_cache, struct resolver *resolver, struct server_metrics *metrics);
+static void serial_handle_client(int client_sockfd, int *passed_fd, const struct server_options *options, struct path_cache *path_cache, struct arena *scratch, struct server_metrics *metrics);
+#if defined(__linux__)
+static int  run_event_loop(int server_fd, int ready_fd, const struct server_options *options, struct path_cache *path_cache, struct resolver *resolver, struct server_metrics *metrics);
+static void event_loop_init(struct event_loop *loop, int server_fd, const struct server_options *options, struct path_cache *path_cache, struct resolver *resolver, struct server_metrics *metrics);
+static void event_loop_run_epoll(struct event_loop *loop);
+static void event_loop_watch(struct event_loop *loop, struct event_source *source, uint32_t events, int op);
+static void event_loop_unwatch(const struct event_loop *loop, struct event_source *source);
+static void event_loop_accept(struct event_loop *loop);
+static void event_loop_start_client(struct event_loop *loop, int client_sockfd, const struct sockaddr_storage *client_addr);
+static int  event_loop_drain(struct event_loop *loop);
+static void event_loop_check_handoff(struct event_loop *loop, uint64_t now);
+#if defined(HAVE_OPENSSL)
+static void event_loop_collect_handshakes(struct event_loop *loop);
+#endif
+static void event_loop_add_client(struct event_loop *loop, int client_sockfd, const struct sockaddr_storage *client_addr);
+static void event_loop_read_client(struct event_loop *loop, struct client_connection *client);
+static void event_loop_parse_client(struct event_loop *loop, struct client_connection *client, ssize_t bytes_received);
+static void event_loop_attach_buffer(struct event_loop *loop, struct client_connection *client);
+static void event_loop_detach_buffer(struct event_loop *loop, struct client_connection *client);
+static void event_loop_run_command(struct event_loop *loop, struct client_connection *client, uint32_t id, char *buffer, uint32_t timeout);
+static void event_loop_run_pipeline(struct event_loop *loop, struct client_connection *client, uint32_t id, char *payload, size_t len, uint32_t timeout);
+static struct command_request *event_loop_new_request(struct event_loop *loop, struct client_connection *client, uint32_t id, pid_t pid, int output_fd, uint64_t started);
+static void event_loop_start_deadline(struct event_loop *loop, struct command_request *request, uint32_t timeout);
+static void event_loop_reply_error(struct event_loop *loop, struct client_connection *client, uint32_t id, const char *message);
+static void event_loop_reply_cached(struct event_loop *loop, struct client_connection *client, uint32_t id, const struct result_cache_entry *entry);
+static void event_loop_join_shared(struct event_loop *loop, struct result_cache_entry *entry, struct client_connection *client, uint32_t id);
+static void event_loop_share_output(struct event_loop *loop, struct command_request *request, const char *output, size_t len);
+static void event_loop_send_output(struct event_loop *loop, struct client_connection *client, uint32_t id, const char *output, size_t len);
+static int  event_loop_send(struct event_loop *loop, struct client_connection *client, const void *buffer, size_t len, int flags);
+static int  event_loop_send_from(struct event_loop *loop, struct client_connection *client, int fd, off_t *offset, size_t len);
+static int  event_loop_send_frame(struct event_loop *loop, struct client_connection *client, uint8_t type, uint32_t id, const void *payload, size_t len);
+static int  event_loop_send_exit(struct event_loop *loop, struct client_connection *client, uint32_t id, int exit_code);
+static int  event_loop_send_pipeline_exit(struct event_loop *loop, struct client_connection *client, uint32_t id, const struct pipeline_stage *stages, size_t stage_count);
+static int  event_loop_send_usage(struct event_loop *loop, struct client_connection *client, uint32_t id, uint64_t wall, const struct rusage *usage, uint64_t output_bytes);
+static void event_loop_flush_client(struct event_loop *loop, struct client_connection *client);
+static void event_loop_fail_client(struct event_loop *loop, struct client_connection *client);
+static void event_loop_discard_output(struct client_connection *client);
+static void event_loop_watch_writable(struct event_loop *loop, struct client_connection *client, uint32_t events);
+static void event_loop_pause_source(struct event_loop *loop, const struct command_request *request, struct event_source *source);
+static void event_loop_resume_source(struct event_loop *loop, const struct command_request *request, struct event_source *source);
+static void event_loop_resume_client(struct event_loop *loop, struct client_connection *client);
+static void event_loop_negotiate_compression(struct event_loop *loop, struct client_connection *client, const struct parsed_frame *frame);
+static void event_loop_enable_usage(struct event_loop *loop, struct client_connection *client, const struct parsed_frame *frame);
+static int  event_loop_forward_output(struct event_loop *loop, struct command_request *request);
+static void event_loop_send_chunk(struct event_loop *loop, struct command_request *request, uint8_t *frame, size_t len);
+static int  event_loop_splice_output(struct event_loop *loop, struct command_request *request);
+#if defined(HAVE_ZLIB)
+static int  deflate_output(struct event_loop *loop, struct command_request *request, const uint8_t *input, size_t len, uint64_t *compressed_len);
+#endif
+static void event_loop_reap(struct event_loop *loop);
+static int  event_loop_reap_stage(struct command_request *request, pid_t pid, int status);
+static void event_loop_account_child(struct event_loop *loop, struct command_request *request, const struct rusage *usage);
+static void event_loop_end_run(struct event_loop *loop, struct command_request **link, int exit_code);
+static void event_loop_finish_request(struct event_loop *loop, struct command_request *request);
+static void event_loop_finish_shared(struct event_loop *loop, struct command_request *request);
+static void event_loop_end_reply(struct event_loop *loop, struct client_connection *client, uint32_t id, int exit_code, const struct command_request *request);
+static void event_loop_free_request(struct event_loop *loop, struct command_request *request);
+static void event_loop_close_client(struct event_loop *loop, struct client_connection *client);
+static void event_loop_release(struct event_loop *loop);
+static void event_loop_destroy(struct event_loop *loop);
+
+// Warm Workers
+static void                warm_pools_start(struct event_loop *loop);
+static void                warm_pools_stop(struct event_loop *loop);
+static struct warm_worker *warm_worker_start(struct event_loop *loop, struct warm_pool *pool, size_t slot);
+static struct warm_worker *warm_pool_find_idle(struct event_loop *loop, const char *command, char **args);
+static int                 warm_worker_dispatch(struct warm_worker *worker, char **args);
+static void                warm_worker_read_status(struct event_loop *loop, struct warm_worker *worker);
+static int                 warm_worker_read_output(struct event_loop *loop, struct warm_worker *worker);
+static void                warm_worker_finish_job(struct event_loop *loop, struct warm_worker *worker, int exit_code);
+static void                warm_worker_retire(struct event_loop *loop, struct warm_worker *worker);
+
+// Admission Control
+static int                    event_loop_admit(struct event_loop *loop, struct client_connection *client, uint32_t id, char **args, uint8_t type, const char *payload, size_t payload_len, uint32_t timeout);
+static void                   event_loop_reply_busy(struct event_loop *loop, struct client_connection *client, uint32_t id, int peer_limited);
+static void                   event_loop_run_pending(struct event_loop *loop);
+static void                   event_loop_pause_accept(struct event_loop *loop);
+static void                   admission_start(struct event_loop *loop, struct command_request *request, const struct client_connection *client);
+static void                   admission_finish(struct event_loop *loop, struct command_request *request);
+static struct admission_peer *admission_find_peer(struct admission *admission, const char *address, int create);
+static void                   admission_drop_peer(struct admission *admission, struct admission_peer *peer);
+static uint32_t               admission_retry_after(const struct event_loop *loop, int peer_limited);
+static void                   admission_destroy(struct admission *admission);
+
+// Deadlines
+static void event_loop_set_deadline(struct event_loop *loop, struct command_request *request, uint64_t deadline);
+static void event_loop_check_deadlines(struct event_loop *loop);
+static void event_loop_signal_request(struct event_loop *loop, struct command_request *request, uint64_t now);
+static void event_loop_cancel_request(struct event_loop *loop, struct command_request *request);
+static void event_loop_cancel_client(struct event_loop *loop, struct client_connection *client);
+static void event_loop_set_timer(struct event_loop *loop);
+
+// Batches
+static void event_loop_run_batch(struct event_loop *loop, struct client_connection *client, uint32_t id, char *payload, size_t len, uint32_t timeout);
+static void event_loop_batch_fill(struct event_loop *loop, struct command_batch *batch);
+static void event_loop_batch_start(struct event_loop *loop, struct command_batch *batch, size_t index);
+static void event_loop_batch_fail(struct event_loop *loop, struct command_batch *batch, size_t index, int exit_code, const char *message);
+static void event_loop_batch_output(struct command_batch *batch, size_t index, const char *output, size_t len);
+static void event_loop_batch_reply(struct event_loop *loop, struct command_batch *batch, size_t index, int exit_code, uint64_t run, const struct command_request *finished);
+static void event_loop_free_batch(struct command_batch *batch);
+
+// File Serving
+static int  event_loop_serve_files(struct event_loop *loop, struct client_connection *client, uint32_t id, char **args);
+static void event_loop_run_fetch(struct event_loop *loop, struct client_connection *client, uint32_t id, const char *payload, size_t len);
+static void event_loop_start_transfer(struct event_loop *loop, struct client_connection *client, uint32_t id, const int *fds, size_t count, off_t offset, uint64_t length);
+static void event_loop_run_transfers(struct event_loop *loop);
+static void event_loop_end_transfer(struct event_loop *loop, struct file_transfer *transfer, int result);
+static int  file_transfer_send(struct event_loop *loop, struct file_transfer *transfer);
+static int  open_served_file(const struct server_options *options, const char *path);
+static int  is_served_path(const struct server_options *options, const char *path);
+#endif
+
+// io_uring Engine
+#if defined(HAVE_IO_URING)
+static void                 event_loop_run_uring(struct event_loop *loop);
+static void                 event_loop_complete(struct event_loop *loop, struct event_source *source, int32_t result, uint32_t flags);
+static void                 event_loop_arm(struct event_loop *loop, struct event_source *source);
+static void                 uring_cancel(struct event_loop *loop, const struct event_source *source);
+static int                  uring_init(struct uring *ring, unsigned int entries);
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+static int                  uring_submit_and_wait(struct uring *ring, unsigned int min_complete);
+static void                 uring_destroy(struct uring *ring);
+static void                *ring_offset(void *rings, uint32_t offset);
+#endif
 
 // Command Runner
-static void split_input(char *input, char **command, char **args);
-int         find_binary_executable(const char *command, char *full_path, int stdout_copy);
-static void execute_process(const char *full_path, char **args);
+static char **split_input(char *input, char **command, struct arena *arena);
+static size_t split_pipeline(char *payload, size_t len, char **stages[], struct arena *arena);
+int          find_binary_executable(struct path_cache *path_cache, const char *command, char *full_path);
+static int   search_path(const char *command, char *full_path);
+static void  execute_process(int spawn_backend, const char *full_path, char **args, int client_sockfd, int output_fd, uint32_t timeout, struct server_metrics *metrics);
+static int   wait_for_child(pid_t pid, int client_sockfd, uint32_t timeout, struct server_metrics *metrics);
+static pid_t spawn_process(int spawn_backend, const char *full_path, char **args, const struct child_io *io);
+static pid_t spawn_with_fork(const char *full_path, char **args, const struct child_io *io);
+static pid_t spawn_with_vfork(const char *full_path, char **args, const struct child_io *io);
+static pid_t spawn_with_posix_spawn(const char *full_path, char **args, const struct child_io *io);
 //static void free_memory(char *command, char **args, int args_used);
 
-// Signal Handling Functions
-static void setup_signal_handler(void);
-static void sigint_handler(int signum);
+// Path Cache
+static void                     path_cache_init(struct path_cache *path_cache, struct server_metrics *metrics);
+static void                     path_cache_prewarm(struct path_cache *path_cache);
+static struct path_cache_entry *path_cache_find(struct path_cache *path_cache, const char *command);
+static void                     path_cache_insert(struct path_cache *path_cache, const char *command, const char *full_path);
+static void                     path_cache_sweep(struct path_cache *path_cache);
+static void                     path_cache_poll(struct path_cache *path_cache);
+static void                     path_cache_flush(struct path_cache *path_cache);
+static void                     path_cache_destroy(struct path_cache *path_cache);
+static uint32_t                 hash_string(const char *string);
+static time_t                   monotonic_seconds(void);
+static uint64_t                 monotonic_microseconds(void);
+
+// Result Cache
+static const struct cache_rule   *find_cache_rule(const struct server_options *options, const char *command);
+static void                       join_arguments(char **args, char *key, size_t size);
+static struct result_cache_entry *result_cache_find(struct result_cache *cache, const char *key);
+static struct result_cache_entry *result_cache_insert(struct result_cache *cache, const char *key, uint64_t ttl);
+static void                       result_cache_append(struct result_cache_entry *entry, const char *output, size_t len);
+static void                       result_cache_unlink(struct result_cache *cache, const struct result_cache_entry *entry);
+static void                       result_cache_sweep(struct result_cache *cache);
+static void                       result_cache_free_entry(struct result_cache_entry *entry);
+static void                       result_cache_destroy(struct result_cache *cache);
+
+// Name Resolution
+static struct resolver       *resolver_create(void);
+static void                   resolver_destroy(struct resolver *resolver);
+static int                    resolver_lookup(struct resolver *resolver, const struct sockaddr_storage *addr, socklen_t addr_len, char *host, size_t host_len);
+static void                  *resolver_thread(void *arg);
+static struct resolver_entry *resolver_find(struct resolver *resolver, const struct sockaddr_storage *addr);
+static void                   resolver_unlink(struct resolver *resolver, struct resolver_entry *entry);
+static void                   resolver_push_front(struct resolver *resolver, struct resolver_entry *entry);
+static int                    same_host(const struct sockaddr_storage *a, const struct sockaddr_storage *b);
+
+// Metrics
+static struct server_metrics *metrics_create(void);
+static void                   metrics_destroy(struct server_metrics *metrics);
+static void                   metrics_count(_Atomic uint64_t *counter, uint64_t amount);
+static void                   metrics_adjust(_Atomic int64_t *gauge, int64_t delta);
+static void                   metrics_record(struct server_metrics *metrics, int stage, uint64_t started);
+static void                   metrics_record_usage(struct server_metrics *metrics, const struct rusage *usage);
+static void                   metrics_observe(struct stage_histogram *histogram, const uint64_t *bounds, uint64_t value);
+static uint64_t               timeval_microseconds(const struct timeval *time);
+static size_t                 metrics_render(struct server_metrics *metrics, char *buffer, size_t size);
+static void                   metrics_append(char *buffer, size_t size, size_t *offset, const char *format, ...) __attribute__((format(printf, 4, 5)));
+static void                   metrics_append_histogram(char *buffer, size_t size, size_t *offset, const char *name, const char *label, const struct stage_histogram *histogram, const uint64_t *bounds, double scale);
+static struct metrics_server *metrics_server_start(struct sockaddr_storage *addr, in_port_t port, int listener_fd, struct server_metrics *metrics);
+static void                   metrics_server_stop(struct metrics_server *server);
+static void                  *metrics_server_thread(void *arg);
+static void                   metrics_server_reply(struct server_metrics *metrics, int client_fd);
+
+// Worker Pool
+static int            run_supervisor(struct sockaddr_storage *addr, in_port_t port, const struct server_options *options, struct server_metrics *metrics);
+static pid_t          start_worker(size_t index, const int *listeners, size_t listener_count, int ready_fd, const struct server_options *options, struct server_metrics *metrics);
+_Noreturn static void run_worker(size_t index, int listener_fd, int ready_fd, const struct server_options *options, struct server_metrics *metrics);
+static void           pin_to_cpu(size_t index);
+static void           set_pinned(int pinned);
+
+// Handoff
+static void handoff_adopt(struct server_options *options, const struct sockaddr_storage *addr);
+static int  handoff_parse_fd(const char *fd_str, const char **end);
+static int  handoff_check_listener(int fd, const struct sockaddr_storage *addr);
+static int  handoff_listener(const struct server_options *options, size_t index, struct sockaddr_storage *addr, in_port_t port, int reuse_port);
+static void handoff_close_unused(const struct server_options *options, size_t used);
+static int  handoff_start(const struct server_options *options, const int *listeners, size_t count, struct handoff *handoff);
+static int  handoff_poll(const struct handoff *handoff, uint64_t now, pid_t *pid);
+static int  handoff_end(struct handoff *handoff, pid_t pid);
+static void handoff_cancel(struct handoff *handoff);
+static int  handoff_wait(int ready_fd, pid_t *pid);
+static void handoff_ready(int ready_fd, uint64_t started);
+
+// Logging
+static void   log_open(const char *path, int level);
+static void   log_close(void);
+static void   log_after_fork(void);
+static void   log_start_thread(struct server_log *log);
+static void   log_event(int level, const struct log_fields *fields, const char *format, ...) __attribute__((format(printf, 3, 4)));
+static void  *log_thread(void *arg);
+static void   log_drain(struct server_log *log);
+static void   log_utc_time(time_t seconds, struct tm *utc);
+static size_t log_format(const struct log_record *record, char *buffer, size_t size);
+static size_t log_append_quoted(char *buffer, size_t size, size_t offset, const char *text);
+static void   log_copy(char *destination, size_t size, const char *source);
+
+// TLS
+#if defined(HAVE_OPENSSL)
+static struct tls_server *tls_server_create(const char *binary_name, const char *tls_str, struct server_metrics *metrics);
+static void               tls_server_destroy(struct tls_server *tls);
+static int                tls_accept(struct tls_server *tls, int sockfd);
+static int                tls_start_handshake(struct tls_server *tls, int handoff_fd, int sockfd, const struct sockaddr_storage *addr);
+static void              *tls_handshake_thread(void *arg);
+static int                tls_start_relay(SSL *ssl, int sockfd);
+static void              *tls_relay_thread(void *arg);
+static void               tls_log_failure(const char *message);
+#endif
+
+// Signal Handling Functions
+static void setup_signal_handler(void);
+static void sigint_handler(int signum);
+static void sigterm_handler(int signum);
+static void sigusr2_handler(int signum);
+
+static volatile sig_atomic_t exit_flag = 0;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t drain_flag = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t reload_flag = 0;   // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct server_log    *server_log = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+#if defined(__linux__)
+static cpu_set_t unpinned_cpus;      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static cpu_set_t pinned_cpus;        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int       cpus_pinned = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+#endif
+
+#if defined(__APPLE__)
+// glibc declares it in <unistd.h> under _GNU_SOURCE, macOS does not declare it anywhere
+extern char **environ;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+#endif
+
+#if defined(__linux__)
+// What a warm Python worker runs: each job is the arguments, NUL-terminated, then an empty one
+static const char warm_python_bootstrap[] = "import os, sys, runpy\n"
+                                            "while True:\n"
+                                            "    job = b''\n"
+                                            "    while not job.endswith(b'\\0\\0'):\n"
+                                            "        data = os.read(3, 65536)\n"
+                                            "        if not data:\n"
+                                            "            sys.exit(0)\n"
+                                            "        job += data\n"
+                                            "    args = [os.fsdecode(arg) for arg in job[:-2].split(b'\\0')]\n"
+                                            "    pid = os.fork()\n"
+                                            "    if pid == 0:\n"
+                                            "        os.close(3)\n"
+                                            "        sys.argv = args[1:]\n"
+                                            "        sys.path[0] = os.path.dirname(os.path.abspath(args[1]))\n"
+                                            "        code = 0\n"
+                                            "        try:\n"
+                                            "            runpy.run_path(args[1], run_name='__main__')\n"
+                                            "        except SystemExit as e:\n"
+                                            "            if isinstance(e.code, int):\n"
+                                            "                code = e.code\n"
+                                            "            elif e.code is not None:\n"
+                                            "                print(e.code, file=sys.stderr)\n"
+                                            "                code = 1\n"
+                                            "        except BaseException:\n"
+                                            "            import traceback\n"
+                                            "            traceback.print_exc()\n"
+                                            "            code = 1\n"
+                                            "        try:\n"
+                                            "            sys.stdout.flush()\n"
+                                            "            sys.stderr.flush()\n"
+                                            "        finally:\n"
+                                            "            os._exit(code & 255)\n"
+                                            "    code = os.waitstatus_to_exitcode(os.waitpid(pid, 0)[1])\n"
+                                            "    os.write(3, b'%d\\n' % (code if code >= 0 else 128 - code))\n";
+
+// The same for bash, where the script is sourced in a subshell with the job's arguments as its positional parameters
+static const char warm_bash_bootstrap[] = "while :; do\n"
+                                          "    warm_args=()\n"
+                                          "    while IFS= read -r -d '' warm_arg <&3 && [ -n \"$warm_arg\" ]; do\n"
+                                          "        warm_args+=(\"$warm_arg\")\n"
+                                          "    done\n"
+                                          "    [ ${#warm_args[@]} -eq 0 ] && exit 0\n"
+                                          "    (exec 3>&-; warm_script=${warm_args[1]}; set -- \"${warm_args[@]:2}\"; unset warm_args warm_arg; . \"$warm_script\")\n"
+                                          "    printf '%d\\n' $? >&3\n"
+                                          "done\n";
+#endif
+
+// Upper bounds of the stage latency buckets, in microseconds
+static const uint64_t metrics_bucket_bounds[METRICS_BUCKETS] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+
+// Upper bounds of the child peak memory buckets, in KiB, from 256 KiB to 64 GiB
+static const uint64_t metrics_rss_bounds[METRICS_BUCKETS] = {256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536, 131072, 262144, 524288, 1048576, 2097152, 4194304, 8388608, 16777216, 33554432, 67108864};
+
+int main(int argc, char *argv[])
+{
+    char                   *ip_address;
+    char                   *port_str;
+    struct server_options   options;
+    in_port_t               port;
+    int                     sockfd;
+    struct sockaddr_storage addr;
+    struct server_metrics  *metrics;
+    struct metrics_server  *metrics_server;
+    int                     handed_off;
+
+    ip_address     = NULL;
+    port_str       = NULL;
+    metrics_server = NULL;
+    memset(&options, 0, sizeof(options));
+    options.started    = monotonic_microseconds();
+    options.argv       = argv;
+    options.metrics_fd = -1;
+
+    // Set up server
+    parse_arguments(argc, argv, &ip_address, &port_str, &options);
+    handle_arguments(argv[0], ip_address, port_str, &port, &options);
+    log_open(options.log_str, options.log_level);
+    convert_address(ip_address, &addr);
+    handoff_adopt(&options, &addr);
+
+    if(options.serve_metrics && addr.ss_family == AF_UNIX)
+    {
+        usage(argv[0], EXIT_FAILURE, "The metrics endpoint needs an IP or vsock address, a Unix socket has no second port.");
+    }
+
+    if(options.tls_str != NULL && !is_tcp_address(&addr))
+    {
+        usage(argv[0], EXIT_FAILURE, "TLS needs an IP address, local transports are not encrypted.");
+    }
+
+    setup_signal_handler();
+    metrics = metrics_create();
+
+#if defined(HAVE_OPENSSL)
+    // Made before the workers fork, so they all share the session ticket keys
+    if(options.tls_str != NULL)
+    {
+        options.tls = tls_server_create(argv[0], options.tls_str, metrics);
+    }
+#endif
+
+    if(options.serve_metrics)
+    {
+        struct sockaddr_storage metrics_addr;
+
+        metrics_addr       = addr;
+        metrics_server     = metrics_server_start(&metrics_addr, options.metrics_port, options.inherited_metrics, metrics);
+        options.metrics_fd = metrics_server->fd;
+    }
+
+    if(options.workers > 0)
+    {
+        handed_off = run_supervisor(&addr, port, &options, metrics);
+    }
+    else
+    {
+        sockfd = handoff_listener(&options, 0, &addr, port, 0);
+        handoff_close_unused(&options, 1);
+        handed_off = serve(sockfd, options.ready_fd, &options, metrics);
+    }
+
+    // Shutting the metrics port down would take it from the new server too, exiting ends the thread instead
+    if(metrics_server != NULL && !handed_off)
+    {
+        metrics_server_stop(metrics_server);
+    }
+
+    // The new server is still listening on the path
+    if(addr.ss_family == AF_UNIX && !handed_off)
+    {
+        unlink(((struct sockaddr_un *)&addr)->sun_path);
+    }
+
+#if defined(HAVE_OPENSSL)
+    if(options.tls != NULL)
+    {
+        tls_server_destroy(options.tls);
+    }
+#endif
+
+    metrics_destroy(metrics);
+    free(options.inherited);
+    log_close();
+    return 0;
+}
+
+// ----- Function Definitions -----
+
+// Argument Parsing Functions
+static void parse_arguments(const int argc, char *argv[], char **ip_address, char **port, struct server_options *options)
+{
+    int opt;
+    opterr = 0;
+
+    // Option parsing
+    while((opt = getopt(argc, argv, "a:c:f:hi:k:l:m:o:p:q:rs:S:t:u:v:w:z:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'a':
+            {
+                options->metrics_port_str = optarg;
+                break;
+            }
+            case 'c':
+            {
+                options->cache_str = optarg;
+                break;
+            }
+            case 'f':
+            {
+                options->files_str = optarg;
+                break;
+            }
+            case 'h':
+            {
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            }
+            case 'i':
+            {
+                options->warm_str = optarg;
+                break;
+            }
+            case 'k':
+            {
+                options->tls_str = optarg;
+                break;
+            }
+            case 'l':
+            {
+                options->child_limit_str = optarg;
+                break;
+            }
+            case 'm':
+            {
+                options->mode_str = optarg;
+                break;
+            }
+            case 'o':
+            {
+                options->log_str = optarg;
+                break;
+            }
+            case 'p':
+            {
+                options->peer_limit_str = optarg;
+                break;
+            }
+            case 'q':
+            {
+                options->queue_str = optarg;
+                break;
+            }
+            case 'r':
+            {
+                options->resolve_names = 1;
+                break;
+            }
+            case 's':
+            {
+                options->spawn_str = optarg;
+                break;
+            }
+            case 'S':
+            {
+                options->tuning_str = optarg;
+                break;
+            }
+            case 't':
+            {
+                options->timeout_str = optarg;
+                break;
+            }
+            case 'u':
+            {
+                options->warm_uses_str = optarg;
+                break;
+            }
+            case 'v':
+            {
+                options->log_level_str = optarg;
+                break;
+            }
+            case 'w':
+            {
+                options->workers_str = optarg;
+                break;
+            }
+            case 'z':
+            {
+                options->compress_str = optarg;
+                break;
+            }
+            case '?':
+            {
+                char message[UNKNOWN_OPTION_MESSAGE_LEN];
+
+                snprintf(message, sizeof(message), "Unknown option '-%c'.", optopt);
+                usage(argv[0], EXIT_FAILURE, message);
+            }
+            default:
+            {
+                usage(argv[0], EXIT_FAILURE, NULL);
+            }
+        }
+    }
+
+    // Check for sufficient args
+    if(optind >= argc)
+    {
+        usage(argv[0], EXIT_FAILURE, "The ip address and port are required.");
+    }
+
+    // Check for port arg
+    if(optind + 1 >= argc)
+    {
+        usage(argv[0], EXIT_FAILURE, "The port is required.");
+    }
+
+    // Check for extra args
+    if(optind < argc - 2)
+    {
+        usage(argv[0], EXIT_FAILURE, "Error: Too many arguments.");
+    }
+
+    *ip_address = argv[optind];
+    *port       = argv[optind + 1];
+}
+
+static void handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, in_port_t *port, struct server_options *options)
+{
+    if(ip_address == NULL)
+    {
+        usage(binary_name, EXIT_FAILURE, "The ip address is required.");
+    }
+
+    if(port_str == NULL)
+    {
+        usage(binary_name, EXIT_FAILURE, "The port is required.");
+    }
+
+    *port = parse_in_port_t(binary_name, port_str);
+    options->mode               = parse_mode(binary_name, options->mode_str);
+    options->spawn_backend      = parse_spawn_backend(binary_name, options->spawn_str);
+    options->workers            = parse_workers(binary_name, options->workers_str);
+    options->compress_threshold = parse_compress_threshold(binary_name, options->compress_str);
+    parse_cache_rules(binary_name, options->cache_str, options);
+    parse_warm_rules(binary_name, options->warm_str, options);
+    parse_file_roots(binary_name, options->files_str, options);
+    options->warm_uses   = parse_warm_uses(binary_name, options->warm_uses_str);
+    options->child_limit = parse_limit(binary_name, options->child_limit_str, 0, ADMISSION_MAX_LIMIT, "The limit on running commands must be between 1 and 65536.");
+    options->peer_limit  = parse_limit(binary_name, options->peer_limit_str, 0, ADMISSION_MAX_LIMIT, "The limit on commands per client must be between 1 and 65536.");
+    options->queue_len   = parse_limit(binary_name, options->queue_str, ADMISSION_DEFAULT_QUEUE, ADMISSION_MAX_QUEUE, "The admission queue must hold between 1 and 65536 commands.");
+    options->max_timeout = parse_timeout(binary_name, options->timeout_str);
+    options->log_level   = parse_log_level(binary_name, options->log_level_str);
+    parse_socket_tuning(binary_name, options->tuning_str, &options->tuning);
+
+    // Serial mode runs one command at a time already
+    if(options->mode == MODE_SERIAL && (options->child_limit_str != NULL || options->peer_limit_str != NULL || options->queue_str != NULL))
+    {
+        usage(binary_name, EXIT_FAILURE, "Admission limits need the epoll or uring mode.");
+    }
+
+#if !defined(HAVE_OPENSSL)
+    if(options->tls_str != NULL)
+    {
+        usage(binary_name, EXIT_FAILURE, "This server was built without OpenSSL, so it cannot speak TLS.");
+    }
+#endif
+
+    if(options->metrics_port_str != NULL)
+    {
+        options->serve_metrics = 1;
+        options->metrics_port  = parse_in_port_t(binary_name, options->metrics_port_str);
+    }
+}
+
+static in_port_t parse_in_port_t(const char *binary_name, const char *port_str)
+{
+    char     *endptr;
+    uintmax_t parsed_value;
+
+    errno        = 0;
+    parsed_value = strtoumax(port_str, &endptr, BASE_TEN);
+
+    // Check for errno was signalled
+    if(errno != 0)
+    {
+        perror("Error parsing in_port_t.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Check for any non-numeric characters in the input string
+    if(*endptr != '\0')
+    {
+        usage(binary_name, EXIT_FAILURE, "Invalid characters in input.");
+    }
+
+    // Check if the parsed value is within valid range of in_port_t
+    if(parsed_value > UINT16_MAX)
+    {
+        usage(binary_name, EXIT_FAILURE, "in_port_t value out of range.");
+    }
+
+    return (in_port_t)parsed_value;
+}
+
+static int parse_mode(const char *binary_name, const char *mode_str)
+{
+    if(mode_str == NULL || strcmp(mode_str, "serial") == 0)
+    {
+        return MODE_SERIAL;
+    }
+
+    if(strcmp(mode_str, "epoll") == 0)
+    {
+#if defined(__linux__)
+        return MODE_EPOLL;
+#else
+        usage(binary_name, EXIT_FAILURE, "The epoll mode is only available on Linux.");
+#endif
+    }
+
+    if(strcmp(mode_str, "uring") == 0)
+    {
+#if defined(HAVE_IO_URING)
+        return MODE_URING;
+#else
+        usage(binary_name, EXIT_FAILURE, "This server was built without io_uring support.");
+#endif
+    }
+
+    usage(binary_name, EXIT_FAILURE, "Unknown mode, expected serial, epoll or uring.");
+}
+
+static int parse_spawn_backend(const char *binary_name, const char *spawn_str)
+{
+    if(spawn_str == NULL || strcmp(spawn_str, "fork") == 0)
+    {
+        return SPAWN_FORK;
+    }
+
+    if(strcmp(spawn_str, "vfork") == 0)
+    {
+        return SPAWN_VFORK;
+    }
+
+    if(strcmp(spawn_str, "spawn") == 0)
+    {
+        return SPAWN_POSIX;
+    }
+
+    usage(binary_name, EXIT_FAILURE, "Unknown spawn backend, expected fork, vfork or spawn.");
+}
+
+static size_t parse_workers(const char *binary_name, const char *workers_str)
+{
+    char     *endptr;
+    uintmax_t parsed_value;
+
+    if(workers_str == NULL)
+    {
+        return 0;
+    }
+
+#if !defined(SO_REUSEPORT)
+    usage(binary_name, EXIT_FAILURE, "Workers need SO_REUSEPORT, which this platform does not have.");
+#endif
+
+    errno        = 0;
+    parsed_value = strtoumax(workers_str, &endptr, BASE_TEN);
+
+    if(errno != 0 || *endptr != '\0' || parsed_value == 0 || parsed_value > MAX_WORKERS)
+    {
+        usage(binary_name, EXIT_FAILURE, "The number of workers must be between 1 and 1024.");
+    }
+
+    return (size_t)parsed_value;
+}
+
+static size_t parse_compress_threshold(const char *binary_name, const char *compress_str)
+{
+    char     *endptr;
+    uintmax_t parsed_value;
+
+    if(compress_str == NULL)
+    {
+        return COMPRESS_DEFAULT_THRESHOLD;
+    }
+
+    errno        = 0;
+    parsed_value = strtoumax(compress_str, &endptr, BASE_TEN);
+
+    if(errno != 0 || *endptr != '\0' || endptr == compress_str || parsed_value > OUTPUT_CHUNK_LEN)
+    {
+        usage(binary_name, EXIT_FAILURE, "The compression threshold must be between 0 and 16384 bytes.");
+    }
+
+    return (size_t)parsed_value;
+}
+
+static void parse_cache_rules(const char *binary_name, const char *cache_str, struct server_options *options)
+{
+    const char *rule;
+
+    if(cache_str == NULL)
+    {
+        return;
+    }
+
+    // Serial mode runs one request at a time, so there is never a run to share
+    if(options->mode == MODE_SERIAL)
+    {
+        usage(binary_name, EXIT_FAILURE, "The result cache needs the epoll or uring mode.");
+    }
+
+    rule = cache_str;
+
+    while(1)
+    {
+        size_t    rule_len;
+        size_t    command_len;
+        uintmax_t ttl;
+
+        rule_len    = strcspn(rule, ",");
+        command_len = strcspn(rule, ":,");
+        ttl         = RESULT_CACHE_DEFAULT_TTL;
+
+        if(command_len == 0 || options->cache_rule_count >= MAX_CACHE_RULES)
+        {
+            usage(binary_name, EXIT_FAILURE, "The result cache takes up to 64 commands, as command[:seconds] separated by commas.");
+        }
+
+        if(command_len < rule_len)
+        {
+            char *endptr;
+
+            errno = 0;
+            ttl   = strtoumax(&rule[command_len + 1], &endptr, BASE_TEN);
+
+            if(errno != 0 || endptr != &rule[rule_len] || endptr == &rule[command_len + 1] || ttl == 0 || ttl > RESULT_CACHE_MAX_TTL)
+            {
+                usage(binary_name, EXIT_FAILURE, "A cached command's lifetime must be between 1 and 3600 seconds.");
+            }
+        }
+
+        options->cache_rules[options->cache_rule_count].command     = rule;
+        options->cache_rules[options->cache_rule_count].command_len = command_len;
+        options->cache_rules[options->cache_rule_count].ttl         = (uint64_t)ttl * MICROSECONDS_PER_SECOND;
+        options->cache_rule_count++;
+
+        if(rule[rule_len] == '\0')
+        {
+            break;
+        }
+
+        rule += rule_len + 1;
+    }
+}
+
+static void parse_warm_rules(const char *binary_name, const char *warm_str, struct server_options *options)
+{
+    const char *rule;
+
+    if(warm_str == NULL)
+    {
+        return;
+    }
+
+    // Warm workers are driven by the event loop
+    if(options->mode == MODE_SERIAL)
+    {
+        usage(binary_name, EXIT_FAILURE, "Warm workers need the epoll or uring mode.");
+    }
+
+    rule = warm_str;
+
+    while(1)
+    {
+        struct warm_rule *warm;
+        size_t            rule_len;
+        size_t            name_len;
+        uintmax_t         workers;
+
+        rule_len = strcspn(rule, ",");
+        name_len = strcspn(rule, ":,");
+        workers  = WARM_DEFAULT_WORKERS;
+
+        if(name_len == 0 || name_len >= WARM_NAME_LEN || options->warm_rule_count >= MAX_WARM_POOLS)
+        {
+            usage(binary_name, EXIT_FAILURE, "Warm workers take up to 8 interpreters, as interpreter[:workers] separated by commas.");
+        }
+
+        if(name_len < rule_len)
+        {
+            char *endptr;
+
+            errno   = 0;
+            workers = strtoumax(&rule[name_len + 1], &endptr, BASE_TEN);
+
+            if(errno != 0 || endptr != &rule[rule_len] || endptr == &rule[name_len + 1] || workers == 0 || workers > WARM_MAX_WORKERS)
+            {
+                usage(binary_name, EXIT_FAILURE, "An interpreter's number of warm workers must be between 1 and 64.");
+            }
+        }
+
+        warm = &options->warm_rules[options->warm_rule_count];
+        memcpy(warm->interpreter, rule, name_len);
+        warm->interpreter[name_len] = '\0';
+        warm->workers               = (size_t)workers;
+
+        if(strncmp(warm->interpreter, "python", strlen("python")) == 0)
+        {
+            warm->flavor = WARM_PYTHON;
+        }
+        else if(strcmp(warm->interpreter, "bash") == 0)
+        {
+            warm->flavor = WARM_BASH;
+        }
+        else
+        {
+            usage(binary_name, EXIT_FAILURE, "Warm workers can only run python and bash.");
+        }
+
+        options->warm_rule_count++;
+
+        if(rule[rule_len] == '\0')
+        {
+            break;
+        }
+
+        rule += rule_len + 1;
+    }
+}
+
+static uint64_t parse_warm_uses(const char *binary_name, const char *warm_uses_str)
+{
+    char     *endptr;
+    uintmax_t parsed_value;
+
+    if(warm_uses_str == NULL)
+    {
+        return WARM_DEFAULT_USES;
+    }
+
+    errno        = 0;
+    parsed_value = strtoumax(warm_uses_str, &endptr, BASE_TEN);
+
+    if(errno != 0 || *endptr != '\0' || parsed_value == 0 || parsed_value > WARM_MAX_USES)
+    {
+        usage(binary_name, EXIT_FAILURE, "The jobs per warm worker must be between 1 and 1000000.");
+    }
+
+    return (uint64_t)parsed_value;
+}
+
+static size_t parse_limit(const char *binary_name, const char *limit_str, size_t fallback, size_t max, const char *message)
+{
+    char     *endptr;
+    uintmax_t parsed_value;
+
+    if(limit_str == NULL)
+    {
+        return fallback;
+    }
+
+    errno        = 0;
+    parsed_value = strtoumax(limit_str, &endptr, BASE_TEN);
+
+    if(errno != 0 || *endptr != '\0' || parsed_value == 0 || parsed_value > max)
+    {
+        usage(binary_name, EXIT_FAILURE, message);
+    }
+
+    return (size_t)parsed_value;
+}
+
+static uint32_t parse_timeout(const char *binary_name, const char *timeout_str)
+{
+    char     *endptr;
+    uintmax_t parsed_value;
+
+    if(timeout_str == NULL)
+    {
+        return 0;
+    }
+
+    errno        = 0;
+    parsed_value = strtoumax(timeout_str, &endptr, BASE_TEN);
+
+    if(errno != 0 || *endptr != '\0' || parsed_value == 0 || parsed_value > MAX_TIMEOUT)
+    {
+        usage(binary_name, EXIT_FAILURE, "The timeout must be between 1 and 86400 seconds.");
+    }
+
+    return (uint32_t)(parsed_value * MILLISECONDS_PER_SECOND);
+}
+
+static void parse_file_roots(const char *binary_name, const char *files_str, struct server_options *options)
+{
+    const char *root;
+
+    if(files_str == NULL)
+    {
+        return;
+    }
+
+    // Files are sent by the event loop between its other work
+    if(options->mode == MODE_SERIAL)
+    {
+        usage(binary_name, EXIT_FAILURE, "Serving files needs the epoll or uring mode.");
+    }
+
+    root = files_str;
+
+    while(1)
+    {
+        struct file_root *file_root;
+        char              path[LINE_LENGTH];
+        char             *resolved;
+        size_t            root_len;
+
+        root_len = strcspn(root, ",");
+
+        if(root_len == 0 || root_len >= sizeof(path) || options->file_root_count >= MAX_FILE_ROOTS)
+        {
+            usage(binary_name, EXIT_FAILURE, "Files can be served from up to 8 directories, separated by commas.");
+        }
+
+        memcpy(path, root, root_len);
+        path[root_len] = '\0';
+
+        // Opened files are checked against where they really are, so the roots have to be resolved too
+        resolved = realpath(path, NULL);
+
+        if(resolved == NULL)
+        {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            usage(binary_name, EXIT_FAILURE, "Every directory to serve files from must exist.");
+        }
+
+        file_root      = &options->file_roots[options->file_root_count++];
+        file_root->len = strlen(resolved);
+
+        if(file_root->len >= sizeof(file_root->path))
+        {
+            free(resolved);
+            usage(binary_name, EXIT_FAILURE, "A directory to serve files from has too long a path.");
+        }
+
+        memcpy(file_root->path, resolved, file_root->len + 1);
+        free(resolved);
+
+        if(root[root_len] == '\0')
+        {
+            break;
+        }
+
+        root += root_len + 1;
+    }
+}
+
+static int parse_log_level(const char *binary_name, const char *level_str)
+{
+    if(level_str == NULL || strcmp(level_str, "info") == 0)
+    {
+        return LOG_INFO;
+    }
+
+    if(strcmp(level_str, "debug") == 0)
+    {
+        return LOG_DEBUG;
+    }
+
+    if(strcmp(level_str, "warn") == 0)
+    {
+        return LOG_WARN;
+    }
+
+    if(strcmp(level_str, "error") == 0)
+    {
+        return LOG_ERROR;
+    }
+
+    usage(binary_name, EXIT_FAILURE, "Unknown log level, expected debug, info, warn or error.");
+}
+
+static void parse_socket_tuning(const char *binary_name, const char *tuning_str, struct socket_tuning *tuning)
+{
+    const char *option;
+
+    if(tuning_str == NULL)
+    {
+        return;
+    }
+
+    option = tuning_str;
+
+    while(1)
+    {
+        size_t      option_len;
+        size_t      name_len;
+        const char *value;
+        size_t      value_len;
+
+        option_len = strcspn(option, ",");
+        name_len   = strcspn(option, "=,");
+        value      = name_len < option_len ? &option[name_len + 1] : NULL;
+        value_len  = value != NULL ? option_len - name_len - 1 : 0;
+
+        if(name_len == strlen("nodelay") && strncmp(option, "nodelay", name_len) == 0 && value == NULL)
+        {
+            tuning->nodelay = 1;
+        }
+        else if(name_len == strlen("cork") && strncmp(option, "cork", name_len) == 0 && value == NULL)
+        {
+#if !defined(MSG_MORE)
+            usage(binary_name, EXIT_FAILURE, "The cork option needs MSG_MORE, which this platform does not have.");
+#endif
+            tuning->cork = 1;
+        }
+        else if(name_len == strlen("sndbuf") && strncmp(option, "sndbuf", name_len) == 0 && value != NULL)
+        {
+            tuning->send_buffer = parse_tuning_value(binary_name, value, value_len, 0, TUNING_MAX_BUFFER, "Socket buffers must be between 1 and 268435456 bytes.");
+        }
+        else if(name_len == strlen("rcvbuf") && strncmp(option, "rcvbuf", name_len) == 0 && value != NULL)
+        {
+            tuning->receive_buffer = parse_tuning_value(binary_name, value, value_len, 0, TUNING_MAX_BUFFER, "Socket buffers must be between 1 and 268435456 bytes.");
+        }
+        else if(name_len == strlen("fastopen") && strncmp(option, "fastopen", name_len) == 0)
+        {
+#if !defined(TCP_FASTOPEN)
+            usage(binary_name, EXIT_FAILURE, "This platform does not have TCP Fast Open.");
+#endif
+            tuning->fastopen = parse_tuning_value(binary_name, value, value_len, TUNING_DEFAULT_FASTOPEN_QUEUE, TUNING_MAX_FASTOPEN_QUEUE, "The Fast Open queue must hold between 1 and 65536 connections.");
+        }
+        else if(name_len == strlen("lowat") && strncmp(option, "lowat", name_len) == 0 && value != NULL)
+        {
+#if !defined(TCP_NOTSENT_LOWAT)
+            usage(binary_name, EXIT_FAILURE, "This platform does not have TCP_NOTSENT_LOWAT.");
+#endif
+            tuning->notsent_lowat = parse_tuning_value(binary_name, value, value_len, 0, TUNING_MAX_BUFFER, "The unsent low water mark must be between 1 and 268435456 bytes.");
+        }
+        else
+        {
+            usage(binary_name, EXIT_FAILURE, "Unknown socket option, expected nodelay, cork, sndbuf=<bytes>, rcvbuf=<bytes>, fastopen[=<queue>] or lowat=<bytes>.");
+        }
+
+        if(option[option_len] == '\0')
+        {
+            break;
+        }
+
+        option += option_len + 1;
+    }
+}
+
+static int parse_tuning_value(const char *binary_name, const char *value, size_t len, int fallback, int max, const char *message)
+{
+    char      number[TUNING_VALUE_LEN];
+    char     *endptr;
+    uintmax_t parsed_value;
+
+    if(value == NULL)
+    {
+        return fallback;
+    }
+
+    if(len == 0 || len >= sizeof(number))
+    {
+        usage(binary_name, EXIT_FAILURE, message);
+    }
+
+    memcpy(number, value, len);
+    number[len]  = '\0';
+    errno        = 0;
+    parsed_value = strtoumax(number, &endptr, BASE_TEN);
+
+    if(errno != 0 || *endptr != '\0' || parsed_value == 0 || parsed_value > (uintmax_t)max)
+    {
+        usage(binary_name, EXIT_FAILURE, message);
+    }
+
+    return (int)parsed_value;
+}
+
+// Error Handling Functions
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-a <port>] [-c <list>] [-f <dirs>] [-i <list> [-u <n>]] [-k <files>] [-l <n> [-q <n>]] [-m <mode>] [-o <file>] [-p <n>] [-r] [-s <how>] [-S <opts>] [-t <secs>] [-v <level>] [-w <n>] [-z <bytes>] <address> <port>\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs(" -a <port>  Serve Prometheus metrics over HTTP on this port of the same address\n", stderr);
+    fputs(" -c <list>  Share runs of these commands and keep their results, as command[:seconds],... (default: 1 second)\n", stderr);
+    fputs(" -f <dirs>  Send files under these directories with sendfile() when cat is asked for them, as dir,dir,...\n", stderr);
+    fputs(" -h         Display this help message\n", stderr);
+    fputs(" -i <list>  Keep warm workers for these interpreters, as interpreter[:workers],... (python or bash, default: 2)\n", stderr);
+    fputs(" -k <files> Serve TLS 1.2 with this certificate and key, as cert.pem,key.pem, handing the keys to the kernel when it can\n", stderr);
+    fputs(" -l <n>     Run at most n commands at once, queueing the rest\n", stderr);
+    fputs(" -m <mode>  Connection handling: serial (default), epoll or uring\n", stderr);
+    fputs(" -o <file>  Append the log to this file instead of stderr\n", stderr);
+    fputs(" -p <n>     Run or queue at most n commands at once for each client address, turning away the rest\n", stderr);
+    fputs(" -q <n>     Queue at most n commands over the -l limit, turning away the rest (default: 64)\n", stderr);
+    fputs(" -r         Log client host names, looked up in the background\n", stderr);
+    fputs(" -s <how>   Process creation: fork (default), vfork or spawn (posix_spawn)\n", stderr);
+    fputs(" -S <opts>  Tune TCP client sockets, as nodelay,cork,sndbuf=<bytes>,rcvbuf=<bytes>,fastopen[=<queue>],lowat=<bytes>\n", stderr);
+    fputs(" -t <secs>  Kill commands that run longer, and cap the timeout sessions ask for\n", stderr);
+    fputs(" -u <n>     Replace a warm worker after it has run n scripts (default: 100)\n", stderr);
+    fputs(" -v <level> Log records of at least this level: debug, info (default), warn or error\n", stderr);
+    fputs(" -w <n>     Run n worker processes, each accepting on its own SO_REUSEPORT socket the supervisor keeps open\n", stderr);
+    fputs(" -z <bytes> Compress output chunks of at least this size for sessions that ask (default: 256)\n", stderr);
+    fputs("Addresses:\n", stderr);
+    fputs(" An IPv4 or IPv6 address, unix:<path> for a Unix socket, where the port is not used, or vsock:<cid> (any for every CID)\n", stderr);
+    fputs("Signals:\n", stderr);
+    fputs(" SIGTERM    Stop accepting, finish the requests in flight, then exit\n", stderr);
+    fputs(" SIGUSR2    Start the binary again with the same options, hand it the listening sockets, then drain like SIGTERM\n", stderr);
+    exit(exit_code);
+}
+
+// Network Handling Functions
+
+/**
+ * Converts the address from a human-readable string into a binary representation.
+ * @param address string IP address in human-readable format (e.g., "192.168.0.1"), unix:<path> or vsock:<cid>
+ * @param addr    pointer to the struct sockaddr_storage where the binary representation will be stored
+ */
+static void convert_address(const char *address, struct sockaddr_storage *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+
+    // Local callers skip TCP altogether
+    if(strncmp(address, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0)
+    {
+        struct sockaddr_un *unix_addr;
+        const char         *path;
+
+        unix_addr = (struct sockaddr_un *)addr;
+        path      = &address[strlen(UNIX_PREFIX)];
+
+        if(path[0] == '\0' || strlen(path) >= sizeof(unix_addr->sun_path))
+        {
+            fprintf(stderr, "%s is not a usable Unix socket path\n", path);
+            exit(EXIT_FAILURE);
+        }
+
+        unix_addr->sun_family = AF_UNIX;
+        strcpy(unix_addr->sun_path, path);
+        return;
+    }
+
+#if defined(__linux__)
+    if(strncmp(address, VSOCK_PREFIX, strlen(VSOCK_PREFIX)) == 0)
+    {
+        struct sockaddr_vm *vsock_addr;
+        const char         *cid;
+        char               *endptr;
+        uintmax_t           parsed_value;
+
+        vsock_addr             = (struct sockaddr_vm *)addr;
+        cid                    = &address[strlen(VSOCK_PREFIX)];
+        vsock_addr->svm_family = AF_VSOCK;
+        vsock_addr->svm_cid    = VMADDR_CID_ANY;
+
+        if(strcmp(cid, VSOCK_ANY) == 0)
+        {
+            return;
+        }
+
+        errno        = 0;
+        parsed_value = strtoumax(cid, &endptr, BASE_TEN);
+
+        if(errno != 0 || cid[0] == '\0' || *endptr != '\0' || parsed_value >= VMADDR_CID_ANY)
+        {
+            fprintf(stderr, "%s is not a vsock context ID\n", cid);
+            exit(EXIT_FAILURE);
+        }
+
+        vsock_addr->svm_cid = (unsigned int)parsed_value;
+        return;
+    }
+#endif
+
+    // Converts the str address to binary address and checks for IPv4 or IPv6
+    if(inet_pton(AF_INET, address, &(((struct sockaddr_in *)addr)->sin_addr)) == 1)
+    {
+        // IPv4 address
+        addr->ss_family = AF_INET;
+        log_event(LOG_DEBUG, NULL, "IPv4 found");
+    }
+    else if(inet_pton(AF_INET6, address, &(((struct sockaddr_in6 *)addr)->sin6_addr)) == 1)
+    {
+        // IPv6 address
+        addr->ss_family = AF_INET6;
+    }
+    else
+    {
+        fprintf(stderr, "%s is not an IPv4, IPv6, unix: or vsock: address\n", address);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Creates a socket with the specified domain, type, and protocol.
+ * @param domain   the communication domain, e.g., AF_INET for IPv4 or AF_INET6 for IPv6
+ * @param type     the socket type, e.g., SOCK_STREAM for a TCP socket or SOCK_DGRAM for a UDP socket
+ * @param protocol the specific protocol to be used, often set to 0 for the default protocol
+ * @return         the file descriptor for the created socket, or -1 on error
+ */
+static int socket_create(int domain, int type, int protocol)
+{
+    int sockfd;
+
+    sockfd = socket(domain, type, protocol);
+
+    if(sockfd == -1)
+    {
+        fprintf(stderr, "Socket creation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Keep the listener out of every child the server launches
+    if(fcntl(sockfd, F_SETFD, FD_CLOEXEC) == -1)
+    {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+
+    return sockfd;
+}
+
+/**
+ * Binds a socket to the specified address and port. A Unix socket left behind by an earlier
+ * run is removed first, the port is not used for one.
+ * @param sockfd    the socket file descriptor
+ * @param addr      a pointer to the struct sockaddr_storage containing the address
+ * @param port      the port number to bind the socket
+ */
+static void socket_bind(int sockfd, struct sockaddr_storage *addr, in_port_t port)
+{
+    char      addr_str[ADDRESS_STR_LEN];    // Array to store the human-readable address, with its port
+    char      ip_str[INET6_ADDRSTRLEN];     // Array to store human-readable IP address for either IPv4 or IPv6
+    socklen_t addr_len;                     // Variable to store the length of the addr struct
+    void     *vaddr;                        // Pointer to actual (binary) IP address within addr struct
+    in_port_t net_port;                     // Stores network byte order representation of port number
+
+    // Convert port number to network byte order (big endian)
+    net_port = htons(port);
+    vaddr    = NULL;
+
+    // Handle IPv4
+    if(addr->ss_family == AF_INET)
+    {
+        struct sockaddr_in *ipv4_addr;
+
+        ipv4_addr           = (struct sockaddr_in *)addr;
+        addr_len            = sizeof(*ipv4_addr);
+        ipv4_addr->sin_port = net_port;
+        vaddr               = (void *)&(((struct sockaddr_in *)addr)->sin_addr);
+    }
+    // Handle IPv6
+    else if(addr->ss_family == AF_INET6)
+    {
+        struct sockaddr_in6 *ipv6_addr;
+
+        ipv6_addr            = (struct sockaddr_in6 *)addr;
+        addr_len             = sizeof(*ipv6_addr);
+        ipv6_addr->sin6_port = net_port;
+        vaddr                = (void *)&(((struct sockaddr_in6 *)addr)->sin6_addr);
+    }
+    // Handle Unix sockets
+    else if(addr->ss_family == AF_UNIX)
+    {
+        struct sockaddr_un *unix_addr;
+        struct stat         status;
+
+        unix_addr = (struct sockaddr_un *)addr;
+        addr_len  = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + strlen(unix_addr->sun_path) + 1);
+        snprintf(addr_str, sizeof(addr_str), UNIX_PREFIX "%s", unix_addr->sun_path);
+
+        // Only ever a stale socket, never a file that happens to have the name
+        if(lstat(unix_addr->sun_path, &status) == 0 && S_ISSOCK(status.st_mode))
+        {
+            unlink(unix_addr->sun_path);
+        }
+    }
+#if defined(__linux__)
+    // Handle vsock, whose ports are 32 bits in host byte order
+    else if(addr->ss_family == AF_VSOCK)
+    {
+        struct sockaddr_vm *vsock_addr;
+
+        vsock_addr           = (struct sockaddr_vm *)addr;
+        addr_len             = sizeof(*vsock_addr);
+        vsock_addr->svm_port = port;
+        if(vsock_addr->svm_cid == VMADDR_CID_ANY)
+        {
+            snprintf(addr_str, sizeof(addr_str), VSOCK_PREFIX VSOCK_ANY ":%u", port);
+        }
+        else
+        {
+            snprintf(addr_str, sizeof(addr_str), VSOCK_PREFIX "%u:%u", vsock_addr->svm_cid, port);
+        }
+    }
+#endif
+    else
+    {
+        fprintf(stderr, "Internal error: addr->ss_family must be AF_INET, AF_INET6, AF_UNIX or AF_VSOCK, was: %d\n", addr->ss_family);
+        exit(EXIT_FAILURE);
+    }
+
+    // Converts binary IP address to a human-readable string and stores it in addr_str
+    if(vaddr != NULL)
+    {
+        if(inet_ntop(addr->ss_family, vaddr, ip_str, sizeof(ip_str)) == NULL)
+        {
+            perror("inet_ntop");
+            exit(EXIT_FAILURE);
+        }
+
+        snprintf(addr_str, sizeof(addr_str), "%s:%u", ip_str, port);
+    }
+
+    log_event(LOG_DEBUG, NULL, "Binding to %s", addr_str);
+
+    // Bind socket to port
+    if(bind(sockfd, (struct sockaddr *)addr, addr_len) == -1)
+    {
+        perror("Binding failed");
+        fprintf(stderr, "Error code: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    log_event(LOG_INFO, NULL, "Bound to socket: %s", addr_str);
+}
+
+/**
+ * Starts listening on a server socket for incoming connections with a specified backlog.
+ * @param server_fd the file descriptor of the server socket to start listening on
+ * @param backlog   the maximum number of pending connections that can be queued up
+ */
+static void start_listening(int server_fd, int backlog)
+{
+    if(listen(server_fd, backlog) == -1)
+    {
+        perror("listen failed");
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    log_event(LOG_INFO, NULL, "Listening for incoming connections");
+}
+
+/**
+ * Creates, binds and starts a listening socket on the given address.
+ * @param addr       the address to listen on
+ * @param port       the port to listen on
+ * @param reuse_port non-zero to share the port with other workers through SO_REUSEPORT
+ * @param tuning     the options accepted connections get, or NULL for the kernel's
+ * @return           the file descriptor of the listening socket
+ */
+static int open_listener(struct sockaddr_storage *addr, in_port_t port, int reuse_port, const struct socket_tuning *tuning)
+{
+    int sockfd;
+    int enable;
+
+    sockfd = socket_create(addr->ss_family, SOCK_STREAM, 0);
+
+    enable = 1;
+    if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) == -1)
+    {
+        perror("Setsockopt failed");
+        exit(EXIT_FAILURE);
+    }
+
+#if defined(SO_REUSEPORT)
+    // The kernel spreads incoming connections across every socket bound to the port
+    if(reuse_port && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) == -1)
+    {
+        perror("Setsockopt failed");
+        exit(EXIT_FAILURE);
+    }
+#else
+    (void)reuse_port;
+#endif
+
+    // The options are all TCP's, a local transport has nothing to tune
+    if(tuning != NULL && is_tcp_address(addr))
+    {
+        tune_listener(sockfd, tuning);
+    }
+
+    socket_bind(sockfd, addr, port);
+    start_listening(sockfd, SOMAXCONN);
+
+    return sockfd;
+}
+
+/**
+ * Tells TCP addresses apart from the local transports, which have no SO_REUSEPORT or TCP options.
+ * @param addr the address
+ * @return     1 for an IPv4 or IPv6 address, 0 for a Unix socket or vsock
+ */
+static int is_tcp_address(const struct sockaddr_storage *addr)
+{
+    return addr->ss_family == AF_INET || addr->ss_family == AF_INET6;
+}
+
+/**
+ * Sets the -S options on a listening socket before it listens. Connections accepted from it
+ * start out with the same options, so nothing is set per connection.
+ * @param sockfd the listening socket
+ * @param tuning the options
+ */
+static void tune_listener(int sockfd, const struct socket_tuning *tuning)
+{
+    int enable;
+
+    enable = 1;
+
+    if(tuning->nodelay && setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) == -1)
+    {
+        perror("setsockopt TCP_NODELAY");
+        exit(EXIT_FAILURE);
+    }
+
+    if(tuning->send_buffer > 0 && setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &tuning->send_buffer, sizeof(tuning->send_buffer)) == -1)
+    {
+        perror("setsockopt SO_SNDBUF");
+        exit(EXIT_FAILURE);
+    }
+
+    if(tuning->receive_buffer > 0 && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &tuning->receive_buffer, sizeof(tuning->receive_buffer)) == -1)
+    {
+        perror("setsockopt SO_RCVBUF");
+        exit(EXIT_FAILURE);
+    }
+
+#if defined(TCP_FASTOPEN)
+    // A client that has a cookie from an earlier connection sends its request in the SYN
+    if(tuning->fastopen > 0 && setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &tuning->fastopen, sizeof(tuning->fastopen)) == -1)
+    {
+        perror("setsockopt TCP_FASTOPEN");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+#if defined(TCP_NOTSENT_LOWAT)
+    // Output waits in the pipe instead of the socket, so a slow client holds less kernel memory
+    if(tuning->notsent_lowat > 0 && setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &tuning->notsent_lowat, sizeof(tuning->notsent_lowat)) == -1)
+    {
+        perror("setsockopt TCP_NOTSENT_LOWAT");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    // The kernel doubles what it was asked for and may cap it, so log what the sockets really get
+    if(tuning->send_buffer > 0 || tuning->receive_buffer > 0)
+    {
+        int       send_buffer;
+        int       receive_buffer;
+        socklen_t len;
+
+        len = sizeof(send_buffer);
+        getsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &send_buffer, &len);
+        len = sizeof(receive_buffer);
+        getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, &len);
+        log_event(LOG_INFO, NULL, "Socket buffers are %d bytes for sending and %d for receiving", send_buffer, receive_buffer);
+    }
+}
+
+/**
+ * Accepts an incoming connection on the server socket.
+ * @param server_fd         the file descriptor of the server socket
+ * @param client_addr       a pointer to a struct sockaddr_storage for storing client address information
+ * @param client_addr_len   a pointer to the length of the client address structure
+ * @param resolver          the background resolver for host names, or NULL to log addresses only
+ * @param metrics           the server's counters
+ * @return                 the file descriptor for the accepted connection, or -1 on error
+ */
+static int socket_accept_connection(int server_fd, struct sockaddr_storage *client_addr, socklen_t *client_addr_len, struct resolver *resolver, struct server_metrics *metrics)
+{
+    int      client_fd;
+    uint64_t accepted;
+
+    errno = 0;
+
+#if defined(__linux__)
+    // Only the child serving this client should inherit its socket, so it is close-on-exec from the start
+    client_fd = accept4(server_fd, (struct sockaddr *)client_addr, client_addr_len, SOCK_CLOEXEC);
+#else
+    client_fd = accept(server_fd, (struct sockaddr *)client_addr, client_addr_len);
+#endif
+
+    if(client_fd == -1)
+    {
+        if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("accept failed");
+        }
+
+        return -1;
+    }
+
+    accepted = monotonic_microseconds();
+
+#if !defined(__linux__)
+    // Only the child serving this client should inherit its socket, and only as stdout
+    if(fcntl(client_fd, F_SETFD, FD_CLOEXEC) == -1)
+    {
+        perror("fcntl");
+        close(client_fd);
+        return -1;
+    }
+#endif
+
+    log_connection(client_fd, client_addr, *client_addr_len, resolver);
+    metrics_count(&metrics->connections_accepted, 1);
+    metrics_adjust(&metrics->connections_open, 1);
+    metrics_record(metrics, STAGE_ACCEPT, accepted);
+
+    return client_fd;
+}
+
+/**
+ * Logs a newly accepted connection.
+ * @param client_fd       the client's socket
+ * @param client_addr     the client's address
+ * @param client_addr_len the length of the client's address
+ * @param resolver        the background resolver for host names, or NULL to log the address only
+ */
+static void log_connection(int client_fd, const struct sockaddr_storage *client_addr, socklen_t client_addr_len, struct resolver *resolver)
+{
+    char  client_host[NI_MAXHOST];       // Array to store the address of the client
+    char  client_service[NI_MAXSERV];    // Array to store the port information of the client
+    char  client_name[NI_MAXHOST];       // Array to store the hostname of the client, if already known
+    char  peer[NI_MAXHOST + NI_MAXSERV];
+    pid_t pid;
+
+    if(describe_local_peer(client_fd, client_addr, peer, sizeof(peer), &pid))
+    {
+        log_event(LOG_INFO, &(struct log_fields){.present = LOG_PEER | (pid > 0 ? LOG_PID : 0U), .peer = peer, .pid = pid}, "Accepted a new connection");
+        return;
+    }
+
+    // Numeric only: a reverse DNS lookup here would stall every other client while it runs
+    if(getnameinfo((const struct sockaddr *)client_addr, client_addr_len, client_host, NI_MAXHOST, client_service, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+    {
+        snprintf(peer, sizeof(peer), "%s:%s", client_host, client_service);
+
+        if(resolver != NULL && resolver_lookup(resolver, client_addr, client_addr_len, client_name, sizeof(client_name)))
+        {
+            log_event(LOG_INFO, &(struct log_fields){.present = LOG_PEER, .peer = peer}, "Accepted a new connection from %s", client_name);
+        }
+        else
+        {
+            log_event(LOG_INFO, &(struct log_fields){.present = LOG_PEER, .peer = peer}, "Accepted a new connection");
+        }
+    }
+    else
+    {
+        log_event(LOG_WARN, NULL, "Unable to get client information");
+    }
+}
+
+/**
+ * Names a client getnameinfo() knows nothing about. Unix socket clients go by the user they run
+ * as, which is what the per-client limit counts them by, and vsock clients by their context ID.
+ * @param client_fd   the client's socket
+ * @param client_addr the client's address
+ * @param peer        where the name is stored
+ * @param size        the size of peer
+ * @param pid         where the client's process ID is stored, 0 if it is not known
+ * @return            1 if the client was named, 0 for an IPv4 or IPv6 client
+ */
+static int describe_local_peer(int client_fd, const struct sockaddr_storage *client_addr, char *peer, size_t size, pid_t *pid)
+{
+    *pid = 0;
+
+    if(client_addr->ss_family == AF_UNIX)
+    {
+#if defined(SO_PEERCRED)
+        struct ucred credentials;
+        socklen_t    len;
+
+        len = sizeof(credentials);
+
+        if(getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &credentials, &len) == 0)
+        {
+            snprintf(peer, size, "uid:%u", (unsigned int)credentials.uid);
+            *pid = credentials.pid;
+            return 1;
+        }
+#else
+        (void)client_fd;
+#endif
+
+        snprintf(peer, size, "unix");
+        return 1;
+    }
+
+#if defined(__linux__)
+    if(client_addr->ss_family == AF_VSOCK)
+    {
+        snprintf(peer, size, VSOCK_PREFIX "%u", ((const struct sockaddr_vm *)client_addr)->svm_cid);
+        return 1;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * Reads the first request from a newly accepted client, waiting until all of it has arrived.
+ * @param client_sockfd the file descriptor for the connected client socket
+ * @param parser        the connection's receive buffer
+ * @param frame         where the request is stored
+ * @return              PARSE_COMMAND, PARSE_SESSION if the client opened a session instead, or PARSE_ERROR
+ */
+static int read_request(int client_sockfd, struct frame_parser *parser, struct parsed_frame *frame)
+{
+    int result;
+
+    while((result = frame_parser_next(parser, PROTOCOL_UNKNOWN, frame)) == PARSE_INCOMPLETE)
+    {
+        // A blocking read, interrupted only by SIGINT
+        if(frame_parser_fill(parser, client_sockfd, 0) <= 0)
+        {
+            return PARSE_ERROR;
+        }
+    }
+
+    if(result == PARSE_COMMAND)
+    {
+        log_event(LOG_DEBUG, &(struct log_fields){.present = LOG_COMMAND | LOG_BYTES, .command = frame->payload, .bytes = frame->len}, "Received a command");
+    }
+
+    return result;
+}
+
+/**
+ * Closes a socket with the specified file descriptor.
+ * @param sockfd the file descriptor of the socket to be closed
+ */
+static void socket_close(int sockfd)
+{
+    if(close(sockfd) == -1)
+    {
+        perror("error closing socket");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Session Protocol Functions
+
+/**
+ * Writes exactly len bytes to a socket, retrying after short writes.
+ * @param sockfd the file descriptor to write to
+ * @param buffer the bytes to write
+ * @param len    the number of bytes to write
+ * @return       0 on success, -1 on error
+ */
+static int write_fully(int sockfd, const void *buffer, size_t len)
+{
+    const char *bytes;
+    size_t      total;
+
+    bytes = (const char *)buffer;
+    total = 0;
+
+    while(total < len)
+    {
+        ssize_t bytes_written;
+
+        bytes_written = write(sockfd, bytes + total, len - total);
+
+        if(bytes_written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(bytes_written <= 0)
+        {
+            return -1;
+        }
+
+        total += (size_t)bytes_written;
+    }
+
+    return 0;
+}
+
+/**
+ * Fills in a frame header: a type byte, then the request ID and payload length as 32-bit big-endian integers.
+ * @param header the FRAME_HEADER_LEN bytes to fill in
+ * @param type   the frame type
+ * @param id     the ID of the request the frame belongs to
+ * @param len    the payload length
+ */
+static void encode_frame_header(uint8_t *header, uint8_t type, uint32_t id, size_t len)
+{
+    uint32_t net_id;
+    uint32_t net_len;
+
+    net_id    = htonl(id);
+    net_len   = htonl((uint32_t)len);
+    header[0] = type;
+    memcpy(&header[1], &net_id, sizeof(net_id));
+    memcpy(&header[1 + sizeof(net_id)], &net_len, sizeof(net_len));
+}
+
+/**
+ * Writes one session frame. The header and payload go out in a single write so small
+ * frames are not split across segments.
+ * @param sockfd  the file descriptor of the client socket
+ * @param type    the frame type
+ * @param id      the ID of the request the frame belongs to
+ * @param payload the payload bytes
+ * @param len     the payload length, at most LINE_LENGTH
+ * @return        0 on success, -1 on error
+ */
+static int write_frame(int sockfd, uint8_t type, uint32_t id, const void *payload, size_t len)
+{
+    uint8_t frame[FRAME_HEADER_LEN + LINE_LENGTH];
+
+    if(len > LINE_LENGTH)
+    {
+        return -1;
+    }
+
+    encode_frame_header(frame, type, id, len);
+    memcpy(&frame[FRAME_HEADER_LEN], payload, len);
+
+    return write_fully(sockfd, frame, FRAME_HEADER_LEN + len);
+}
+
+/**
+ * Converts a wait status into a shell-style exit code.
+ * @param status the status returned by waitpid
+ * @return       the exit code, or 128 plus the signal number if the child was killed
+ */
+static int exit_code_from_status(int status)
+{
+    if(WIFSIGNALED(status))
+    {
+        return SIGNAL_EXIT_BASE + WTERMSIG(status);
+    }
+
+    return WEXITSTATUS(status);
+}
+
+// Frame Parser Functions
+
+/**
+ * Receives whatever the client has sent so far into the free end of the buffer. Bytes left
+ * over from a partial request are moved to the front first, since requests are parsed in place.
+ * A descriptor a Unix socket client sends along is kept in the parser, any it had is closed.
+ * @param parser the connection's receive buffer
+ * @param sockfd the client socket
+ * @param flags  recv() flags, MSG_DONTWAIT to never wait for the client
+ * @return       the number of bytes received, 0 on EOF, or -1 on error
+ */
+static ssize_t frame_parser_fill(struct frame_parser *parser, int sockfd, int flags)
+{
+    union
+    {
+        char           buffer[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr   message;
+    struct iovec    iov;
+    struct cmsghdr *header;
+    ssize_t         bytes_received;
+
+    // Reserving first, it may move what is buffered
+    iov.iov_len  = frame_parser_reserve(parser);
+    iov.iov_base = &parser->buffer[parser->end];
+    memset(&message, 0, sizeof(message));
+    message.msg_iov        = &iov;
+    message.msg_iovlen     = 1;
+    message.msg_control    = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    // Close-on-exec from the start, so a passed descriptor never leaks into an unrelated child
+    bytes_received = recvmsg(sockfd, &message, flags | RECV_CLOEXEC);
+
+    if(bytes_received > 0)
+    {
+        parser->end += (size_t)bytes_received;
+    }
+
+    for(header = CMSG_FIRSTHDR(&message); bytes_received >= 0 && header != NULL; header = CMSG_NXTHDR(&message, header))
+    {
+        size_t count;
+
+        if(header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+
+        count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        // Only the first is used, the output goes to the same place as the errors
+        for(size_t i = 0; i < count; i++)
+        {
+            int fd;
+
+            memcpy(&fd, CMSG_DATA(header) + (i * sizeof(int)), sizeof(fd));
+
+            if(i > 0)
+            {
+                close(fd);
+                continue;
+            }
+
+            if(parser->passed_fd != -1)
+            {
+                close(parser->passed_fd);
+            }
+
+            parser->passed_fd = fd;
+
+#if !defined(__linux__)
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+        }
+    }
+
+    return bytes_received;
+}
+
+/**
+ * Makes room for more bytes after the ones already received. The caller receives into
+ * &parser->buffer[parser->end] and adds what it got to parser->end.
+ * @param parser the connection's receive buffer
+ * @return       the number of bytes that fit
+ */
+static size_t frame_parser_reserve(struct frame_parser *parser)
+{
+    frame_parser_restore(parser);
+
+    if(parser->start == parser->end)
+    {
+        parser->start = 0;
+        parser->end   = 0;
+    }
+    else if(parser->start > 0)
+    {
+        memmove(parser->buffer, &parser->buffer[parser->start], parser->end - parser->start);
+        parser->end -= parser->start;
+        parser->start = 0;
+    }
+
+    return FRAME_BUFFER_LEN - 1 - parser->end;
+}
+
+/**
+ * Takes the next complete request from the buffer. Before a connection's protocol is known its
+ * first byte decides it: the session marker, or the length byte of a legacy request.
+ * @param parser   the connection's receive buffer
+ * @param protocol the connection's protocol so far
+ * @param frame    where the request is stored
+ * @return         PARSE_COMMAND, PARSE_SESSION, PARSE_INCOMPLETE if more bytes are needed, or PARSE_ERROR
+ */
+static int frame_parser_next(struct frame_parser *parser, int protocol, struct parsed_frame *frame)
+{
+    const char *data;
+    size_t      available;
+    size_t      header_len;
+    size_t      len;
+
+    frame_parser_restore(parser);
+
+    // A parser with nothing buffered may not have a buffer at all
+    available = parser->end - parser->start;
+
+    if(available == 0)
+    {
+        return PARSE_INCOMPLETE;
+    }
+
+    data = &parser->buffer[parser->start];
+
+    if(protocol == PROTOCOL_UNKNOWN)
+    {
+        if((uint8_t)data[0] == SESSION_MARKER)
+        {
+            parser->start++;
+            return PARSE_SESSION;
+        }
+
+        header_len  = 1;
+        len         = (uint8_t)data[0];
+        frame->type = FRAME_COMMAND;
+        frame->id   = 0;
+    }
+    else if(protocol == PROTOCOL_SESSION)
+    {
+        uint32_t net_id;
+        uint32_t net_len;
+
+        if(available < FRAME_HEADER_LEN)
+        {
+            return PARSE_INCOMPLETE;
+        }
+
+        memcpy(&net_id, &data[1], sizeof(net_id));
+        memcpy(&net_len, &data[1 + sizeof(net_id)], sizeof(net_len));
+        header_len  = FRAME_HEADER_LEN;
+        len         = ntohl(net_len);
+        frame->type = (uint8_t)data[0];
+        frame->id   = ntohl(net_id);
+
+        if(len > MAX_COMMAND_LEN)
+        {
+            log_event(LOG_WARN, &(struct log_fields){.present = LOG_BYTES, .bytes = len}, "Frame of %zu bytes is too large", len);
+            return PARSE_ERROR;
+        }
+    }
+    else
+    {
+        // A legacy client sends a single request, anything after it is ignored
+        return PARSE_INCOMPLETE;
+    }
+
+    if(available < header_len + len)
+    {
+        return PARSE_INCOMPLETE;
+    }
+
+    frame->payload = &parser->buffer[parser->start + header_len];
+    frame->len     = len;
+    parser->start += header_len + len;
+
+    // Borrow the byte after the payload as its terminator, it is put back before the next parse
+    parser->borrowed               = parser->start;
+    parser->saved                  = parser->buffer[parser->start];
+    parser->buffer[parser->start]  = '\0';
+
+    return PARSE_COMMAND;
+}
+
+/**
+ * Puts back the byte the last payload's terminator was written over.
+ * @param parser the connection's receive buffer
+ */
+static void frame_parser_restore(struct frame_parser *parser)
+{
+    if(parser->borrowed != 0)
+    {
+        parser->buffer[parser->borrowed] = parser->saved;
+        parser->borrowed                 = 0;
+    }
+}
+
+// Memory Functions
+
+/**
+ * Sets up an empty slab. Nothing is allocated until the first object is.
+ * @param slab        the slab
+ * @param object_size the size of every object it hands out
+ */
+static void slab_init(struct slab *slab, size_t object_size)
+{
+    size_t align;
+
+    align             = _Alignof(max_align_t);
+    slab->object_size = (object_size + align - 1) / align * align;
+    slab->free_list   = NULL;
+    slab->blocks      = NULL;
+}
+
+/**
+ * Takes an object from the free list, carving up a new block when the list is empty.
+ * The object holds whatever its last owner left in it.
+ * @param slab the slab
+ * @return     the object, object_size bytes
+ */
+static void *slab_alloc(struct slab *slab)
+{
+    struct slab_object *object;
+
+    if(slab->free_list == NULL)
+    {
+        struct slab_block *block;
+        char              *objects;
+
+        block = (struct slab_block *)malloc(sizeof(*block) + slab->object_size * SLAB_BLOCK_OBJECTS);
+
+        if(block == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+
+        block->next  = slab->blocks;
+        slab->blocks = block;
+        objects      = (char *)block->objects;
+
+        for(size_t i = SLAB_BLOCK_OBJECTS; i > 0; i--)
+        {
+            object          = (struct slab_object *)(void *)&objects[(i - 1) * slab->object_size];
+            object->next    = slab->free_list;
+            slab->free_list = object;
+        }
+    }
+
+    object          = slab->free_list;
+    slab->free_list = object->next;
+
+    return object;
+}
+
+/**
+ * Puts an object back on the free list for the next slab_alloc().
+ * @param slab   the slab the object came from
+ * @param object the object
+ */
+static void slab_free(struct slab *slab, void *object)
+{
+    struct slab_object *free_object;
+
+    free_object       = (struct slab_object *)object;
+    free_object->next = slab->free_list;
+    slab->free_list   = free_object;
+}
+
+/**
+ * Frees every block of a slab, along with any objects still handed out from them.
+ * @param slab the slab
+ */
+static void slab_destroy(struct slab *slab)
+{
+    while(slab->blocks != NULL)
+    {
+        struct slab_block *block;
+
+        block        = slab->blocks;
+        slab->blocks = block->next;
+        free(block);
+    }
+
+    slab->free_list = NULL;
+}
+
+/**
+ * Allocates an arena's memory up front.
+ * @param arena the arena
+ * @param size  how many bytes it holds
+ */
+static void arena_init(struct arena *arena, size_t size)
+{
+    arena->base = (char *)malloc(size);
+
+    if(arena->base == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    arena->size = size;
+    arena->used = 0;
+}
+
+/**
+ * Takes the next size bytes from an arena. The memory is not cleared.
+ * @param arena the arena
+ * @param size  how many bytes are needed
+ * @return      the memory, aligned for any type, or NULL if the arena is full
+ */
+static void *arena_alloc(struct arena *arena, size_t size)
+{
+    size_t align;
+    size_t offset;
+
+    align  = _Alignof(max_align_t);
+    offset = (arena->used + align - 1) / align * align;
+
+    if(offset > arena->size || size > arena->size - offset)
+    {
+        return NULL;
+    }
+
+    arena->used = offset + size;
+
+    return &arena->base[offset];
+}
+
+/**
+ * Empties an arena, everything taken from it is given back at once.
+ * @param arena the arena
+ */
+static void arena_reset(struct arena *arena)
+{
+    arena->used = 0;
+}
+
+/**
+ * Frees an arena's memory.
+ * @param arena the arena
+ */
+static void arena_destroy(struct arena *arena)
+{
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+// Server Loop Functions
+
+/**
+ * Serves clients on a listening socket until SIGINT, or until SIGTERM or a handoff once the
+ * requests in flight are done, then closes it.
+ * @param server_fd the file descriptor of the listening socket
+ * @param ready_fd  where to report being ready to accept, -1 unless this server replaces another
+ * @param options   the parsed command line options
+ * @param metrics   the server's counters
+ * @return          1 if the listener was handed to a new server, 0 otherwise
+ */
+static int serve(int server_fd, int ready_fd, const struct server_options *options, struct server_metrics *metrics)
+{
+    struct path_cache path_cache;
+    struct resolver  *resolver;
+    int               handed_off;
+
+    path_cache_init(&path_cache, metrics);    // Resolve every command on the PATH before the first client
+    resolver = options->resolve_names ? resolver_create() : NULL;
+
+    // Handle incoming client connections
+#if defined(__linux__)
+    if(options->mode == MODE_EPOLL || options->mode == MODE_URING)
+    {
+        handed_off = run_event_loop(server_fd, ready_fd, options, &path_cache, resolver, metrics);
+    }
+    else
+    {
+        handed_off = run_serial_loop(server_fd, ready_fd, options, &path_cache, resolver, metrics);
+    }
+#else
+    handed_off = run_serial_loop(server_fd, ready_fd, options, &path_cache, resolver, metrics);
+#endif
+
+    if(resolver != NULL)
+    {
+        resolver_destroy(resolver);
+    }
+
+    log_event(LOG_INFO, NULL, "Path cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " invalidations", path_cache.hits, path_cache.misses, path_cache.invalidations);
+    path_cache_destroy(&path_cache);
+
+    return handed_off;
+}
+
+/**
+ * Handles one client at a time: accept, read the command, run it and wait for it to finish.
+ * Nothing is in flight between clients, so a handoff or SIGTERM stops the loop straight away.
+ * @param server_fd  the file descriptor of the listening socket, closed on return
+ * @param ready_fd   where to report being ready to accept, or -1
+ * @param options    the parsed command line options
+ * @param path_cache the cache of resolved executables
+ * @param resolver   the background host name resolver, or NULL
+ * @param metrics    the server's counters
+ * @return           1 if the listener was handed to a new server, 0 otherwise
+ */
+static int run_serial_loop(int server_fd, int ready_fd, const struct server_options *options, struct path_cache *path_cache, struct resolver *resolver, struct server_metrics *metrics)
+{
+    struct arena   scratch;
+    struct handoff handoff;
+    sigset_t       drain_signals;
+    int            handed_off;
+
+    // One client at a time, so they all share the memory their requests are read and split in
+    arena_init(&scratch, SCRATCH_LEN);
+    handoff_ready(ready_fd, options->started);
+    handed_off = 0;
+    sigemptyset(&drain_signals);
+    sigaddset(&drain_signals, SIGTERM);
+    sigaddset(&drain_signals, SIGUSR2);
+
+    while(!exit_flag)
+    {
+        int                     client_sockfd;
+        int                     passed_fd;
+        struct sockaddr_storage client_addr;
+        socklen_t               client_addr_len;
+
+        // A worker's listener belongs to its supervisor, which hands over the whole pool
+        if(reload_flag)
+        {
+            reload_flag = 0;
+
+            // Clients are served one at a time, so there is nothing else to do while the new server starts
+            if(options->workers == 0 && handoff_start(options, &server_fd, 1, &handoff) == 0)
+            {
+                pid_t new_pid;
+
+                if(handoff_wait(handoff.ready_fd, &new_pid) == -1)
+                {
+                    new_pid = -1;
+                }
+
+                if(handoff_end(&handoff, new_pid) == 0)
+                {
+                    handed_off = 1;
+                    break;
+                }
+            }
+        }
+
+        if(drain_flag)
+        {
+            break;
+        }
+
+        client_addr_len = sizeof(client_addr);
+        client_sockfd   = socket_accept_connection(server_fd, &client_addr, &client_addr_len, resolver, metrics);
+
+        if(client_sockfd == -1)
+        {
+            if(exit_flag)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        // A drain or handoff waits for this client instead of interrupting its reads and waits
+        sigprocmask(SIG_BLOCK, &drain_signals, NULL);
+
+#if defined(HAVE_OPENSSL)
+        if(options->tls != NULL)
+        {
+            client_sockfd = tls_accept(options->tls, client_sockfd);
+        }
+
+        if(client_sockfd == -1)
+        {
+            sigprocmask(SIG_UNBLOCK, &drain_signals, NULL);
+            continue;
+        }
+#endif
+
+        passed_fd = -1;
+        serial_handle_client(client_sockfd, &passed_fd, options, path_cache, &scratch, metrics);
+
+        if(passed_fd != -1)
+        {
+            close(passed_fd);
+        }
+
+        socket_close(client_sockfd);
+        metrics_adjust(&metrics->connections_open, -1);
+        sigprocmask(SIG_UNBLOCK, &drain_signals, NULL);
+    }
+
+    arena_destroy(&scratch);
+    socket_close(server_fd);    // Close server
+    return handed_off;
+}
+
+/**
+ * Reads one client's command, runs it and waits for it to finish. The caller closes the socket,
+ * and the descriptor the client sent for the output if there is one.
+ * @param client_sockfd the client's socket
+ * @param passed_fd     where the descriptor a Unix socket client sent is stored, -1 for none
+ * @param options       the parsed command line options
+ * @param path_cache    the cache of resolved executables
+ * @param scratch       where the request is received and split, emptied first
+ * @param metrics       the server's counters
+ */
+static void serial_handle_client(int client_sockfd, int *passed_fd, const struct server_options *options, struct path_cache *path_cache, struct arena *scratch, struct server_metrics *metrics)
+{
+    struct frame_parser parser;
+    struct parsed_frame frame;
+    char              **args;
+    char               *command;
+    char               *full_path;
+    int                 find_executable_result;
+    int                 result;
+    uint64_t            started;
+
+    // Command Runner
+    arena_reset(scratch);
+    command          = NULL;
+    parser.buffer    = (char *)arena_alloc(scratch, FRAME_BUFFER_LEN);
+    parser.start     = 0;
+    parser.end       = 0;
+    parser.borrowed  = 0;
+    parser.passed_fd = -1;
+    full_path        = (char *)arena_alloc(scratch, LINE_LENGTH);
+
+    if(parser.buffer == NULL || full_path == NULL)
+    {
+        return;
+    }
+
+    started    = monotonic_microseconds();
+    result     = read_request(client_sockfd, &parser, &frame);
+    *passed_fd = parser.passed_fd;
+
+    if(result == PARSE_SESSION)
+    {
+        const char message[] = "Sessions need the epoll or uring mode.";
+
+        write_frame(client_sockfd, FRAME_ERROR, 0, message, strlen(message));
+    }
+
+    if(result != PARSE_COMMAND)
+    {
+        return;
+    }
+
+    metrics_record(metrics, STAGE_READ, started);
+    metrics_count(&metrics->requests, 1);
+
+    args = split_input(frame.payload, &command, scratch);
+
+    if(args == NULL || command == NULL)
+    {
+        dprintf(client_sockfd, "Invalid command.\n");
+        return;
+    }
+
+    // The loop never waits on the inotify descriptor, so check it before every lookup
+    path_cache_poll(path_cache);
+    started                = monotonic_microseconds();
+    find_executable_result = find_binary_executable(path_cache, command, full_path);
+    metrics_record(metrics, STAGE_LOOKUP, started);
+
+    if(find_executable_result != 0)
+    {
+        metrics_count(&metrics->commands_not_found, 1);
+        dprintf(client_sockfd, "Command %s was not found.\n", command);
+        return;
+    }
+
+    // Only the child sees the client socket, or what the client sent for the output, the server's own stdout is left alone
+    execute_process(options->spawn_backend, full_path, args, client_sockfd, *passed_fd, options->max_timeout, metrics);
+}
+
+#if defined(__linux__)
+
+/**
+ * Handles clients through epoll: the server keeps accepting and dispatching while
+ * children run, and reaps them asynchronously through a SIGCHLD signalfd.
+ * @param server_fd  the file descriptor of the listening socket, closed on return
+ * @param ready_fd   where to report being ready to accept, or -1
+ * @param options    the parsed command line options
+ * @param path_cache the cache of resolved executables
+ * @param resolver   the background host name resolver, or NULL
+ * @param metrics    the server's counters
+ * @return           1 if the listener was handed to a new server, 0 otherwise
+ */
+static int run_event_loop(int server_fd, int ready_fd, const struct server_options *options, struct path_cache *path_cache, struct resolver *resolver, struct server_metrics *metrics)
+{
+    struct event_loop loop;
+    int               handed_off;
+
+    // The warm pools are started by now, so the first clients never wait on them
+    event_loop_init(&loop, server_fd, options, path_cache, resolver, metrics);
+    handoff_ready(ready_fd, options->started);
+
+#if defined(HAVE_IO_URING)
+    if(loop.ring.fd != -1)
+    {
+        event_loop_run_uring(&loop);
+        handed_off = loop.handed_off;
+        event_loop_destroy(&loop);
+        return handed_off;
+    }
+#endif
+
+    event_loop_run_epoll(&loop);
+    handed_off = loop.handed_off;
+    event_loop_destroy(&loop);
+    return handed_off;
+}
+
+/**
+ * Waits for readiness with epoll and handles each ready source.
+ * @param loop the event loop state
+ */
+static void event_loop_run_epoll(struct event_loop *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while(!exit_flag)
+    {
+        int ready;
+
+        if((reload_flag || drain_flag) && event_loop_drain(loop))
+        {
+            break;
+        }
+
+        // Files still being sent go on as soon as the ready events are handled
+        ready = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, loop->transfers != NULL ? 0 : -1);
+
+        if(ready == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("epoll_wait");
+            break;
+        }
+
+        for(int i = 0; i < ready; i++)
+        {
+            const struct event_source *source;
+
+            source = (const struct event_source *)events[i].data.ptr;
+
+            switch(source->type)
+            {
+                case SOURCE_LISTENER:
+                {
+                    event_loop_accept(loop);
+                    break;
+                }
+                case SOURCE_SIGNAL:
+                {
+                    event_loop_reap(loop);
+                    break;
+                }
+                case SOURCE_CLIENT:
+                {
+                    struct client_connection *client;
+
+                    client = (struct client_connection *)source->owner;
+
+                    if(events[i].events & EPOLLOUT)
+                    {
+                        event_loop_flush_client(loop, client);
+
+                        // Room for the queue may be all there is, and a flush can close the client
+                        if(!(events[i].events & ~(uint32_t)EPOLLOUT) || client->source.fd == -1)
+                        {
+                            break;
+                        }
+                    }
+
+                    // Without EPOLLIN the client is only watched for hanging up on its command
+                    if(!(source->events & EPOLLIN))
+                    {
+                        event_loop_cancel_client(loop, client);
+                    }
+                    else
+                    {
+                        event_loop_read_client(loop, client);
+                    }
+
+                    break;
+                }
+                case SOURCE_OUTPUT:
+                {
+                    event_loop_forward_output(loop, (struct command_request *)source->owner);
+                    break;
+                }
+                case SOURCE_PATH_WATCH:
+                {
+                    path_cache_poll(loop->path_cache);
+                    break;
+                }
+                case SOURCE_WARM_CONTROL:
+                {
+                    warm_worker_read_status(loop, (struct warm_worker *)source->owner);
+                    break;
+                }
+                case SOURCE_WARM_OUTPUT:
+                {
+                    warm_worker_read_output(loop, (struct warm_worker *)source->owner);
+                    break;
+                }
+                case SOURCE_TIMER:
+                {
+                    event_loop_check_deadlines(loop);
+                    break;
+                }
+                case SOURCE_HANDOFF:
+                {
+                    event_loop_check_handoff(loop, monotonic_microseconds());
+                    break;
+                }
+#if defined(HAVE_OPENSSL)
+                case SOURCE_TLS:
+                {
+                    event_loop_collect_handshakes(loop);
+                    break;
+                }
+#endif
+                default:
+                {
+                    break;
+                }
+            }
+        }
+
+        event_loop_run_pending(loop);
+        event_loop_run_transfers(loop);
+        event_loop_release(loop);
+    }
+}
+
+/**
+ * Creates the epoll instance or io_uring, and the SIGCHLD signalfd, and registers the listener.
+ * If io_uring was asked for but the kernel refuses it, the loop falls back to epoll.
+ * @param loop       the event loop state to initialise
+ * @param server_fd  the file descriptor of the listening socket
+ * @param options    the parsed command line options
+ * @param path_cache the cache of resolved executables
+ * @param resolver   the background host name resolver, or NULL
+ * @param metrics    the server's counters
+ */
+static void event_loop_init(struct event_loop *loop, int server_fd, const struct server_options *options, struct path_cache *path_cache, struct resolver *resolver, struct server_metrics *metrics)
+{
+    sigset_t mask;
+    int      flags;
+
+    memset(loop, 0, sizeof(*loop));
+    loop->options    = options;
+    loop->path_cache = path_cache;
+    loop->resolver   = resolver;
+    loop->metrics    = metrics;
+    slab_init(&loop->client_slab, sizeof(struct client_connection));
+    slab_init(&loop->request_slab, sizeof(struct command_request));
+    slab_init(&loop->buffer_slab, FRAME_BUFFER_LEN);
+    arena_init(&loop->scratch, SCRATCH_LEN);
+    log_event(LOG_INFO, NULL, "Idle connections take %zu bytes each, and %zu more while part of a request is buffered", loop->client_slab.object_size, loop->buffer_slab.object_size);
+
+    // Accept until the backlog is empty instead of blocking on a connection that was reset
+    flags = fcntl(server_fd, F_GETFL);
+    if(flags == -1 || fcntl(server_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+
+    // SIGCHLD is only ever consumed through the signalfd
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if(sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+    {
+        perror("sigprocmask");
+        exit(EXIT_FAILURE);
+    }
+
+    loop->signal.type = SOURCE_SIGNAL;
+    loop->signal.fd   = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(loop->signal.fd == -1)
+    {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+
+    loop->timer.type = SOURCE_TIMER;
+    loop->timer.fd   = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(loop->timer.fd == -1)
+    {
+        perror("timerfd_create");
+        exit(EXIT_FAILURE);
+    }
+
+    loop->epoll_fd = -1;
+
+#if defined(HAVE_IO_URING)
+    loop->ring.fd = -1;
+
+    if(options->mode == MODE_URING && uring_init(&loop->ring, URING_ENTRIES) == -1)
+    {
+        perror("io_uring_setup");
+        log_event(LOG_WARN, NULL, "io_uring is not available, falling back to epoll");
+    }
+
+    if(loop->ring.fd == -1)
+#endif
+    {
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if(loop->epoll_fd == -1)
+        {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    loop->listener.type = SOURCE_LISTENER;
+    loop->listener.fd   = server_fd;
+
+    event_loop_watch(loop, &loop->listener, EPOLLIN, EPOLL_CTL_ADD);
+    event_loop_watch(loop, &loop->signal, EPOLLIN, EPOLL_CTL_ADD);
+    event_loop_watch(loop, &loop->timer, EPOLLIN, EPOLL_CTL_ADD);
+
+    if(path_cache->watch_fd != -1)
+    {
+        loop->path_watch.type = SOURCE_PATH_WATCH;
+        loop->path_watch.fd   = path_cache->watch_fd;
+        event_loop_watch(loop, &loop->path_watch, EPOLLIN, EPOLL_CTL_ADD);
+    }
+
+    loop->tls.fd             = -1;
+    loop->tls_handoff_fd     = -1;
+    loop->handoff.ready_fd   = -1;
+    loop->handoff_ready.type = SOURCE_HANDOFF;
+    loop->handoff_ready.fd   = -1;
+
+#if defined(HAVE_OPENSSL)
+    if(options->tls != NULL)
+    {
+        int handoff_fds[2];
+
+        // Handshakes finish on their own threads and come back through this pipe
+        if(pipe2(handoff_fds, O_CLOEXEC) == -1)
+        {
+            perror("pipe2");
+            exit(EXIT_FAILURE);
+        }
+
+        flags = fcntl(handoff_fds[0], F_GETFL);
+        if(flags == -1 || fcntl(handoff_fds[0], F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            perror("fcntl");
+            exit(EXIT_FAILURE);
+        }
+
+        loop->tls.type       = SOURCE_TLS;
+        loop->tls.fd         = handoff_fds[0];
+        loop->tls_handoff_fd = handoff_fds[1];
+        event_loop_watch(loop, &loop->tls, EPOLLIN, EPOLL_CTL_ADD);
+    }
+#endif
+
+    warm_pools_start(loop);
+}
+
+/**
+ * Registers a source with epoll or changes the events it is watched for. Under io_uring
+ * the source is armed instead, unless an operation on it is still in flight.
+ * @param loop   the event loop state
+ * @param source the source to watch
+ * @param events the epoll events to wait for, 0 to pause the source
+ * @param op     EPOLL_CTL_ADD or EPOLL_CTL_MOD
+ */
+static void event_loop_watch(struct event_loop *loop, struct event_source *source, uint32_t events, int op)
+{
+    struct epoll_event event;
+
+    source->events = events;
+
+#if defined(HAVE_IO_URING)
+    if(loop->ring.fd != -1)
+    {
+        if(events != 0 && !source->in_flight)
+        {
+            event_loop_arm(loop, source);
+        }
+
+        return;
+    }
+#endif
+
+    memset(&event, 0, sizeof(event));
+    event.events   = events;
+    event.data.ptr = source;
+
+    // Whatever a client is read for, it also waits for room while it has output queued
+    if(source->type == SOURCE_CLIENT && ((const struct client_connection *)source->owner)->queued != NULL)
+    {
+        event.events |= EPOLLOUT;
+    }
+
+    if(epoll_ctl(loop->epoll_fd, op, source->fd, &event) == -1)
+    {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Removes a source from epoll and closes it. The registration belongs to the open file, not the
+ * descriptor, so a child that has not reached execv yet would otherwise keep it alive.
+ * @param loop   the event loop state
+ * @param source the source to close
+ */
+static void event_loop_unwatch(const struct event_loop *loop, struct event_source *source)
+{
+#if defined(HAVE_IO_URING)
+    if(loop->ring.fd != -1)
+    {
+        // A receive or poll in flight holds its own reference to the socket, a shutdown completes it
+        if(source->in_flight && (source->type == SOURCE_CLIENT || source->type == SOURCE_WARM_CONTROL))
+        {
+            shutdown(source->fd, SHUT_RDWR);
+        }
+
+        close(source->fd);
+        source->fd = -1;
+        return;
+    }
+#endif
+
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL) == -1)
+    {
+        perror("epoll_ctl");
+    }
+
+    close(source->fd);
+    source->fd = -1;
+}
+
+/**
+ * Accepts every pending connection and waits for each one to send its first request.
+ * @param loop the event loop state
+ */
+static void event_loop_accept(struct event_loop *loop)
+{
+    while(!exit_flag)
+    {
+        int                     client_sockfd;
+        struct sockaddr_storage client_addr;
+        socklen_t               client_addr_len;
+
+        client_addr_len = sizeof(client_addr);
+        client_sockfd   = socket_accept_connection(loop->listener.fd, &client_addr, &client_addr_len, loop->resolver, loop->metrics);
+
+        if(client_sockfd == -1)
+        {
+            break;
+        }
+
+        event_loop_start_client(loop, client_sockfd, &client_addr);
+    }
+}
+
+/**
+ * Hands a newly accepted client to a handshake thread when clients speak TLS, and starts
+ * tracking it straight away otherwise.
+ * @param loop          the event loop state
+ * @param client_sockfd the client's socket
+ * @param client_addr   the client's address, zeroed if it is not known
+ */
+static void event_loop_start_client(struct event_loop *loop, int client_sockfd, const struct sockaddr_storage *client_addr)
+{
+#if defined(HAVE_OPENSSL)
+    if(loop->options->tls != NULL)
+    {
+        if(tls_start_handshake(loop->options->tls, loop->tls_handoff_fd, client_sockfd, client_addr) == -1)
+        {
+            socket_close(client_sockfd);
+            metrics_adjust(&loop->metrics->connections_open, -1);
+        }
+
+        return;
+    }
+#endif
+
+    event_loop_add_client(loop, client_sockfd, client_addr);
+}
+
+/**
+ * Starts handing the listener to a new server if SIGUSR2 asked for it, and drains the loop after a
+ * handoff or SIGTERM: it stops accepting, stops reading from clients with requests in flight so
+ * each is closed once its last reply is sent, and closes idle sessions. A client accepted but
+ * not heard from yet is still read, so the request it is sending is not lost.
+ * @param loop the event loop state
+ * @return     1 once nothing is left in flight or DRAIN_TIMEOUT has passed, 0 otherwise
+ */
+static int event_loop_drain(struct event_loop *loop)
+{
+    struct client_connection *next;
+    uint64_t                  now;
+    size_t                    handshaking;
+
+    if(reload_flag)
+    {
+        reload_flag = 0;
+
+        // A worker's listener belongs to its supervisor, which hands over the whole pool
+        if(loop->options->workers == 0 && loop->drain_deadline == 0 && loop->handoff.ready_fd == -1 && handoff_start(loop->options, &loop->listener.fd, 1, &loop->handoff) == 0)
+        {
+            // Clients are served as usual until the new server reports or its deadline passes
+            loop->handoff_ready.fd = loop->handoff.ready_fd;
+            event_loop_watch(loop, &loop->handoff_ready, EPOLLIN, EPOLL_CTL_ADD);
+
+            if(loop->next_deadline == 0 || loop->handoff.deadline < loop->next_deadline)
+            {
+                loop->next_deadline = loop->handoff.deadline;
+                event_loop_set_timer(loop);
+            }
+        }
+    }
+
+    if(!drain_flag)
+    {
+        return 0;
+    }
+
+    now = monotonic_microseconds();
+
+    if(loop->drain_deadline == 0)
+    {
+        loop->drain_deadline = now + (uint64_t)DRAIN_TIMEOUT * MICROSECONDS_PER_SECOND;
+        loop->listener.events = 0;
+
+#if defined(HAVE_IO_URING)
+        // A multishot accept keeps going until it is cancelled
+        if(loop->ring.fd != -1 && loop->listener.in_flight)
+        {
+            uring_cancel(loop, &loop->listener);
+        }
+#endif
+
+        // Only closing it takes this process out of an SO_REUSEPORT group, a paused socket would
+        // still be handed connections that nobody accepts. The new server holds its own copy
+        event_loop_unwatch(loop, &loop->listener);
+
+        if(loop->next_deadline == 0 || loop->drain_deadline < loop->next_deadline)
+        {
+            loop->next_deadline = loop->drain_deadline;
+            event_loop_set_timer(loop);
+        }
+
+        log_event(LOG_INFO, NULL, "Stopped accepting, draining the requests in flight");
+    }
+
+    handshaking = 0;
+
+#if defined(HAVE_OPENSSL)
+    // A connection still in its handshake is no client yet. A finished one is written before the count drops
+    if(loop->tls.fd != -1)
+    {
+        handshaking = atomic_load(&loop->options->tls->handshakes);
+        event_loop_collect_handshakes(loop);
+    }
+#endif
+
+    for(struct client_connection *client = loop->clients; client != NULL; client = next)
+    {
+        next = client->next;
+
+        if(client->active_requests == 0 && client->protocol == PROTOCOL_SESSION)
+        {
+            event_loop_close_client(loop, client);
+        }
+        else if(client->active_requests > 0 && !client->read_closed)
+        {
+            client->read_closed = 1;
+            event_loop_watch(loop, &client->source, 0, EPOLL_CTL_MOD);
+        }
+    }
+
+    // A cancelled accept can still complete with a connection, so the last of its completions is waited for
+    if(loop->clients == NULL && loop->running == NULL && handshaking == 0 && !loop->listener.in_flight)
+    {
+        log_event(LOG_INFO, NULL, "Drained, exiting");
+        return 1;
+    }
+
+    if(now >= loop->drain_deadline)
+    {
+        log_event(LOG_WARN, NULL, "Still busy after %d seconds of draining, leaving the rest to finish on their own", DRAIN_TIMEOUT);
+        return 1;
+    }
+
+    // A handshake that fails writes nothing to wake the loop, so it checks back shortly
+    if(handshaking != 0 && now + (uint64_t)DRAIN_POLL_INTERVAL * MICROSECONDS_PER_MILLISECOND < loop->next_deadline)
+    {
+        loop->next_deadline = now + (uint64_t)DRAIN_POLL_INTERVAL * MICROSECONDS_PER_MILLISECOND;
+        event_loop_set_timer(loop);
+    }
+
+    return 0;
+}
+
+/**
+ * Hands the listener over once the new server reports that it is accepting, and gives up on it
+ * once it fails or its deadline passes, so this one carries on. Called when the readiness pipe
+ * is readable and from the timer.
+ * @param loop the event loop state
+ * @param now  monotonic microseconds
+ */
+static void event_loop_check_handoff(struct event_loop *loop, uint64_t now)
+{
+    pid_t pid;
+
+    if(!handoff_poll(&loop->handoff, now, &pid))
+    {
+        return;
+    }
+
+#if defined(HAVE_IO_URING)
+    // The poll holds its own reference to the pipe, and the new server may never write to it
+    if(loop->ring.fd != -1 && loop->handoff_ready.in_flight)
+    {
+        uring_cancel(loop, &loop->handoff_ready);
+    }
+#endif
+
+    // The pipe is closed here, so the handoff no longer owns it
+    event_loop_unwatch(loop, &loop->handoff_ready);
+    loop->handoff.ready_fd = -1;
+
+    if(handoff_end(&loop->handoff, pid) == 0)
+    {
+        loop->handed_off = 1;
+        drain_flag       = 1;
+    }
+}
+
+#if defined(HAVE_OPENSSL)
+/**
+ * Starts tracking every client whose handshake finished since the last call.
+ * @param loop the event loop state
+ */
+static void event_loop_collect_handshakes(struct event_loop *loop)
+{
+    struct tls_handoff connection;
+
+    while(read(loop->tls.fd, &connection, sizeof(connection)) == (ssize_t)sizeof(connection))
+    {
+        event_loop_add_client(loop, connection.fd, &connection.addr);
+    }
+}
+#endif
+
+/**
+ * Starts tracking a newly accepted client and waits for its first request.
+ * @param loop          the event loop state
+ * @param client_sockfd the client's socket
+ * @param client_addr   the client's address, zeroed if it is not known
+ */
+static void event_loop_add_client(struct event_loop *loop, int client_sockfd, const struct sockaddr_storage *client_addr)
+{
+    struct client_connection *client;
+    int                       flags;
+
+    // A client that stops reading must not hold up the loop, what does not fit is queued instead
+    flags = fcntl(client_sockfd, F_GETFL);
+    if(flags == -1 || fcntl(client_sockfd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+        socket_close(client_sockfd);
+        metrics_adjust(&loop->metrics->connections_open, -1);
+        return;
+    }
+
+    // Slab objects are not cleared, so every field is set here. The receive buffer is only
+    // taken once the client sends something
+    client                       = (struct client_connection *)slab_alloc(&loop->client_slab);
+    client->source.type          = SOURCE_CLIENT;
+    client->source.fd            = client_sockfd;
+    client->source.owner         = client;
+    client->source.events        = 0;
+    client->source.in_flight     = 0;
+    client->source.next_paused   = NULL;
+    client->parser.buffer        = NULL;
+    client->parser.start         = 0;
+    client->parser.end           = 0;
+    client->parser.borrowed      = 0;
+    client->parser.passed_fd     = -1;
+    client->protocol             = PROTOCOL_UNKNOWN;
+    client->read_closed          = 0;
+    client->write_failed         = 0;
+    client->active_requests      = 0;
+    client->compression_level    = 0;
+    client->report_usage         = 0;
+    client->polled               = 0;
+    client->accepted             = monotonic_microseconds();
+    client->peer[0]              = '\0';
+    client->queued               = NULL;
+    client->queued_tail          = NULL;
+    client->queued_bytes         = 0;
+    client->writable.type        = SOURCE_WRITABLE;
+    client->writable.fd          = client_sockfd;
+    client->writable.owner       = client;
+    client->writable.events      = 0;
+    client->writable.in_flight   = 0;
+    client->writable.next_paused = NULL;
+    client->paused               = NULL;
+    client->paused_transfers     = NULL;
+    client->closing              = 0;
+    client->prev                 = NULL;
+    client->next                 = loop->clients;
+    metrics_adjust(&loop->metrics->connection_memory, (int64_t)loop->client_slab.object_size);
+
+    if(client_addr->ss_family == AF_INET)
+    {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)client_addr)->sin_addr, client->peer, sizeof(client->peer));
+    }
+    else if(client_addr->ss_family == AF_INET6)
+    {
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)client_addr)->sin6_addr, client->peer, sizeof(client->peer));
+    }
+    else
+    {
+        pid_t pid;
+
+        describe_local_peer(client_sockfd, client_addr, client->peer, sizeof(client->peer), &pid);
+    }
+
+    if(loop->clients != NULL)
+    {
+        loop->clients->prev = client;
+    }
+
+    loop->clients = client;
+    event_loop_watch(loop, &client->source, EPOLLIN, EPOLL_CTL_ADD);
+}
+
+/**
+ * Receives what a readable client has sent and runs every complete request in it. Partial
+ * requests wait in the client's buffer for the rest to arrive. The first byte tells a legacy
+ * request apart from the start of a session.
+ * @param loop   the event loop state
+ * @param client the readable client
+ */
+static void event_loop_read_client(struct event_loop *loop, struct client_connection *client)
+{
+    ssize_t bytes_received;
+
+    event_loop_attach_buffer(loop, client);
+    bytes_received = frame_parser_fill(&client->parser, client->source.fd, MSG_DONTWAIT);
+
+    if(bytes_received == -1 && (errno == EAGAIN || errno == EINTR))
+    {
+        return;
+    }
+
+    event_loop_parse_client(loop, client, bytes_received);
+}
+
+/**
+ * Runs every complete request received from a client so far, or starts closing the client
+ * if it hung up.
+ * @param loop           the event loop state
+ * @param client         the client
+ * @param bytes_received what the last receive returned, 0 or less on EOF or error
+ */
+static void event_loop_parse_client(struct event_loop *loop, struct client_connection *client, ssize_t bytes_received)
+{
+    struct parsed_frame frame;
+    int                 result;
+
+    result = PARSE_ERROR;
+
+    if(bytes_received > 0)
+    {
+        // Stop if a reply fails and the client is closed part way through, or is only left to drain
+        while(client->source.fd != -1 && !client->closing && (result = frame_parser_next(&client->parser, client->protocol, &frame)) > PARSE_INCOMPLETE)
+        {
+            if(result == PARSE_SESSION)
+            {
+                client->protocol = PROTOCOL_SESSION;
+            }
+            else if(client->protocol == PROTOCOL_UNKNOWN)
+            {
+                log_event(LOG_DEBUG, &(struct log_fields){.present = LOG_PEER | LOG_COMMAND | LOG_BYTES, .peer = client->peer, .command = frame.payload, .bytes = frame.len}, "Received a command");
+                client->protocol = PROTOCOL_LEGACY;
+                metrics_record(loop->metrics, STAGE_READ, client->accepted);
+                event_loop_run_command(loop, client, 0, frame.payload, 0);
+            }
+            else if(frame.type == FRAME_COMPRESS)
+            {
+                event_loop_negotiate_compression(loop, client, &frame);
+            }
+            else if(frame.type == FRAME_USAGE)
+            {
+                event_loop_enable_usage(loop, client, &frame);
+            }
+            else if(frame.type == FRAME_COMMAND_TIMEOUT && frame.len >= sizeof(uint32_t))
+            {
+                uint32_t net_timeout;
+
+                memcpy(&net_timeout, frame.payload, sizeof(net_timeout));
+                log_event(LOG_DEBUG, &(struct log_fields){.present = LOG_PEER | LOG_COMMAND, .peer = client->peer, .command = &frame.payload[sizeof(net_timeout)]}, "Session command %" PRIu32 " with a timeout of %" PRIu32 " ms", frame.id, ntohl(net_timeout));
+                event_loop_run_command(loop, client, frame.id, &frame.payload[sizeof(net_timeout)], ntohl(net_timeout));
+            }
+            else if(frame.type == FRAME_PIPELINE && frame.len >= sizeof(uint32_t))
+            {
+                uint32_t net_timeout;
+
+                memcpy(&net_timeout, frame.payload, sizeof(net_timeout));
+                log_event(LOG_DEBUG, &(struct log_fields){.present = LOG_PEER, .peer = client->peer}, "Session pipeline %" PRIu32 " with a timeout of %" PRIu32 " ms", frame.id, ntohl(net_timeout));
+                event_loop_run_pipeline(loop, client, frame.id, &frame.payload[sizeof(net_timeout)], frame.len - sizeof(net_timeout), ntohl(net_timeout));
+            }
+            else if(frame.type == FRAME_BATCH && frame.len >= sizeof(uint32_t))
+            {
+                uint32_t net_timeout;
+
+                memcpy(&net_timeout, frame.payload, sizeof(net_timeout));
+                log_event(LOG_DEBUG, &(struct log_fields){.present = LOG_PEER, .peer = client->peer}, "Session batch %" PRIu32 " with a timeout of %" PRIu32 " ms", frame.id, ntohl(net_timeout));
+                event_loop_run_batch(loop, client, frame.id, &frame.payload[sizeof(net_timeout)], frame.len - sizeof(net_timeout), ntohl(net_timeout));
+            }
+            else if(frame.type == FRAME_FETCH && frame.len > FETCH_HEADER_LEN)
+            {
+                log_event(LOG_DEBUG, &(struct log_fields){.present = LOG_PEER | LOG_COMMAND, .peer = client->peer, .command = &frame.payload[FETCH_HEADER_LEN]}, "Session fetch %" PRIu32, frame.id);
+                event_loop_run_fetch(loop, client, frame.id, frame.payload, frame.len);
+            }
+            else if(frame.type != FRAME_COMMAND)
+            {
+                event_loop_reply_error(loop, client, frame.id, "Unexpected frame type.");
+            }
+            else
+            {
+                log_event(LOG_DEBUG, &(struct log_fields){.present = LOG_PEER | LOG_COMMAND, .peer = client->peer, .command = frame.payload}, "Session command %" PRIu32, frame.id);
+                event_loop_run_command(loop, client, frame.id, frame.payload, 0);
+            }
+        }
+
+        if(client->source.fd != -1)
+        {
+            event_loop_detach_buffer(loop, client);
+        }
+    }
+
+    if(client->source.fd == -1 || result != PARSE_ERROR)
+    {
+        return;
+    }
+
+    // EOF, a read error or a malformed frame. Let the commands already sent finish before closing
+    if(client->active_requests > 0)
+    {
+        client->read_closed = 1;
+        event_loop_watch(loop, &client->source, 0, EPOLL_CTL_MOD);
+    }
+    else
+    {
+        event_loop_close_client(loop, client);
+    }
+}
+
+/**
+ * Gives a client a receive buffer if it does not have one yet.
+ * @param loop   the event loop state
+ * @param client the client about to receive
+ */
+static void event_loop_attach_buffer(struct event_loop *loop, struct client_connection *client)
+{
+    if(client->parser.buffer != NULL)
+    {
+        return;
+    }
+
+    client->parser.buffer = (char *)slab_alloc(&loop->buffer_slab);
+    metrics_adjust(&loop->metrics->connection_memory, (int64_t)loop->buffer_slab.object_size);
+}
+
+/**
+ * Gives a client's receive buffer back once everything in it has been handled, so an idle
+ * client only takes up its connection structure. A buffer io_uring is receiving into is kept.
+ * @param loop   the event loop state
+ * @param client the client
+ */
+static void event_loop_detach_buffer(struct event_loop *loop, struct client_connection *client)
+{
+    if(client->parser.buffer == NULL || (client->source.in_flight && !client->polled))
+    {
+        return;
+    }
+
+    frame_parser_restore(&client->parser);
+
+    if(client->parser.start != client->parser.end)
+    {
+        return;
+    }
+
+    slab_free(&loop->buffer_slab, client->parser.buffer);
+    metrics_adjust(&loop->metrics->connection_memory, -(int64_t)loop->buffer_slab.object_size);
+    client->parser.buffer = NULL;
+    client->parser.start  = 0;
+    client->parser.end    = 0;
+}
+
+/**
+ * Starts the child for a command. Legacy clients get the socket as the child's stdout,
+ * session clients get a pipe the server reads and frames. Session clients keep being
+ * read, so pipelined commands all run at once. Commands allowed by -c are answered from
+ * the result cache, or share a run of the same command line that is already going. Scripts
+ * for an interpreter given with -i go to an idle warm worker when there is one.
+ * @param loop    the event loop state
+ * @param client  the client that sent the command
+ * @param id      the request ID the output is tagged with
+ * @param buffer  the command line, split in place
+ * @param timeout milliseconds the client allows the command to run, 0 for the server's limit
+ */
+static void event_loop_run_command(struct event_loop *loop, struct client_connection *client, uint32_t id, char *buffer, uint32_t timeout)
+{
+    struct command_request    *request;
+    const struct cache_rule   *rule;
+    struct result_cache_entry *shared;
+    struct warm_worker        *worker;
+    char                     **args;
+    char                      *command;
+    char                      *key;
+    char                      *full_path;
+    char                       message[LINE_LENGTH];
+    int                        pipe_fds[2];
+    int                        passed_fd;
+    int                        output_fd;
+    pid_t                      pid;
+    uint64_t                   started;
+    int                        found;
+
+    command = NULL;
+    shared  = NULL;
+    metrics_count(&loop->metrics->requests, 1);
+
+    // Nothing from starting the last command is still in use, the child and the caches have their own copies
+    arena_reset(&loop->scratch);
+    args      = split_input(buffer, &command, &loop->scratch);
+    key       = (char *)arena_alloc(&loop->scratch, MAX_COMMAND_LEN + 1);
+    full_path = (char *)arena_alloc(&loop->scratch, LINE_LENGTH);
+
+    if(args == NULL || key == NULL || full_path == NULL)
+    {
+        event_loop_reply_error(loop, client, id, "Too many arguments.");
+        return;
+    }
+
+    if(command == NULL)
+    {
+        event_loop_reply_error(loop, client, id, "Empty command.");
+        return;
+    }
+
+    // Sending the files is cheaper than any cached or shared run of cat
+    if(loop->options->file_root_count > 0 && event_loop_serve_files(loop, client, id, args))
+    {
+        return;
+    }
+
+    rule = find_cache_rule(loop->options, command);
+
+    if(rule != NULL)
+    {
+        struct result_cache_entry *entry;
+
+        join_arguments(args, key, MAX_COMMAND_LEN + 1);
+        entry = result_cache_find(&loop->result_cache, key);
+
+        if(entry != NULL && entry->complete)
+        {
+            loop->result_cache.hits++;
+            metrics_count(&loop->metrics->result_cache_hits, 1);
+            event_loop_reply_cached(loop, client, id, entry);
+            return;
+        }
+
+        if(entry != NULL)
+        {
+            loop->result_cache.coalesced++;
+            metrics_count(&loop->metrics->result_cache_coalesced, 1);
+            event_loop_join_shared(loop, entry, client, id);
+            return;
+        }
+
+        loop->result_cache.misses++;
+        metrics_count(&loop->metrics->result_cache_misses, 1);
+    }
+
+    started = monotonic_microseconds();
+    found   = find_binary_executable(loop->path_cache, command, full_path) == 0;
+    metrics_record(loop->metrics, STAGE_LOOKUP, started);
+
+    if(!found)
+    {
+        metrics_count(&loop->metrics->commands_not_found, 1);
+        snprintf(message, sizeof(message), "Command %s was not found.", command);
+        event_loop_reply_error(loop, client, id, message);
+        return;
+    }
+
+    if(!event_loop_admit(loop, client, id, args, FRAME_COMMAND, NULL, 0, timeout))
+    {
+        return;
+    }
+
+    // Without room in the cache the command simply runs on its own
+    if(rule != NULL)
+    {
+        shared = result_cache_insert(&loop->result_cache, key, rule->ttl);
+    }
+
+    pipe_fds[0] = -1;
+    pipe_fds[1] = -1;
+    passed_fd   = -1;
+    output_fd   = client->source.fd;
+    pid         = 0;
+    started     = monotonic_microseconds();
+    worker      = warm_pool_find_idle(loop, command, args);
+
+    // A worker that cannot take the job is replaced, and this one runs the usual way
+    if(worker != NULL && warm_worker_dispatch(worker, args) == -1)
+    {
+        warm_worker_retire(loop, worker);
+        worker = NULL;
+    }
+
+    // Shared output goes to every waiting client, so it has to pass through the server
+    if(worker == NULL && (client->protocol == PROTOCOL_SESSION || shared != NULL))
+    {
+        if(pipe2(pipe_fds, O_CLOEXEC) == -1)
+        {
+            perror("pipe2");
+
+            if(shared != NULL)
+            {
+                result_cache_unlink(&loop->result_cache, shared);
+                result_cache_free_entry(shared);
+            }
+
+            metrics_count(&loop->metrics->spawn_failures, 1);
+            event_loop_reply_error(loop, client, id, "Unable to create output pipe.");
+            return;
+        }
+
+        output_fd = pipe_fds[1];
+    }
+    // A legacy client on a Unix socket sent its own output along, and the child writes straight to it
+    else if(worker == NULL && client->parser.passed_fd != -1)
+    {
+        passed_fd                = client->parser.passed_fd;
+        output_fd                = passed_fd;
+        client->parser.passed_fd = -1;
+    }
+
+    if(worker == NULL)
+    {
+        struct child_io io;
+
+        // A legacy child writes to the client's socket itself, and like any stdout it has to block
+        if(output_fd == client->source.fd)
+        {
+            int flags;
+
+            flags = fcntl(output_fd, F_GETFL);
+            if(flags != -1)
+            {
+                fcntl(output_fd, F_SETFL, flags & ~O_NONBLOCK);
+            }
+        }
+
+        io.input_fd  = -1;
+        io.output_fd = output_fd;
+        io.error_fd  = output_fd;
+        io.group     = 0;
+        started      = monotonic_microseconds();
+        pid          = spawn_process(loop->options->spawn_backend, full_path, args, &io);
+    }
+
+    metrics_record(loop->metrics, STAGE_SPAWN, started);
+
+    if(pipe_fds[1] != -1)
+    {
+        close(pipe_fds[1]);    // Only the child writes to the pipe
+    }
+
+    if(passed_fd != -1)
+    {
+        close(passed_fd);
+    }
+
+    if(pid == -1)
+    {
+        if(pipe_fds[0] != -1)
+        {
+            close(pipe_fds[0]);
+        }
+
+        if(shared != NULL)
+        {
+            result_cache_unlink(&loop->result_cache, shared);
+            result_cache_free_entry(shared);
+        }
+
+        metrics_count(&loop->metrics->spawn_failures, 1);
+        event_loop_reply_error(loop, client, id, "Unable to start command.");
+        return;
+    }
+
+    request         = event_loop_new_request(loop, shared == NULL ? client : NULL, id, pid, pipe_fds[0], started);
+    request->shared = shared;
+    request->group  = worker != NULL ? worker->pid : pid;
+    metrics_adjust(&loop->metrics->children_running, 1);
+    admission_start(loop, request, client);
+    event_loop_start_deadline(loop, request, timeout);
+
+    // The worker reports when the job is done, there is no child of the server to reap
+    if(worker != NULL)
+    {
+        worker->request = request;
+        metrics_count(&loop->metrics->warm_requests, 1);
+    }
+    else
+    {
+        request->next = loop->running;
+        loop->running = request;
+    }
+
+    if(shared != NULL)
+    {
+        // The client that started the run is just its first waiter
+        event_loop_join_shared(loop, shared, client, id);
+    }
+    else
+    {
+        client->active_requests++;
+    }
+
+    if(request->output.fd != -1)
+    {
+        event_loop_watch(loop, &request->output, EPOLLIN, EPOLL_CTL_ADD);
+    }
+    else if(client->protocol != PROTOCOL_SESSION)
+    {
+        // The child or warm worker owns the legacy client's output, all that is left to notice is a hang up
+        event_loop_watch(loop, &client->source, EPOLLRDHUP, EPOLL_CTL_MOD);
+    }
+}
+
+/**
+ * Starts a pipeline sent as a FRAME_PIPELINE. Every stage is spawned straight from its
+ * arguments, with no shell in between, and each one's stdout is piped into the next one's
+ * stdin. The last stage's stdout and every stage's stderr go to the client like a command's
+ * output. The stages share one process group, so a timeout or cancellation stops them all,
+ * and the pipeline takes a single slot under the admission limits. Pipelines are never
+ * cached or given to warm workers.
+ * @param loop    the event loop state
+ * @param client  the session client that sent the pipeline
+ * @param id      the request ID the output is tagged with
+ * @param payload the stages, each one's arguments NUL-terminated and closed by an empty one
+ * @param len     the length of the stages in bytes
+ * @param timeout milliseconds the client allows the pipeline to run, 0 for the server's limit
+ */
+static void event_loop_run_pipeline(struct event_loop *loop, struct client_connection *client, uint32_t id, char *payload, size_t len, uint32_t timeout)
+{
+    struct command_request *request;
+    struct pipeline_stage  *stages;
+    char                  **stage_args[MAX_PIPELINE_STAGES];
+    char                   *full_paths[MAX_PIPELINE_STAGES];
+    char                    full_path[LINE_LENGTH];
+    char                    message[LINE_LENGTH];
+    struct child_io         io;
+    int                     output_fds[2];
+    size_t                  stage_count;
+    size_t                  started_count;
+    uint64_t                started;
+
+    metrics_count(&loop->metrics->requests, 1);
+    arena_reset(&loop->scratch);
+    stage_count = split_pipeline(payload, len, stage_args, &loop->scratch);
+
+    if(stage_count == 0)
+    {
+        event_loop_reply_error(loop, client, id, "Malformed pipeline.");
+        return;
+    }
+
+    // Every stage has to exist before any of them is started
+    for(size_t i = 0; i < stage_count; i++)
+    {
+        int found;
+
+        started = monotonic_microseconds();
+        found   = find_binary_executable(loop->path_cache, stage_args[i][0], full_path) == 0;
+        metrics_record(loop->metrics, STAGE_LOOKUP, started);
+
+        if(!found)
+        {
+            metrics_count(&loop->metrics->commands_not_found, 1);
+            snprintf(message, sizeof(message), "Command %s was not found.", stage_args[i][0]);
+            event_loop_reply_error(loop, client, id, message);
+            return;
+        }
+
+        full_paths[i] = (char *)arena_alloc(&loop->scratch, strlen(full_path) + 1);
+
+        if(full_paths[i] == NULL)
+        {
+            event_loop_reply_error(loop, client, id, "Too many arguments.");
+            return;
+        }
+
+        strcpy(full_paths[i], full_path);
+    }
+
+    if(!event_loop_admit(loop, client, id, NULL, FRAME_PIPELINE, payload, len, timeout))
+    {
+        return;
+    }
+
+    if(pipe2(output_fds, O_CLOEXEC) == -1)
+    {
+        perror("pipe2");
+        metrics_count(&loop->metrics->spawn_failures, 1);
+        event_loop_reply_error(loop, client, id, "Unable to create output pipe.");
+        return;
+    }
+
+    stages = (struct pipeline_stage *)malloc(stage_count * sizeof(*stages));
+
+    if(stages == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    io.input_fd   = -1;
+    io.error_fd   = output_fds[1];
+    io.group      = 0;
+    started       = monotonic_microseconds();
+    started_count = 0;
+
+    while(started_count < stage_count)
+    {
+        int stage_fds[2];
+
+        stage_fds[0] = -1;
+        stage_fds[1] = -1;
+
+        if(started_count + 1 < stage_count && pipe2(stage_fds, O_CLOEXEC) == -1)
+        {
+            perror("pipe2");
+            break;
+        }
+
+        io.output_fd                    = started_count + 1 < stage_count ? stage_fds[1] : output_fds[1];
+        stages[started_count].pid       = spawn_process(loop->options->spawn_backend, full_paths[started_count], stage_args[started_count], &io);
+        stages[started_count].exit_code = 0;
+        stages[started_count].exited    = 0;
+
+        // The stages keep their own copies of the pipe between them
+        if(io.input_fd != -1)
+        {
+            close(io.input_fd);
+        }
+
+        if(stage_fds[1] != -1)
+        {
+            close(stage_fds[1]);
+        }
+
+        io.input_fd = stage_fds[0];
+
+        if(stages[started_count].pid == -1)
+        {
+            break;
+        }
+
+        if(io.group == 0)
+        {
+            io.group = stages[0].pid;
+        }
+
+        started_count++;
+    }
+
+    metrics_record(loop->metrics, STAGE_SPAWN, started);
+    close(output_fds[1]);    // Only the stages write to the pipe
+
+    if(io.input_fd != -1)
+    {
+        close(io.input_fd);
+    }
+
+    if(started_count < stage_count)
+    {
+        // The stages already started are reaped like any child nobody is waiting for
+        if(io.group != 0)
+        {
+            kill(-io.group, SIGKILL);
+        }
+
+        close(output_fds[0]);
+        free(stages);
+        metrics_count(&loop->metrics->spawn_failures, 1);
+        event_loop_reply_error(loop, client, id, "Unable to start command.");
+        return;
+    }
+
+    log_event(LOG_DEBUG, &(struct log_fields){.present = LOG_PEER | LOG_PID, .peer = client->peer, .pid = io.group}, "Pipeline %" PRIu32 " started %zu stages", id, stage_count);
+    request                 = event_loop_new_request(loop, client, id, stages[stage_count - 1].pid, output_fds[0], started);
+    request->group          = io.group;
+    request->stages         = stages;
+    request->stage_count    = stage_count;
+    request->stages_running = stage_count;
+    request->next           = loop->running;
+    loop->running           = request;
+    metrics_adjust(&loop->metrics->children_running, (int64_t)stage_count);
+    admission_start(loop, request, client);
+    event_loop_start_deadline(loop, request, timeout);
+    client->active_requests++;
+    event_loop_watch(loop, &request->output, EPOLLIN, EPOLL_CTL_ADD);
+}
+
+/**
+ * Allocates a request for a child that has just been started, running on its own with no
+ * deadline yet.
+ * @param loop      the event loop state
+ * @param client    the client the output goes to, NULL for a shared run
+ * @param id        the request ID the output is tagged with
+ * @param pid       the child, or the last stage of a pipeline
+ * @param output_fd the pipe the output is read from, -1 if the child writes to the client itself
+ * @param started   monotonic microseconds taken before the child was spawned, so its run time includes the spawn
+ * @return          the request
+ */
+static struct command_request *event_loop_new_request(struct event_loop *loop, struct client_connection *client, uint32_t id, pid_t pid, int output_fd, uint64_t started)
+{
+    struct command_request *request;
+
+    // Slab objects are not cleared, so every field is set here
+    request                     = (struct command_request *)slab_alloc(&loop->request_slab);
+    request->output.type        = SOURCE_OUTPUT;
+    request->output.fd          = output_fd;
+    request->output.owner       = request;
+    request->output.events      = 0;
+    request->output.in_flight   = 0;
+    request->output.next_paused = NULL;
+    request->client             = client;
+    request->id                 = id;
+    request->pid                = pid;
+    request->exited             = 0;
+    request->exit_code          = 0;
+    request->copy_output        = 0;
+    request->bytes_forwarded    = 0;
+    request->started            = started;
+    request->reaped             = 0;
+    memset(&request->usage, 0, sizeof(request->usage));
+#if defined(HAVE_ZLIB)
+    request->deflating          = 0;
+#endif
+    request->shared             = NULL;
+    request->admitted           = 0;
+    request->peer               = NULL;
+    request->group              = pid;
+    request->deadline           = 0;
+    request->signalled          = 0;
+    request->timed_out          = 0;
+    request->stages             = NULL;
+    request->stage_count        = 0;
+    request->stages_running     = 0;
+    request->batch              = NULL;
+    request->batch_index        = 0;
+    request->next               = NULL;
+
+    return request;
+}
+
+/**
+ * Sets the deadline of a request that has just started.
+ * @param loop    the event loop state
+ * @param request the request
+ * @param timeout milliseconds the client allows it to run, 0 for the server's limit
+ */
+static void event_loop_start_deadline(struct event_loop *loop, struct command_request *request, uint32_t timeout)
+{
+    // Clients may ask for less time than the server allows, never for more
+    if(loop->options->max_timeout > 0 && (timeout == 0 || timeout > loop->options->max_timeout))
+    {
+        timeout = loop->options->max_timeout;
+    }
+
+    if(timeout > 0)
+    {
+        event_loop_set_deadline(loop, request, request->started + (uint64_t)timeout * MICROSECONDS_PER_MILLISECOND);
+    }
+}
+
+/**
+ * Reports a request that could not be run. Legacy clients get the message as their output
+ * and are closed, session clients get an error frame and can send the next command.
+ * @param loop    the event loop state
+ * @param client  the client to reply to
+ * @param id      the ID of the failed request
+ * @param message the error message
+ */
+static void event_loop_reply_error(struct event_loop *loop, struct client_connection *client, uint32_t id, const char *message)
+{
+    if(client->protocol == PROTOCOL_SESSION)
+    {
+        if(!client->write_failed && event_loop_send_frame(loop, client, FRAME_ERROR, id, message, strlen(message)) == -1)
+        {
+            client->write_failed = 1;
+        }
+
+        if(client->write_failed && client->active_requests == 0)
+        {
+            event_loop_close_client(loop, client);
+        }
+
+        return;
+    }
+
+    dprintf(client->source.fd, "%s\n", message);
+    event_loop_close_client(loop, client);
+}
+
+/**
+ * Answers a request from a result that is still fresh, without running anything.
+ * @param loop   the event loop state
+ * @param client the client that sent the request
+ * @param id     the ID of the request
+ * @param entry  the cached result
+ */
+static void event_loop_reply_cached(struct event_loop *loop, struct client_connection *client, uint32_t id, const struct result_cache_entry *entry)
+{
+    client->active_requests++;
+    event_loop_send_output(loop, client, id, entry->output, entry->output_len);
+    event_loop_end_reply(loop, client, id, entry->exit_code, NULL);
+}
+
+/**
+ * Adds a request to a run of the same command line. It gets the output collected so far
+ * straight away and the rest as it arrives.
+ * @param loop   the event loop state
+ * @param entry  the entry of the run
+ * @param client the client that sent the request
+ * @param id     the ID of the request
+ */
+static void event_loop_join_shared(struct event_loop *loop, struct result_cache_entry *entry, struct client_connection *client, uint32_t id)
+{
+    struct result_waiter *waiter;
+
+    waiter = (struct result_waiter *)malloc(sizeof(*waiter));
+
+    if(waiter == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    waiter->client = client;
+    waiter->id     = id;
+    waiter->next   = entry->waiters;
+    entry->waiters = waiter;
+    client->active_requests++;
+    event_loop_send_output(loop, client, id, entry->output, entry->output_len);
+
+    if(client->protocol != PROTOCOL_SESSION)
+    {
+        // Like a legacy client whose child writes to it, nothing more is read from it
+        event_loop_watch(loop, &client->source, 0, EPOLL_CTL_MOD);
+    }
+}
+
+/**
+ * Sends a chunk of a shared run's output to every request waiting on it and keeps it for
+ * the ones that come later.
+ * @param loop    the event loop state
+ * @param request the shared run
+ * @param output  the output bytes
+ * @param len     the number of output bytes
+ */
+static void event_loop_share_output(struct event_loop *loop, struct command_request *request, const char *output, size_t len)
+{
+    struct result_cache_entry *entry;
+
+    entry                     = request->shared;
+    request->bytes_forwarded += len;
+
+    // Too long to keep: later requests run the command themselves, the ones already waiting keep getting its output
+    if(!entry->oversized && entry->output_len + len > RESULT_CACHE_MAX_OUTPUT)
+    {
+        free(entry->output);
+        entry->output     = NULL;
+        entry->output_len = 0;
+        entry->oversized  = 1;
+    }
+
+    if(!entry->oversized)
+    {
+        result_cache_append(entry, output, len);
+    }
+
+    for(const struct result_waiter *waiter = entry->waiters; waiter != NULL; waiter = waiter->next)
+    {
+        event_loop_send_output(loop, waiter->client, waiter->id, output, len);
+    }
+}
+
+/**
+ * Sends output that the server already holds: raw for a legacy client and as output frames
+ * for a session. Shared output is never compressed, since it is written once per waiter.
+ * @param loop   the event loop state
+ * @param client the client to send to
+ * @param id     the request ID the output is tagged with
+ * @param output the output bytes
+ * @param len    the number of output bytes
+ */
+static void event_loop_send_output(struct event_loop *loop, struct client_connection *client, uint32_t id, const char *output, size_t len)
+{
+    uint8_t frame[FRAME_HEADER_LEN + OUTPUT_CHUNK_LEN];
+
+    if(client->write_failed)
+    {
+        return;
+    }
+
+    if(client->protocol != PROTOCOL_SESSION)
+    {
+        event_loop_send(loop, client, output, len, 0);
+        return;
+    }
+
+    while(len > 0)
+    {
+        size_t chunk_len;
+
+        chunk_len = len < OUTPUT_CHUNK_LEN ? len : OUTPUT_CHUNK_LEN;
+        encode_frame_header(frame, FRAME_OUTPUT, id, chunk_len);
+        memcpy(&frame[FRAME_HEADER_LEN], output, chunk_len);
+
+        if(event_loop_send(loop, client, frame, FRAME_HEADER_LEN + chunk_len, 0) == -1)
+        {
+            return;
+        }
+
+        output += chunk_len;
+        len    -= chunk_len;
+    }
+}
+
+/**
+ * Sends bytes to a client without ever blocking the loop on it. What the socket has no room
+ * for is queued behind whatever was queued before it, and goes out as the client reads.
+ * While anything is queued, every later write is queued too so the stream stays in order.
+ * @param loop   the event loop state
+ * @param client the client to send to
+ * @param buffer the bytes to send
+ * @param len    the number of bytes to send
+ * @param flags  the send() flags, such as SEND_MORE
+ * @return       0 once the bytes are sent or queued, -1 if the client has failed
+ */
+static int event_loop_send(struct event_loop *loop, struct client_connection *client, const void *buffer, size_t len, int flags)
+{
+    const char           *bytes;
+    struct queued_output *block;
+
+    if(client->write_failed)
+    {
+        return -1;
+    }
+
+    bytes = (const char *)buffer;
+
+    while(client->queued == NULL && len > 0)
+    {
+        ssize_t bytes_sent;
+
+        // Sockets handed to a legacy child are blocking again, so the send has to say it
+        bytes_sent = send(client->source.fd, bytes, len, flags | MSG_DONTWAIT);
+
+        if(bytes_sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(bytes_sent == -1 && errno == EAGAIN)
+        {
+            break;
+        }
+
+        if(bytes_sent <= 0)
+        {
+            event_loop_fail_client(loop, client);
+            return -1;
+        }
+
+        bytes += bytes_sent;
+        len   -= (size_t)bytes_sent;
+    }
+
+    if(len == 0)
+    {
+        return 0;
+    }
+
+    // A client that reads nothing while its commands keep writing is not worth holding memory for
+    if(client->queued_bytes + len > MAX_QUEUED_OUTPUT)
+    {
+        log_event(LOG_WARN, &(struct log_fields){.present = LOG_PEER, .peer = client->peer}, "Client stopped reading with %zu bytes queued, dropping it", client->queued_bytes);
+        event_loop_fail_client(loop, client);
+        return -1;
+    }
+
+    block = client->queued_tail;
+
+    if(block == NULL || block->capacity - block->end < len)
+    {
+        size_t capacity;
+
+        capacity = len > OUTPUT_BLOCK_LEN ? len : OUTPUT_BLOCK_LEN;
+        block    = (struct queued_output *)malloc(sizeof(*block) + capacity);
+
+        if(block == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+
+        block->next     = NULL;
+        block->start    = 0;
+        block->end      = 0;
+        block->capacity = capacity;
+
+        if(client->queued_tail != NULL)
+        {
+            client->queued_tail->next = block;
+        }
+        else
+        {
+            client->queued = block;
+            event_loop_watch_writable(loop, client, EPOLLOUT);
+        }
+
+        client->queued_tail = block;
+    }
+
+    memcpy(&block->data[block->end], bytes, len);
+    block->end           += len;
+    client->queued_bytes += len;
+
+    return 0;
+}
+
+/**
+ * Sends exactly len bytes read from a pipe or a file to a client through a buffer, queuing
+ * what the socket has no room for like event_loop_send().
+ * @param loop   the event loop state
+ * @param client the client to send to
+ * @param fd     the pipe or file to read from, holding at least len bytes
+ * @param offset where to read the file from, moved past what was read, or NULL to read a pipe
+ * @param len    the number of bytes to send
+ * @return       0 on success, -1 if the bytes could not be read or the client has failed
+ */
+static int event_loop_send_from(struct event_loop *loop, struct client_connection *client, int fd, off_t *offset, size_t len)
+{
+    char buffer[OUTPUT_CHUNK_LEN];
+
+    while(len > 0)
+    {
+        ssize_t bytes_read;
+        size_t  wanted;
+
+        wanted     = len < sizeof(buffer) ? len : sizeof(buffer);
+        bytes_read = offset != NULL ? pread(fd, buffer, wanted, *offset) : read(fd, buffer, wanted);
+
+        if(bytes_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(bytes_read <= 0 || event_loop_send(loop, client, buffer, (size_t)bytes_read, 0) == -1)
+        {
+            return -1;
+        }
+
+        if(offset != NULL)
+        {
+            *offset += bytes_read;
+        }
+
+        len -= (size_t)bytes_read;
+    }
+
+    return 0;
+}
+
+/**
+ * Sends one session frame with event_loop_send(). The header and payload go out in a single
+ * send so small frames are not split across segments.
+ * @param loop    the event loop state
+ * @param client  the session to send to
+ * @param type    the frame type
+ * @param id      the ID of the request the frame belongs to
+ * @param payload the payload bytes
+ * @param len     the payload length, at most LINE_LENGTH
+ * @return        0 on success, -1 on error
+ */
+static int event_loop_send_frame(struct event_loop *loop, struct client_connection *client, uint8_t type, uint32_t id, const void *payload, size_t len)
+{
+    uint8_t frame[FRAME_HEADER_LEN + LINE_LENGTH];
+
+    if(len > LINE_LENGTH)
+    {
+        return -1;
+    }
+
+    encode_frame_header(frame, type, id, len);
+    memcpy(&frame[FRAME_HEADER_LEN], payload, len);
+
+    return event_loop_send(loop, client, frame, FRAME_HEADER_LEN + len, 0);
+}
+
+/**
+ * Sends the trailer that marks the end of a command's output.
+ * @param loop      the event loop state
+ * @param client    the session to send to
+ * @param id        the ID of the finished request
+ * @param exit_code the exit code of the command
+ * @return          0 on success, -1 on error
+ */
+static int event_loop_send_exit(struct event_loop *loop, struct client_connection *client, uint32_t id, int exit_code)
+{
+    uint32_t net_code;
+
+    net_code = htonl((uint32_t)exit_code);
+
+    return event_loop_send_frame(loop, client, FRAME_EXIT, id, &net_code, sizeof(net_code));
+}
+
+/**
+ * Sends the trailer that marks the end of a pipeline's output.
+ * @param loop        the event loop state
+ * @param client      the session to send to
+ * @param id          the ID of the finished request
+ * @param stages      the pipeline's stages, in order
+ * @param stage_count the number of stages
+ * @return            0 on success, -1 on error
+ */
+static int event_loop_send_pipeline_exit(struct event_loop *loop, struct client_connection *client, uint32_t id, const struct pipeline_stage *stages, size_t stage_count)
+{
+    uint32_t net_codes[MAX_PIPELINE_STAGES];
+
+    for(size_t i = 0; i < stage_count; i++)
+    {
+        net_codes[i] = htonl((uint32_t)stages[i].exit_code);
+    }
+
+    return event_loop_send_frame(loop, client, FRAME_PIPELINE_EXIT, id, net_codes, stage_count * sizeof(net_codes[0]));
+}
+
+/**
+ * Sends what a request used, ahead of its trailer, for sessions that asked with FRAME_USAGE.
+ * @param loop         the event loop state
+ * @param client       the session to send to
+ * @param id           the ID of the finished request
+ * @param wall         microseconds from spawning the request's first child to reaping its last
+ * @param usage        the request's children's resources, summed, with the largest max RSS
+ * @param output_bytes the output sent for the request
+ * @return             0 on success, -1 on error
+ */
+static int event_loop_send_usage(struct event_loop *loop, struct client_connection *client, uint32_t id, uint64_t wall, const struct rusage *usage, uint64_t output_bytes)
+{
+    uint64_t fields[USAGE_FIELDS];
+    uint32_t net_values[USAGE_LEN / sizeof(uint32_t)];
+
+    fields[0] = wall;
+    fields[1] = timeval_microseconds(&usage->ru_utime);
+    fields[2] = timeval_microseconds(&usage->ru_stime);
+    fields[3] = usage->ru_maxrss > 0 ? (uint64_t)usage->ru_maxrss : 0;
+    fields[4] = usage->ru_nvcsw > 0 ? (uint64_t)usage->ru_nvcsw : 0;
+    fields[5] = usage->ru_nivcsw > 0 ? (uint64_t)usage->ru_nivcsw : 0;
+    fields[6] = output_bytes;
+
+    // Every field goes high half first, like a fetch's offset
+    for(size_t i = 0; i < USAGE_FIELDS; i++)
+    {
+        net_values[2 * i]     = htonl((uint32_t)(fields[i] >> 32));
+        net_values[2 * i + 1] = htonl((uint32_t)fields[i]);
+    }
+
+    return event_loop_send_frame(loop, client, FRAME_USAGE, id, net_values, USAGE_LEN);
+}
+
+/**
+ * Sends what is queued for a client now that its socket has room. Once the queue is empty the
+ * client's pipes and file transfers go on, or a client that was closed meanwhile is closed for good.
+ * @param loop   the event loop state
+ * @param client the writable client
+ */
+static void event_loop_flush_client(struct event_loop *loop, struct client_connection *client)
+{
+    while(client->queued != NULL && !client->write_failed)
+    {
+        struct queued_output *block;
+        ssize_t               bytes_sent;
+
+        block      = client->queued;
+        bytes_sent = send(client->source.fd, &block->data[block->start], block->end - block->start, MSG_DONTWAIT);
+
+        if(bytes_sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(bytes_sent == -1 && errno == EAGAIN)
+        {
+            return;
+        }
+
+        if(bytes_sent <= 0)
+        {
+            break;
+        }
+
+        block->start         += (size_t)bytes_sent;
+        client->queued_bytes -= (size_t)bytes_sent;
+
+        if(block->start == block->end)
+        {
+            client->queued = block->next;
+            free(block);
+        }
+    }
+
+    if(client->queued != NULL || client->write_failed)
+    {
+        event_loop_fail_client(loop, client);
+        return;
+    }
+
+    client->queued_tail = NULL;
+    event_loop_watch_writable(loop, client, 0);
+
+    if(client->closing)
+    {
+        event_loop_close_client(loop, client);
+        return;
+    }
+
+    event_loop_resume_client(loop, client);
+}
+
+/**
+ * Gives up on sending to a client. What was queued is dropped, and its paused pipes and file
+ * transfers go on so they see the failure and wind down.
+ * @param loop   the event loop state
+ * @param client the client that could not be written to
+ */
+static void event_loop_fail_client(struct event_loop *loop, struct client_connection *client)
+{
+    client->write_failed = 1;
+    event_loop_discard_output(client);
+    event_loop_watch_writable(loop, client, 0);
+
+    if(client->closing)
+    {
+        event_loop_close_client(loop, client);
+        return;
+    }
+
+    event_loop_resume_client(loop, client);
+}
+
+/**
+ * Frees everything queued for a client.
+ * @param client the client
+ */
+static void event_loop_discard_output(struct client_connection *client)
+{
+    while(client->queued != NULL)
+    {
+        struct queued_output *block;
+
+        block          = client->queued;
+        client->queued = block->next;
+        free(block);
+    }
+
+    client->queued_tail  = NULL;
+    client->queued_bytes = 0;
+}
+
+/**
+ * Starts or stops waiting for room in a client's socket.
+ * @param loop   the event loop state
+ * @param client the client
+ * @param events EPOLLOUT to wait, 0 to stop
+ */
+static void event_loop_watch_writable(struct event_loop *loop, struct client_connection *client, uint32_t events)
+{
+#if defined(HAVE_IO_URING)
+    if(loop->ring.fd != -1)
+    {
+        // The receive in flight on the client's own source cannot wait for room as well
+        event_loop_watch(loop, &client->writable, events, EPOLL_CTL_MOD);
+        return;
+    }
+#endif
+
+    // epoll takes one registration per socket, which adds EPOLLOUT while the queue is not empty
+    (void)events;
+    event_loop_watch(loop, &client->source, client->source.events, EPOLL_CTL_MOD);
+}
+
+/**
+ * Stops reading a pipe after a chunk of a request's output if a client it goes to has output
+ * queued, until that client's queue has drained. A shared run waits for its waiters one at a
+ * time this way. A source already paused or at end of file is left alone.
+ * @param loop    the event loop state
+ * @param request the request the output belongs to
+ * @param source  the pipe
+ */
+static void event_loop_pause_source(struct event_loop *loop, const struct command_request *request, struct event_source *source)
+{
+    struct client_connection *client;
+
+    client = request->client;
+
+    if(request->shared != NULL)
+    {
+        for(const struct result_waiter *waiter = request->shared->waiters; waiter != NULL && client == NULL; waiter = waiter->next)
+        {
+            client = waiter->client->queued != NULL ? waiter->client : NULL;
+        }
+    }
+
+    if(client == NULL || client->queued == NULL || source->events == 0)
+    {
+        return;
+    }
+
+    event_loop_watch(loop, source, 0, EPOLL_CTL_MOD);
+    source->next_paused = client->paused;
+    client->paused      = source;
+}
+
+/**
+ * Reads a paused pipe again straight away, for a warm worker whose job ended while its output
+ * was paused and which the next job must find watched.
+ * @param loop    the event loop state
+ * @param request the request the pipe was paused for
+ * @param source  the pipe
+ */
+static void event_loop_resume_source(struct event_loop *loop, const struct command_request *request, struct event_source *source)
+{
+    const struct result_waiter *waiter;
+    struct client_connection   *client;
+
+    waiter = request->shared != NULL ? request->shared->waiters : NULL;
+    client = request->shared != NULL ? NULL : request->client;
+
+    // A shared run's pipe is paused for whichever waiter was behind
+    while(client != NULL || waiter != NULL)
+    {
+        if(client == NULL)
+        {
+            client = waiter->client;
+            waiter = waiter->next;
+        }
+
+        for(struct event_source **link = &client->paused; *link != NULL; link = &(*link)->next_paused)
+        {
+            if(*link == source)
+            {
+                *link               = source->next_paused;
+                source->next_paused = NULL;
+                event_loop_watch(loop, source, EPOLLIN, EPOLL_CTL_MOD);
+                return;
+            }
+        }
+
+        client = NULL;
+    }
+}
+
+/**
+ * Reads every pipe paused for a client again, and puts its paused file transfers back on
+ * the loop's list.
+ * @param loop   the event loop state
+ * @param client the client whose queue has drained or who failed
+ */
+static void event_loop_resume_client(struct event_loop *loop, struct client_connection *client)
+{
+    while(client->paused != NULL)
+    {
+        struct event_source *source;
+
+        source              = client->paused;
+        client->paused      = source->next_paused;
+        source->next_paused = NULL;
+        event_loop_watch(loop, source, EPOLLIN, EPOLL_CTL_MOD);
+    }
+
+    while(client->paused_transfers != NULL)
+    {
+        struct file_transfer *transfer;
+
+        transfer                 = client->paused_transfers;
+        client->paused_transfers = transfer->next;
+        transfer->next           = loop->transfers;
+        loop->transfers          = transfer;
+    }
+}
+
+/**
+ * Answers a session's request for compressed output. The payload names an algorithm and a
+ * level, the reply names the algorithm every later output frame of the session may use,
+ * which is COMPRESSION_NONE if the server was built without it.
+ * @param loop   the event loop state
+ * @param client the session asking
+ * @param frame  the compression request
+ */
+static void event_loop_negotiate_compression(struct event_loop *loop, struct client_connection *client, const struct parsed_frame *frame)
+{
+    uint8_t algorithm;
+
+    algorithm = COMPRESSION_NONE;
+
+#if defined(HAVE_ZLIB)
+    if(frame->len >= 2 && (uint8_t)frame->payload[0] == COMPRESSION_DEFLATE)
+    {
+        int level;
+
+        level                     = (uint8_t)frame->payload[1];
+        algorithm                 = COMPRESSION_DEFLATE;
+        client->compression_level = level < Z_BEST_SPEED ? Z_BEST_SPEED : (level > Z_BEST_COMPRESSION ? Z_BEST_COMPRESSION : level);
+    }
+#endif
+
+    if(!client->write_failed && event_loop_send_frame(loop, client, FRAME_COMPRESS, frame->id, &algorithm, sizeof(algorithm)) == -1)
+    {
+        client->write_failed = 1;
+    }
+
+    if(client->write_failed && client->active_requests == 0)
+    {
+        event_loop_close_client(loop, client);
+    }
+}
+
+/**
+ * Turns on usage reports for the rest of a session. Every later request that runs something
+ * gets a FRAME_USAGE ahead of its trailer, and the empty reply tells the client the server
+ * knows the frame.
+ * @param loop   the event loop state
+ * @param client the session asking
+ * @param frame  the usage request
+ */
+static void event_loop_enable_usage(struct event_loop *loop, struct client_connection *client, const struct parsed_frame *frame)
+{
+    client->report_usage = 1;
+
+    if(!client->write_failed && event_loop_send_frame(loop, client, FRAME_USAGE, frame->id, "", 0) == -1)
+    {
+        client->write_failed = 1;
+    }
+
+    if(client->write_failed && client->active_requests == 0)
+    {
+        event_loop_close_client(loop, client);
+    }
+}
+
+/**
+ * Moves one chunk of a child's output from its pipe to the client as an output frame.
+ * The bytes are spliced across when possible and copied through a buffer otherwise. Once
+ * a client it goes to has output queued, the pipe is not read again until the queue has
+ * drained, so a client that stops reading only holds up the commands it is waiting on.
+ * @param loop    the event loop state
+ * @param request the request whose pipe is readable
+ * @return        1 if the pipe is still open, 0 if it was closed and the request may be gone
+ */
+static int event_loop_forward_output(struct event_loop *loop, struct command_request *request)
+{
+    uint8_t frame[FRAME_HEADER_LEN + OUTPUT_CHUNK_LEN];
+    ssize_t bytes_read;
+
+    // Compressed, shared and batched output have to pass through userspace anyway, and spliced bytes must not overtake queued ones
+    if(request->shared == NULL && request->batch == NULL && !request->copy_output && request->client->compression_level == 0 && request->client->queued == NULL && event_loop_splice_output(loop, request) == 0)
+    {
+        event_loop_pause_source(loop, request, &request->output);
+        return 1;
+    }
+
+    // Read straight into the frame so the header and payload go out in one write
+    bytes_read = read(request->output.fd, &frame[FRAME_HEADER_LEN], OUTPUT_CHUNK_LEN);
+
+    if(bytes_read == -1 && errno == EINTR)
+    {
+        return 1;
+    }
+
+    if(bytes_read <= 0)
+    {
+        event_loop_unwatch(loop, &request->output);
+
+        if(request->exited)
+        {
+            event_loop_finish_request(loop, request);
+        }
+
+        return 0;
+    }
+
+    event_loop_send_chunk(loop, request, frame, (size_t)bytes_read);
+    event_loop_pause_source(loop, request, &request->output);
+
+    return 1;
+}
+
+/**
+ * Sends a chunk of a request's output to whoever is waiting on it: the clients sharing the
+ * run, its batch's result, a session as an output frame, or a legacy client as it is.
+ * @param loop    the event loop state
+ * @param request the request the output belongs to
+ * @param frame   FRAME_HEADER_LEN free bytes for the header, followed by the output
+ * @param len     the number of output bytes
+ */
+static void event_loop_send_chunk(struct event_loop *loop, struct command_request *request, uint8_t *frame, size_t len)
+{
+    struct client_connection *client;
+
+    if(request->shared != NULL)
+    {
+        event_loop_share_output(loop, request, (const char *)&frame[FRAME_HEADER_LEN], len);
+        return;
+    }
+
+    if(request->batch != NULL)
+    {
+        request->bytes_forwarded += (uint64_t)len;
+        event_loop_batch_output(request->batch, request->batch_index, (const char *)&frame[FRAME_HEADER_LEN], len);
+        return;
+    }
+
+    client = request->client;
+
+    // Keep draining a client that went away so the child is never blocked on a full pipe, until it is stopped
+    if(client->write_failed)
+    {
+        event_loop_cancel_request(loop, request);
+        return;
+    }
+
+    // Only a warm worker's output reaches a legacy client through the server
+    if(client->protocol != PROTOCOL_SESSION)
+    {
+        if(event_loop_send(loop, client, &frame[FRAME_HEADER_LEN], len, 0) == -1)
+        {
+            client->write_failed = 1;
+            event_loop_cancel_request(loop, request);
+        }
+
+        request->bytes_forwarded += (uint64_t)len;
+        return;
+    }
+
+#if defined(HAVE_ZLIB)
+    if(client->compression_level > 0 && len >= loop->options->compress_threshold)
+    {
+        uint64_t compressed_len;
+
+        if(deflate_output(loop, request, &frame[FRAME_HEADER_LEN], len, &compressed_len) == -1)
+        {
+            client->write_failed = 1;
+            event_loop_cancel_request(loop, request);
+            return;
+        }
+
+        request->bytes_forwarded += (uint64_t)len;
+        metrics_count(&loop->metrics->compressed_bytes, compressed_len);
+        return;
+    }
+#endif
+
+    encode_frame_header(frame, FRAME_OUTPUT, request->id, len);
+
+    // Once the child has exited its exit trailer comes next, so with cork the two can share a segment.
+    // Nobody reads the output any more if this fails, so stop the command instead of draining it to the end.
+    if(event_loop_send(loop, client, frame, FRAME_HEADER_LEN + len, loop->options->tuning.cork && request->exited ? SEND_MORE : 0) == -1)
+    {
+        client->write_failed = 1;
+        event_loop_cancel_request(loop, request);
+        return;
+    }
+
+    request->bytes_forwarded += (uint64_t)len;
+}
+
+/**
+ * Forwards everything currently in a request's pipe as one output frame without copying it
+ * through userspace. The frame length has to be known before the payload is sent, so the
+ * pipe is sized with FIONREAD, the header is written and exactly that many bytes are spliced
+ * after it. Nothing else reads the pipe, so those bytes are guaranteed to still be there.
+ * Whatever the socket has no room for is copied into the client's queue to finish the frame.
+ * @param loop    the event loop state
+ * @param request the request whose pipe is readable
+ * @return        0 if the event was handled, -1 if the caller should read the pipe instead
+ */
+static int event_loop_splice_output(struct event_loop *loop, struct command_request *request)
+{
+    struct client_connection *client;
+    uint8_t                   header[FRAME_HEADER_LEN];
+    int                       available;
+    size_t                    remaining;
+
+    client = request->client;
+
+    // An empty readable pipe is end of file, and a dead client's output is just drained
+    if(client->write_failed || ioctl(request->output.fd, FIONREAD, &available) == -1 || available <= 0)
+    {
+        return -1;
+    }
+
+    remaining = (size_t)available;
+    encode_frame_header(header, FRAME_OUTPUT, request->id, remaining);
+
+    // The payload follows at once, so the header leaves in the same segment even with TCP_NODELAY
+    if(event_loop_send(loop, client, header, sizeof(header), SEND_MORE) == -1)
+    {
+        return 0;
+    }
+
+    // Nothing is spliced behind a header that had to be queued
+    while(remaining > 0 && client->queued == NULL)
+    {
+        ssize_t bytes_spliced;
+
+        bytes_spliced = splice(request->output.fd, NULL, client->source.fd, NULL, remaining, SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+
+        if(bytes_spliced == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if(bytes_spliced == -1 && errno == EAGAIN)
+        {
+            break;
+        }
+
+        if(bytes_spliced == -1 && (errno == EINVAL || errno == ENOSYS))
+        {
+            // This socket cannot be spliced to, finish the frame by copying and stop trying
+            request->copy_output = 1;
+            break;
+        }
+
+        if(bytes_spliced <= 0)
+        {
+            // The rest of the frame is lost, so the stream is unusable from here on
+            event_loop_fail_client(loop, client);
+            return 0;
+        }
+
+        remaining                -= (size_t)bytes_spliced;
+        request->bytes_forwarded += (uint64_t)bytes_spliced;
+    }
+
+    if(remaining > 0)
+    {
+        if(event_loop_send_from(loop, client, request->output.fd, NULL, remaining) == -1)
+        {
+            event_loop_fail_client(loop, client);
+            return 0;
+        }
+
+        request->bytes_forwarded += remaining;
+    }
+
+    return 0;
+}
+
+#if defined(HAVE_ZLIB)
+/**
+ * Compresses a chunk of output into the request's deflate stream and sends what comes out as
+ * compressed output frames. Each chunk is flushed to a byte boundary, so the client can
+ * inflate every frame as soon as it arrives, while the stream keeps its window from one
+ * chunk to the next and repetitive output compresses better the longer it runs.
+ * @param loop           the event loop state
+ * @param request        the request the output belongs to
+ * @param input          the output bytes
+ * @param len            the number of output bytes
+ * @param compressed_len where the number of compressed bytes sent is stored
+ * @return               0 on success, -1 if the stream failed or the client could not be written to
+ */
+static int deflate_output(struct event_loop *loop, struct command_request *request, const uint8_t *input, size_t len, uint64_t *compressed_len)
+{
+    uint8_t   frame[FRAME_HEADER_LEN + OUTPUT_CHUNK_LEN];
+    z_stream *stream;
+
+    *compressed_len = 0;
+
+    stream = &request->deflate;
+
+    if(!request->deflating)
+    {
+        // Requests come from the slab uncleared, and zlib only uses its defaults for Z_NULL
+        stream->zalloc = Z_NULL;
+        stream->zfree  = Z_NULL;
+        stream->opaque = Z_NULL;
+
+        if(deflateInit(stream, request->client->compression_level) != Z_OK)
+        {
+            return -1;
+        }
+
+        request->deflating = 1;
+    }
+
+    stream->next_in  = input;
+    stream->avail_in = (uInt)len;
+
+    // A full output buffer means deflate may have more to flush, so go again until it has room left
+    do
+    {
+        size_t produced;
+
+        stream->next_out  = &frame[FRAME_HEADER_LEN];
+        stream->avail_out = OUTPUT_CHUNK_LEN;
+
+        if(deflate(stream, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+        {
+            return -1;
+        }
+
+        produced = OUTPUT_CHUNK_LEN - stream->avail_out;
+
+        if(produced == 0)
+        {
+            continue;
+        }
+
+        encode_frame_header(frame, FRAME_OUTPUT_DEFLATE, request->id, produced);
+
+        if(event_loop_send(loop, request->client, frame, FRAME_HEADER_LEN + produced, 0) == -1)
+        {
+            return -1;
+        }
+
+        *compressed_len += produced;
+    } while(stream->avail_out == 0);
+
+    return 0;
+}
+#endif
+
+/**
+ * Reaps every child that has exited and finishes its request once its output is drained.
+ * @param loop the event loop state
+ */
+static void event_loop_reap(struct event_loop *loop)
+{
+    struct signalfd_siginfo info;
+    pid_t                   pid;
+    int                     status;
+    struct rusage           usage;
+
+    // Several exits can be coalesced into a single notification, so drain it and reap them all
+    while(read(loop->signal.fd, &info, sizeof(info)) == (ssize_t)sizeof(info))
+    {
+    }
+
+    while((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+    {
+        struct command_request **link;
+
+        for(link = &loop->running; *link != NULL; link = &(*link)->next)
+        {
+            struct command_request *request;
+
+            request = *link;
+
+            if(request->stages != NULL ? event_loop_reap_stage(request, pid, status) : request->pid == pid)
+            {
+                metrics_adjust(&loop->metrics->children_running, -1);
+                event_loop_account_child(loop, request, &usage);
+
+                // A pipeline is done once its last stage to exit has
+                if(request->stages_running == 0)
+                {
+                    int exit_code;
+
+                    exit_code = request->timed_out ? TIMEOUT_EXIT_CODE : request->stages != NULL ? request->stages[request->stage_count - 1].exit_code : exit_code_from_status(status);
+                    log_event(LOG_INFO, &(struct log_fields){.present = LOG_PID | LOG_DURATION | LOG_STATUS, .pid = pid, .duration = monotonic_microseconds() - request->started, .status = exit_code}, "Child process exited after %" PRIu64 " us of CPU, %ld KiB max RSS", timeval_microseconds(&request->usage.ru_utime) + timeval_microseconds(&request->usage.ru_stime), request->usage.ru_maxrss);
+                    event_loop_end_run(loop, link, exit_code);
+                }
+
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Records that a request's child, or the last of its pipeline's stages, has exited.
+ * The request is complete once its output has been forwarded too.
+ * @param loop      the event loop state
+ * @param link      where the request is linked into the running list
+ * @param exit_code what the request reports
+ */
+static void event_loop_end_run(struct event_loop *loop, struct command_request **link, int exit_code)
+{
+    struct command_request *request;
+
+    request            = *link;
+    *link              = request->next;
+    request->exited    = 1;
+    request->exit_code = exit_code;
+    request->deadline  = 0;
+    request->reaped    = monotonic_microseconds();
+    metrics_record(loop->metrics, STAGE_RUN, request->started);
+    admission_finish(loop, request);
+
+    if(request->output.fd == -1)
+    {
+        event_loop_finish_request(loop, request);
+    }
+}
+
+/**
+ * Records the exit of a pipeline's stage, if the child is one of them.
+ * @param request the pipeline
+ * @param pid     the child that exited
+ * @param status  the status returned by waitpid
+ * @return        non-zero if the child was one of the pipeline's stages
+ */
+static int event_loop_reap_stage(struct command_request *request, pid_t pid, int status)
+{
+    for(size_t i = 0; i < request->stage_count; i++)
+    {
+        struct pipeline_stage *stage;
+
+        stage = &request->stages[i];
+
+        if(stage->pid == pid && !stage->exited)
+        {
+            // Like a command, a stage the timeout stopped exits as timeout(1) would
+            stage->exited    = 1;
+            stage->exit_code = request->timed_out ? TIMEOUT_EXIT_CODE : exit_code_from_status(status);
+            request->stages_running--;
+            log_event(LOG_DEBUG, &(struct log_fields){.present = LOG_PID | LOG_STATUS, .pid = pid, .status = stage->exit_code}, "Pipeline %" PRIu32 " stage %zu exited", request->id, i);
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Adds what a reaped child used to its request, which a pipeline sums over its stages, and
+ * to the metrics.
+ * @param loop    the event loop state
+ * @param request the request the child ran for
+ * @param usage   what wait4 reported for the child
+ */
+static void event_loop_account_child(struct event_loop *loop, struct command_request *request, const struct rusage *usage)
+{
+    timeradd(&request->usage.ru_utime, &usage->ru_utime, &request->usage.ru_utime);
+    timeradd(&request->usage.ru_stime, &usage->ru_stime, &request->usage.ru_stime);
+    request->usage.ru_maxrss = usage->ru_maxrss > request->usage.ru_maxrss ? usage->ru_maxrss : request->usage.ru_maxrss;
+    request->usage.ru_nvcsw += usage->ru_nvcsw;
+    request->usage.ru_nivcsw += usage->ru_nivcsw;
+    metrics_record_usage(loop->metrics, usage);
+}
+
+/**
+ * Completes a request whose child has exited and whose output has been forwarded.
+ * @param loop    the event loop state
+ * @param request the finished request
+ */
+static void event_loop_finish_request(struct event_loop *loop, struct command_request *request)
+{
+    if(request->shared != NULL)
+    {
+        event_loop_finish_shared(loop, request);
+    }
+    else if(request->batch != NULL)
+    {
+        request->batch->running--;
+        metrics_record(loop->metrics, STAGE_DRAIN, request->reaped);
+        event_loop_batch_reply(loop, request->batch, request->batch_index, request->exit_code, request->reaped - request->started, request);
+        event_loop_batch_fill(loop, request->batch);
+    }
+    else
+    {
+        if(request->client->protocol == PROTOCOL_SESSION)
+        {
+            log_event(LOG_INFO, &(struct log_fields){.present = LOG_PEER | LOG_DURATION | LOG_BYTES | LOG_STATUS, .peer = request->client->peer, .duration = request->reaped - request->started, .bytes = request->bytes_forwarded, .status = request->exit_code}, "Request %" PRIu32 " finished", request->id);
+            metrics_record(loop->metrics, STAGE_DRAIN, request->reaped);
+            metrics_count(&loop->metrics->output_bytes, request->bytes_forwarded);
+        }
+
+        event_loop_end_reply(loop, request->client, request->id, request->exit_code, request);
+    }
+
+    event_loop_free_request(loop, request);
+}
+
+/**
+ * Completes every request waiting on a shared run, then keeps the result until it expires
+ * unless it was too long to keep.
+ * @param loop    the event loop state
+ * @param request the finished run
+ */
+static void event_loop_finish_shared(struct event_loop *loop, struct command_request *request)
+{
+    struct result_cache_entry *entry;
+    size_t                     answered;
+
+    entry    = request->shared;
+    answered = 0;
+    metrics_record(loop->metrics, STAGE_DRAIN, request->reaped);
+
+    while(entry->waiters != NULL)
+    {
+        struct result_waiter *waiter;
+
+        waiter         = entry->waiters;
+        entry->waiters = waiter->next;
+        event_loop_end_reply(loop, waiter->client, waiter->id, request->exit_code, NULL);
+        free(waiter);
+        answered++;
+    }
+
+    log_event(LOG_INFO, &(struct log_fields){.present = LOG_COMMAND | LOG_BYTES | LOG_STATUS, .command = entry->key, .bytes = request->bytes_forwarded, .status = request->exit_code}, "Shared run answered %zu requests", answered);
+
+    if(entry->oversized)
+    {
+        result_cache_unlink(&loop->result_cache, entry);
+        result_cache_free_entry(entry);
+        return;
+    }
+
+    entry->complete  = 1;
+    entry->exit_code = request->exit_code;
+    entry->expires   = monotonic_microseconds() + entry->ttl;
+}
+
+/**
+ * Ends one request's reply. Session clients get the exit trailer, and are closed once they
+ * have hung up and their last request is done. Legacy clients are closed straight away.
+ * @param loop      the event loop state
+ * @param client    the client the request came from
+ * @param id        the ID of the request
+ * @param exit_code the exit code of the command
+ * @param request   the finished run, whose stages a pipeline's trailer lists, or NULL
+ */
+static void event_loop_end_reply(struct event_loop *loop, struct client_connection *client, uint32_t id, int exit_code, const struct command_request *request)
+{
+    int result;
+
+    client->active_requests--;
+
+    if(client->protocol != PROTOCOL_SESSION)
+    {
+        event_loop_close_client(loop, client);
+        return;
+    }
+
+    // Cached and shared results ran nothing for this request, so they have no usage to report
+    if(!client->write_failed && client->report_usage && request != NULL && event_loop_send_usage(loop, client, id, request->reaped - request->started, &request->usage, request->bytes_forwarded) == -1)
+    {
+        client->write_failed = 1;
+    }
+
+    if(!client->write_failed)
+    {
+        if(request != NULL && request->stages != NULL)
+        {
+            result = event_loop_send_pipeline_exit(loop, client, id, request->stages, request->stage_count);
+        }
+        else
+        {
+            result = event_loop_send_exit(loop, client, id, exit_code);
+        }
+
+        client->write_failed = result == -1;
+    }
+
+    if((client->read_closed || client->write_failed) && client->active_requests == 0)
+    {
+        event_loop_close_client(loop, client);
+    }
+}
+
+/**
+ * Frees a request and its compression state.
+ * @param loop    the event loop state
+ * @param request the request to free
+ */
+static void event_loop_free_request(struct event_loop *loop, struct command_request *request)
+{
+#if defined(HAVE_ZLIB)
+    if(request->deflating)
+    {
+        deflateEnd(&request->deflate);
+    }
+#endif
+
+    free(request->stages);
+    slab_free(&loop->request_slab, request);
+}
+
+/**
+ * Closes a client socket. The structure is only freed after the current batch of events,
+ * since a later event in the batch may still point at it. A client with output queued is
+ * only closed once the queue has drained, and nothing more is read from it meanwhile.
+ * @param loop   the event loop state
+ * @param client the client to close
+ */
+static void event_loop_close_client(struct event_loop *loop, struct client_connection *client)
+{
+    if(client->queued != NULL && !client->write_failed)
+    {
+        client->closing     = 1;
+        client->read_closed = 1;
+        event_loop_watch(loop, &client->source, 0, EPOLL_CTL_MOD);
+        return;
+    }
+
+    metrics_adjust(&loop->metrics->connections_open, -1);
+    event_loop_discard_output(client);
+
+#if defined(HAVE_IO_URING)
+    // The poll for room holds the socket open, and nothing else would complete it
+    if(loop->ring.fd != -1 && client->writable.in_flight)
+    {
+        uring_cancel(loop, &client->writable);
+    }
+#endif
+
+    if(client->prev != NULL)
+    {
+        client->prev->next = client->next;
+    }
+    else
+    {
+        loop->clients = client->next;
+    }
+
+    if(client->next != NULL)
+    {
+        client->next->prev = client->prev;
+    }
+
+    event_loop_unwatch(loop, &client->source);
+    client->source.type   = -1;
+    client->writable.type = -1;
+    client->writable.fd   = -1;
+    client->next          = loop->closed;
+    loop->closed        = client;
+
+    // Sent for an output that never got to a child
+    if(client->parser.passed_fd != -1)
+    {
+        close(client->parser.passed_fd);
+        client->parser.passed_fd = -1;
+    }
+}
+
+/**
+ * Frees the clients and warm workers closed while handling the last batch of events.
+ * @param loop the event loop state
+ */
+static void event_loop_release(struct event_loop *loop)
+{
+    struct client_connection **link;
+    struct warm_worker       **worker_link;
+
+    link = &loop->closed;
+
+    while(*link != NULL)
+    {
+        struct client_connection *client;
+
+        client = *link;
+
+        // The kernel still owns part of this client until its last io_uring operation completes
+        if(client->source.in_flight || client->writable.in_flight)
+        {
+            link = &client->next;
+            continue;
+        }
+
+        *link = client->next;
+
+        if(client->parser.buffer != NULL)
+        {
+            slab_free(&loop->buffer_slab, client->parser.buffer);
+            metrics_adjust(&loop->metrics->connection_memory, -(int64_t)loop->buffer_slab.object_size);
+        }
+
+        slab_free(&loop->client_slab, client);
+        metrics_adjust(&loop->metrics->connection_memory, -(int64_t)loop->client_slab.object_size);
+    }
+
+    worker_link = &loop->retired;
+
+    while(*worker_link != NULL)
+    {
+        struct warm_worker *worker;
+
+        worker = *worker_link;
+
+        if(worker->control.in_flight || worker->output.in_flight)
+        {
+            worker_link = &worker->next;
+            continue;
+        }
+
+        *worker_link = worker->next;
+        free(worker);
+    }
+}
+
+/**
+ * Releases the event loop resources, the listening socket included. Children still running are left to finish on their own.
+ * @param loop the event loop state
+ */
+static void event_loop_destroy(struct event_loop *loop)
+{
+    // Transfers paused for a slow client are freed with the rest
+    for(struct client_connection *client = loop->clients; client != NULL; client = client->next)
+    {
+        while(client->paused_transfers != NULL)
+        {
+            struct file_transfer *transfer;
+
+            transfer                 = client->paused_transfers;
+            client->paused_transfers = transfer->next;
+            transfer->next           = loop->transfers;
+            loop->transfers          = transfer;
+        }
+    }
+
+    while(loop->transfers != NULL)
+    {
+        struct file_transfer *transfer;
+
+        transfer        = loop->transfers;
+        loop->transfers = transfer->next;
+
+        for(size_t i = 0; i < transfer->count; i++)
+        {
+            close(transfer->fds[i]);
+        }
+
+        free(transfer);
+    }
+
+    while(loop->running != NULL)
+    {
+        struct command_request *request;
+
+        request       = loop->running;
+        loop->running = request->next;
+
+        if(request->output.fd != -1)
+        {
+            event_loop_unwatch(loop, &request->output);
+        }
+
+        // The last of a batch's commands to be freed takes the batch with it
+        if(request->batch != NULL && --request->batch->running == 0)
+        {
+            event_loop_free_batch(request->batch);
+        }
+
+        event_loop_free_request(loop, request);
+    }
+
+    if(loop->options->cache_rule_count > 0)
+    {
+        log_event(LOG_INFO, NULL, "Result cache: %" PRIu64 " hits, %" PRIu64 " coalesced, %" PRIu64 " misses", loop->result_cache.hits, loop->result_cache.coalesced, loop->result_cache.misses);
+    }
+
+    result_cache_destroy(&loop->result_cache);
+    admission_destroy(&loop->admission);
+    warm_pools_stop(loop);
+
+    // Output still queued for a client goes with it
+    while(loop->clients != NULL)
+    {
+        event_loop_discard_output(loop->clients);
+        event_loop_close_client(loop, loop->clients);
+    }
+
+#if defined(HAVE_IO_URING)
+    if(loop->ring.fd != -1)
+    {
+        // Closing the ring cancels everything still in flight, so nothing completes into freed memory
+        uring_destroy(&loop->ring);
+
+        for(struct client_connection *client = loop->closed; client != NULL; client = client->next)
+        {
+            client->source.in_flight   = 0;
+            client->writable.in_flight = 0;
+        }
+
+        for(struct warm_worker *worker = loop->retired; worker != NULL; worker = worker->next)
+        {
+            worker->control.in_flight = 0;
+            worker->output.in_flight  = 0;
+        }
+    }
+#endif
+
+    event_loop_release(loop);
+    slab_destroy(&loop->client_slab);
+    slab_destroy(&loop->request_slab);
+    slab_destroy(&loop->buffer_slab);
+    arena_destroy(&loop->scratch);
+    close(loop->signal.fd);
+    close(loop->timer.fd);
+
+    // The new server keeps the listener either way, this one is leaving before it reported
+    if(loop->handoff.ready_fd != -1)
+    {
+        handoff_cancel(&loop->handoff);
+    }
+
+    // Draining closes the listener early
+    if(loop->listener.fd != -1)
+    {
+        socket_close(loop->listener.fd);
+    }
+
+#if defined(HAVE_OPENSSL)
+    if(loop->tls.fd != -1)
+    {
+        close(loop->tls.fd);
+
+        // A handshake still running writes its connection here, and closes it when that fails
+        if(atomic_load(&loop->options->tls->handshakes) == 0)
+        {
+            close(loop->tls_handoff_fd);
+        }
+    }
+#endif
+
+    if(loop->epoll_fd != -1)
+    {
+        close(loop->epoll_fd);
+    }
+}
+
+// Warm Worker Functions
+
+/**
+ * Starts the workers of every interpreter given with -i.
+ * @param loop the event loop state
+ */
+static void warm_pools_start(struct event_loop *loop)
+{
+    for(size_t i = 0; i < loop->options->warm_rule_count; i++)
+    {
+        struct warm_pool *pool;
+
+        pool       = &loop->warm_pools[i];
+        pool->rule = &loop->options->warm_rules[i];
+
+        if(find_binary_executable(loop->path_cache, pool->rule->interpreter, pool->full_path) != 0)
+        {
+            fprintf(stderr, "Warm interpreter %s was not found\n", pool->rule->interpreter);
+            exit(EXIT_FAILURE);
+        }
+
+        for(size_t slot = 0; slot < pool->rule->workers; slot++)
+        {
+            pool->workers[slot] = warm_worker_start(loop, pool, slot);
+        }
+
+        log_event(LOG_INFO, NULL, "Started %zu warm %s workers", pool->rule->workers, pool->full_path);
+    }
+}
+
+/**
+ * Stops every warm worker. Jobs still running are dropped like any other running child.
+ * @param loop the event loop state
+ */
+static void warm_pools_stop(struct event_loop *loop)
+{
+    for(size_t i = 0; i < loop->options->warm_rule_count; i++)
+    {
+        struct warm_pool *pool;
+
+        pool = &loop->warm_pools[i];
+
+        for(size_t slot = 0; slot < pool->rule->workers; slot++)
+        {
+            struct warm_worker *worker;
+
+            worker = pool->workers[slot];
+
+            if(worker == NULL)
+            {
+                continue;
+            }
+
+            if(worker->request != NULL)
+            {
+                event_loop_free_request(loop, worker->request);
+                worker->request = NULL;
+            }
+
+            // Out of its slot, so it is not replaced
+            pool->workers[slot] = NULL;
+            warm_worker_retire(loop, worker);
+        }
+    }
+}
+
+/**
+ * Starts one warm worker. Its control socket becomes fd 3 and the output pipe its stdout and
+ * stderr. The worker runs in its own session, without new privileges, and dies with the server.
+ * @param loop the event loop state
+ * @param pool the pool the worker belongs to
+ * @param slot the worker's place in the pool
+ * @return     the worker, or NULL if it could not be started
+ */
+static struct warm_worker *warm_worker_start(struct event_loop *loop, struct warm_pool *pool, size_t slot)
+{
+    struct warm_worker *worker;
+    int                 control_fds[2];
+    int                 pipe_fds[2];
+    int                 flags;
+    pid_t               pid;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, control_fds) == -1)
+    {
+        perror("socketpair");
+        return NULL;
+    }
+
+    if(pipe2(pipe_fds, O_CLOEXEC) == -1)
+    {
+        perror("pipe2");
+        close(control_fds[0]);
+        close(control_fds[1]);
+        return NULL;
+    }
+
+    // Only the server's end is non-blocking, a job writing faster than it is read just waits
+    flags = fcntl(pipe_fds[0], F_GETFL);
+    if(flags == -1 || fcntl(pipe_fds[0], F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+        close(control_fds[0]);
+        close(control_fds[1]);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return NULL;
+    }
+
+    pid = fork();
+
+    if(pid == -1)
+    {
+        perror("Error creating warm worker");
+        close(control_fds[0]);
+        close(control_fds[1]);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return NULL;
+    }
+
+    if(pid == 0)
+    {
+        sigset_t    empty_mask;
+        const char *argv[5];
+
+        sigemptyset(&empty_mask);
+        sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        set_pinned(0);
+
+        // dup2 clears close-on-exec on the copies, the originals are closed by execv
+        if(control_fds[1] == WARM_CONTROL_FD)
+        {
+            flags = fcntl(WARM_CONTROL_FD, F_GETFD);
+            if(flags == -1 || fcntl(WARM_CONTROL_FD, F_SETFD, flags & ~FD_CLOEXEC) == -1)
+            {
+                perror("fcntl");
+                _exit(EXIT_FAILURE);
+            }
+        }
+        else if(dup2(control_fds[1], WARM_CONTROL_FD) == -1)
+        {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+
+        if(dup2(pipe_fds[1], STDOUT_FILENO) == -1 || dup2(pipe_fds[1], STDERR_FILENO) == -1)
+        {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+
+        if(setsid() == -1 || prctl(PR_SET_PDEATHSIG, SIGKILL) == -1 || prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1)
+        {
+            perror("Error isolating warm worker");
+            _exit(EXIT_FAILURE);
+        }
+
+        argv[0] = pool->rule->interpreter;
+        argv[1] = "-c";
+        argv[2] = pool->rule->flavor == WARM_PYTHON ? warm_python_bootstrap : warm_bash_bootstrap;
+        argv[3] = pool->rule->flavor == WARM_PYTHON ? NULL : pool->rule->interpreter;    // bash takes it as $0
+        argv[4] = NULL;
+
+        // execv does not modify the arguments, it only predates const
+        execv(pool->full_path, (char *const *)(uintptr_t)argv);
+        perror("execv");
+        _exit(EXIT_FAILURE);
+    }
+
+    close(control_fds[1]);
+    close(pipe_fds[1]);
+
+    worker = (struct warm_worker *)calloc(1, sizeof(*worker));
+
+    if(worker == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    worker->control.type  = SOURCE_WARM_CONTROL;
+    worker->control.fd    = control_fds[0];
+    worker->control.owner = worker;
+    worker->output.type   = SOURCE_WARM_OUTPUT;
+    worker->output.fd     = pipe_fds[0];
+    worker->output.owner  = worker;
+    worker->pool          = pool;
+    worker->slot          = slot;
+    worker->pid           = pid;
+
+    event_loop_watch(loop, &worker->control, EPOLLIN, EPOLL_CTL_ADD);
+    event_loop_watch(loop, &worker->output, EPOLLIN, EPOLL_CTL_ADD);
+
+    return worker;
+}
+
+/**
+ * Finds a worker that can run a command right away. Only commands that name a warm
+ * interpreter and a script, without interpreter options, can be run by a worker.
+ * @param loop    the event loop state
+ * @param command the command name
+ * @param args    the command's arguments
+ * @return        an idle worker, or NULL if the command has to be started the usual way
+ */
+static struct warm_worker *warm_pool_find_idle(struct event_loop *loop, const char *command, char **args)
+{
+    if(args[1] == NULL || args[1][0] == '-')
+    {
+        return NULL;
+    }
+
+    for(size_t i = 0; i < loop->options->warm_rule_count; i++)
+    {
+        struct warm_pool *pool;
+
+        pool = &loop->warm_pools[i];
+
+        if(strcmp(pool->rule->interpreter, command) != 0)
+        {
+            continue;
+        }
+
+        for(size_t slot = 0; slot < pool->rule->workers; slot++)
+        {
+            if(pool->workers[slot] != NULL && pool->workers[slot]->request == NULL)
+            {
+                return pool->workers[slot];
+            }
+        }
+
+        return NULL;
+    }
+
+    return NULL;
+}
+
+/**
+ * Hands a job to a worker: the arguments, each NUL-terminated, then an empty one.
+ * @param worker the idle worker
+ * @param args   the command's arguments
+ * @return       0 on success, -1 if the worker could not be reached
+ */
+static int warm_worker_dispatch(struct warm_worker *worker, char **args)
+{
+    char   job[MAX_COMMAND_LEN + LINE_LENGTH];
+    size_t len;
+
+    len = 0;
+
+    for(size_t i = 0; args[i] != NULL; i++)
+    {
+        size_t arg_len;
+
+        arg_len = strlen(args[i]) + 1;
+
+        if(len + arg_len >= sizeof(job))
+        {
+            return -1;
+        }
+
+        memcpy(&job[len], args[i], arg_len);
+        len += arg_len;
+    }
+
+    job[len] = '\0';
+    len++;
+
+    return write_fully(worker->control.fd, job, len);
+}
+
+/**
+ * Reads what a worker reports on its control socket. An exit code ends the job running,
+ * end of file means the worker died and is replaced.
+ * @param loop   the event loop state
+ * @param worker the worker whose control socket is readable
+ */
+static void warm_worker_read_status(struct event_loop *loop, struct warm_worker *worker)
+{
+    ssize_t bytes_received;
+    char   *newline;
+
+    bytes_received = recv(worker->control.fd, &worker->status[worker->status_len], sizeof(worker->status) - worker->status_len - 1, MSG_DONTWAIT);
+
+    if(bytes_received == -1 && (errno == EAGAIN || errno == EINTR))
+    {
+        return;
+    }
+
+    if(bytes_received <= 0)
+    {
+        if(worker->request != NULL)
+        {
+            // Whatever the job wrote before the worker died still goes to the client
+            while(warm_worker_read_output(loop, worker))
+            {
+            }
+
+            log_event(LOG_WARN, &(struct log_fields){.present = LOG_PID, .pid = worker->pid}, "Warm %s worker died during a job", worker->pool->rule->interpreter);
+            warm_worker_finish_job(loop, worker, EXIT_FAILURE);
+        }
+
+        warm_worker_retire(loop, worker);
+        return;
+    }
+
+    worker->status_len                += (size_t)bytes_received;
+    worker->status[worker->status_len]  = '\0';
+    newline                             = strchr(worker->status, '\n');
+
+    if(newline == NULL)
+    {
+        // A worker never sends more than an exit code, anything longer means it is broken
+        if(worker->status_len == sizeof(worker->status) - 1)
+        {
+            warm_worker_retire(loop, worker);
+        }
+
+        return;
+    }
+
+    worker->status_len = 0;
+
+    if(worker->request == NULL)
+    {
+        warm_worker_retire(loop, worker);
+        return;
+    }
+
+    // The job has exited, so everything it wrote is already in the pipe
+    while(warm_worker_read_output(loop, worker))
+    {
+    }
+
+    warm_worker_finish_job(loop, worker, (int)strtol(worker->status, NULL, BASE_TEN));
+
+    if(worker->uses >= loop->options->warm_uses)
+    {
+        metrics_count(&loop->metrics->warm_recycles, 1);
+        warm_worker_retire(loop, worker);
+    }
+}
+
+/**
+ * Moves one chunk of output from a worker's pipe to the job's client. With no job running the
+ * output is dropped.
+ * @param loop   the event loop state
+ * @param worker the worker whose output pipe is readable
+ * @return       1 if there may be more to read, 0 once the pipe is empty or closed
+ */
+static int warm_worker_read_output(struct event_loop *loop, struct warm_worker *worker)
+{
+    uint8_t frame[FRAME_HEADER_LEN + OUTPUT_CHUNK_LEN];
+    ssize_t bytes_read;
+
+    bytes_read = read(worker->output.fd, &frame[FRAME_HEADER_LEN], OUTPUT_CHUNK_LEN);
+
+    if(bytes_read == -1 && errno == EINTR)
+    {
+        return 1;
+    }
+
+    if(bytes_read == 0)
+    {
+        // The worker is gone, its control socket reports it
+        event_loop_watch(loop, &worker->output, 0, EPOLL_CTL_MOD);
+        return 0;
+    }
+
+    if(bytes_read == -1)
+    {
+        return 0;
+    }
+
+    if(worker->request == NULL)
+    {
+        return 1;
+    }
+
+    event_loop_send_chunk(loop, worker->request, frame, (size_t)bytes_read);
+
+    // Draining the pipe once the job has exited reads on regardless, pausing only stops the events
+    event_loop_pause_source(loop, worker->request, &worker->output);
+
+    return 1;
+}
+
+/**
+ * Finishes a worker's job with the exit code it reported.
+ * @param loop      the event loop state
+ * @param worker    the worker that ran the job
+ * @param exit_code the exit code of the job
+ */
+static void warm_worker_finish_job(struct event_loop *loop, struct warm_worker *worker, int exit_code)
+{
+    struct command_request *request;
+
+    request            = worker->request;
+
+    // The next job's output must not wait on this job's clients
+    event_loop_resume_source(loop, request, &worker->output);
+
+    request->exited    = 1;
+    request->exit_code = request->timed_out ? TIMEOUT_EXIT_CODE : exit_code;
+    request->deadline  = 0;
+    request->reaped    = monotonic_microseconds();
+    worker->request    = NULL;
+    worker->uses++;
+    log_event(LOG_INFO, &(struct log_fields){.present = LOG_PID | LOG_DURATION | LOG_STATUS, .pid = worker->pid, .duration = request->reaped - request->started, .status = request->exit_code}, "Warm %s worker finished a job", worker->pool->rule->interpreter);
+    metrics_adjust(&loop->metrics->children_running, -1);
+    metrics_record(loop->metrics, STAGE_RUN, request->started);
+    admission_finish(loop, request);
+    event_loop_finish_request(loop, request);
+}
+
+/**
+ * Closes a worker, which exits once it reads end of file on its control socket, and starts
+ * a new one in its place. A worker that died before running a single job is not replaced,
+ * it would most likely die again.
+ * @param loop   the event loop state
+ * @param worker the worker to retire
+ */
+static void warm_worker_retire(struct event_loop *loop, struct warm_worker *worker)
+{
+    struct warm_pool *pool;
+
+    pool = worker->pool;
+
+    event_loop_unwatch(loop, &worker->control);
+    event_loop_unwatch(loop, &worker->output);
+
+    // Completions still in flight for the worker land in the default case
+    worker->control.type = -1;
+    worker->output.type  = -1;
+    worker->next         = loop->retired;
+    loop->retired        = worker;
+
+    if(pool->workers[worker->slot] != worker)
+    {
+        return;
+    }
+
+    if(worker->uses == 0)
+    {
+        log_event(LOG_ERROR, &(struct log_fields){.present = LOG_PID, .pid = worker->pid}, "Warm %s worker exited without running a job, it is not replaced", pool->rule->interpreter);
+        pool->workers[worker->slot] = NULL;
+        return;
+    }
+
+    pool->workers[worker->slot] = warm_worker_start(loop, pool, worker->slot);
+}
+
+// Admission Control Functions
+
+/**
+ * Decides whether a command may start now. Over the per-client limit, or with the queue
+ * full, the client is told to retry later. Over the -l limit the command is queued, and
+ * so is every command behind it, so they are admitted in arrival order.
+ * @param loop         the event loop state
+ * @param client       the client that sent the command
+ * @param id           the ID of the request
+ * @param args         the command's arguments, NULL for a pipeline or batch
+ * @param type         FRAME_COMMAND, FRAME_PIPELINE or FRAME_BATCH
+ * @param payload      a pipeline's or batch's payload after the timeout, as it was sent
+ * @param payload_len  the length of the payload in bytes
+ * @param timeout      milliseconds the client allows the command to run, 0 for the server's limit
+ * @return             1 if the command may start, 0 if it was queued or turned away
+ */
+static int event_loop_admit(struct event_loop *loop, struct client_connection *client, uint32_t id, char **args, uint8_t type, const char *payload, size_t payload_len, uint32_t timeout)
+{
+    struct admission       *admission;
+    struct pending_request *pending;
+    char                    line[MAX_COMMAND_LEN + 1];
+    const char             *queued_line;
+    size_t                  line_len;
+
+    admission = &loop->admission;
+
+    if(loop->options->peer_limit > 0)
+    {
+        const struct admission_peer *peer;
+
+        peer = admission_find_peer(admission, client->peer, 0);
+
+        if(peer != NULL && peer->running + peer->queued >= loop->options->peer_limit)
+        {
+            event_loop_reply_busy(loop, client, id, 1);
+            return 0;
+        }
+    }
+
+    if(loop->options->child_limit == 0 || (admission->running < loop->options->child_limit && (admission->queued == 0 || admission->draining)))
+    {
+        return 1;
+    }
+
+    if(admission->queued >= loop->options->queue_len)
+    {
+        event_loop_reply_busy(loop, client, id, 0);
+        return 0;
+    }
+
+    // A pipeline's or batch's payload is kept as it was sent, it was never split in place
+    if(type != FRAME_COMMAND)
+    {
+        queued_line = payload;
+        line_len    = payload_len;
+    }
+    else
+    {
+        join_arguments(args, line, sizeof(line));
+        queued_line = line;
+        line_len    = strlen(line);
+    }
+
+    pending = (struct pending_request *)malloc(sizeof(*pending) + line_len + 1);
+
+    if(pending == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(pending->line, queued_line, line_len);
+    pending->line[line_len] = '\0';
+    pending->client         = client;
+    pending->id             = id;
+    pending->timeout        = timeout;
+    pending->queued         = monotonic_microseconds();
+    pending->type           = type;
+    pending->line_len       = line_len;
+    pending->next           = NULL;
+
+    if(admission->tail != NULL)
+    {
+        admission->tail->next = pending;
+    }
+    else
+    {
+        admission->head = pending;
+    }
+
+    admission->tail = pending;
+    admission->queued++;
+    metrics_count(&loop->metrics->admission_queued, 1);
+    metrics_adjust(&loop->metrics->admission_queue_depth, 1);
+
+    if(loop->options->peer_limit > 0)
+    {
+        admission_find_peer(admission, client->peer, 1)->queued++;
+    }
+
+    // The queue holds the client open, and a legacy client sends nothing more
+    client->active_requests++;
+
+    if(client->protocol != PROTOCOL_SESSION)
+    {
+        event_loop_watch(loop, &client->source, 0, EPOLL_CTL_MOD);
+    }
+
+    event_loop_pause_accept(loop);
+
+    return 0;
+}
+
+/**
+ * Turns a request away with a hint of when to retry. Sessions get a busy frame and keep
+ * their connection, legacy clients get the hint as text and are closed.
+ * @param loop         the event loop state
+ * @param client       the client to turn away
+ * @param id           the ID of the request
+ * @param peer_limited non-zero if the client is over its own limit
+ */
+static void event_loop_reply_busy(struct event_loop *loop, struct client_connection *client, uint32_t id, int peer_limited)
+{
+    uint32_t retry_after;
+
+    retry_after = admission_retry_after(loop, peer_limited);
+    metrics_count(&loop->metrics->admission_rejected, 1);
+
+    if(client->protocol == PROTOCOL_SESSION)
+    {
+        uint32_t net_retry_after;
+
+        net_retry_after = htonl(retry_after);
+
+        if(!client->write_failed && event_loop_send_frame(loop, client, FRAME_BUSY, id, &net_retry_after, sizeof(net_retry_after)) == -1)
+        {
+            client->write_failed = 1;
+        }
+
+        if(client->write_failed && client->active_requests == 0)
+        {
+            event_loop_close_client(loop, client);
+        }
+
+        return;
+    }
+
+    dprintf(client->source.fd, "Server busy, retry after %" PRIu32 " ms.\n", retry_after);
+    event_loop_close_client(loop, client);
+}
+
+/**
+ * Starts queued commands while there is room under the -l limit. Called once per batch of
+ * events, after the children that exited in it have given their slots back.
+ * @param loop the event loop state
+ */
+static void event_loop_run_pending(struct event_loop *loop)
+{
+    struct admission *admission;
+
+    admission = &loop->admission;
+
+    while(admission->head != NULL && admission->running < loop->options->child_limit)
+    {
+        struct pending_request   *pending;
+        struct client_connection *client;
+
+        pending         = admission->head;
+        client          = pending->client;
+        admission->head = pending->next;
+
+        if(admission->head == NULL)
+        {
+            admission->tail = NULL;
+        }
+
+        admission->queued--;
+        metrics_adjust(&loop->metrics->admission_queue_depth, -1);
+        metrics_record(loop->metrics, STAGE_QUEUE, pending->queued);
+
+        if(loop->options->peer_limit > 0)
+        {
+            struct admission_peer *peer;
+
+            peer = admission_find_peer(admission, client->peer, 0);
+
+            if(peer != NULL)
+            {
+                peer->queued--;
+                admission_drop_peer(admission, peer);
+            }
+        }
+
+        admission->draining = 1;
+
+        if(pending->type == FRAME_PIPELINE)
+        {
+            event_loop_run_pipeline(loop, client, pending->id, pending->line, pending->line_len, pending->timeout);
+        }
+        else if(pending->type == FRAME_BATCH)
+        {
+            event_loop_run_batch(loop, client, pending->id, pending->line, pending->line_len, pending->timeout);
+        }
+        else
+        {
+            event_loop_run_command(loop, client, pending->id, pending->line, pending->timeout);
+        }
+
+        admission->draining = 0;
+        free(pending);
+
+        // Give back the queue's hold on the client, a legacy client that failed was already closed
+        client->active_requests--;
+
+        if(client->source.fd != -1 && client->protocol == PROTOCOL_SESSION && (client->read_closed || client->write_failed) && client->active_requests == 0)
+        {
+            event_loop_close_client(loop, client);
+        }
+    }
+
+    event_loop_pause_accept(loop);
+}
+
+/**
+ * Stops accepting connections while nothing more can be admitted or queued, so new clients
+ * wait in the listen backlog instead of being accepted only to be turned away, and starts
+ * again once there is room.
+ * @param loop the event loop state
+ */
+static void event_loop_pause_accept(struct event_loop *loop)
+{
+    const struct admission *admission;
+    int                     full;
+
+    admission = &loop->admission;
+    full      = loop->options->child_limit > 0 && admission->running >= loop->options->child_limit && admission->queued >= loop->options->queue_len;
+
+    // A draining loop never accepts again
+    if(full == (loop->listener.events == 0) || loop->drain_deadline != 0)
+    {
+        return;
+    }
+
+    if(full)
+    {
+        metrics_count(&loop->metrics->accept_pauses, 1);
+    }
+
+    event_loop_watch(loop, &loop->listener, full ? 0 : EPOLLIN, EPOLL_CTL_MOD);
+
+#if defined(HAVE_IO_URING)
+    // A multishot accept keeps going until it is cancelled
+    if(full && loop->ring.fd != -1 && loop->listener.in_flight)
+    {
+        uring_cancel(loop, &loop->listener);
+    }
+#endif
+}
+
+/**
+ * Counts a command that has just started against the limits.
+ * @param loop    the event loop state
+ * @param request the request of the command
+ * @param client  the client that started it
+ */
+static void admission_start(struct event_loop *loop, struct command_request *request, const struct client_connection *client)
+{
+    if(loop->options->child_limit == 0 && loop->options->peer_limit == 0)
+    {
+        return;
+    }
+
+    request->admitted = 1;
+    loop->admission.running++;
+
+    if(loop->options->peer_limit > 0)
+    {
+        request->peer = admission_find_peer(&loop->admission, client->peer, 1);
+        request->peer->running++;
+    }
+
+    event_loop_pause_accept(loop);
+}
+
+/**
+ * Gives back the slot of a command whose child has exited, and adds its run time to the
+ * average the retry hint is based on.
+ * @param loop    the event loop state
+ * @param request the request of the command
+ */
+static void admission_finish(struct event_loop *loop, struct command_request *request)
+{
+    struct admission *admission;
+    uint64_t          run;
+
+    if(!request->admitted)
+    {
+        return;
+    }
+
+    admission = &loop->admission;
+    run       = request->reaped - request->started;
+    admission->running--;
+    admission->average_run = admission->average_run == 0 ? run : admission->average_run - admission->average_run / RUN_TIME_WEIGHT + run / RUN_TIME_WEIGHT;
+    request->admitted      = 0;
+
+    if(request->peer != NULL)
+    {
+        request->peer->running--;
+        admission_drop_peer(admission, request->peer);
+        request->peer = NULL;
+    }
+}
+
+/**
+ * Looks up what a client address has running or queued.
+ * @param admission the admission state
+ * @param address   the client address
+ * @param create    non-zero to add the address if it has nothing yet
+ * @return          the address's counts, or NULL if it has none and create is 0
+ */
+static struct admission_peer *admission_find_peer(struct admission *admission, const char *address, int create)
+{
+    struct admission_peer **bucket;
+    struct admission_peer  *peer;
+
+    bucket = &admission->peers[hash_string(address) % ADMISSION_PEER_BUCKETS];
+
+    for(peer = *bucket; peer != NULL; peer = peer->next)
+    {
+        if(strcmp(peer->address, address) == 0)
+        {
+            return peer;
+        }
+    }
+
+    if(!create)
+    {
+        return NULL;
+    }
+
+    peer = (struct admission_peer *)calloc(1, sizeof(*peer));
+
+    if(peer == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(peer->address, sizeof(peer->address), "%s", address);
+    peer->next = *bucket;
+    *bucket    = peer;
+
+    return peer;
+}
+
+/**
+ * Forgets a client address once it has nothing running or queued.
+ * @param admission the admission state
+ * @param peer      the address's counts
+ */
+static void admission_drop_peer(struct admission *admission, struct admission_peer *peer)
+{
+    if(peer->running > 0 || peer->queued > 0)
+    {
+        return;
+    }
+
+    for(struct admission_peer **link = &admission->peers[hash_string(peer->address) % ADMISSION_PEER_BUCKETS]; *link != NULL; link = &(*link)->next)
+    {
+        if(*link == peer)
+        {
+            *link = peer->next;
+            free(peer);
+            return;
+        }
+    }
+}
+
+/**
+ * Estimates how long a turned away client should wait: about one run for a client over its
+ * own limit, and long enough for the queue to drain otherwise.
+ * @param loop         the event loop state
+ * @param peer_limited non-zero if the client was turned away for its own limit
+ * @return             milliseconds
+ */
+static uint32_t admission_retry_after(const struct event_loop *loop, int peer_limited)
+{
+    uint64_t wait;
+
+    wait = loop->admission.average_run;
+
+    if(wait == 0)
+    {
+        return RETRY_AFTER_DEFAULT;
+    }
+
+    if(!peer_limited)
+    {
+        wait *= loop->admission.queued / loop->options->child_limit + 1;
+    }
+
+    wait /= MICROSECONDS_PER_MILLISECOND;
+
+    return wait < RETRY_AFTER_MIN ? RETRY_AFTER_MIN : (wait > RETRY_AFTER_MAX ? RETRY_AFTER_MAX : (uint32_t)wait);
+}
+
+/**
+ * Frees the admission queue and counts. Queued commands are dropped unanswered.
+ * @param admission the admission state
+ */
+static void admission_destroy(struct admission *admission)
+{
+    while(admission->head != NULL)
+    {
+        struct pending_request *pending;
+
+        pending         = admission->head;
+        admission->head = pending->next;
+        pending->client->active_requests--;
+        free(pending);
+    }
+
+    admission->tail   = NULL;
+    admission->queued = 0;
+
+    for(size_t i = 0; i < ADMISSION_PEER_BUCKETS; i++)
+    {
+        while(admission->peers[i] != NULL)
+        {
+            struct admission_peer *peer;
+
+            peer                = admission->peers[i];
+            admission->peers[i] = peer->next;
+            free(peer);
+        }
+    }
+}
+
+// Deadline Functions
+
+/**
+ * Sets when a request's group is next signalled, and brings the timer forward if that is the
+ * earliest deadline.
+ * @param loop     the event loop state
+ * @param request  the request
+ * @param deadline monotonic microseconds, 0 to clear it
+ */
+static void event_loop_set_deadline(struct event_loop *loop, struct command_request *request, uint64_t deadline)
+{
+    request->deadline = deadline;
+
+    if(deadline != 0 && (loop->next_deadline == 0 || deadline < loop->next_deadline))
+    {
+        loop->next_deadline = deadline;
+        event_loop_set_timer(loop);
+    }
+}
+
+/**
+ * Signals every request whose deadline has passed and sets the timer for the next one.
+ * Requests that finished early leave their deadline behind, so the timer may find nothing due.
+ * @param loop the event loop state
+ */
+static void event_loop_check_deadlines(struct event_loop *loop)
+{
+    uint64_t expirations;
+    uint64_t now;
+    uint64_t next;
+
+    // Only reset the readiness, the deadlines themselves say what is due
+    while(read(loop->timer.fd, &expirations, sizeof(expirations)) == (ssize_t)sizeof(expirations))
+    {
+    }
+
+    now  = monotonic_microseconds();
+    next = 0;
+
+    for(struct command_request *request = loop->running; request != NULL; request = request->next)
+    {
+        if(request->deadline != 0 && request->deadline <= now)
+        {
+            event_loop_signal_request(loop, request, now);
+        }
+
+        if(request->deadline != 0 && (next == 0 || request->deadline < next))
+        {
+            next = request->deadline;
+        }
+    }
+
+    for(size_t i = 0; i < loop->options->warm_rule_count; i++)
+    {
+        const struct warm_pool *pool;
+
+        pool = &loop->warm_pools[i];
+
+        for(size_t slot = 0; slot < pool->rule->workers; slot++)
+        {
+            struct command_request *request;
+
+            request = pool->workers[slot] != NULL ? pool->workers[slot]->request : NULL;
+
+            if(request == NULL)
+            {
+                continue;
+            }
+
+            if(request->deadline != 0 && request->deadline <= now)
+            {
+                event_loop_signal_request(loop, request, now);
+            }
+
+            if(request->deadline != 0 && (next == 0 || request->deadline < next))
+            {
+                next = request->deadline;
+            }
+        }
+    }
+
+    // A new server that has not reported by its deadline is given up on
+    if(loop->handoff.ready_fd != -1)
+    {
+        event_loop_check_handoff(loop, now);
+    }
+
+    if(loop->handoff.ready_fd != -1 && (next == 0 || loop->handoff.deadline < next))
+    {
+        next = loop->handoff.deadline;
+    }
+
+    // A draining loop wakes at its deadline even with nothing else due
+    if(loop->drain_deadline > now && (next == 0 || loop->drain_deadline < next))
+    {
+        next = loop->drain_deadline;
+    }
+
+    loop->next_deadline = next;
+    event_loop_set_timer(loop);
+}
+
+/**
+ * Stops a request's command: SIGTERM to its whole process group first, then SIGKILL if the
+ * group has not gone after CANCEL_KILL_DELAY. A request signalled before its deadline was
+ * cancelled, one signalled at its deadline timed out.
+ * @param loop    the event loop state
+ * @param request the request to stop
+ * @param now     monotonic microseconds
+ */
+static void event_loop_signal_request(struct event_loop *loop, struct command_request *request, uint64_t now)
+{
+    if(request->exited || request->group <= 0 || request->signalled == SIGKILL)
+    {
+        return;
+    }
+
+    if(request->signalled == 0)
+    {
+        request->timed_out = request->deadline != 0 && request->deadline <= now;
+        metrics_count(request->timed_out ? &loop->metrics->timeouts : &loop->metrics->cancellations, 1);
+        log_event(LOG_WARN, &(struct log_fields){.present = LOG_PID | LOG_DURATION, .pid = request->group, .duration = now - request->started}, "Request %" PRIu32 " %s, terminating its process group", request->id, request->timed_out ? "timed out" : "was cancelled");
+        request->signalled = SIGTERM;
+        kill(-request->group, SIGTERM);
+        event_loop_set_deadline(loop, request, now + (uint64_t)CANCEL_KILL_DELAY * MICROSECONDS_PER_MILLISECOND);
+        return;
+    }
+
+    log_event(LOG_WARN, &(struct log_fields){.present = LOG_PID, .pid = request->group}, "Process group is still running, killing it");
+    request->signalled = SIGKILL;
+    request->deadline  = 0;
+    kill(-request->group, SIGKILL);
+}
+
+/**
+ * Stops a request nobody is waiting for any more, unless it is already being stopped.
+ * @param loop    the event loop state
+ * @param request the request to stop
+ */
+static void event_loop_cancel_request(struct event_loop *loop, struct command_request *request)
+{
+    if(request->signalled == 0)
+    {
+        event_loop_signal_request(loop, request, monotonic_microseconds());
+    }
+}
+
+/**
+ * Cancels what a legacy client has running once it hangs up, rather than leaving the child
+ * to write into a dead socket. Runs shared with other clients keep going.
+ * @param loop   the event loop state
+ * @param client the client that hung up
+ */
+static void event_loop_cancel_client(struct event_loop *loop, struct client_connection *client)
+{
+    // Nothing more is wanted from the client, and a hang up stays readable until it is closed
+    event_loop_watch(loop, &client->source, 0, EPOLL_CTL_MOD);
+
+    for(struct command_request *request = loop->running; request != NULL; request = request->next)
+    {
+        if(request->client == client)
+        {
+            event_loop_cancel_request(loop, request);
+        }
+    }
+
+    for(size_t i = 0; i < loop->options->warm_rule_count; i++)
+    {
+        const struct warm_pool *pool;
+
+        pool = &loop->warm_pools[i];
+
+        for(size_t slot = 0; slot < pool->rule->workers; slot++)
+        {
+            if(pool->workers[slot] != NULL && pool->workers[slot]->request != NULL && pool->workers[slot]->request->client == client)
+            {
+                event_loop_cancel_request(loop, pool->workers[slot]->request);
+            }
+        }
+    }
+}
+
+/**
+ * Sets the timerfd for the earliest deadline, or disarms it if there is none.
+ * @param loop the event loop state
+ */
+static void event_loop_set_timer(struct event_loop *loop)
+{
+    struct itimerspec timer;
+
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec  = (time_t)(loop->next_deadline / MICROSECONDS_PER_SECOND);
+    timer.it_value.tv_nsec = (long)(loop->next_deadline % MICROSECONDS_PER_SECOND * NANOSECONDS_PER_MICROSECOND);
+
+    if(timerfd_settime(loop->timer.fd, TFD_TIMER_ABSTIME, &timer, NULL) == -1)
+    {
+        perror("timerfd_settime");
+    }
+}
+
+
+// Batch Functions
+
+/**
+ * Starts a batch sent as a FRAME_BATCH. Its commands are answered in one exchange: each
+ * one's output is held until it exits, then sent as output frames followed by a
+ * FRAME_BATCH_RESULT with its index, and an exit trailer with the number of commands that
+ * failed ends the batch. The batch is admitted as one request, and its commands count
+ * against the limits while they run. They are never cached or given to warm workers.
+ * @param loop    the event loop state
+ * @param client  the session client that sent the batch
+ * @param id      the request ID every frame of the reply is tagged with
+ * @param payload how many commands may run at once, 0 for the default, then the commands
+ * @param len     the length of the payload in bytes
+ * @param timeout milliseconds each command may run, 0 for the server's limit
+ */
+static void event_loop_run_batch(struct event_loop *loop, struct client_connection *client, uint32_t id, char *payload, size_t len, uint32_t timeout)
+{
+    struct command_batch *batch;
+    char                 *commands;
+    uint32_t              net_parallelism;
+    size_t                commands_len;
+    size_t                count;
+    size_t                offset;
+
+    if(len < sizeof(net_parallelism))
+    {
+        event_loop_reply_error(loop, client, id, "Malformed batch.");
+        return;
+    }
+
+    memcpy(&net_parallelism, payload, sizeof(net_parallelism));
+    commands     = &payload[sizeof(net_parallelism)];
+    commands_len = len - sizeof(net_parallelism);
+    count        = 0;
+    offset       = 0;
+
+    // Every command has to be NUL-terminated and not empty
+    while(offset < commands_len)
+    {
+        size_t command_len;
+
+        command_len = strnlen(&commands[offset], commands_len - offset);
+
+        if(command_len == 0 || command_len == commands_len - offset || count == MAX_BATCH_COMMANDS)
+        {
+            event_loop_reply_error(loop, client, id, count == MAX_BATCH_COMMANDS ? "Too many commands in the batch." : "Malformed batch.");
+            return;
+        }
+
+        offset += command_len + 1;
+        count++;
+    }
+
+    if(count == 0)
+    {
+        event_loop_reply_error(loop, client, id, "Empty batch.");
+        return;
+    }
+
+    if(!event_loop_admit(loop, client, id, NULL, FRAME_BATCH, payload, len, timeout))
+    {
+        return;
+    }
+
+    batch = (struct command_batch *)malloc(sizeof(*batch) + commands_len);
+
+    if(batch == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(batch->commands, commands, commands_len);
+    batch->client      = client;
+    batch->id          = id;
+    batch->timeout     = timeout;
+    batch->parallelism = ntohl(net_parallelism) == 0 ? BATCH_DEFAULT_PARALLELISM : ntohl(net_parallelism);
+    batch->count       = count;
+    batch->next        = 0;
+    batch->running     = 0;
+    batch->failed      = 0;
+    offset             = 0;
+
+    if(batch->parallelism > MAX_BATCH_PARALLELISM)
+    {
+        batch->parallelism = MAX_BATCH_PARALLELISM;
+    }
+
+    for(size_t i = 0; i < count; i++)
+    {
+        struct batch_item *item;
+
+        item                  = &batch->items[i];
+        item->command         = &batch->commands[offset];
+        item->output          = NULL;
+        item->output_len      = 0;
+        item->output_capacity = 0;
+        item->truncated       = 0;
+        offset               += strlen(item->command) + 1;
+    }
+
+    log_event(LOG_DEBUG, &(struct log_fields){.present = LOG_PEER, .peer = client->peer}, "Batch %" PRIu32 " runs %zu commands, %zu at a time", id, count, batch->parallelism);
+    client->active_requests++;
+    event_loop_batch_fill(loop, batch);
+}
+
+/**
+ * Starts a batch's next commands while it has room for them, and ends it once every command
+ * has been answered. Nothing more is started for a client that can no longer be written to.
+ * @param loop  the event loop state
+ * @param batch the batch
+ */
+static void event_loop_batch_fill(struct event_loop *loop, struct command_batch *batch)
+{
+    while(batch->next < batch->count && batch->running < batch->parallelism && !batch->client->write_failed)
+    {
+        event_loop_batch_start(loop, batch, batch->next++);
+    }
+
+    if(batch->running > 0 || (batch->next < batch->count && !batch->client->write_failed))
+    {
+        return;
+    }
+
+    log_event(LOG_INFO, &(struct log_fields){.present = LOG_PEER | LOG_STATUS, .peer = batch->client->peer, .status = (int)batch->failed}, "Batch %" PRIu32 " finished with %" PRIu32 " of %zu commands failed", batch->id, batch->failed, batch->count);
+    event_loop_end_reply(loop, batch->client, batch->id, (int)batch->failed, NULL);
+    event_loop_free_batch(batch);
+}
+
+/**
+ * Starts one command of a batch, with its output going to a pipe the server holds it from.
+ * A command that cannot be started is answered straight away.
+ * @param loop  the event loop state
+ * @param batch the batch
+ * @param index the index of the command
+ */
+static void event_loop_batch_start(struct event_loop *loop, struct command_batch *batch, size_t index)
+{
+    struct command_request *request;
+    struct child_io         io;
+    char                  **args;
+    char                   *line;
+    char                   *command;
+    char                   *full_path;
+    char                    message[LINE_LENGTH];
+    int                     pipe_fds[2];
+    pid_t                   pid;
+    uint64_t                started;
+    int                     found;
+
+    command = NULL;
+    metrics_count(&loop->metrics->requests, 1);
+
+    // The batch keeps its copy of the command, it is split from one in the arena
+    arena_reset(&loop->scratch);
+    line = (char *)arena_alloc(&loop->scratch, strlen(batch->items[index].command) + 1);
+
+    if(line == NULL)
+    {
+        event_loop_batch_fail(loop, batch, index, NOT_EXECUTABLE_EXIT_CODE, "Too many arguments.");
+        return;
+    }
+
+    strcpy(line, batch->items[index].command);
+    args      = split_input(line, &command, &loop->scratch);
+    full_path = (char *)arena_alloc(&loop->scratch, LINE_LENGTH);
+
+    if(args == NULL || full_path == NULL)
+    {
+        event_loop_batch_fail(loop, batch, index, NOT_EXECUTABLE_EXIT_CODE, "Too many arguments.");
+        return;
+    }
+
+    if(command == NULL)
+    {
+        event_loop_batch_fail(loop, batch, index, NOT_EXECUTABLE_EXIT_CODE, "Empty command.");
+        return;
+    }
+
+    started = monotonic_microseconds();
+    found   = find_binary_executable(loop->path_cache, command, full_path) == 0;
+    metrics_record(loop->metrics, STAGE_LOOKUP, started);
+
+    if(!found)
+    {
+        metrics_count(&loop->metrics->commands_not_found, 1);
+        snprintf(message, sizeof(message), "Command %s was not found.", command);
+        event_loop_batch_fail(loop, batch, index, NOT_FOUND_EXIT_CODE, message);
+        return;
+    }
+
+    if(pipe2(pipe_fds, O_CLOEXEC) == -1)
+    {
+        perror("pipe2");
+        metrics_count(&loop->metrics->spawn_failures, 1);
+        event_loop_batch_fail(loop, batch, index, NOT_EXECUTABLE_EXIT_CODE, "Unable to create output pipe.");
+        return;
+    }
+
+    io.input_fd  = -1;
+    io.output_fd = pipe_fds[1];
+    io.error_fd  = pipe_fds[1];
+    io.group     = 0;
+    started      = monotonic_microseconds();
+    pid          = spawn_process(loop->options->spawn_backend, full_path, args, &io);
+    metrics_record(loop->metrics, STAGE_SPAWN, started);
+    close(pipe_fds[1]);    // Only the child writes to the pipe
+
+    if(pid == -1)
+    {
+        close(pipe_fds[0]);
+        metrics_count(&loop->metrics->spawn_failures, 1);
+        event_loop_batch_fail(loop, batch, index, NOT_EXECUTABLE_EXIT_CODE, "Unable to start command.");
+        return;
+    }
+
+    request              = event_loop_new_request(loop, batch->client, batch->id, pid, pipe_fds[0], started);
+    request->batch       = batch;
+    request->batch_index = index;
+    request->next        = loop->running;
+    loop->running        = request;
+    batch->running++;
+    metrics_adjust(&loop->metrics->children_running, 1);
+    admission_start(loop, request, batch->client);
+    event_loop_start_deadline(loop, request, batch->timeout);
+    event_loop_watch(loop, &request->output, EPOLLIN, EPOLL_CTL_ADD);
+}
+
+/**
+ * Answers a batch command that could not be started, with the reason as its output.
+ * @param loop      the event loop state
+ * @param batch     the batch
+ * @param index     the index of the command
+ * @param exit_code the shell-style exit code for the failure
+ * @param message   the reason
+ */
+static void event_loop_batch_fail(struct event_loop *loop, struct command_batch *batch, size_t index, int exit_code, const char *message)
+{
+    // Nothing was held for a command that never started, so the reason goes straight out
+    event_loop_send_output(loop, batch->client, batch->id, message, strlen(message));
+    event_loop_send_output(loop, batch->client, batch->id, "\n", 1);
+    event_loop_batch_reply(loop, batch, index, exit_code, 0, NULL);
+}
+
+/**
+ * Holds a chunk of a batch command's output until it exits, dropping what goes past
+ * BATCH_MAX_OUTPUT.
+ * @param batch  the batch
+ * @param index  the index of the command
+ * @param output the output bytes
+ * @param len    the number of output bytes
+ */
+static void event_loop_batch_output(struct command_batch *batch, size_t index, const char *output, size_t len)
+{
+    struct batch_item *item;
+
+    item = &batch->items[index];
+
+    if(item->output_len + len > BATCH_MAX_OUTPUT)
+    {
+        item->truncated = 1;
+        len             = BATCH_MAX_OUTPUT - item->output_len;
+    }
+
+    if(item->output_len + len > item->output_capacity)
+    {
+        char  *grown;
+        size_t capacity;
+
+        capacity = item->output_capacity == 0 ? OUTPUT_CHUNK_LEN : item->output_capacity;
+
+        while(capacity < item->output_len + len)
+        {
+            capacity *= 2;
+        }
+
+        grown = (char *)realloc(item->output, capacity);
+
+        if(grown == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+
+        item->output          = grown;
+        item->output_capacity = capacity;
+    }
+
+    if(len > 0)
+    {
+        memcpy(&item->output[item->output_len], output, len);
+        item->output_len += len;
+    }
+}
+
+/**
+ * Sends a batch command's output and result frame, and lets the output go. Once the client
+ * can no longer be written to, the batch's other commands are stopped.
+ * @param loop      the event loop state
+ * @param batch     the batch
+ * @param index     the index of the command
+ * @param exit_code the exit code of the command
+ * @param run       microseconds the command ran for
+ * @param finished  the finished run, whose usage is reported if the session asked, or NULL
+ */
+static void event_loop_batch_reply(struct event_loop *loop, struct command_batch *batch, size_t index, int exit_code, uint64_t run, const struct command_request *finished)
+{
+    struct batch_item        *item;
+    struct client_connection *client;
+    uint8_t                   result[BATCH_RESULT_LEN];
+    uint32_t                  net_value;
+
+    item   = &batch->items[index];
+    client = batch->client;
+
+    if(exit_code != 0)
+    {
+        batch->failed++;
+    }
+
+    log_event(LOG_DEBUG, &(struct log_fields){.present = LOG_COMMAND | LOG_DURATION | LOG_BYTES | LOG_STATUS, .command = item->command, .duration = run, .bytes = item->output_len, .status = exit_code}, "Batch %" PRIu32 " command %zu exited", batch->id, index);
+    metrics_count(&loop->metrics->output_bytes, item->output_len);
+    event_loop_send_output(loop, client, batch->id, item->output, item->output_len);
+
+    // The usage goes ahead of the result it belongs to, a command that never started has none
+    if(!client->write_failed && client->report_usage && finished != NULL && event_loop_send_usage(loop, client, batch->id, run, &finished->usage, item->output_len) == -1)
+    {
+        client->write_failed = 1;
+    }
+
+    net_value = htonl((uint32_t)index);
+    memcpy(&result[0], &net_value, sizeof(net_value));
+    net_value = htonl((uint32_t)exit_code);
+    memcpy(&result[sizeof(uint32_t)], &net_value, sizeof(net_value));
+    net_value = htonl((uint32_t)(run >> 32));    // The run time goes high half first
+    memcpy(&result[2 * sizeof(uint32_t)], &net_value, sizeof(net_value));
+    net_value = htonl((uint32_t)run);
+    memcpy(&result[3 * sizeof(uint32_t)], &net_value, sizeof(net_value));
+    net_value = htonl(item->truncated ? BATCH_OUTPUT_TRUNCATED : 0);
+    memcpy(&result[4 * sizeof(uint32_t)], &net_value, sizeof(net_value));
+
+    if(!client->write_failed && event_loop_send_frame(loop, client, FRAME_BATCH_RESULT, batch->id, result, sizeof(result)) == -1)
+    {
+        client->write_failed = 1;
+    }
+
+    free(item->output);
+    item->output          = NULL;
+    item->output_len      = 0;
+    item->output_capacity = 0;
+
+    if(!client->write_failed)
+    {
+        return;
+    }
+
+    // Nobody reads the results any more
+    for(struct command_request *request = loop->running; request != NULL; request = request->next)
+    {
+        if(request->batch == batch)
+        {
+            event_loop_cancel_request(loop, request);
+        }
+    }
+}
+
+/**
+ * Frees a batch and any output it still holds.
+ * @param batch the batch
+ */
+static void event_loop_free_batch(struct command_batch *batch)
+{
+    for(size_t i = 0; i < batch->count; i++)
+    {
+        free(batch->items[i].output);
+    }
+
+    free(batch);
+}
+
+// File Serving Functions
+
+/**
+ * Answers a cat of regular files under the -f directories by sending them, without starting
+ * cat. Anything else cat would have to handle itself, such as options, stdin or a file it
+ * would refuse, is left to the real cat, and so is output the session wants compressed.
+ * Files sent this way take no slot under the admission limits.
+ * @param loop   the event loop state
+ * @param client the client that sent the command
+ * @param id     the request ID the output is tagged with
+ * @param args   the command's NULL-terminated arguments
+ * @return       non-zero if the files are being sent, 0 if the command should run as usual
+ */
+static int event_loop_serve_files(struct event_loop *loop, struct client_connection *client, uint32_t id, char **args)
+{
+    int    fds[MAX_SERVED_FILES];
+    size_t count;
+
+    if(strcmp(args[0], "cat") != 0 || args[1] == NULL || client->compression_level != 0)
+    {
+        return 0;
+    }
+
+    for(count = 0; args[count + 1] != NULL; count++)
+    {
+        int fd;
+
+        fd = count < MAX_SERVED_FILES && args[count + 1][0] != '-' ? open_served_file(loop->options, args[count + 1]) : -1;
+
+        if(fd == -1)
+        {
+            for(size_t i = 0; i < count; i++)
+            {
+                close(fds[i]);
+            }
+
+            return 0;
+        }
+
+        fds[count] = fd;
+    }
+
+    event_loop_start_transfer(loop, client, id, fds, count, 0, UINT64_MAX);
+
+    return 1;
+}
+
+/**
+ * Sends part of a file for a FRAME_FETCH, so a client can follow a growing log by asking
+ * for what comes after the bytes it already has. An offset at or past the end sends
+ * nothing and still succeeds.
+ * @param loop    the event loop state
+ * @param client  the session client that sent the fetch
+ * @param id      the request ID the output is tagged with
+ * @param payload the offset and length, then the NUL-terminated path
+ * @param len     the length of the payload in bytes
+ */
+static void event_loop_run_fetch(struct event_loop *loop, struct client_connection *client, uint32_t id, const char *payload, size_t len)
+{
+    uint32_t halves[4];
+    uint64_t offset;
+    uint64_t length;
+    char     message[LINE_LENGTH];
+    int      fd;
+
+    metrics_count(&loop->metrics->requests, 1);
+
+    if(loop->options->file_root_count == 0)
+    {
+        event_loop_reply_error(loop, client, id, "This server does not serve files.");
+        return;
+    }
+
+    memcpy(halves, payload, sizeof(halves));
+    offset = (uint64_t)ntohl(halves[0]) << 32 | ntohl(halves[1]);
+    length = (uint64_t)ntohl(halves[2]) << 32 | ntohl(halves[3]);
+
+    if(offset > INT64_MAX || memchr(&payload[FETCH_HEADER_LEN], '\0', len - FETCH_HEADER_LEN) != &payload[len - 1])
+    {
+        event_loop_reply_error(loop, client, id, "Malformed fetch.");
+        return;
+    }
+
+    fd = open_served_file(loop->options, &payload[FETCH_HEADER_LEN]);
+
+    if(fd == -1)
+    {
+        snprintf(message, sizeof(message), "Unable to fetch %s: %s", &payload[FETCH_HEADER_LEN], strerror(errno));
+        event_loop_reply_error(loop, client, id, message);
+        return;
+    }
+
+    // A length of 0 asks for everything up to the end
+    event_loop_start_transfer(loop, client, id, &fd, 1, (off_t)offset, length == 0 ? UINT64_MAX : length);
+}
+
+/**
+ * Starts sending files to a client. They are only sent from event_loop_run_transfers(),
+ * so the loop keeps handling other clients in between.
+ * @param loop   the event loop state
+ * @param client the client to send them to
+ * @param id     the request ID the output is tagged with
+ * @param fds    the open files, in the order they are sent, owned by the transfer from here
+ * @param count  the number of files
+ * @param offset where to start in the first file
+ * @param length the most bytes to send, UINT64_MAX for everything
+ */
+static void event_loop_start_transfer(struct event_loop *loop, struct client_connection *client, uint32_t id, const int *fds, size_t count, off_t offset, uint64_t length)
+{
+    struct file_transfer *transfer;
+
+    transfer = (struct file_transfer *)malloc(sizeof(*transfer));
+
+    if(transfer == NULL)
+    {
+        perror("malloc");
+
+        for(size_t i = 0; i < count; i++)
+        {
+            close(fds[i]);
+        }
+
+        event_loop_reply_error(loop, client, id, "Unable to send file.");
+        return;
+    }
+
+    memcpy(transfer->fds, fds, count * sizeof(*fds));
+    transfer->client     = client;
+    transfer->id         = id;
+    transfer->count      = count;
+    transfer->current    = 0;
+    transfer->offset     = offset;
+    transfer->remaining  = length;
+    transfer->bytes_sent = 0;
+    transfer->next       = loop->transfers;
+    loop->transfers      = transfer;
+    client->active_requests++;
+    metrics_count(&loop->metrics->files_served, 1);
+
+    // The files are the legacy client's whole reply, a hang up shows up as a failed send
+    if(client->protocol != PROTOCOL_SESSION)
+    {
+        event_loop_watch(loop, &client->source, 0, EPOLL_CTL_MOD);
+    }
+}
+
+/**
+ * Sends the next chunk of every file transfer, and ends the ones that are done. A transfer
+ * whose client has output queued waits on the client until the queue has drained. The list
+ * is taken whole first, since a client that fails puts its paused transfers back on it.
+ * @param loop the event loop state
+ */
+static void event_loop_run_transfers(struct event_loop *loop)
+{
+    struct file_transfer *pending;
+
+    pending         = loop->transfers;
+    loop->transfers = NULL;
+
+    while(pending != NULL)
+    {
+        struct file_transfer     *transfer;
+        struct client_connection *client;
+        int                       result;
+
+        transfer = pending;
+        client   = transfer->client;
+        pending  = transfer->next;
+
+        if(client->queued != NULL && !client->write_failed)
+        {
+            transfer->next           = client->paused_transfers;
+            client->paused_transfers = transfer;
+            continue;
+        }
+
+        result = file_transfer_send(loop, transfer);
+
+        if(result > 0)
+        {
+            transfer->next  = loop->transfers;
+            loop->transfers = transfer;
+            continue;
+        }
+
+        event_loop_end_transfer(loop, transfer, result);
+    }
+}
+
+/**
+ * Closes a finished transfer's files and replies like a cat that exited with 0. A transfer
+ * that failed part way through a frame cannot be finished, so its session is closed instead.
+ * @param loop     the event loop state
+ * @param transfer the transfer, already unlinked
+ * @param result   0 if everything was sent, -1 if it failed
+ */
+static void event_loop_end_transfer(struct event_loop *loop, struct file_transfer *transfer, int result)
+{
+    for(size_t i = 0; i < transfer->count; i++)
+    {
+        close(transfer->fds[i]);
+    }
+
+    if(result == -1)
+    {
+        event_loop_fail_client(loop, transfer->client);
+    }
+
+    log_event(LOG_INFO, &(struct log_fields){.present = LOG_PEER | LOG_BYTES, .peer = transfer->client->peer, .bytes = transfer->bytes_sent}, "Request %" PRIu32 " sent files", transfer->id);
+    metrics_count(&loop->metrics->output_bytes, transfer->bytes_sent);
+    event_loop_end_reply(loop, transfer->client, transfer->id, EXIT_SUCCESS, NULL);
+    free(transfer);
+}
+
+/**
+ * Sends one chunk of a transfer, as an output frame for a session. The chunk is sized from
+ * the file as it is now, so a log that grows while it is sent is followed to its new end.
+ * What sendfile() finds no room for is read into the client's queue to finish the frame.
+ * @param loop     the event loop state
+ * @param transfer the transfer
+ * @return         1 if there is more to send, 0 once it is all sent, -1 on failure
+ */
+static int file_transfer_send(struct event_loop *loop, struct file_transfer *transfer)
+{
+    struct client_connection *client;
+
+    client = transfer->client;
+
+    while(transfer->current < transfer->count && transfer->remaining > 0 && !client->write_failed)
+    {
+        uint8_t     header[FRAME_HEADER_LEN];
+        struct stat file_stat;
+        int         fd;
+        size_t      chunk;
+        size_t      sent;
+
+        fd = transfer->fds[transfer->current];
+
+        if(fstat(fd, &file_stat) == -1)
+        {
+            perror("fstat");
+            return -1;
+        }
+
+        if(file_stat.st_size <= transfer->offset)
+        {
+            transfer->current++;
+            transfer->offset = 0;
+            continue;
+        }
+
+        chunk = (uint64_t)(file_stat.st_size - transfer->offset) < transfer->remaining ? (size_t)(file_stat.st_size - transfer->offset) : (size_t)transfer->remaining;
+        chunk = chunk < FILE_CHUNK_LEN ? chunk : FILE_CHUNK_LEN;
+
+        if(client->protocol == PROTOCOL_SESSION)
+        {
+            encode_frame_header(header, FRAME_OUTPUT, transfer->id, chunk);
+
+            if(event_loop_send(loop, client, header, sizeof(header), SEND_MORE) == -1)
+            {
+                return -1;
+            }
+        }
+
+        // Nothing is sent behind a header that had to be queued
+        for(sent = 0; sent < chunk && client->queued == NULL;)
+        {
+            ssize_t bytes_sent;
+
+            bytes_sent = sendfile(client->source.fd, fd, &transfer->offset, chunk - sent);
+
+            if(bytes_sent == -1 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if(bytes_sent == -1 && errno == EAGAIN)
+            {
+                break;
+            }
+
+            // Also a file cut short since its size was read, which leaves the frame unfinished
+            if(bytes_sent <= 0)
+            {
+                return -1;
+            }
+
+            sent += (size_t)bytes_sent;
+        }
+
+        if(sent < chunk)
+        {
+            if(event_loop_send_from(loop, client, fd, &transfer->offset, chunk - sent) == -1)
+            {
+                return -1;
+            }
+
+            sent = chunk;
+        }
+
+        transfer->bytes_sent += sent;
+
+        if(transfer->remaining != UINT64_MAX)
+        {
+            transfer->remaining -= sent;
+        }
+
+        return 1;
+    }
+
+    return client->write_failed ? -1 : 0;
+}
+
+/**
+ * Opens a file a client asked for, if it is a regular file under one of the -f directories.
+ * The check is made on the file that was opened, so neither a symlink nor one swapped in
+ * afterwards can reach outside them.
+ * @param options the parsed command line options
+ * @param path    the path the client gave, relative ones from the server's directory like cat's
+ * @return        the open file, or -1 with errno set, EACCES if the file is not served
+ */
+static int open_served_file(const struct server_options *options, const char *path)
+{
+    char        link_path[LINE_LENGTH];
+    char        opened[LINE_LENGTH];
+    struct stat file_stat;
+    ssize_t     opened_len;
+    int         fd;
+
+    // Non-blocking so a FIFO cannot hold up the loop, it is turned away below anyway
+    fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+
+    if(fd == -1)
+    {
+        return -1;
+    }
+
+    snprintf(link_path, sizeof(link_path), "/proc/self/fd/%d", fd);
+    opened_len = readlink(link_path, opened, sizeof(opened) - 1);
+
+    if(opened_len > 0)
+    {
+        opened[opened_len] = '\0';
+    }
+
+    if(opened_len <= 0 || fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode) || !is_served_path(options, opened))
+    {
+        close(fd);
+        errno = EACCES;
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Checks whether a resolved path is inside one of the -f directories.
+ * @param options the parsed command line options
+ * @param path    the resolved path
+ * @return        non-zero if files there are served
+ */
+static int is_served_path(const struct server_options *options, const char *path)
+{
+    for(size_t i = 0; i < options->file_root_count; i++)
+    {
+        const struct file_root *root;
+
+        root = &options->file_roots[i];
+
+        // The root itself is a directory, so only what is below it can match
+        if(strncmp(path, root->path, root->len) == 0 && (path[root->len] == '/' || root->path[root->len - 1] == '/'))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#endif
+
+#if defined(HAVE_IO_URING)
+
+// io_uring Engine Functions
+
+/**
+ * Handles completions from io_uring. Each wait submits every operation queued since the
+ * last one, so a batch of ready clients costs a single system call.
+ * @param loop the event loop state
+ */
+static void event_loop_run_uring(struct event_loop *loop)
+{
+    while(!exit_flag)
+    {
+        unsigned int head;
+        unsigned int tail;
+
+        if((reload_flag || drain_flag) && event_loop_drain(loop))
+        {
+            break;
+        }
+
+        // Files still being sent go on as soon as the completions are handled
+        if(uring_submit_and_wait(&loop->ring, loop->transfers != NULL ? 0 : 1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("io_uring_enter");
+            break;
+        }
+
+        head = *loop->ring.cq_head;
+        tail = __atomic_load_n(loop->ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        while(head != tail)
+        {
+            struct io_uring_cqe cqe;
+
+            // Copy the entry out and hand its slot back before handling it
+            cqe = loop->ring.cqes[head & *loop->ring.cq_mask];
+            head++;
+            __atomic_store_n(loop->ring.cq_head, head, __ATOMIC_RELEASE);
+
+            // Cancellations carry no source, the operation they cancel completes on its own
+            if(cqe.user_data != 0)
+            {
+                event_loop_complete(loop, (struct event_source *)(uintptr_t)cqe.user_data, cqe.res, cqe.flags);
+            }
+        }
+
+        event_loop_run_pending(loop);
+        event_loop_run_transfers(loop);
+        event_loop_release(loop);
+    }
+}
+
+/**
+ * Handles one completed operation and re-arms its source if it is still wanted.
+ * @param loop   the event loop state
+ * @param source the source the operation was for
+ * @param result the operation's result, a negative errno on failure
+ * @param flags  the completion flags
+ */
+static void event_loop_complete(struct event_loop *loop, struct event_source *source, int32_t result, uint32_t flags)
+{
+    source->in_flight = (flags & IORING_CQE_F_MORE) != 0;
+
+    switch(source->type)
+    {
+        case SOURCE_LISTENER:
+        {
+            if(result >= 0)
+            {
+                struct sockaddr_storage client_addr;
+                socklen_t               client_addr_len;
+                uint64_t                accepted;
+
+                // Multishot accept cannot hand back an address per connection, so ask for it
+                accepted        = monotonic_microseconds();
+                client_addr_len = sizeof(client_addr);
+                memset(&client_addr, 0, sizeof(client_addr));
+                if(getpeername(result, (struct sockaddr *)&client_addr, &client_addr_len) == 0)
+                {
+                    log_connection(result, &client_addr, client_addr_len, loop->resolver);
+                }
+
+                metrics_count(&loop->metrics->connections_accepted, 1);
+                metrics_adjust(&loop->metrics->connections_open, 1);
+                metrics_record(loop->metrics, STAGE_ACCEPT, accepted);
+                event_loop_start_client(loop, result, &client_addr);
+            }
+            else if(result != -EAGAIN && result != -EINTR && result != -ECANCELED)
+            {
+                log_event(LOG_ERROR, NULL, "accept failed: %s", strerror(-result));
+            }
+
+            break;
+        }
+        case SOURCE_CLIENT:
+        {
+            struct client_connection *client;
+
+            client = (struct client_connection *)source->owner;
+
+            // A poll for the client hanging up on its command, or for an idle client sending something
+            if(client->polled)
+            {
+                client->polled = 0;
+
+                if(result <= 0 || source->events == 0)
+                {
+                    break;
+                }
+
+                if(source->events & EPOLLIN)
+                {
+                    event_loop_read_client(loop, client);
+                }
+                else
+                {
+                    event_loop_cancel_client(loop, client);
+                }
+
+                break;
+            }
+
+            if(result > 0)
+            {
+                client->parser.end += (size_t)result;
+            }
+
+            // A paused client keeps what it sent in its buffer until it is watched again
+            if(source->events != 0)
+            {
+                event_loop_parse_client(loop, client, result);
+            }
+
+            break;
+        }
+        case SOURCE_WRITABLE:
+        {
+            // Stopped once the queue drained, or the client failed while the poll was in flight
+            if(source->events != 0)
+            {
+                event_loop_flush_client(loop, (struct client_connection *)source->owner);
+            }
+
+            break;
+        }
+        case SOURCE_OUTPUT:
+        {
+            if(!event_loop_forward_output(loop, (struct command_request *)source->owner))
+            {
+                return;    // The request may have been freed
+            }
+
+            break;
+        }
+        case SOURCE_SIGNAL:
+        {
+            event_loop_reap(loop);
+            break;
+        }
+        case SOURCE_PATH_WATCH:
+        {
+            path_cache_poll(loop->path_cache);
+            break;
+        }
+        case SOURCE_WARM_CONTROL:
+        {
+            warm_worker_read_status(loop, (struct warm_worker *)source->owner);
+            break;
+        }
+        case SOURCE_WARM_OUTPUT:
+        {
+            warm_worker_read_output(loop, (struct warm_worker *)source->owner);
+            break;
+        }
+        case SOURCE_TIMER:
+        {
+            event_loop_check_deadlines(loop);
+            break;
+        }
+        case SOURCE_HANDOFF:
+        {
+            // A poll still in flight when the handoff ended, or one left over from an earlier handoff
+            if(source->fd != -1)
+            {
+                event_loop_check_handoff(loop, monotonic_microseconds());
+            }
+
+            break;
+        }
+#if defined(HAVE_OPENSSL)
+        case SOURCE_TLS:
+        {
+            event_loop_collect_handshakes(loop);
+            break;
+        }
+#endif
+        default:
+        {
+            // A client closed while its receive was in flight
+            return;
+        }
+    }
+
+    if(source->fd != -1 && source->events != 0 && !source->in_flight && !exit_flag)
+    {
+        event_loop_arm(loop, source);
+    }
+}
+
+/**
+ * Queues the operation that waits on a source: a multishot accept for the listener, a
+ * receive straight into the parse buffer for a client with part of a request buffered, a
+ * poll for room in a client's socket while it has output queued, and a poll for reading
+ * everything else.
+ * @param loop   the event loop state
+ * @param source the source to arm
+ */
+static void event_loop_arm(struct event_loop *loop, struct event_source *source)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(&loop->ring);
+
+    if(sqe == NULL)
+    {
+        log_event(LOG_ERROR, NULL, "io_uring submission queue is full");
+        log_close();
+        exit(EXIT_FAILURE);
+    }
+
+    sqe->fd        = source->fd;
+    sqe->user_data = (uint64_t)(uintptr_t)source;
+
+    switch(source->type)
+    {
+        case SOURCE_LISTENER:
+        {
+            sqe->opcode       = IORING_OP_ACCEPT;
+            sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            break;
+        }
+        case SOURCE_CLIENT:
+        {
+            struct client_connection *client;
+            struct frame_parser      *parser;
+            size_t                    space;
+
+            client = (struct client_connection *)source->owner;
+
+            // An idle client has no buffer to receive into, it gets one once it is readable
+            if(!(source->events & EPOLLIN) || client->parser.buffer == NULL)
+            {
+                sqe->opcode        = IORING_OP_POLL_ADD;
+                sqe->poll32_events = (source->events & EPOLLIN) ? POLLIN : POLLRDHUP;
+                client->polled     = 1;
+                break;
+            }
+
+            parser      = &client->parser;
+            space       = frame_parser_reserve(parser);
+            sqe->opcode = IORING_OP_RECV;
+            sqe->addr   = (uint64_t)(uintptr_t)&parser->buffer[parser->end];
+            sqe->len    = (uint32_t)space;
+            break;
+        }
+        case SOURCE_WRITABLE:
+        {
+            sqe->opcode        = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLOUT;
+            break;
+        }
+        default:
+        {
+            sqe->opcode        = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLIN;
+            break;
+        }
+    }
+
+    source->in_flight = 1;
+}
+
+/**
+ * Cancels the operation in flight on a source. It completes with -ECANCELED, and is not armed
+ * again unless the source was watched again in the meantime.
+ * @param loop   the event loop state
+ * @param source the source whose operation to cancel
+ */
+static void uring_cancel(struct event_loop *loop, const struct event_source *source)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(&loop->ring);
+
+    if(sqe == NULL)
+    {
+        log_event(LOG_ERROR, NULL, "io_uring submission queue is full");
+        log_close();
+        exit(EXIT_FAILURE);
+    }
+
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = (uint64_t)(uintptr_t)source;
+    sqe->user_data = 0;
+}
+
+/**
+ * Creates an io_uring instance and maps its rings.
+ * @param ring    the ring state to fill in
+ * @param entries the number of submission queue entries
+ * @return        0 on success, -1 with errno set if io_uring cannot be used
+ */
+static int uring_init(struct uring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    size_t                 sq_size;
+    size_t                 cq_size;
+    void                  *sqes;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+
+    if(ring->fd == -1)
+    {
+        return -1;
+    }
+
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(ring->fd);
+        ring->fd = -1;
+        errno    = ENOSYS;
+        return -1;
+    }
+
+    sq_size          = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_size          = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->sqes_size  = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->rings      = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, (off_t)IORING_OFF_SQ_RING);
+    sqes             = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, (off_t)IORING_OFF_SQES);
+
+    if(ring->rings == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        int saved_errno;
+
+        saved_errno = errno;
+
+        if(ring->rings != MAP_FAILED)
+        {
+            munmap(ring->rings, ring->rings_size);
+        }
+
+        if(sqes != MAP_FAILED)
+        {
+            munmap(sqes, ring->sqes_size);
+        }
+
+        close(ring->fd);
+        ring->fd = -1;
+        errno    = saved_errno;
+        return -1;
+    }
+
+    ring->sqes       = (struct io_uring_sqe *)sqes;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head    = (unsigned int *)ring_offset(ring->rings, params.sq_off.head);
+    ring->sq_tail    = (unsigned int *)ring_offset(ring->rings, params.sq_off.tail);
+    ring->sq_mask    = (unsigned int *)ring_offset(ring->rings, params.sq_off.ring_mask);
+    ring->sq_array   = (unsigned int *)ring_offset(ring->rings, params.sq_off.array);
+    ring->cq_head    = (unsigned int *)ring_offset(ring->rings, params.cq_off.head);
+    ring->cq_tail    = (unsigned int *)ring_offset(ring->rings, params.cq_off.tail);
+    ring->cq_mask    = (unsigned int *)ring_offset(ring->rings, params.cq_off.ring_mask);
+    ring->cqes       = (struct io_uring_cqe *)ring_offset(ring->rings, params.cq_off.cqes);
+
+    return 0;
+}
+
+/**
+ * Takes the next free submission queue entry, submitting what is queued if the queue is full.
+ * The entry is published straight away: without SQPOLL the kernel only reads the queue
+ * inside io_uring_enter, by which time the caller has filled it in.
+ * @param ring the ring
+ * @return     a zeroed entry, or NULL if none could be freed up
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int         tail;
+    unsigned int         index;
+
+    tail = *ring->sq_tail;
+
+    if(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        if(syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, 0, 0, NULL, 0) == -1)
+        {
+            return NULL;
+        }
+
+        ring->unsubmitted = 0;
+
+        if(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        {
+            return NULL;
+        }
+    }
+
+    index                 = tail & *ring->sq_mask;
+    sqe                   = &ring->sqes[index];
+    ring->sq_array[index] = index;
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+
+    return sqe;
+}
+
+/**
+ * Submits every queued operation and waits for completions.
+ * @param ring         the ring
+ * @param min_complete how many completions to wait for, 0 to only submit
+ * @return             0 on success, -1 with errno set on error
+ */
+static int uring_submit_and_wait(struct uring *ring, unsigned int min_complete)
+{
+    long submitted;
+
+    submitted = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+
+    if(submitted == -1)
+    {
+        return -1;
+    }
+
+    ring->unsubmitted -= (unsigned int)submitted;
+
+    return 0;
+}
+
+/**
+ * Unmaps the rings and closes the io_uring instance.
+ * @param ring the ring
+ */
+static void uring_destroy(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->rings, ring->rings_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/**
+ * Finds a field inside the mapped rings.
+ * @param rings  the start of the ring mapping
+ * @param offset the field's offset, as reported by io_uring_setup
+ * @return       the field's address
+ */
+static void *ring_offset(void *rings, uint32_t offset)
+{
+    return (char *)rings + offset;
+}
+
+#endif
+
+// Command Runner Functions
+
+/**
+ * Split an input string into a command and its arguments.
+ * @param input The input string to be split.
+ * @param command A pointer to store the command extracted from the input.
+ * @param arena Where the argument vector is allocated, sized for the most arguments the input can hold.
+ * @return The NULL-terminated arguments, or NULL if they do not fit in the arena.
+ */
+static char **split_input(char *input, char **command, struct arena *arena)
+{
+    size_t     args_count = 0;
+    char     **args;
+    char      *savePtr;
+    const char delimiter[] = " ";
+    char      *token;
+
+    // Every argument but the last is followed by at least one space
+    args = (char **)arena_alloc(arena, (strlen(input) / 2 + 2) * sizeof(*args));
+
+    if(args == NULL)
+    {
+        return NULL;
+    }
+
+    token = strtok_r(input, delimiter, &savePtr);
+
+    while(token != NULL)
+    {
+        if(args_count == 0)
+        {
+            // Set command
+            *command = token;
+        }
+        // Set args
+        args[args_count] = token;
+
+        token = strtok_r(NULL, delimiter, &savePtr);
+        args_count++;
+    }
+    // execv requires for a null terminated list of args
+    args[args_count] = NULL;
+
+    return args;
+}
+
+/**
+ * Split a pipeline's payload into the arguments of each stage. The arguments are used in
+ * place, an empty one closes a stage, so no argument can be empty.
+ * @param payload The stages, each one's arguments NUL-terminated and closed by an empty one.
+ * @param len The length of the payload in bytes.
+ * @param stages Where each stage's NULL-terminated arguments are stored, MAX_PIPELINE_STAGES of them.
+ * @param arena Where the argument vectors are allocated.
+ * @return The number of stages, or 0 if the payload is malformed or does not fit in the arena.
+ */
+static size_t split_pipeline(char *payload, size_t len, char **stages[], struct arena *arena)
+{
+    char  **args;
+    size_t  args_count;
+    size_t  stage_start;
+    size_t  stage_count;
+    size_t  offset;
+
+    // An argument takes at least two bytes, and each stage's closing one becomes its NULL
+    args = (char **)arena_alloc(arena, (len / 2 + MAX_PIPELINE_STAGES + 1) * sizeof(*args));
+
+    if(args == NULL)
+    {
+        return 0;
+    }
+
+    args_count  = 0;
+    stage_start = 0;
+    stage_count = 0;
+    offset      = 0;
+
+    while(offset < len)
+    {
+        size_t arg_len;
+
+        arg_len = strnlen(&payload[offset], len - offset);
+
+        if(arg_len == len - offset)
+        {
+            return 0;
+        }
+
+        if(arg_len > 0)
+        {
+            args[args_count++] = &payload[offset];
+        }
+        else
+        {
+            if(args_count == stage_start || stage_count == MAX_PIPELINE_STAGES)
+            {
+                return 0;
+            }
+
+            stages[stage_count++] = &args[stage_start];
+            args[args_count++]    = NULL;
+            stage_start           = args_count;
+        }
+
+        offset += arg_len + 1;
+    }
+
+    // The last stage was never closed
+    if(args_count != stage_start)
+    {
+        return 0;
+    }
+
+    return stage_count;
+}
+
+/**
+ * Find the full path of a binary executable given its command name, from the cache when possible.
+ * @param path_cache The cache of resolved executables.
+ * @param command The command name to search for, e.g., "ls" or "gcc".
+ * @param full_path A buffer to store the full path of the executable if found.
+ * @return 0 if the executable is found, -1 if not found or an error occurs.
+ */
+int find_binary_executable(struct path_cache *path_cache, const char *command, char *full_path)
+{
+    const struct path_cache_entry *entry;
+    int                            result;
+
+    entry = path_cache_find(path_cache, command);
+
+    if(entry != NULL)
+    {
+        path_cache->hits++;
+        metrics_count(&path_cache->metrics->path_cache_hits, 1);
+
+        if(entry->full_path == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+
+        snprintf(full_path, LINE_LENGTH, "%s", entry->full_path);
+        return EXIT_SUCCESS;
+    }
+
+    path_cache->misses++;
+    metrics_count(&path_cache->metrics->path_cache_misses, 1);
+    result = search_path(command, full_path);
+    path_cache_insert(path_cache, command, result == EXIT_SUCCESS ? full_path : NULL);
+
+    return result;
+}
+
+/**
+ * Walk the PATH directories looking for an executable with the given name.
+ * @param command The command name to search for, e.g., "ls" or "gcc".
+ * @param full_path A buffer to store the full path of the executable if found.
+ * @return 0 if the executable is found, -1 if not found or an error occurs.
+ */
+static int search_path(const char *command, char *full_path)
+{
+    const char delimiter[] = ":";
+    char      *path;
+    char       path_copy[LINE_LENGTH];    // Create a copy to not alter the original
+    char      *path_token;
+    char      *savePtr;
+
+    path = getenv("PATH");
+
+    if(path == NULL)
+    {
+        log_event(LOG_ERROR, NULL, "PATH environment variable not found");
+        return EXIT_FAILURE;
+    }
+
+    strncpy(path_copy, path, sizeof(path_copy) - 1);
+    path_copy[sizeof(path_copy) - 1] = '\0';
+
+    path_token = strtok_r(path_copy, delimiter, &savePtr);
+
+    while(path_token != NULL)
+    {
+        snprintf(full_path, LINE_LENGTH, "%s/%s", path_token, command);
+        if(access(full_path, X_OK) == 0)    // Checks if the path is an executable file
+        {
+            return EXIT_SUCCESS;    // Binary executable found
+        }
+        path_token = strtok_r(NULL, delimiter, &savePtr);
+    }
+
+    return EXIT_FAILURE;
+}
+
+/**
+ * Execute a new process with the specified binary and arguments and wait for it.
+ * @param spawn_backend How the child is created, one of the SPAWN_ values.
+ * @param full_path The full path to the binary executable to be executed.
+ * @param args An array of pointers to the arguments for the new process.
+ * @param client_sockfd The client socket the child writes its output to.
+ * @param output_fd Where the child writes instead, the descriptor a Unix socket client sent, or -1.
+ * @param timeout Milliseconds the child may run, 0 for no limit.
+ * @param metrics The server's counters.
+ */
+void execute_process(int spawn_backend, const char *full_path, char **args, int client_sockfd, int output_fd, uint32_t timeout, struct server_metrics *metrics)
+{
+    struct child_io io;
+    int             status;
+    struct rusage   usage;
+    pid_t           pid;
+    uint64_t        started;
+    int             timed_out;
+
+    io.input_fd  = -1;
+    io.output_fd = output_fd != -1 ? output_fd : client_sockfd;
+    io.error_fd  = io.output_fd;
+    io.group     = 0;
+    started      = monotonic_microseconds();
+    pid          = spawn_process(spawn_backend, full_path, args, &io);
+    metrics_record(metrics, STAGE_SPAWN, started);
+
+    if(pid == -1)
+    {
+        metrics_count(&metrics->spawn_failures, 1);
+        return;
+    }
+
+    metrics_adjust(&metrics->children_running, 1);
+    started   = monotonic_microseconds();
+    timed_out = wait_for_child(pid, client_sockfd, timeout, metrics);
+    wait4(pid, &status, 0, &usage);
+    metrics_adjust(&metrics->children_running, -1);
+    metrics_record(metrics, STAGE_RUN, started);
+    metrics_record_usage(metrics, &usage);
+
+    if(timed_out)
+    {
+        dprintf(client_sockfd, "Command timed out after %" PRIu32 " ms.\n", timeout);
+    }
+
+    if(WIFEXITED(status))
+    {
+        log_event(LOG_INFO, &(struct log_fields){.present = LOG_COMMAND | LOG_PID | LOG_DURATION | LOG_STATUS, .command = args[0], .pid = pid, .duration = monotonic_microseconds() - started, .status = WEXITSTATUS(status)}, "Child process exited after %" PRIu64 " us of CPU, %ld KiB max RSS", timeval_microseconds(&usage.ru_utime) + timeval_microseconds(&usage.ru_stime), usage.ru_maxrss);
+    }
+}
+
+/**
+ * Waits for a child to exit without reaping it, while watching its deadline and the client.
+ * If either runs out, the child's process group gets SIGTERM, then SIGKILL after
+ * CANCEL_KILL_DELAY. Without pidfds the caller just blocks in waitpid().
+ * @param pid The child's pid, which is also its process group.
+ * @param client_sockfd The client socket, checked for the client hanging up.
+ * @param timeout Milliseconds the child may run, 0 for no limit.
+ * @param metrics The server's counters.
+ * @return 1 if the child was stopped for running out of time, 0 otherwise.
+ */
+static int wait_for_child(pid_t pid, int client_sockfd, uint32_t timeout, struct server_metrics *metrics)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    struct pollfd fds[2];
+    uint64_t      deadline;
+    int           signalled;
+    int           timed_out;
+
+    fds[0].fd     = (int)syscall(SYS_pidfd_open, pid, 0);
+    fds[0].events = POLLIN;
+    fds[1].fd     = client_sockfd;
+    fds[1].events = POLLRDHUP;
+
+    if(fds[0].fd == -1)
+    {
+        return 0;
+    }
+
+    deadline  = timeout > 0 ? monotonic_microseconds() + (uint64_t)timeout * MICROSECONDS_PER_MILLISECOND : 0;
+    signalled = 0;
+    timed_out = 0;
+
+    while(1)
+    {
+        uint64_t now;
+        int      wait_ms;
+        int      ready;
+
+        now     = monotonic_microseconds();
+        wait_ms = deadline == 0 ? -1 : (deadline <= now ? 0 : (int)((deadline - now + MICROSECONDS_PER_MILLISECOND - 1) / MICROSECONDS_PER_MILLISECOND));
+
+        // Once the group is being stopped only its exit matters
+        ready = poll(fds, signalled ? 1 : 2, wait_ms);
+
+        if(ready == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("poll");
+            break;
+        }
+
+        if(fds[0].revents != 0)
+        {
+            break;
+        }
+
+        if(ready > 0 && fds[1].revents == 0)
+        {
+            continue;
+        }
+
+        if(signalled == 0)
+        {
+            timed_out = ready == 0;
+            metrics_count(timed_out ? &metrics->timeouts : &metrics->cancellations, 1);
+            log_event(LOG_WARN, &(struct log_fields){.present = LOG_PID, .pid = pid}, "Command %s, terminating its process group", timed_out ? "timed out" : "was cancelled");
+            kill(-pid, SIGTERM);
+            signalled = SIGTERM;
+            deadline  = monotonic_microseconds() + (uint64_t)CANCEL_KILL_DELAY * MICROSECONDS_PER_MILLISECOND;
+        }
+        else
+        {
+            log_event(LOG_WARN, &(struct log_fields){.present = LOG_PID, .pid = pid}, "Process group is still running, killing it");
+            kill(-pid, SIGKILL);
+            deadline = 0;
+        }
+    }
+
+    close(fds[0].fd);
+
+    return timed_out;
+#else
+    (void)pid;
+    (void)client_sockfd;
+    (void)timeout;
+    (void)metrics;
+
+    return 0;
+#endif
+}
+
+/**
+ * Start a new process with the specified binary and arguments without waiting for it.
+ * The child's standard streams are wired up as io says. It leads a process group of its
+ * own, or joins a pipeline's, so a command can be cancelled along with everything it started.
+ * @param spawn_backend How the child is created, one of the SPAWN_ values.
+ * @param full_path The full path to the binary executable to be executed.
+ * @param args An array of pointers to the arguments for the new process.
+ * @param io Where the child's standard streams go and which process group it joins.
+ * @return The pid of the child, or -1 if it could not be created.
+ */
+static pid_t spawn_process(int spawn_backend, const char *full_path, char **args, const struct child_io *io)
+{
+    switch(spawn_backend)
+    {
+        case SPAWN_VFORK:
+        {
+            return spawn_with_vfork(full_path, args, io);
+        }
+        case SPAWN_POSIX:
+        {
+            return spawn_with_posix_spawn(full_path, args, io);
+        }
+        default:
+        {
+            return spawn_with_fork(full_path, args, io);
+        }
+    }
+}
+
+/**
+ * Start a child with fork() and execv(). The whole address space is copied on write,
+ * so the cost grows with the size of the server.
+ * @param full_path The full path to the binary executable to be executed.
+ * @param args An array of pointers to the arguments for the new process.
+ * @param io Where the child's standard streams go and which process group it joins.
+ * @return The pid of the child, or -1 if it could not be created.
+ */
+static pid_t spawn_with_fork(const char *full_path, char **args, const struct child_io *io)
+{
+    pid_t pid = fork();
+    if(pid == -1)
+    {
+        perror("Error creating child process");
+        return -1;
+    }
+
+    if(pid == 0)
+    {
+        sigset_t empty_mask;
+
+        // The event loop blocks SIGCHLD and the server ignores SIGPIPE, both survive execv
+        sigemptyset(&empty_mask);
+        sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        set_pinned(0);
+        setpgid(0, io->group);
+
+        if((io->input_fd != -1 && io->input_fd != STDIN_FILENO && dup2(io->input_fd, STDIN_FILENO) == -1) || (io->output_fd != STDOUT_FILENO && dup2(io->output_fd, STDOUT_FILENO) == -1) || dup2(io->error_fd, STDERR_FILENO) == -1)
+        {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+
+        execv(full_path, args);
+        perror("execv");
+        _exit(EXIT_FAILURE);
+    }
+
+    // Also from this side, so the group exists before anything is sent to it
+    setpgid(pid, io->group != 0 ? io->group : pid);
+
+    return pid;
+}
+
+/**
+ * Start a child with vfork() and execv(). The child borrows the parent's memory until it
+ * calls execv, so no page tables are copied. The parent is suspended until then, and the
+ * child may only make system calls before it.
+ * @param full_path The full path to the binary executable to be executed.
+ * @param args An array of pointers to the arguments for the new process.
+ * @param io Where the child's standard streams go and which process group it joins.
+ * @return The pid of the child, or -1 if it could not be created.
+ */
+static pid_t spawn_with_vfork(const char *full_path, char **args, const struct child_io *io)
+{
+    sigset_t empty_mask;
+    pid_t    pid;
+
+    sigemptyset(&empty_mask);
+
+    pid = vfork();
+    if(pid == -1)
+    {
+        perror("Error creating child process");
+        return -1;
+    }
+
+    if(pid == 0)
+    {
+        // The signal mask and dispositions belong to the child, only memory is shared
+        sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        set_pinned(0);
+        setpgid(0, io->group);
+
+        if((io->input_fd != -1 && io->input_fd != STDIN_FILENO && dup2(io->input_fd, STDIN_FILENO) == -1) || (io->output_fd != STDOUT_FILENO && dup2(io->output_fd, STDOUT_FILENO) == -1) || dup2(io->error_fd, STDERR_FILENO) == -1)
+        {
+            _exit(EXIT_FAILURE);
+        }
+
+        execv(full_path, args);
+        _exit(EXIT_FAILURE);
+    }
+
+    return pid;
+}
+
+/**
+ * Start a child with posix_spawn(). The output is wired up through file actions and the
+ * signal state through spawn attributes; glibc implements it with clone(CLONE_VM | CLONE_VFORK).
+ * @param full_path The full path to the binary executable to be executed.
+ * @param args An array of pointers to the arguments for the new process.
+ * @param io Where the child's standard streams go and which process group it joins.
+ * @return The pid of the child, or -1 if it could not be created.
+ */
+static pid_t spawn_with_posix_spawn(const char *full_path, char **args, const struct child_io *io)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t          attributes;
+    sigset_t                   empty_mask;
+    sigset_t                   default_signals;
+    pid_t                      pid;
+    int                        result;
+
+    sigemptyset(&empty_mask);
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attributes);
+
+    if(io->input_fd != -1 && io->input_fd != STDIN_FILENO)
+    {
+        posix_spawn_file_actions_adddup2(&actions, io->input_fd, STDIN_FILENO);
+    }
+
+    if(io->output_fd != STDOUT_FILENO)
+    {
+        posix_spawn_file_actions_adddup2(&actions, io->output_fd, STDOUT_FILENO);
+    }
+
+    posix_spawn_file_actions_adddup2(&actions, io->error_fd, STDERR_FILENO);
+    posix_spawnattr_setsigmask(&attributes, &empty_mask);
+    posix_spawnattr_setsigdefault(&attributes, &default_signals);
+    posix_spawnattr_setpgroup(&attributes, io->group);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    // There is no spawn attribute for the CPU mask, the child takes the calling thread's
+    set_pinned(0);
+    result = posix_spawn(&pid, full_path, &actions, &attributes, args, environ);
+    set_pinned(1);
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if(result != 0)
+    {
+        errno = result;
+        perror("posix_spawn");
+        return -1;
+    }
+
+    return pid;
+}
+
+/**
+ * Free the memory allocated for the command and its arguments.
+ * @param command The pointer to the command string that needs to be freed.
+ * @param args An array of pointers to the arguments that need to be freed.
+ * @param args_used The number of arguments stored in the 'args' array.
+ */
+//static void free_memory(char *command, char **args, int args_used)
+//{
+//    free(command);
+//    for(int i = 0; i < args_used; i++)
+//    {
+//        if(args[i] != NULL)
+//        {
+//            //            free(args[i]);
+//        }
+//    }
+//    printf("Memory deallocated\n");
+//}
+
+// Path Cache Functions
+
+/**
+ * Sets up an empty cache, starts watching the PATH directories and fills the cache from them.
+ * @param path_cache the cache to initialise
+ * @param metrics    the server's counters, where hits and misses are also counted
+ */
+static void path_cache_init(struct path_cache *path_cache, struct server_metrics *metrics)
+{
+    memset(path_cache, 0, sizeof(*path_cache));
+    path_cache->watch_fd = -1;
+    path_cache->metrics  = metrics;
+
+#if defined(__linux__)
+    {
+        const char *path;
+
+        path                 = getenv("PATH");
+        path_cache->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        if(path_cache->watch_fd == -1)
+        {
+            perror("inotify_init1");
+        }
+        else if(path != NULL)
+        {
+            char  path_copy[LINE_LENGTH];
+            char *path_token;
+            char *savePtr;
+
+            strncpy(path_copy, path, sizeof(path_copy) - 1);
+            path_copy[sizeof(path_copy) - 1] = '\0';
+
+            // Any binary appearing, disappearing or changing mode can change what a command resolves to
+            for(path_token = strtok_r(path_copy, ":", &savePtr); path_token != NULL; path_token = strtok_r(NULL, ":", &savePtr))
+            {
+                inotify_add_watch(path_cache->watch_fd, path_token, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+            }
+        }
+    }
+#endif
+
+    path_cache_prewarm(path_cache);
+}
+
+/**
+ * Adds every executable in the PATH directories to the cache. Earlier directories win,
+ * the same way search_path() would resolve them.
+ * @param path_cache the cache to fill
+ */
+static void path_cache_prewarm(struct path_cache *path_cache)
+{
+    const char *path;
+    char        path_copy[LINE_LENGTH];
+    char       *path_token;
+    char       *savePtr;
+
+    path = getenv("PATH");
+
+    if(path == NULL)
+    {
+        return;
+    }
+
+    strncpy(path_copy, path, sizeof(path_copy) - 1);
+    path_copy[sizeof(path_copy) - 1] = '\0';
+
+    for(path_token = strtok_r(path_copy, ":", &savePtr); path_token != NULL; path_token = strtok_r(NULL, ":", &savePtr))
+    {
+        DIR                 *directory;
+        const struct dirent *file;
+
+        directory = opendir(path_token);
+
+        if(directory == NULL)
+        {
+            continue;
+        }
+
+        while((file = readdir(directory)) != NULL)
+        {
+            char full_path[LINE_LENGTH];
+
+            if(file->d_name[0] == '.' || file->d_type == DT_DIR || path_cache_find(path_cache, file->d_name) != NULL)
+            {
+                continue;
+            }
+
+            snprintf(full_path, sizeof(full_path), "%s/%s", path_token, file->d_name);
+
+            if(access(full_path, X_OK) == 0)
+            {
+                path_cache_insert(path_cache, file->d_name, full_path);
+            }
+        }
+
+        closedir(directory);
+    }
+
+    log_event(LOG_INFO, NULL, "Path cache pre-warmed with %zu commands", path_cache->entries);
+}
+
+/**
+ * Looks up a command, dropping its entry if it has expired.
+ * @param path_cache the cache to search
+ * @param command    the command name
+ * @return           the entry, or NULL if the command is not cached
+ */
+static struct path_cache_entry *path_cache_find(struct path_cache *path_cache, const char *command)
+{
+    struct path_cache_entry **link;
+    time_t                    now;
+
+    now = monotonic_seconds();
+
+    for(link = &path_cache->buckets[hash_string(command) % PATH_CACHE_BUCKETS]; *link != NULL; link = &(*link)->next)
+    {
+        struct path_cache_entry *entry;
+
+        entry = *link;
+
+        if(strcmp(entry->command, command) != 0)
+        {
+            continue;
+        }
+
+        if(entry->expires > now)
+        {
+            return entry;
+        }
+
+        *link = entry->next;
+        path_cache->entries--;
+        free(entry);
+        return NULL;
+    }
+
+    return NULL;
+}
+
+/**
+ * Adds a resolved command to the cache. A full cache is swept first, and if every entry is
+ * still a live command on the PATH the new one is simply not cached, so clients sending
+ * random names cannot grow it without bound.
+ * @param path_cache the cache to add to
+ * @param command    the command name
+ * @param full_path  the executable it resolves to, or NULL if it is not on the PATH
+ */
+static void path_cache_insert(struct path_cache *path_cache, const char *command, const char *full_path)
+{
+    struct path_cache_entry *entry;
+    size_t                   command_size;
+    size_t                   full_path_size;
+    uint32_t                 bucket;
+
+    if(path_cache->entries >= PATH_CACHE_MAX_ENTRIES)
+    {
+        path_cache_sweep(path_cache);
+    }
+
+    if(path_cache->entries >= PATH_CACHE_MAX_ENTRIES)
+    {
+        return;
+    }
+
+    command_size   = strlen(command) + 1;
+    full_path_size = full_path != NULL ? strlen(full_path) + 1 : 0;
+
+    // One allocation holds the entry and both strings
+    entry = (struct path_cache_entry *)malloc(sizeof(*entry) + command_size + full_path_size);
+
+    if(entry == NULL)
+    {
+        return;
+    }
+
+    entry->command   = entry->storage;
+    entry->full_path = NULL;
+    memcpy(entry->command, command, command_size);
+
+    if(full_path != NULL)
+    {
+        entry->full_path = entry->storage + command_size;
+        memcpy(entry->full_path, full_path, full_path_size);
+    }
+
+    bucket                      = hash_string(command) % PATH_CACHE_BUCKETS;
+    entry->expires              = monotonic_seconds() + PATH_CACHE_TTL;
+    entry->next                 = path_cache->buckets[bucket];
+    path_cache->buckets[bucket] = entry;
+    path_cache->entries++;
+}
+
+/**
+ * Makes room in a full cache. Expired entries go first, since lookups only drop the ones they
+ * come across. If that is not enough, every command that is not on the PATH goes too: random or
+ * mistyped names only ever add those, and they are cheap to look up again.
+ * @param path_cache the cache to sweep
+ */
+static void path_cache_sweep(struct path_cache *path_cache)
+{
+    time_t now;
+
+    now = monotonic_seconds();
+
+    for(int negatives = 0; negatives < 2 && path_cache->entries >= PATH_CACHE_MAX_ENTRIES; negatives++)
+    {
+        for(size_t i = 0; i < PATH_CACHE_BUCKETS; i++)
+        {
+            struct path_cache_entry **link;
+
+            link = &path_cache->buckets[i];
+
+            while(*link != NULL)
+            {
+                struct path_cache_entry *entry;
+
+                entry = *link;
+
+                if(entry->expires > now && (!negatives || entry->full_path != NULL))
+                {
+                    link = &entry->next;
+                    continue;
+                }
+
+                *link = entry->next;
+                path_cache->entries--;
+                free(entry);
+            }
+        }
+    }
+}
+
+/**
+ * Drains pending inotify events and drops the whole cache if a PATH directory changed.
+ * @param path_cache the cache to check
+ */
+static void path_cache_poll(struct path_cache *path_cache)
+{
+    char    events[LINE_LENGTH];
+    ssize_t bytes_read;
+    int     changed;
+
+    if(path_cache->watch_fd == -1)
+    {
+        return;
+    }
+
+    changed = 0;
+
+    while((bytes_read = read(path_cache->watch_fd, events, sizeof(events))) > 0)
+    {
+        changed = 1;
+    }
+
+    if(changed)
+    {
+        path_cache->invalidations++;
+        metrics_count(&path_cache->metrics->path_cache_invalidations, 1);
+        path_cache_flush(path_cache);
+    }
+}
+
+/**
+ * Removes every entry from the cache.
+ * @param path_cache the cache to empty
+ */
+static void path_cache_flush(struct path_cache *path_cache)
+{
+    for(size_t i = 0; i < PATH_CACHE_BUCKETS; i++)
+    {
+        while(path_cache->buckets[i] != NULL)
+        {
+            struct path_cache_entry *entry;
+
+            entry                  = path_cache->buckets[i];
+            path_cache->buckets[i] = entry->next;
+            free(entry);
+        }
+    }
+
+    path_cache->entries = 0;
+}
+
+/**
+ * Frees the cache and stops watching the PATH directories.
+ * @param path_cache the cache to destroy
+ */
+static void path_cache_destroy(struct path_cache *path_cache)
+{
+    path_cache_flush(path_cache);
+
+    if(path_cache->watch_fd != -1)
+    {
+        close(path_cache->watch_fd);
+        path_cache->watch_fd = -1;
+    }
+}
+
+/**
+ * Hashes a string with 32-bit FNV-1a.
+ * @param string the NUL-terminated string to hash
+ * @return       the hash
+ */
+static uint32_t hash_string(const char *string)
+{
+    uint32_t hash;
+
+    hash = HASH_OFFSET_BASIS;
+
+    for(const char *c = string; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= HASH_PRIME;
+    }
+
+    return hash;
+}
+
+/**
+ * Reads a clock that never jumps when the wall clock is changed.
+ * @return the current monotonic time in seconds
+ */
+static time_t monotonic_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec;
+}
+
+/**
+ * Reads the monotonic clock with enough resolution to time a single request stage.
+ * @return the current monotonic time in microseconds
+ */
+static uint64_t monotonic_microseconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * MICROSECONDS_PER_SECOND + (uint64_t)now.tv_nsec / NANOSECONDS_PER_MICROSECOND;
+}
+
+// Result Cache Functions
+
+/**
+ * Finds the -c rule for a command.
+ * @param options the parsed command line options
+ * @param command the command name, as the client sent it
+ * @return        the rule, or NULL if the command's results are never cached
+ */
+static const struct cache_rule *find_cache_rule(const struct server_options *options, const char *command)
+{
+    size_t command_len;
+
+    command_len = strlen(command);
+
+    for(size_t i = 0; i < options->cache_rule_count; i++)
+    {
+        const struct cache_rule *rule;
+
+        rule = &options->cache_rules[i];
+
+        if(rule->command_len == command_len && memcmp(rule->command, command, command_len) == 0)
+        {
+            return rule;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Builds the cache key of a command line. split_input() drops repeated spaces, so requests
+ * that differ only in spacing share a key.
+ * @param args the arguments, NULL-terminated
+ * @param key  where the key is stored
+ * @param size the size of key, enough for the command line it was split from
+ */
+static void join_arguments(char **args, char *key, size_t size)
+{
+    size_t len;
+
+    len    = 0;
+    key[0] = '\0';
+
+    for(size_t i = 0; args[i] != NULL; i++)
+    {
+        size_t arg_len;
+
+        arg_len = strlen(args[i]);
+
+        if(len + arg_len + 2 > size)
+        {
+            break;
+        }
+
+        if(i > 0)
+        {
+            key[len++] = ' ';
+        }
+
+        memcpy(&key[len], args[i], arg_len + 1);
+        len += arg_len;
+    }
+}
+
+/**
+ * Looks up a command line, dropping its result if it has expired. Runs still going never expire.
+ * @param cache the cache to search
+ * @param key   the command line's key
+ * @return      the entry, or NULL if the command line is neither cached nor running
+ */
+static struct result_cache_entry *result_cache_find(struct result_cache *cache, const char *key)
+{
+    struct result_cache_entry **link;
+
+    for(link = &cache->buckets[hash_string(key) % RESULT_CACHE_BUCKETS]; *link != NULL; link = &(*link)->next)
+    {
+        struct result_cache_entry *entry;
+
+        entry = *link;
+
+        if(entry->oversized || strcmp(entry->key, key) != 0)
+        {
+            continue;
+        }
+
+        if(!entry->complete || entry->expires > monotonic_microseconds())
+        {
+            return entry;
+        }
+
+        *link = entry->next;
+        cache->entries--;
+        result_cache_free_entry(entry);
+        return NULL;
+    }
+
+    return NULL;
+}
+
+/**
+ * Adds the entry for a run that is about to start. A full cache first drops its expired
+ * results and, if that does not make room, the run is not shared.
+ * @param cache the cache to add to
+ * @param key   the command line's key
+ * @param ttl   how long the result is kept once the run is done, in microseconds
+ * @return      the entry, or NULL if there was no room
+ */
+static struct result_cache_entry *result_cache_insert(struct result_cache *cache, const char *key, uint64_t ttl)
+{
+    struct result_cache_entry *entry;
+    size_t                     key_size;
+    uint32_t                   bucket;
+
+    if(cache->entries >= RESULT_CACHE_MAX_ENTRIES)
+    {
+        result_cache_sweep(cache);
+
+        if(cache->entries >= RESULT_CACHE_MAX_ENTRIES)
+        {
+            return NULL;
+        }
+    }
+
+    key_size = strlen(key) + 1;
+    entry    = (struct result_cache_entry *)calloc(1, sizeof(*entry) + key_size);
+
+    if(entry == NULL)
+    {
+        return NULL;
+    }
+
+    entry->key = entry->storage;
+    memcpy(entry->key, key, key_size);
+
+    bucket                 = hash_string(key) % RESULT_CACHE_BUCKETS;
+    entry->ttl             = ttl;
+    entry->next            = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    cache->entries++;
+
+    return entry;
+}
+
+// The analyzer cannot follow the entry back from an io_uring completion and takes the grown buffer for a leak
+#if defined(__GNUC__) && !defined(__clang__)
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wanalyzer-malloc-leak"
+#endif
+
+/**
+ * Keeps a chunk of a run's output. The caller makes sure it fits in RESULT_CACHE_MAX_OUTPUT.
+ * @param entry  the entry of the run
+ * @param output the output bytes
+ * @param len    the number of output bytes
+ */
+static void result_cache_append(struct result_cache_entry *entry, const char *output, size_t len)
+{
+    if(entry->output_len + len > entry->output_capacity)
+    {
+        char  *grown;
+        size_t capacity;
+
+        capacity = entry->output_capacity > 0 ? entry->output_capacity : OUTPUT_CHUNK_LEN;
+
+        while(capacity < entry->output_len + len)
+        {
+            capacity *= 2;
+        }
+
+        grown = (char *)realloc(entry->output, capacity);
+
+        if(grown == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+
+        entry->output          = grown;
+        entry->output_capacity = capacity;
+    }
+
+    memcpy(&entry->output[entry->output_len], output, len);
+    entry->output_len += len;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+    #pragma GCC diagnostic pop
+#endif
+
+/**
+ * Takes an entry out of the table without freeing it.
+ * @param cache the cache the entry is in
+ * @param entry the entry to remove
+ */
+static void result_cache_unlink(struct result_cache *cache, const struct result_cache_entry *entry)
+{
+    for(struct result_cache_entry **link = &cache->buckets[hash_string(entry->key) % RESULT_CACHE_BUCKETS]; *link != NULL; link = &(*link)->next)
+    {
+        if(*link == entry)
+        {
+            *link = entry->next;
+            cache->entries--;
+            return;
+        }
+    }
+}
+
+/**
+ * Drops every expired result. Lookups only drop the entries they come across, which leaves
+ * results nobody asks for again until the cache fills up.
+ * @param cache the cache to sweep
+ */
+static void result_cache_sweep(struct result_cache *cache)
+{
+    uint64_t now;
+
+    now = monotonic_microseconds();
+
+    for(size_t i = 0; i < RESULT_CACHE_BUCKETS; i++)
+    {
+        struct result_cache_entry **link;
+
+        link = &cache->buckets[i];
+
+        while(*link != NULL)
+        {
+            struct result_cache_entry *entry;
+
+            entry = *link;
+
+            if(!entry->complete || entry->expires > now)
+            {
+                link = &entry->next;
+                continue;
+            }
+
+            *link = entry->next;
+            cache->entries--;
+            result_cache_free_entry(entry);
+        }
+    }
+}
+
+/**
+ * Frees an entry, its output and whatever requests are still waiting on it.
+ * @param entry the entry to free
+ */
+static void result_cache_free_entry(struct result_cache_entry *entry)
+{
+    while(entry->waiters != NULL)
+    {
+        struct result_waiter *waiter;
+
+        waiter         = entry->waiters;
+        entry->waiters = waiter->next;
+        free(waiter);
+    }
+
+    free(entry->output);
+    free(entry);
+}
+
+/**
+ * Frees every entry in the cache.
+ * @param cache the cache to destroy
+ */
+static void result_cache_destroy(struct result_cache *cache)
+{
+    for(size_t i = 0; i < RESULT_CACHE_BUCKETS; i++)
+    {
+        while(cache->buckets[i] != NULL)
+        {
+            struct result_cache_entry *entry;
+
+            entry             = cache->buckets[i];
+            cache->buckets[i] = entry->next;
+            result_cache_free_entry(entry);
+        }
+    }
+
+    cache->entries = 0;
+}
+
+// Name Resolution Functions
+
+/**
+ * Starts the background resolver thread.
+ * @return the resolver
+ */
+static struct resolver *resolver_create(void)
+{
+    struct resolver *resolver;
+    sigset_t         all_signals;
+    sigset_t         old_mask;
+    int              result;
+
+    resolver = (struct resolver *)calloc(1, sizeof(*resolver));
+
+    if(resolver == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&resolver->lock, NULL);
+    pthread_cond_init(&resolver->wake, NULL);
+
+    // The thread inherits this mask, so SIGINT and SIGCHLD keep going to the server loop
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+    result = pthread_create(&resolver->thread, NULL, resolver_thread, resolver);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if(result != 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        exit(EXIT_FAILURE);
+    }
+
+    return resolver;
+}
+
+/**
+ * Stops the resolver thread, waiting for any lookup in progress, and frees the resolver.
+ * @param resolver the resolver to destroy
+ */
+static void resolver_destroy(struct resolver *resolver)
+{
+    pthread_mutex_lock(&resolver->lock);
+    resolver->stopping = 1;
+    pthread_cond_signal(&resolver->wake);
+    pthread_mutex_unlock(&resolver->lock);
+
+    pthread_join(resolver->thread, NULL);
+    pthread_cond_destroy(&resolver->wake);
+    pthread_mutex_destroy(&resolver->lock);
+    free(resolver);
+}
+
+/**
+ * Gets the cached host name for a client address without blocking. Unknown addresses are
+ * queued for the background thread, or skipped if it is already too far behind.
+ * @param resolver the resolver
+ * @param addr     the client address
+ * @param addr_len the length of the client address
+ * @param host     a buffer for the host name
+ * @param host_len the size of the host buffer
+ * @return         1 if the host name was filled in, 0 if it is not known yet
+ */
+static int resolver_lookup(struct resolver *resolver, const struct sockaddr_storage *addr, socklen_t addr_len, char *host, size_t host_len)
+{
+    struct resolver_entry *entry;
+    int                    found;
+
+    found = 0;
+    pthread_mutex_lock(&resolver->lock);
+    entry = resolver_find(resolver, addr);
+
+    if(entry != NULL)
+    {
+        resolver_unlink(resolver, entry);
+        resolver_push_front(resolver, entry);
+
+        if(entry->resolved)
+        {
+            snprintf(host, host_len, "%s", entry->host);
+            found = 1;
+        }
+    }
+    else if(resolver->queue_count < RESOLVER_QUEUE_LEN)
+    {
+        if(resolver->entries_used < RESOLVER_CACHE_SIZE)
+        {
+            entry = &resolver->entries[resolver->entries_used++];
+        }
+        else
+        {
+            // Evict the least recently seen address. If its lookup is still queued, the thread
+            // copies the address when it starts and resolves the replacement instead.
+            entry = resolver->least_recent;
+            resolver_unlink(resolver, entry);
+        }
+
+        memset(entry, 0, sizeof(*entry));
+        memcpy(&entry->addr, addr, addr_len);
+        entry->addr_len = addr_len;
+        resolver_push_front(resolver, entry);
+
+        resolver->queue[(resolver->queue_head + resolver->queue_count) % RESOLVER_QUEUE_LEN] = entry;
+        resolver->queue_count++;
+        pthread_cond_signal(&resolver->wake);
+    }
+
+    pthread_mutex_unlock(&resolver->lock);
+
+    return found;
+}
+
+/**
+ * Runs queued reverse lookups one at a time and logs each result.
+ * @param arg the resolver
+ * @return    NULL
+ */
+static void *resolver_thread(void *arg)
+{
+    struct resolver *resolver;
+
+    resolver = (struct resolver *)arg;
+    pthread_mutex_lock(&resolver->lock);
+
+    while(!resolver->stopping)
+    {
+        struct resolver_entry  *entry;
+        struct sockaddr_storage addr;
+        socklen_t               addr_len;
+        char                    host[NI_MAXHOST];
+        char                    address[NI_MAXHOST];
+
+        if(resolver->queue_count == 0)
+        {
+            pthread_cond_wait(&resolver->wake, &resolver->lock);
+            continue;
+        }
+
+        entry                = resolver->queue[resolver->queue_head];
+        resolver->queue_head = (resolver->queue_head + 1) % RESOLVER_QUEUE_LEN;
+        resolver->queue_count--;
+        addr                 = entry->addr;
+        addr_len             = entry->addr_len;
+
+        // The lookup can take seconds, so never hold the lock across it
+        pthread_mutex_unlock(&resolver->lock);
+
+        if(getnameinfo((const struct sockaddr *)&addr, addr_len, host, sizeof(host), NULL, 0, NI_NAMEREQD) != 0)
+        {
+            getnameinfo((const struct sockaddr *)&addr, addr_len, host, sizeof(host), NULL, 0, NI_NUMERICHOST);
+        }
+
+        getnameinfo((const struct sockaddr *)&addr, addr_len, address, sizeof(address), NULL, 0, NI_NUMERICHOST);
+        log_event(LOG_DEBUG, NULL, "Resolved %s to %s", address, host);
+
+        pthread_mutex_lock(&resolver->lock);
+
+        // The entry may have been reused for another address while the lookup ran
+        entry = resolver_find(resolver, &addr);
+
+        if(entry != NULL && !entry->resolved)
+        {
+            snprintf(entry->host, sizeof(entry->host), "%s", host);
+            entry->resolved = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&resolver->lock);
+
+    return NULL;
+}
+
+/**
+ * Finds the cache entry for a client address. The caller must hold the lock.
+ * @param resolver the resolver
+ * @param addr     the client address, its port is ignored
+ * @return         the entry, or NULL if the address is not cached
+ */
+static struct resolver_entry *resolver_find(struct resolver *resolver, const struct sockaddr_storage *addr)
+{
+    for(struct resolver_entry *entry = resolver->most_recent; entry != NULL; entry = entry->next)
+    {
+        if(same_host(&entry->addr, addr))
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Removes an entry from the recency list. The caller must hold the lock.
+ * @param resolver the resolver
+ * @param entry    the entry to remove
+ */
+static void resolver_unlink(struct resolver *resolver, struct resolver_entry *entry)
+{
+    if(entry->prev != NULL)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        resolver->most_recent = entry->next;
+    }
+
+    if(entry->next != NULL)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        resolver->least_recent = entry->prev;
+    }
+
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+/**
+ * Makes an entry the most recently used. The caller must hold the lock.
+ * @param resolver the resolver
+ * @param entry    the entry, not currently in the list
+ */
+static void resolver_push_front(struct resolver *resolver, struct resolver_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = resolver->most_recent;
+
+    if(resolver->most_recent != NULL)
+    {
+        resolver->most_recent->prev = entry;
+    }
+    else
+    {
+        resolver->least_recent = entry;
+    }
+
+    resolver->most_recent = entry;
+}
+
+/**
+ * Checks whether two socket addresses name the same host, ignoring their ports.
+ * @param a the first address
+ * @param b the second address
+ * @return  1 if they are the same host, 0 otherwise
+ */
+static int same_host(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+    if(a->ss_family != b->ss_family)
+    {
+        return 0;
+    }
+
+    if(a->ss_family == AF_INET)
+    {
+        struct sockaddr_in ipv4_a;
+        struct sockaddr_in ipv4_b;
+
+        memcpy(&ipv4_a, a, sizeof(ipv4_a));
+        memcpy(&ipv4_b, b, sizeof(ipv4_b));
+
+        return ipv4_a.sin_addr.s_addr == ipv4_b.sin_addr.s_addr;
+    }
+
+    if(a->ss_family == AF_INET6)
+    {
+        struct sockaddr_in6 ipv6_a;
+        struct sockaddr_in6 ipv6_b;
+
+        memcpy(&ipv6_a, a, sizeof(ipv6_a));
+        memcpy(&ipv6_b, b, sizeof(ipv6_b));
+
+        return memcmp(&ipv6_a.sin6_addr, &ipv6_b.sin6_addr, sizeof(ipv6_a.sin6_addr)) == 0;
+    }
+
+    return 0;
+}
+
+// Metrics Functions
+
+/**
+ * Allocates zeroed counters in memory shared with every process forked afterwards.
+ * @return the counters
+ */
+static struct server_metrics *metrics_create(void)
+{
+    void *memory;
+
+    memory = mmap(NULL, sizeof(struct server_metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(memory == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    return (struct server_metrics *)memory;
+}
+
+/**
+ * Unmaps the counters.
+ * @param metrics the counters
+ */
+static void metrics_destroy(struct server_metrics *metrics)
+{
+    munmap(metrics, sizeof(*metrics));
+}
+
+/**
+ * Adds to a counter.
+ * @param counter the counter
+ * @param amount  how much to add
+ */
+static void metrics_count(_Atomic uint64_t *counter, uint64_t amount)
+{
+    atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
+}
+
+/**
+ * Moves a gauge up or down.
+ * @param gauge the gauge
+ * @param delta how much to add, negative to subtract
+ */
+static void metrics_adjust(_Atomic int64_t *gauge, int64_t delta)
+{
+    atomic_fetch_add_explicit(gauge, delta, memory_order_relaxed);
+}
+
+/**
+ * Records how long a stage took, from when it started until now.
+ * @param metrics the counters
+ * @param stage   one of the STAGE_ values
+ * @param started when the stage started, in monotonic microseconds
+ */
+static void metrics_record(struct server_metrics *metrics, int stage, uint64_t started)
+{
+    metrics_observe(&metrics->stages[stage], metrics_bucket_bounds, monotonic_microseconds() - started);
+}
+
+/**
+ * Records what a reaped child used: its CPU time and peak memory into their histograms, and
+ * its context switches into their counters.
+ * @param metrics the counters
+ * @param usage   what wait4 reported for the child
+ */
+static void metrics_record_usage(struct server_metrics *metrics, const struct rusage *usage)
+{
+    uint64_t user;
+    uint64_t system;
+
+    user   = timeval_microseconds(&usage->ru_utime);
+    system = timeval_microseconds(&usage->ru_stime);
+    metrics_count(&metrics->child_user_time, user);
+    metrics_count(&metrics->child_system_time, system);
+    metrics_count(&metrics->child_voluntary_switches, usage->ru_nvcsw > 0 ? (uint64_t)usage->ru_nvcsw : 0);
+    metrics_count(&metrics->child_involuntary_switches, usage->ru_nivcsw > 0 ? (uint64_t)usage->ru_nivcsw : 0);
+    metrics_observe(&metrics->child_cpu, metrics_bucket_bounds, user + system);
+    metrics_observe(&metrics->child_rss, metrics_rss_bounds, usage->ru_maxrss > 0 ? (uint64_t)usage->ru_maxrss : 0);
+}
+
+/**
+ * Counts a value into the first bucket whose bound holds it.
+ * @param histogram the histogram
+ * @param bounds    the upper bounds of its METRICS_BUCKETS buckets, in ascending order
+ * @param value     the value, in the unit of the bounds
+ */
+static void metrics_observe(struct stage_histogram *histogram, const uint64_t *bounds, uint64_t value)
+{
+    size_t bucket;
+
+    for(bucket = 0; bucket < METRICS_BUCKETS && value > bounds[bucket]; bucket++)
+    {
+    }
+
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+}
+
+/**
+ * Converts a time from a struct rusage into microseconds.
+ * @param time the time
+ * @return     the time in microseconds
+ */
+static uint64_t timeval_microseconds(const struct timeval *time)
+{
+    return (uint64_t)time->tv_sec * MICROSECONDS_PER_SECOND + (uint64_t)time->tv_usec;
+}
+
+/**
+ * Writes every counter in the Prometheus text exposition format.
+ * @param metrics the counters
+ * @param buffer  where the text is written
+ * @param size    the size of the buffer
+ * @return        the length of the text
+ */
+static size_t metrics_render(struct server_metrics *metrics, char *buffer, size_t size)
+{
+    static const char *const stage_names[STAGE_COUNT] = {"accept", "read", "lookup", "spawn", "run", "drain", "queue"};
+    uint64_t                 hits;
+    uint64_t                 misses;
+    size_t                   offset;
+
+    offset = 0;
+    hits   = atomic_load_explicit(&metrics->path_cache_hits, memory_order_relaxed);
+    misses = atomic_load_explicit(&metrics->path_cache_misses, memory_order_relaxed);
+
+    metrics_append(buffer, size, &offset, "# HELP server_connections_accepted_total Connections accepted.\n# TYPE server_connections_accepted_total counter\nserver_connections_accepted_total %" PRIu64 "\n", atomic_load_explicit(&metrics->connections_accepted, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_connections_open Connections currently open.\n# TYPE server_connections_open gauge\nserver_connections_open %" PRId64 "\n", atomic_load_explicit(&metrics->connections_open, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_requests_total Commands received.\n# TYPE server_requests_total counter\nserver_requests_total %" PRIu64 "\n", atomic_load_explicit(&metrics->requests, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_commands_not_found_total Commands that were not on the PATH.\n# TYPE server_commands_not_found_total counter\nserver_commands_not_found_total %" PRIu64 "\n", atomic_load_explicit(&metrics->commands_not_found, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_spawn_failures_total Commands whose child could not be started.\n# TYPE server_spawn_failures_total counter\nserver_spawn_failures_total %" PRIu64 "\n", atomic_load_explicit(&metrics->spawn_failures, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_children_running Children that have not been reaped yet.\n# TYPE server_children_running gauge\nserver_children_running %" PRId64 "\n", atomic_load_explicit(&metrics->children_running, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_output_bytes_total Output bytes forwarded to session clients.\n# TYPE server_output_bytes_total counter\nserver_output_bytes_total %" PRIu64 "\n", atomic_load_explicit(&metrics->output_bytes, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_compressed_bytes_total Compressed bytes sent for that output.\n# TYPE server_compressed_bytes_total counter\nserver_compressed_bytes_total %" PRIu64 "\n", atomic_load_explicit(&metrics->compressed_bytes, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_path_cache_hits_total Command lookups answered by the path cache.\n# TYPE server_path_cache_hits_total counter\nserver_path_cache_hits_total %" PRIu64 "\n", hits);
+    metrics_append(buffer, size, &offset, "# HELP server_path_cache_misses_total Command lookups that searched the PATH.\n# TYPE server_path_cache_misses_total counter\nserver_path_cache_misses_total %" PRIu64 "\n", misses);
+    metrics_append(buffer, size, &offset, "# HELP server_path_cache_hit_ratio Share of command lookups answered by the path cache.\n# TYPE server_path_cache_hit_ratio gauge\nserver_path_cache_hit_ratio %.4f\n", hits + misses > 0 ? (double)hits / (double)(hits + misses) : 0.0);
+    metrics_append(buffer, size, &offset, "# HELP server_path_cache_invalidations_total Times a PATH directory changed and the cache was dropped.\n# TYPE server_path_cache_invalidations_total counter\nserver_path_cache_invalidations_total %" PRIu64 "\n", atomic_load_explicit(&metrics->path_cache_invalidations, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_result_cache_hits_total Requests answered from a cached result.\n# TYPE server_result_cache_hits_total counter\nserver_result_cache_hits_total %" PRIu64 "\n", atomic_load_explicit(&metrics->result_cache_hits, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_result_cache_coalesced_total Requests that shared a run of the same command line already going.\n# TYPE server_result_cache_coalesced_total counter\nserver_result_cache_coalesced_total %" PRIu64 "\n", atomic_load_explicit(&metrics->result_cache_coalesced, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_result_cache_misses_total Cacheable requests that started a run.\n# TYPE server_result_cache_misses_total counter\nserver_result_cache_misses_total %" PRIu64 "\n", atomic_load_explicit(&metrics->result_cache_misses, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_warm_requests_total Commands run by a warm worker.\n# TYPE server_warm_requests_total counter\nserver_warm_requests_total %" PRIu64 "\n", atomic_load_explicit(&metrics->warm_requests, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_warm_recycles_total Warm workers replaced after their last job.\n# TYPE server_warm_recycles_total counter\nserver_warm_recycles_total %" PRIu64 "\n", atomic_load_explicit(&metrics->warm_recycles, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_admission_queued_total Commands queued for a slot under the running limit.\n# TYPE server_admission_queued_total counter\nserver_admission_queued_total %" PRIu64 "\n", atomic_load_explicit(&metrics->admission_queued, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_admission_rejected_total Commands turned away with a retry hint.\n# TYPE server_admission_rejected_total counter\nserver_admission_rejected_total %" PRIu64 "\n", atomic_load_explicit(&metrics->admission_rejected, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_admission_queue_depth Commands waiting for admission.\n# TYPE server_admission_queue_depth gauge\nserver_admission_queue_depth %" PRId64 "\n", atomic_load_explicit(&metrics->admission_queue_depth, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_accept_pauses_total Times accepting stopped because nothing more could be admitted or queued.\n# TYPE server_accept_pauses_total counter\nserver_accept_pauses_total %" PRIu64 "\n", atomic_load_explicit(&metrics->accept_pauses, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_timeouts_total Commands stopped for running past their deadline.\n# TYPE server_timeouts_total counter\nserver_timeouts_total %" PRIu64 "\n", atomic_load_explicit(&metrics->timeouts, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_cancellations_total Commands stopped because their client went away.\n# TYPE server_cancellations_total counter\nserver_cancellations_total %" PRIu64 "\n", atomic_load_explicit(&metrics->cancellations, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_files_served_total Requests answered by sending files without running a command.\n# TYPE server_files_served_total counter\nserver_files_served_total %" PRIu64 "\n", atomic_load_explicit(&metrics->files_served, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_tls_handshakes_total TLS handshakes completed.\n# TYPE server_tls_handshakes_total counter\nserver_tls_handshakes_total %" PRIu64 "\n", atomic_load_explicit(&metrics->tls_handshakes, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_tls_resumptions_total TLS handshakes that resumed a session from a ticket.\n# TYPE server_tls_resumptions_total counter\nserver_tls_resumptions_total %" PRIu64 "\n", atomic_load_explicit(&metrics->tls_resumptions, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_tls_kernel_total TLS connections whose records the kernel encrypts.\n# TYPE server_tls_kernel_total counter\nserver_tls_kernel_total %" PRIu64 "\n", atomic_load_explicit(&metrics->tls_kernel, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_tls_failures_total TLS connections dropped before they could be served.\n# TYPE server_tls_failures_total counter\nserver_tls_failures_total %" PRIu64 "\n", atomic_load_explicit(&metrics->tls_failures, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_connection_memory_bytes Memory held by open connections, their state and any receive buffers.\n# TYPE server_connection_memory_bytes gauge\nserver_connection_memory_bytes %" PRId64 "\n", atomic_load_explicit(&metrics->connection_memory, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_child_cpu_seconds_total CPU time used by reaped children.\n# TYPE server_child_cpu_seconds_total counter\nserver_child_cpu_seconds_total{mode=\"user\"} %.6f\nserver_child_cpu_seconds_total{mode=\"system\"} %.6f\n", (double)atomic_load_explicit(&metrics->child_user_time, memory_order_relaxed) / MICROSECONDS_PER_SECOND, (double)atomic_load_explicit(&metrics->child_system_time, memory_order_relaxed) / MICROSECONDS_PER_SECOND);
+    metrics_append(buffer, size, &offset, "# HELP server_child_context_switches_total Context switches of reaped children.\n# TYPE server_child_context_switches_total counter\nserver_child_context_switches_total{kind=\"voluntary\"} %" PRIu64 "\nserver_child_context_switches_total{kind=\"involuntary\"} %" PRIu64 "\n", atomic_load_explicit(&metrics->child_voluntary_switches, memory_order_relaxed), atomic_load_explicit(&metrics->child_involuntary_switches, memory_order_relaxed));
+    metrics_append(buffer, size, &offset, "# HELP server_stage_duration_seconds Time spent in each stage of a request.\n# TYPE server_stage_duration_seconds histogram\n");
+
+    for(size_t stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        char label[METRICS_LABEL_LEN];
+
+        snprintf(label, sizeof(label), "stage=\"%s\"", stage_names[stage]);
+        metrics_append_histogram(buffer, size, &offset, "server_stage_duration_seconds", label, &metrics->stages[stage], metrics_bucket_bounds, 1.0 / MICROSECONDS_PER_SECOND);
+    }
+
+    metrics_append(buffer, size, &offset, "# HELP server_child_cpu_time_seconds User and system CPU time of each reaped child.\n# TYPE server_child_cpu_time_seconds histogram\n");
+    metrics_append_histogram(buffer, size, &offset, "server_child_cpu_time_seconds", NULL, &metrics->child_cpu, metrics_bucket_bounds, 1.0 / MICROSECONDS_PER_SECOND);
+    metrics_append(buffer, size, &offset, "# HELP server_child_max_rss_bytes Peak resident memory of each reaped child.\n# TYPE server_child_max_rss_bytes histogram\n");
+    metrics_append_histogram(buffer, size, &offset, "server_child_max_rss_bytes", NULL, &metrics->child_rss, metrics_rss_bounds, BYTES_PER_KIB);
+
+    return offset;
+}
+
+/**
+ * Appends one histogram's cumulative buckets, sum and count. The per-bucket counts are added
+ * up as they are read, so a scrape never waits on the workers counting into them.
+ * @param buffer    the buffer
+ * @param size      the size of the buffer
+ * @param offset    the length of the text so far, advanced past the new text
+ * @param name      the metric name
+ * @param label     a label every line carries, such as stage="run", or NULL for none
+ * @param histogram the histogram
+ * @param bounds    the upper bounds of its buckets
+ * @param scale     what a recorded value is multiplied by to get the metric's unit
+ */
+static void metrics_append_histogram(char *buffer, size_t size, size_t *offset, const char *name, const char *label, const struct stage_histogram *histogram, const uint64_t *bounds, double scale)
+{
+    uint64_t cumulative;
+
+    cumulative = 0;
+
+    for(size_t bucket = 0; bucket <= METRICS_BUCKETS; bucket++)
+    {
+        cumulative += atomic_load_explicit(&histogram->buckets[bucket], memory_order_relaxed);
+
+        if(bucket < METRICS_BUCKETS)
+        {
+            metrics_append(buffer, size, offset, "%s_bucket{%s%sle=\"%.12g\"} %" PRIu64 "\n", name, label != NULL ? label : "", label != NULL ? "," : "", (double)bounds[bucket] * scale, cumulative);
+        }
+    }
+
+    metrics_append(buffer, size, offset, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, label != NULL ? label : "", label != NULL ? "," : "", cumulative);
+    metrics_append(buffer, size, offset, "%s_sum%s%s%s %.6f\n", name, label != NULL ? "{" : "", label != NULL ? label : "", label != NULL ? "}" : "", (double)atomic_load_explicit(&histogram->sum, memory_order_relaxed) * scale);
+    metrics_append(buffer, size, offset, "%s_count%s%s%s %" PRIu64 "\n", name, label != NULL ? "{" : "", label != NULL ? label : "", label != NULL ? "}" : "", cumulative);
+}
+
+/**
+ * Appends formatted text to a buffer, dropping whatever does not fit.
+ * @param buffer the buffer
+ * @param size   the size of the buffer
+ * @param offset the length of the text so far, advanced past the new text
+ * @param format the printf format
+ */
+static void metrics_append(char *buffer, size_t size, size_t *offset, const char *format, ...)
+{
+    va_list args;
+    int     written;
+
+    if(*offset >= size)
+    {
+        return;
+    }
+
+    va_start(args, format);
+    written = vsnprintf(buffer + *offset, size - *offset, format, args);
+    va_end(args);
+
+    if(written > 0)
+    {
+        *offset += (size_t)written < size - *offset ? (size_t)written : size - *offset - 1;
+    }
+}
+
+/**
+ * Starts answering metrics scrapes on their own port. The endpoint has its own thread, so
+ * a scrape is answered even while a serial server is blocked on a client, and it lives in
+ * the process that owns the shared counters, so one scrape covers every worker.
+ * @param addr        the address to listen on
+ * @param port        the port to listen on
+ * @param listener_fd the listening socket taken over from the server this one replaces, or -1 to open one
+ * @param metrics     the counters to report
+ * @return            the running endpoint
+ */
+static struct metrics_server *metrics_server_start(struct sockaddr_storage *addr, in_port_t port, int listener_fd, struct server_metrics *metrics)
+{
+    struct metrics_server *server;
+    sigset_t               all_signals;
+    sigset_t               old_mask;
+    int                    result;
+
+    server = (struct metrics_server *)calloc(1, sizeof(*server));
+
+    if(server == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    server->metrics = metrics;
+    server->fd      = listener_fd != -1 ? listener_fd : open_listener(addr, port, 0, NULL);
+    log_event(LOG_INFO, NULL, "Serving metrics on port %u", port);
+
+    // The thread inherits this mask, so SIGINT and SIGCHLD keep going to the server loop
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+    result = pthread_create(&server->thread, NULL, metrics_server_thread, server);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if(result != 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        exit(EXIT_FAILURE);
+    }
+
+    return server;
+}
+
+/**
+ * Stops the metrics thread and closes its port.
+ * @param server the endpoint to stop
+ */
+static void metrics_server_stop(struct metrics_server *server)
+{
+    // Wakes the thread out of accept()
+    shutdown(server->fd, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+    close(server->fd);
+    free(server);
+}
+
+/**
+ * Answers scrapes one at a time until the listening socket is shut down.
+ * @param arg the metrics_server
+ * @return    NULL
+ */
+static void *metrics_server_thread(void *arg)
+{
+    const struct metrics_server *server;
+
+    server = (const struct metrics_server *)arg;
+
+    for(;;)
+    {
+        int client_fd;
+
+        client_fd = accept(server->fd, NULL, NULL);
+
+        if(client_fd == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            break;
+        }
+
+        metrics_server_reply(server->metrics, client_fd);
+        close(client_fd);
+    }
+
+    return NULL;
+}
+
+/**
+ * Reads a scraper's HTTP request and answers it with the current metrics, whatever was asked for.
+ * Only snprintf() and write() are used, never stdio, so forking a worker while a scrape is
+ * being answered cannot leave the worker with a locked stream.
+ * @param metrics   the counters to report
+ * @param client_fd the scraper's connection
+ */
+static void metrics_server_reply(struct server_metrics *metrics, int client_fd)
+{
+    char           request[METRICS_REQUEST_LEN];
+    char           header[LINE_LENGTH];
+    char          *body;
+    size_t         received;
+    size_t         body_len;
+    int            header_len;
+    struct timeval timeout;
+
+    timeout.tv_sec  = METRICS_READ_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Wait for the end of the request headers so the scraper does not see a reset
+    received = 0;
+
+    while(received < sizeof(request) - 1)
+    {
+        ssize_t bytes_received;
+
+        bytes_received = recv(client_fd, request + received, sizeof(request) - 1 - received, 0);
+
+        if(bytes_received <= 0)
+        {
+            break;
+        }
+
+        received           += (size_t)bytes_received;
+        request[received]  = '\0';
+
+        if(strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+        {
+            break;
+        }
+    }
+
+    body = (char *)malloc(METRICS_RESPONSE_LEN);
+
+    if(body == NULL)
+    {
+        return;
+    }
+
+    body_len   = metrics_render(metrics, body, METRICS_RESPONSE_LEN);
+    header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+
+    if(write_fully(client_fd, header, (size_t)header_len) == 0)
+    {
+        write_fully(client_fd, body, body_len);
+    }
+
+    free(body);
+}
+
+// Logging Functions
+
+/**
+ * Opens the log and starts the thread that writes it.
+ * @param path  the file to append records to, or NULL for stderr
+ * @param level the lowest level that is logged
+ */
+static void log_open(const char *path, int level)
+{
+    struct server_log *logger;
+
+    logger = (struct server_log *)calloc(1, sizeof(*logger));
+
+    if(logger == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    logger->records = (struct log_record *)calloc(LOG_RING_LEN, sizeof(*logger->records));
+
+    if(logger->records == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    logger->fd = STDERR_FILENO;
+
+    if(path != NULL)
+    {
+        logger->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+        if(logger->fd == -1)
+        {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(size_t i = 0; i < LOG_RING_LEN; i++)
+    {
+        atomic_init(&logger->records[i].sequence, i);
+    }
+
+    logger->mask  = LOG_RING_LEN - 1;
+    logger->level = level;
+    atomic_init(&logger->tail, 0);
+    atomic_init(&logger->dropped, 0);
+    atomic_init(&logger->stopping, 0);
+
+    if(sem_init(&logger->wake, 0, 0) == -1)
+    {
+        perror("sem_init");
+        exit(EXIT_FAILURE);
+    }
+
+    log_start_thread(logger);
+    server_log = logger;
+}
+
+/**
+ * Writes everything still queued, stops the log thread and closes the log. Nothing may log
+ * from another thread once this has started.
+ */
+static void log_close(void)
+{
+    struct server_log *logger;
+
+    logger = server_log;
+
+    if(logger == NULL)
+    {
+        return;
+    }
+
+    server_log = NULL;
+    atomic_store(&logger->stopping, 1);
+    sem_post(&logger->wake);
+    pthread_join(logger->thread, NULL);
+    sem_destroy(&logger->wake);
+
+    if(logger->fd != STDERR_FILENO)
+    {
+        close(logger->fd);
+    }
+
+    free(logger->records);
+    free(logger);
+}
+
+/**
+ * Gives a freshly forked worker a log thread of its own. Records queued before the fork
+ * are the parent's to write, so the worker's copy of the ring starts out empty.
+ */
+static void log_after_fork(void)
+{
+    struct server_log *logger;
+
+    logger = server_log;
+
+    if(logger == NULL)
+    {
+        return;
+    }
+
+    for(size_t i = 0; i < LOG_RING_LEN; i++)
+    {
+        atomic_store_explicit(&logger->records[i].sequence, i, memory_order_relaxed);
+    }
+
+    atomic_store(&logger->tail, 0);
+    atomic_store(&logger->dropped, 0);
+    logger->head = 0;
+
+    // The parent's thread may have been waiting on the semaphore, so the copy starts over too
+    if(sem_init(&logger->wake, 0, 0) == -1)
+    {
+        perror("sem_init");
+        exit(EXIT_FAILURE);
+    }
+
+    log_start_thread(logger);
+}
+
+/**
+ * Starts the thread that writes a log.
+ * @param logger the log
+ */
+static void log_start_thread(struct server_log *logger)
+{
+    sigset_t all_signals;
+    sigset_t old_mask;
+    int      result;
+
+    // The thread inherits this mask, so SIGINT and SIGCHLD keep going to the server loop
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+    result = pthread_create(&logger->thread, NULL, log_thread, logger);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if(result != 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Queues a log record. Safe from any thread, and never blocks: the record is dropped if it
+ * is below the log level or the ring is full.
+ * @param level  the record's level, one of the LOG_ values
+ * @param fields the record's structured fields, or NULL for none
+ * @param format the printf format of the message
+ */
+static void log_event(int level, const struct log_fields *fields, const char *format, ...)
+{
+    struct server_log *logger;
+    struct log_record *record;
+    size_t             position;
+    va_list            args;
+
+    logger = server_log;
+
+    if(logger == NULL || level < logger->level)
+    {
+        return;
+    }
+
+    position = atomic_load_explicit(&logger->tail, memory_order_relaxed);
+
+    while(1)
+    {
+        size_t   sequence;
+        intptr_t difference;
+
+        record     = &logger->records[position & logger->mask];
+        sequence   = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        difference = (intptr_t)sequence - (intptr_t)position;
+
+        if(difference == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&logger->tail, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(difference < 0)
+        {
+            // The log thread is a whole ring behind, losing the record is better than waiting for it
+            atomic_fetch_add_explicit(&logger->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            position = atomic_load_explicit(&logger->tail, memory_order_relaxed);
+        }
+    }
+
+    record->level   = level;
+    record->present = fields != NULL ? fields->present : 0;
+    clock_gettime(CLOCK_REALTIME, &record->time);
+
+    if(fields != NULL)
+    {
+        record->pid      = fields->pid;
+        record->duration = fields->duration;
+        record->bytes    = fields->bytes;
+        record->status   = fields->status;
+
+        if(fields->present & LOG_PEER)
+        {
+            log_copy(record->peer, sizeof(record->peer), fields->peer);
+        }
+
+        if(fields->present & LOG_COMMAND)
+        {
+            log_copy(record->command, sizeof(record->command), fields->command);
+        }
+    }
+
+    va_start(args, format);
+    vsnprintf(record->message, sizeof(record->message), format, args);
+    va_end(args);
+    atomic_store_explicit(&record->sequence, position + 1, memory_order_release);
+
+    // The thread wakes on its own every LOG_FLUSH_INTERVAL, only a filling ring or a problem is worth cutting that short
+    if(level >= LOG_WARN || (position & (LOG_WAKE_RECORDS - 1)) == LOG_WAKE_RECORDS - 1)
+    {
+        sem_post(&logger->wake);
+    }
+}
+
+/**
+ * Writes queued records until the log is closed, then writes what is left.
+ * @param arg the log
+ * @return    NULL
+ */
+static void *log_thread(void *arg)
+{
+    struct server_log *logger;
+
+    logger = (struct server_log *)arg;
+
+    while(1)
+    {
+        struct timespec wake_at;
+        int             stopping;
+
+        // Read first, so every record queued before log_close() is written on the last pass
+        stopping = atomic_load(&logger->stopping);
+        log_drain(logger);
+
+        if(stopping)
+        {
+            break;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &wake_at);
+        wake_at.tv_nsec += (long)LOG_FLUSH_INTERVAL * MICROSECONDS_PER_MILLISECOND * NANOSECONDS_PER_MICROSECOND;
+
+        if(wake_at.tv_nsec >= (long)MICROSECONDS_PER_SECOND * NANOSECONDS_PER_MICROSECOND)
+        {
+            wake_at.tv_sec++;
+            wake_at.tv_nsec -= (long)MICROSECONDS_PER_SECOND * NANOSECONDS_PER_MICROSECOND;
+        }
+
+        while(sem_timedwait(&logger->wake, &wake_at) == -1 && errno == EINTR)
+        {
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Formats every record that is ready and writes them in as few writes as the batch allows.
+ * Records lost to a full ring since the last pass are reported after them.
+ * @param logger the log
+ */
+static void log_drain(struct server_log *logger)
+{
+    size_t   used;
+    uint64_t dropped;
+
+    used = 0;
+
+    while(1)
+    {
+        struct log_record *record;
+
+        record = &logger->records[logger->head & logger->mask];
+
+        if(atomic_load_explicit(&record->sequence, memory_order_acquire) != logger->head + 1)
+        {
+            break;    // Empty, or the next record is still being filled in
+        }
+
+        if(LOG_BATCH_LEN - used < LOG_LINE_MAX)
+        {
+            write_fully(logger->fd, logger->batch, used);
+            used = 0;
+        }
+
+        used += log_format(record, &logger->batch[used], LOG_BATCH_LEN - used);
+        atomic_store_explicit(&record->sequence, logger->head + logger->mask + 1, memory_order_release);
+        logger->head++;
+    }
+
+    dropped = atomic_exchange_explicit(&logger->dropped, 0, memory_order_relaxed);
+
+    if(dropped > 0)
+    {
+        struct log_record note;
+
+        if(LOG_BATCH_LEN - used < LOG_LINE_MAX)
+        {
+            write_fully(logger->fd, logger->batch, used);
+            used = 0;
+        }
+
+        memset(&note, 0, sizeof(note));
+        note.level = LOG_WARN;
+        clock_gettime(CLOCK_REALTIME, &note.time);
+        snprintf(note.message, sizeof(note.message), "Dropped %" PRIu64 " log records, the log could not keep up", dropped);
+        used += log_format(&note, &logger->batch[used], LOG_BATCH_LEN - used);
+    }
+
+    if(used > 0)
+    {
+        write_fully(logger->fd, logger->batch, used);
+    }
+}
+
+/**
+ * Splits seconds since the epoch into a UTC date and time. gmtime_r takes the lock that guards
+ * the time zone, and a worker forked while the parent's log thread held it would wait on it forever.
+ * @param seconds the seconds since the epoch
+ * @param utc     where the date and time are stored, only the year to second fields are set
+ */
+static void log_utc_time(time_t seconds, struct tm *utc)
+{
+    int64_t days;
+    int64_t time_of_day;
+    int64_t era;
+    int64_t day_of_era;
+    int64_t year_of_era;
+    int64_t day_of_year;
+    int64_t month;
+
+    days        = (int64_t)seconds / SECONDS_PER_DAY;
+    time_of_day = (int64_t)seconds % SECONDS_PER_DAY;
+
+    if(time_of_day < 0)
+    {
+        time_of_day += SECONDS_PER_DAY;
+        days--;
+    }
+
+    // Days to a civil date, counting from March so the leap day ends the year
+    days += 719468;
+    era         = (days >= 0 ? days : days - 146096) / 146097;
+    day_of_era  = days - era * 146097;
+    year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    month       = (5 * day_of_year + 2) / 153;
+
+    utc->tm_mday = (int)(day_of_year - (153 * month + 2) / 5 + 1);
+    utc->tm_mon  = (int)(month < 10 ? month + 2 : month - 10);
+    utc->tm_year = (int)(year_of_era + era * 400 + (utc->tm_mon < 2) - YEAR_BASE);
+    utc->tm_hour = (int)(time_of_day / 3600);
+    utc->tm_min  = (int)(time_of_day / 60 % 60);
+    utc->tm_sec  = (int)(time_of_day % 60);
+}
+
+/**
+ * Formats a record as one logfmt line.
+ * @param record the record
+ * @param buffer where the line goes
+ * @param size   the room in the buffer, at least LOG_LINE_MAX
+ * @return       the length of the line, including its newline
+ */
+static size_t log_format(const struct log_record *record, char *buffer, size_t size)
+{
+    static const char *const level_names[] = {"debug", "info", "warn", "error"};
+    struct tm                utc;
+    size_t                   offset;
+
+    log_utc_time(record->time.tv_sec, &utc);
+    offset = 0;
+    metrics_append(buffer, size, &offset, "time=%04d-%02d-%02dT%02d:%02d:%02d.%06ldZ level=%s msg=", utc.tm_year + YEAR_BASE, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec, record->time.tv_nsec / NANOSECONDS_PER_MICROSECOND, level_names[record->level]);
+    offset = log_append_quoted(buffer, size, offset, record->message);
+
+    if(record->present & LOG_PEER)
+    {
+        metrics_append(buffer, size, &offset, " peer=%s", record->peer);
+    }
+
+    if(record->present & LOG_COMMAND)
+    {
+        metrics_append(buffer, size, &offset, " command=");
+        offset = log_append_quoted(buffer, size, offset, record->command);
+    }
+
+    if(record->present & LOG_PID)
+    {
+        metrics_append(buffer, size, &offset, " pid=%d", (int)record->pid);
+    }
+
+    if(record->present & LOG_DURATION)
+    {
+        metrics_append(buffer, size, &offset, " duration_us=%" PRIu64, record->duration);
+    }
+
+    if(record->present & LOG_BYTES)
+    {
+        metrics_append(buffer, size, &offset, " bytes=%" PRIu64, record->bytes);
+    }
+
+    if(record->present & LOG_STATUS)
+    {
+        metrics_append(buffer, size, &offset, " status=%d", record->status);
+    }
+
+    buffer[offset++] = '\n';
+
+    return offset;
+}
+
+/**
+ * Appends a string in double quotes, escaping quotes, backslashes and control characters so
+ * a command cannot break the line it is logged on.
+ * @param buffer the buffer
+ * @param size   the size of the buffer
+ * @param offset the length of the text so far
+ * @param text   the string
+ * @return       the new length of the text
+ */
+static size_t log_append_quoted(char *buffer, size_t size, size_t offset, const char *text)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+
+    buffer[offset++] = '"';
+
+    // Room for the longest escape, the closing quote and what log_format() adds after it
+    for(const unsigned char *byte = (const unsigned char *)text; *byte != '\0' && offset + 6 < size; byte++)
+    {
+        if(*byte == '"' || *byte == '\\')
+        {
+            buffer[offset++] = '\\';
+            buffer[offset++] = (char)*byte;
+        }
+        else if(*byte < ' ' || *byte == 0x7f)
+        {
+            buffer[offset++] = '\\';
+            buffer[offset++] = 'x';
+            buffer[offset++] = hex_digits[*byte >> 4];
+            buffer[offset++] = hex_digits[*byte & 0xf];
+        }
+        else
+        {
+            buffer[offset++] = (char)*byte;
+        }
+    }
+
+    buffer[offset++] = '"';
+
+    return offset;
+}
+
+/**
+ * Copies a string into a record field, cutting it short if it does not fit.
+ * @param destination the field
+ * @param size        the size of the field
+ * @param source      the string, or NULL for an empty one
+ */
+static void log_copy(char *destination, size_t size, const char *source)
+{
+    size_t len;
+
+    len = source != NULL ? strnlen(source, size - 1) : 0;
+    memcpy(destination, source != NULL ? source : "", len);
+    destination[len] = '\0';
+}
+
+// TLS Functions
+
+#if defined(HAVE_OPENSSL)
+/**
+ * Loads the server's certificate and key and sets up what every handshake starts from.
+ * @param binary_name the name of the program
+ * @param tls_str     the certificate and key files, separated by a comma, or one file holding both
+ * @param metrics     the server's counters
+ * @return            the TLS settings
+ */
+static struct tls_server *tls_server_create(const char *binary_name, const char *tls_str, struct server_metrics *metrics)
+{
+    struct tls_server *tls;
+    const char        *separator;
+    char               certificate[PATH_MAX];
+    const char        *key;
+    size_t             certificate_len;
+
+    separator       = strchr(tls_str, TLS_KEY_SEPARATOR);
+    key             = separator != NULL ? separator + 1 : tls_str;
+    certificate_len = separator != NULL ? (size_t)(separator - tls_str) : strlen(tls_str);
+
+    if(certificate_len >= sizeof(certificate) || *key == '\0' || separator == tls_str)
+    {
+        usage(binary_name, EXIT_FAILURE, "TLS takes a certificate and a key file, such as cert.pem,key.pem.");
+    }
+
+    memcpy(certificate, tls_str, certificate_len);
+    certificate[certificate_len] = '\0';
+
+    tls = (struct tls_server *)calloc(1, sizeof(*tls));
+
+    if(tls == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    tls->metrics = metrics;
+    tls->context = SSL_CTX_new(TLS_server_method());
+
+    if(tls->context == NULL || SSL_CTX_set_min_proto_version(tls->context, TLS1_2_VERSION) != 1 || SSL_CTX_set_max_proto_version(tls->context, TLS1_2_VERSION) != 1 || SSL_CTX_set_cipher_list(tls->context, TLS_CIPHERS) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    if(SSL_CTX_use_certificate_chain_file(tls->context, certificate) != 1 || SSL_CTX_use_PrivateKey_file(tls->context, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(tls->context) != 1)
+    {
+        fprintf(stderr, "Unable to load the TLS certificate %s and key %s\n", certificate, key);
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    // Sessions resume from tickets alone. The ticket keys are made with the context, so every
+    // worker forked from here accepts the tickets the others issued, and none of them keeps a cache
+    SSL_CTX_set_options(tls->context, SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_session_cache_mode(tls->context, SSL_SESS_CACHE_OFF);
+    log_event(LOG_INFO, NULL, "Clients have to speak TLS, with the certificate in %s", certificate);
+
+    return tls;
+}
+
+/**
+ * Frees the TLS settings, unless a handshake thread is still using them at exit.
+ * @param tls the TLS settings
+ */
+static void tls_server_destroy(struct tls_server *tls)
+{
+    if(atomic_load(&tls->handshakes) != 0)
+    {
+        return;
+    }
+
+    SSL_CTX_free(tls->context);
+    free(tls);
+}
+
+/**
+ * Runs the server side of a handshake on a blocking socket. When the kernel takes the keys, the
+ * socket itself carries plaintext from then on; otherwise a relay thread encrypts for it. Either
+ * way the caller gets a descriptor it reads and writes as if there were no TLS.
+ * @param tls    the TLS settings
+ * @param sockfd the client's socket, closed if the handshake fails
+ * @return       the descriptor to serve the client on, -1 if the handshake failed
+ */
+static int tls_accept(struct tls_server *tls, int sockfd)
+{
+    SSL           *ssl;
+    struct timeval timeout;
+    int            kernel;
+
+    ssl = SSL_new(tls->context);
+
+    if(ssl == NULL || SSL_set_fd(ssl, sockfd) != 1)
+    {
+        tls_log_failure("Unable to start a TLS connection");
+        SSL_free(ssl);
+        metrics_count(&tls->metrics->tls_failures, 1);
+        socket_close(sockfd);
+        metrics_adjust(&tls->metrics->connections_open, -1);
+        return -1;
+    }
+
+    // A client that stops halfway through its handshake is dropped instead of holding a thread
+    timeout.tv_sec  = TLS_HANDSHAKE_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if(SSL_accept(ssl) != 1)
+    {
+        tls_log_failure("TLS handshake failed");
+        SSL_free(ssl);
+        metrics_count(&tls->metrics->tls_failures, 1);
+        socket_close(sockfd);
+        metrics_adjust(&tls->metrics->connections_open, -1);
+        return -1;
+    }
+
+    timeout.tv_sec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    metrics_count(&tls->metrics->tls_handshakes, 1);
+
+    if(SSL_session_reused(ssl))
+    {
+        metrics_count(&tls->metrics->tls_resumptions, 1);
+    }
+
+    kernel = BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    log_event(LOG_DEBUG, NULL, "TLS %s session with %s, %s", SSL_session_reused(ssl) ? "resumed" : "new", SSL_get_cipher_name(ssl), kernel ? "kernel TLS" : "relayed");
+
+    if(kernel)
+    {
+        // The records are the kernel's now, so the SSL object goes and the socket stays open
+        metrics_count(&tls->metrics->tls_kernel, 1);
+        SSL_free(ssl);
+        return sockfd;
+    }
+
+    sockfd = tls_start_relay(ssl, sockfd);
+
+    if(sockfd == -1)
+    {
+        metrics_count(&tls->metrics->tls_failures, 1);
+        metrics_adjust(&tls->metrics->connections_open, -1);
+    }
+
+    return sockfd;
+}
+
+/**
+ * Hands a connection to a handshake thread, which writes it to the handoff pipe once it is ready.
+ * @param tls        the TLS settings
+ * @param handoff_fd the write end of the event loop's handoff pipe
+ * @param sockfd     the client's socket
+ * @param addr       the client's address
+ * @return           0 if the thread started, -1 if the caller should close the socket
+ */
+static int tls_start_handshake(struct tls_server *tls, int handoff_fd, int sockfd, const struct sockaddr_storage *addr)
+{
+    struct tls_handshake *handshake;
+    pthread_attr_t        attributes;
+    pthread_t             thread;
+    sigset_t              all_signals;
+    sigset_t              old_mask;
+    int                   result;
+
+    if(atomic_fetch_add(&tls->handshakes, 1) >= TLS_MAX_HANDSHAKES)
+    {
+        atomic_fetch_sub(&tls->handshakes, 1);
+        log_event(LOG_WARN, NULL, "%d TLS handshakes are already running, turning a connection away", TLS_MAX_HANDSHAKES);
+        metrics_count(&tls->metrics->tls_failures, 1);
+        return -1;
+    }
+
+    handshake = (struct tls_handshake *)malloc(sizeof(*handshake));
+
+    if(handshake == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    handshake->tls             = tls;
+    handshake->handoff_fd      = handoff_fd;
+    handshake->connection.fd   = sockfd;
+    handshake->connection.addr = *addr;
+
+    // The thread inherits this mask, so SIGINT and SIGCHLD keep going to the server loop
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+    result = pthread_create(&thread, &attributes, tls_handshake_thread, handshake);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    pthread_attr_destroy(&attributes);
+
+    if(result != 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        atomic_fetch_sub(&tls->handshakes, 1);
+        free(handshake);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Runs one handshake and passes the connection back to the event loop.
+ * @param arg the tls_handshake, freed here
+ * @return    NULL
+ */
+static void *tls_handshake_thread(void *arg)
+{
+    struct tls_handshake *handshake;
+
+    handshake                = (struct tls_handshake *)arg;
+    handshake->connection.fd = tls_accept(handshake->tls, handshake->connection.fd);
+
+    // The loop is gone if the pipe is, and then so is the connection
+    if(handshake->connection.fd != -1 && write(handshake->handoff_fd, &handshake->connection, sizeof(handshake->connection)) != (ssize_t)sizeof(handshake->connection))
+    {
+        close(handshake->connection.fd);
+        metrics_adjust(&handshake->tls->metrics->connections_open, -1);
+    }
+
+    atomic_fetch_sub(&handshake->tls->handshakes, 1);
+    free(handshake);
+
+    return NULL;
+}
+
+/**
+ * Starts the thread that encrypts and decrypts for a connection the kernel could not take.
+ * @param ssl    the finished TLS connection, owned by the relay from here on
+ * @param sockfd the client's socket, closed with the relay
+ * @return       the local end of the relay, -1 if it could not be started
+ */
+static int tls_start_relay(SSL *ssl, int sockfd)
+{
+    struct tls_relay *relay;
+    int               pair[2];
+    int               flags;
+    pthread_attr_t    attributes;
+    pthread_t         thread;
+    sigset_t          all_signals;
+    sigset_t          old_mask;
+    int               result;
+
+    relay = (struct tls_relay *)malloc(sizeof(*relay));
+
+    if(relay == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        perror("socketpair");
+        free(relay);
+        SSL_free(ssl);
+        close(sockfd);
+        return -1;
+    }
+
+    // The relay waits in poll(), and a client sending half a record must not hold it up
+    flags = fcntl(sockfd, F_GETFL);
+    if(flags != -1)
+    {
+        fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    relay->ssl      = ssl;
+    relay->sockfd   = sockfd;
+    relay->local_fd = pair[1];
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+    result = pthread_create(&thread, &attributes, tls_relay_thread, relay);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    pthread_attr_destroy(&attributes);
+
+    if(result != 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        free(relay);
+        SSL_free(ssl);
+        close(sockfd);
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+
+    return pair[0];
+}
+
+/**
+ * Decrypts what the client sends into the local socket and encrypts what the server writes to
+ * it, until the server closes its end. A client's close_notify only ends the direction it came in.
+ * @param arg the tls_relay, freed here
+ * @return    NULL
+ */
+static void *tls_relay_thread(void *arg)
+{
+    struct tls_relay *relay;
+    struct pollfd     fds[2];
+    char              buffer[TLS_RELAY_CHUNK_LEN];
+    int               done;
+
+    relay         = (struct tls_relay *)arg;
+    fds[0].fd     = relay->sockfd;
+    fds[0].events = POLLIN;
+    fds[1].fd     = relay->local_fd;
+    fds[1].events = POLLIN;
+    done          = 0;
+
+    while(!done)
+    {
+        // Records already decrypted inside OpenSSL do not show up in poll()
+        if(fds[0].fd != -1 && SSL_pending(relay->ssl) > 0)
+        {
+            fds[0].revents = POLLIN;
+            fds[1].revents = 0;
+        }
+        else if(poll(fds, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            break;
+        }
+
+        if(fds[0].revents != 0)
+        {
+            int len;
+
+            len = SSL_read(relay->ssl, buffer, sizeof(buffer));
+
+            if(len > 0)
+            {
+                if(write_fully(relay->local_fd, buffer, (size_t)len) == -1)
+                {
+                    break;
+                }
+            }
+            else if(SSL_get_error(relay->ssl, len) != SSL_ERROR_WANT_READ)
+            {
+                // The client is done sending, but its reply still has to reach it
+                shutdown(relay->local_fd, SHUT_WR);
+                fds[0].fd = -1;
+            }
+        }
+
+        if(fds[1].revents != 0)
+        {
+            ssize_t len;
+            int     sent;
+
+            len = read(relay->local_fd, buffer, sizeof(buffer));
+
+            if(len <= 0)
+            {
+                break;
+            }
+
+            // Without partial writes, a write that would block is retried with the same bytes
+            while((sent = SSL_write(relay->ssl, buffer, (int)len)) <= 0)
+            {
+                struct pollfd writable;
+                int           error;
+
+                error = SSL_get_error(relay->ssl, sent);
+
+                if(error != SSL_ERROR_WANT_WRITE && error != SSL_ERROR_WANT_READ)
+                {
+                    done = 1;
+                    break;
+                }
+
+                writable.fd     = relay->sockfd;
+                writable.events = error == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN;
+                poll(&writable, 1, -1);
+            }
+        }
+    }
+
+    SSL_shutdown(relay->ssl);
+    SSL_free(relay->ssl);
+    close(relay->sockfd);
+    close(relay->local_fd);
+    free(relay);
+    ERR_clear_error();
+
+    return NULL;
+}
+
+/**
+ * Logs why a TLS connection failed and clears this thread's OpenSSL errors.
+ * @param message what failed
+ */
+static void tls_log_failure(const char *message)
+{
+    unsigned long error;
+    char          reason[LOG_MESSAGE_LEN];
+
+    error = ERR_get_error();
+
+    if(error != 0)
+    {
+        ERR_error_string_n(error, reason, sizeof(reason));
+    }
+#if EAGAIN != EWOULDBLOCK
+    else if(errno == EAGAIN || errno == EWOULDBLOCK)
+#else
+    else if(errno == EAGAIN)
+#endif
+    {
+        snprintf(reason, sizeof(reason), "the client took longer than %d seconds", TLS_HANDSHAKE_TIMEOUT);
+    }
+    else
+    {
+        snprintf(reason, sizeof(reason), "%s", errno != 0 ? strerror(errno) : "the client closed the connection");
+    }
+
+    log_event(LOG_WARN, NULL, "%s: %s", message, reason);
+    ERR_clear_error();
+}
+#endif
 
-static volatile sig_atomic_t exit_flag = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+// Worker Pool Functions
 
-int main(int argc, char *argv[])
+/**
+ * Starts the workers and restarts any that die, until SIGINT, or until SIGTERM or a handoff once
+ * they have all drained. The listening sockets are opened here, one SO_REUSEPORT socket per
+ * worker so accepting and name lookups are spread over all of them, and outlive the workers: a
+ * restarted worker picks up the connections that queued while it was down, and a handoff passes
+ * every socket to the new supervisor. Unix sockets and vsock have no SO_REUSEPORT, so the
+ * workers all accept on one socket instead.
+ * @param addr    the address the workers listen on
+ * @param port    the port the workers listen on
+ * @param options the parsed command line options
+ * @param metrics the counters shared by every worker
+ * @return        1 if the listeners were handed to a new server, 0 otherwise
+ */
+static int run_supervisor(struct sockaddr_storage *addr, in_port_t port, const struct server_options *options, struct server_metrics *metrics)
 {
-    char                   *ip_address;
-    char                   *port_str;
-    in_port_t               port;
-    int                     enable;
-    int                     sockfd;
-    struct sockaddr_storage addr;
+    pid_t         *workers;
+    time_t        *started;
+    int           *listeners;
+    size_t         listener_count;
+    size_t         running;
+    struct handoff handoff;
+    int            ready_fds[2];
+    int            draining;
+    int            handed_off;
 
-    ip_address = NULL;
-    port_str   = NULL;
+    listener_count = is_tcp_address(addr) ? options->workers : 1;
+    workers        = (pid_t *)calloc(options->workers, sizeof(*workers));
+    started        = (time_t *)calloc(options->workers, sizeof(*started));
+    listeners      = (int *)calloc(listener_count, sizeof(*listeners));
 
-    // Set up server
-    parse_arguments(argc, argv, &ip_address, &port_str);
-    handle_arguments(argv[0], ip_address, port_str, &port);
-    convert_address(ip_address, &addr);
-    sockfd = socket_create(addr.ss_family, SOCK_STREAM, 0);
+    if(workers == NULL || started == NULL || listeners == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
 
-    enable = 1;
-    if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) == -1)
+    for(size_t i = 0; i < listener_count; i++)
     {
-        perror("Setsockopt failed");
+        listeners[i] = handoff_listener(options, i, addr, port, is_tcp_address(addr));
+    }
+
+    handoff_close_unused(options, listener_count);
+    ready_fds[0] = -1;
+    ready_fds[1] = -1;
+
+    // Every worker reports on this pipe once it is ready, so the server being replaced hears once they all are
+    if(options->ready_fd != -1 && (pipe(ready_fds) == -1 || fcntl(ready_fds[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(ready_fds[1], F_SETFD, FD_CLOEXEC) == -1))
+    {
+        perror("pipe");
         exit(EXIT_FAILURE);
     }
 
-    socket_bind(sockfd, &addr, port);
-    start_listening(sockfd, SOMAXCONN);
-    setup_signal_handler();
+    for(size_t i = 0; i < options->workers; i++)
+    {
+        workers[i] = start_worker(i, listeners, listener_count, ready_fds[1], options, metrics);
+        started[i] = monotonic_seconds();
+    }
 
-    // Handle incoming client connections
-    while(!exit_flag)
+    // Each worker logs its own startup, the supervisor only waits when there is someone to tell
+    if(ready_fds[0] != -1)
     {
-        // Client socket variables
-        int                     client_sockfd;
-        int                     stdout_copy;
-        struct sockaddr_storage client_addr;
-        socklen_t               client_addr_len;
+        pid_t worker_pid;
 
-        // Command runner variables
-        char *args[LINE_LENGTH];
-        char  buffer[LINE_LENGTH];
-        char *command;
-        char  full_path[LINE_LENGTH];
-        int   find_executable_result;
+        // The pipe reaches EOF once every worker has reported or died trying
+        close(ready_fds[1]);
 
-        client_addr_len = sizeof(client_addr);
-        client_sockfd   = socket_accept_connection(sockfd, &client_addr, &client_addr_len);
-        command         = NULL;
+        while(handoff_wait(ready_fds[0], &worker_pid) == 0)
+        {
+        }
 
-        if(client_sockfd == -1)
+        close(ready_fds[0]);
+        handoff_ready(options->ready_fd, options->started);
+    }
+
+    running          = options->workers;
+    handoff.ready_fd = -1;
+    draining         = 0;
+    handed_off       = 0;
+
+    while(running > 0)
+    {
+        pid_t pid;
+        int   status;
+
+        if(reload_flag)
         {
-            if(exit_flag)
+            reload_flag = 0;
+
+            if(!draining && handoff.ready_fd == -1)
             {
-                break;
+                handoff_start(options, listeners, listener_count, &handoff);
             }
-
-            continue;
         }
 
-        stdout_copy = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);    // Duplicate stdout fd
-
-        // Command Runner
-        read_from_socket(client_sockfd, &client_addr, buffer);
-        redirect_stdout(client_sockfd);
-        split_input(buffer, &command, args);
+        if(handoff.ready_fd != -1)
+        {
+            pid_t new_pid;
 
-        find_executable_result = find_binary_executable(command, full_path, stdout_copy);
+            if(handoff_poll(&handoff, monotonic_microseconds(), &new_pid) && handoff_end(&handoff, new_pid) == 0)
+            {
+                handed_off = 1;
+                drain_flag = 1;
+            }
+        }
 
-        if(find_executable_result != 0)
+        // Workers in the terminal's process group may have the SIGTERM already, the rest need telling.
+        // The listeners are closed here too, or they would stay in the SO_REUSEPORT group once the workers close theirs
+        if(drain_flag && !draining)
         {
-            reset_stdout(stdout_copy);
-            socket_close(client_sockfd);
-            continue;
-        }
+            draining = 1;
 
-        execute_process(full_path, args);
-        reset_stdout(stdout_copy);
+            for(size_t i = 0; i < options->workers; i++)
+            {
+                if(workers[i] > 0)
+                {
+                    kill(workers[i], SIGTERM);
+                }
+            }
 
-        socket_close(client_sockfd);
-    }
+            for(size_t i = 0; i < listener_count; i++)
+            {
+                socket_close(listeners[i]);
+                listeners[i] = -1;
+            }
+        }
 
-    socket_close(sockfd);    // Close server
-    return 0;
-}
+        // Workers that die while a new server is starting are still restarted
+        pid = waitpid(-1, &status, handoff.ready_fd != -1 ? WNOHANG : 0);
 
-// ----- Function Definitions -----
+        if(pid == 0)
+        {
+            struct pollfd pfd;
 
-// Argument Parsing Functions
-static void parse_arguments(const int argc, char *argv[], char **ip_address, char **port)
-{
-    int opt;
-    opterr = 0;
+            pfd.fd      = handoff.ready_fd;
+            pfd.events  = POLLIN;
+            pfd.revents = 0;
+            poll(&pfd, 1, HANDOFF_POLL_INTERVAL);
+            continue;
+        }
 
-    // Option parsing
-    while((opt = getopt(argc, argv, "h:")) != -1)
-    {
-        switch(opt)
+        if(pid == -1)
         {
-            case 'h':
+            if(errno != EINTR)
             {
-                usage(argv[0], EXIT_SUCCESS, NULL);
+                perror("waitpid");
+                break;
             }
-            case '?':
+
+            if(exit_flag)
             {
-                char message[UNKNOWN_OPTION_MESSAGE_LEN];
+                // Workers in the terminal's process group got the SIGINT already, the rest need telling
+                for(size_t i = 0; i < options->workers; i++)
+                {
+                    if(workers[i] > 0)
+                    {
+                        kill(workers[i], SIGINT);
+                    }
+                }
+            }
 
-                snprintf(message, sizeof(message), "Unknown option '-%c'.", optopt);
-                usage(argv[0], EXIT_FAILURE, message);
+            continue;
+        }
+
+        for(size_t i = 0; i < options->workers; i++)
+        {
+            if(workers[i] != pid)
+            {
+                continue;
             }
-            default:
+
+            log_event(exit_flag || draining ? LOG_INFO : LOG_WARN, &(struct log_fields){.present = LOG_PID | LOG_STATUS, .pid = pid, .status = exit_code_from_status(status)}, "Worker %zu exited", i);
+            workers[i] = 0;
+            running--;
+
+            if(!exit_flag && !draining)
             {
-                usage(argv[0], EXIT_FAILURE, NULL);
+                if(monotonic_seconds() - started[i] < WORKER_RESTART_DELAY)
+                {
+                    sleep(WORKER_RESTART_DELAY);
+                }
+
+                workers[i] = start_worker(i, listeners, listener_count, -1, options, metrics);
+                started[i] = monotonic_seconds();
+                running++;
             }
+
+            break;
         }
     }
 
-    // Check for sufficient args
-    if(optind >= argc)
+    for(size_t i = 0; i < listener_count; i++)
     {
-        usage(argv[0], EXIT_FAILURE, "The ip address and port are required.");
+        if(listeners[i] != -1)
+        {
+            socket_close(listeners[i]);
+        }
     }
 
-    // Check for port arg
-    if(optind + 1 >= argc)
+    // The new server keeps the listeners either way, this one is leaving before it reported
+    if(handoff.ready_fd != -1)
     {
-        usage(argv[0], EXIT_FAILURE, "The port is required.");
+        handoff_cancel(&handoff);
     }
 
-    // Check for extra args
-    if(optind < argc - 2)
-    {
-        usage(argv[0], EXIT_FAILURE, "Error: Too many arguments.");
-    }
+    free(listeners);
+    free(workers);
+    free(started);
 
-    *ip_address = argv[optind];
-    *port       = argv[optind + 1];
+    return handed_off;
 }
 
-static void handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, in_port_t *port)
+/**
+ * Forks a worker process, which keeps only the listening socket it accepts on.
+ * @param index          the worker's slot, used to pick its CPU and listening socket
+ * @param listeners      the supervisor's listening sockets
+ * @param listener_count the number of listening sockets
+ * @param ready_fd       where the worker reports being ready to accept, or -1
+ * @param options        the parsed command line options
+ * @param metrics        the counters shared by every worker
+ * @return               the worker's process ID
+ */
+static pid_t start_worker(size_t index, const int *listeners, size_t listener_count, int ready_fd, const struct server_options *options, struct server_metrics *metrics)
 {
-    if(ip_address == NULL)
+    pid_t pid;
+
+    pid = fork();
+
+    if(pid == -1)
     {
-        usage(binary_name, EXIT_FAILURE, "The ip address is required.");
+        perror("fork");
+        exit(EXIT_FAILURE);
     }
 
-    if(port_str == NULL)
+    if(pid == 0)
     {
-        usage(binary_name, EXIT_FAILURE, "The port is required.");
+        log_after_fork();
+
+        for(size_t i = 0; i < listener_count; i++)
+        {
+            if(i != index % listener_count)
+            {
+                close(listeners[i]);
+            }
+        }
+
+        run_worker(index, listeners[index % listener_count], ready_fd, options, metrics);
     }
 
-    *port = parse_in_port_t(binary_name, port_str);
+    log_event(LOG_INFO, &(struct log_fields){.present = LOG_PID, .pid = pid}, "Started worker %zu", index);
+
+    return pid;
 }
 
-static in_port_t parse_in_port_t(const char *binary_name, const char *port_str)
+/**
+ * Runs a worker's own copy of the server on its listening socket, then exits.
+ * @param index       the worker's slot, used to pick its CPU
+ * @param listener_fd the listening socket the worker accepts on
+ * @param ready_fd    where the worker reports being ready to accept, or -1
+ * @param options     the parsed command line options
+ * @param metrics     the counters shared by every worker
+ */
+_Noreturn static void run_worker(size_t index, int listener_fd, int ready_fd, const struct server_options *options, struct server_metrics *metrics)
 {
-    char     *endptr;
-    uintmax_t parsed_value;
+    pin_to_cpu(index);
+    serve(listener_fd, ready_fd, options, metrics);
+    log_close();
+    exit(EXIT_SUCCESS);
+}
 
-    errno        = 0;
-    parsed_value = strtoumax(port_str, &endptr, BASE_TEN);
+/**
+ * Pins the calling process to one of the CPUs it is allowed to run on, spreading workers
+ * round-robin so each one keeps its caches and its share of the accept load.
+ * @param index the worker's slot
+ */
+static void pin_to_cpu(size_t index)
+{
+#if defined(__linux__)
+    cpu_set_t allowed;
+    cpu_set_t target;
+    int       count;
+    int       skip;
 
-    // Check for errno was signalled
-    if(errno != 0)
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
     {
-        perror("Error parsing in_port_t.");
-        exit(EXIT_FAILURE);
+        perror("sched_getaffinity");
+        return;
     }
 
-    // Check for any non-numeric characters in the input string
-    if(*endptr != '\0')
+    count = CPU_COUNT(&allowed);
+
+    if(count <= 0)
     {
-        usage(binary_name, EXIT_FAILURE, "Invalid characters in input.");
+        return;
     }
 
-    // Check if the parsed value is within valid range of in_port_t
-    if(parsed_value > UINT16_MAX)
+    skip = (int)(index % (size_t)count);
+
+    for(size_t cpu = 0; cpu < (size_t)CPU_SETSIZE; cpu++)
     {
-        usage(binary_name, EXIT_FAILURE, "in_port_t value out of range.");
-    }
+        if(!CPU_ISSET(cpu, &allowed))
+        {
+            continue;
+        }
 
-    return (in_port_t)parsed_value;
-}
+        if(skip > 0)
+        {
+            skip--;
+            continue;
+        }
 
-// Error Handling Functions
+        CPU_ZERO(&target);
+        CPU_SET(cpu, &target);
 
-_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
-{
-    if(message)
-    {
-        fprintf(stderr, "%s\n", message);
-    }
+        if(sched_setaffinity(0, sizeof(target), &target) == -1)
+        {
+            perror("sched_setaffinity");
+            return;
+        }
 
-    fprintf(stderr, "Usage: %s [-h] <ip address> <port>\n", program_name);
-    fputs("Options:\n", stderr);
-    fputs(" -h Display this help message\n", stderr);
-    exit(exit_code);
-}
+        // Set before serve starts any thread, which all read them without locking
+        unpinned_cpus = allowed;
+        pinned_cpus   = target;
+        cpus_pinned   = 1;
 
-// Network Handling Functions
+        return;
+    }
+#else
+    (void)index;
+#endif
+}
 
 /**
- * Converts the address from a human-readable string into a binary representation.
- * @param address string IP address in human-readable format (e.g., "192.168.0.1")
- * @param addr    pointer to the struct sockaddr_storage where the binary representation will be stored
+ * Moves the calling thread back onto the CPUs the worker was allowed before pin_to_cpu, or onto
+ * its own CPU again. Children inherit the mask, so each one is unpinned before it execs, otherwise
+ * every command a worker runs would share that worker's single CPU. Safe in a vfork child, and a
+ * failure only leaves the mask as it was.
+ * @param pinned 1 to pin the thread to the worker's CPU, 0 to unpin it
  */
-static void convert_address(const char *address, struct sockaddr_storage *addr)
+static void set_pinned(int pinned)
 {
-    memset(addr, 0, sizeof(*addr));
-
-    // Converts the str address to binary address and checks for IPv4 or IPv6
-    if(inet_pton(AF_INET, address, &(((struct sockaddr_in *)addr)->sin_addr)) == 1)
-    {
-        // IPv4 address
-        addr->ss_family = AF_INET;
-        printf("IPv4 found\n");
-    }
-    else if(inet_pton(AF_INET6, address, &(((struct sockaddr_in6 *)addr)->sin6_addr)) == 1)
-    {
-        // IPv6 address
-        addr->ss_family = AF_INET6;
-    }
-    else
+#if defined(__linux__)
+    if(cpus_pinned)
     {
-        fprintf(stderr, "%s is not an IPv4 or IPv6 address\n", address);
-        exit(EXIT_FAILURE);
+        sched_setaffinity(0, sizeof(cpu_set_t), pinned ? &pinned_cpus : &unpinned_cpus);
     }
+#else
+    (void)pinned;
+#endif
 }
 
+// Handoff Functions
+
 /**
- * Creates a socket with the specified domain, type, and protocol.
- * @param domain   the communication domain, e.g., AF_INET for IPv4 or AF_INET6 for IPv6
- * @param type     the socket type, e.g., SOCK_STREAM for a TCP socket or SOCK_DGRAM for a UDP socket
- * @param protocol the specific protocol to be used, often set to 0 for the default protocol
- * @return         the file descriptor for the created socket, or -1 on error
+ * Takes over the listening sockets the server being replaced handed down, so this one accepts
+ * on the very same sockets and a connection that arrives while both are running is never refused.
+ * Anything in the variables that is not a listening socket of the right family is ignored, and
+ * the variables are cleared so the commands the server runs never see them.
+ * @param options the parsed command line options, where the sockets are stored
+ * @param addr    the address the server listens on
  */
-static int socket_create(int domain, int type, int protocol)
+static void handoff_adopt(struct server_options *options, const struct sockaddr_storage *addr)
 {
-    int sockfd;
+    const char *listeners_str;
+    const char *metrics_str;
+    const char *ready_str;
+    const char *end;
 
-    sockfd = socket(domain, type, protocol);
+    options->inherited_count   = 0;
+    options->inherited_metrics = -1;
+    options->ready_fd          = -1;
+    listeners_str              = getenv(HANDOFF_LISTENERS_ENV);
+    metrics_str                = getenv(HANDOFF_METRICS_ENV);
+    ready_str                  = getenv(HANDOFF_READY_ENV);
 
-    if(sockfd == -1)
+    if(listeners_str != NULL)
     {
-        fprintf(stderr, "Socket creation failed\n");
-        exit(EXIT_FAILURE);
-    }
+        options->inherited = (int *)calloc(MAX_WORKERS, sizeof(*options->inherited));
 
-    return sockfd;
-}
+        if(options->inherited == NULL)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
 
-/**
- * Binds a socket to the specified address and port.
- * @param sockfd    the socket file descriptor
- * @param addr      a pointer to the struct sockaddr_storage containing the address
- * @param port      the port number to bind the socket
- */
-static void socket_bind(int sockfd, struct sockaddr_storage *addr, in_port_t port)
-{
-    char      addr_str[INET6_ADDRSTRLEN];    // Array to store human-readable IP address for either IPv4 or IPv6
-    socklen_t addr_len;                      // Variable to store the length of the addr struct
-    void     *vaddr;                         // Pointer to actual (binary) IP address within addr struct
-    in_port_t net_port;                      // Stores network byte order representation of port number
+        for(const char *fd_str = listeners_str; *fd_str != '\0' && options->inherited_count < MAX_WORKERS; fd_str = *end == ',' ? end + 1 : end)
+        {
+            int fd;
 
-    // Convert port number to network byte order (big endian)
-    net_port = htons(port);
+            fd = handoff_parse_fd(fd_str, &end);
 
-    // Handle IPv4
-    if(addr->ss_family == AF_INET)
-    {
-        struct sockaddr_in *ipv4_addr;
+            if(fd == -1)
+            {
+                break;
+            }
 
-        ipv4_addr           = (struct sockaddr_in *)addr;
-        addr_len            = sizeof(*ipv4_addr);
-        ipv4_addr->sin_port = net_port;
-        vaddr               = (void *)&(((struct sockaddr_in *)addr)->sin_addr);
-    }
-    // Handle IPv6
-    else if(addr->ss_family == AF_INET6)
-    {
-        struct sockaddr_in6 *ipv6_addr;
+            if(handoff_check_listener(fd, addr) == 0)
+            {
+                options->inherited[options->inherited_count++] = fd;
+            }
+        }
 
-        ipv6_addr            = (struct sockaddr_in6 *)addr;
-        addr_len             = sizeof(*ipv6_addr);
-        ipv6_addr->sin6_port = net_port;
-        vaddr                = (void *)&(((struct sockaddr_in6 *)addr)->sin6_addr);
-    }
-    else
-    {
-        fprintf(stderr, "Internal error: addr->ss_family must be AF_INET or AF_INET6, was: %d\n", addr->ss_family);
-        exit(EXIT_FAILURE);
+        log_event(LOG_INFO, NULL, "Took over %zu listening sockets from the server being replaced", options->inherited_count);
     }
 
-    // Converts binary IP address to a human-readable string and stores it in addr_str
-    if(inet_ntop(addr->ss_family, vaddr, addr_str, sizeof(addr_str)) == NULL)
+    if(metrics_str != NULL)
     {
-        perror("inet_ntop");
-        exit(EXIT_FAILURE);
-    }
+        int fd;
+
+        fd = handoff_parse_fd(metrics_str, &end);
 
-    printf("Binding to %s:%u\n", addr_str, port);
+        if(fd != -1 && handoff_check_listener(fd, addr) == 0)
+        {
+            options->inherited_metrics = fd;
+        }
+    }
 
-    // Bind socket to port
-    if(bind(sockfd, (struct sockaddr *)addr, addr_len) == -1)
+    if(ready_str != NULL)
     {
-        perror("Binding failed");
-        fprintf(stderr, "Error code: %d\n", errno);
-        exit(EXIT_FAILURE);
+        options->ready_fd = handoff_parse_fd(ready_str, &end);
+
+        if(options->ready_fd != -1 && fcntl(options->ready_fd, F_SETFD, FD_CLOEXEC) == -1)
+        {
+            options->ready_fd = -1;
+        }
     }
 
-    printf("Bound to socket: %s:%u\n", addr_str, port);
+    unsetenv(HANDOFF_LISTENERS_ENV);
+    unsetenv(HANDOFF_METRICS_ENV);
+    unsetenv(HANDOFF_READY_ENV);
 }
 
 /**
- * Starts listening on a server socket for incoming connections with a specified backlog.
- * @param server_fd the file descriptor of the server socket to start listening on
- * @param backlog   the maximum number of pending connections that can be queued up
+ * Parses a file descriptor at the start of a string.
+ * @param fd_str the string
+ * @param end    where a pointer to the first character after the number is stored
+ * @return       the file descriptor, or -1 if the string does not start with one
  */
-static void start_listening(int server_fd, int backlog)
+static int handoff_parse_fd(const char *fd_str, const char **end)
 {
-    if(listen(server_fd, backlog) == -1)
+    char *endptr;
+    long  fd;
+
+    errno = 0;
+    fd    = strtol(fd_str, &endptr, BASE_TEN);
+    *end  = endptr;
+
+    if(errno != 0 || endptr == fd_str || fd < 0 || fd > INT_MAX)
     {
-        perror("listen failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    printf("Listening for incoming connections...\n");
+    return (int)fd;
 }
 
 /**
- * Accepts an incoming connection on the server socket.
- * @param server_fd         the file descriptor of the server socket
- * @param client_addr       a pointer to a struct sockaddr_storage for storing client address information
- * @param client_addr_len   a pointer to the length of the client address structure
- * @return                 the file descriptor for the accepted connection, or -1 on error
+ * Checks that an inherited descriptor is a listening socket for the server's address family, and
+ * keeps it out of children again. It goes back to blocking, since the old server may have left
+ * it non-blocking and the serial loop needs accept to wait; the old one stops accepting from it
+ * before this server does.
+ * @param fd   the descriptor
+ * @param addr the address the server listens on
+ * @return     0 if the socket can be used, -1 otherwise
  */
-static int socket_accept_connection(int server_fd, struct sockaddr_storage *client_addr, socklen_t *client_addr_len)
+static int handoff_check_listener(int fd, const struct sockaddr_storage *addr)
 {
-    int  client_fd;
-    char client_host[NI_MAXHOST];       // Array to store the hostname of the client
-    char client_service[NI_MAXSERV];    // Array to store the port information of the client
+    struct sockaddr_storage bound;
+    socklen_t               len;
+    int                     listening;
+    int                     flags;
 
-    errno     = 0;
-    client_fd = accept(server_fd, (struct sockaddr *)client_addr, client_addr_len);
+    len = sizeof(listening);
 
-    if(client_fd == -1)
+    if(getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1 || !listening)
     {
-        if(errno != EINTR)
-        {
-            perror("accept failed");
-        }
-
+        log_event(LOG_WARN, NULL, "Inherited descriptor %d is not a listening socket, ignoring it", fd);
         return -1;
     }
 
-    // Attempts to successfully convert the address information
-    if(getnameinfo((struct sockaddr *)client_addr, *client_addr_len, client_host, NI_MAXHOST, client_service, NI_MAXSERV, 0) == 0)
+    len = sizeof(bound);
+
+    if(getsockname(fd, (struct sockaddr *)&bound, &len) == -1 || bound.ss_family != addr->ss_family)
     {
-        printf("Accepted a new connection from %s:%s\n", client_host, client_service);
+        log_event(LOG_WARN, NULL, "Inherited socket %d is not for this address, ignoring it", fd);
+        return -1;
     }
-    else
+
+    flags = fcntl(fd, F_GETFL);
+
+    if(fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 || flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1)
     {
-        printf("Unable to get client information\n");
+        perror("fcntl");
+        return -1;
     }
 
-    return client_fd;
+    return 0;
 }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-
 /**
- * Reads input from the network socket
- * @param client_sockfd   the file descriptor for the connected client socket
- * @param client_addr     a pointer to a struct sockaddr_storage containing client address information
+ * Gets a listening socket: the one taken over in this slot when there is one, a new one otherwise.
+ * @param options    the parsed command line options
+ * @param index      the slot
+ * @param addr       the address to listen on
+ * @param port       the port to listen on
+ * @param reuse_port non-zero to open the socket with SO_REUSEPORT
+ * @return           the file descriptor of the listening socket
  */
-static void read_from_socket(int client_sockfd, struct sockaddr_storage *client_addr, char *buffer)
+static int handoff_listener(const struct server_options *options, size_t index, struct sockaddr_storage *addr, in_port_t port, int reuse_port)
 {
-    uint8_t size;
-    char    word[UINT8_MAX + 1];
-
-    // Reset buffer
-    for(int i = 0; i < LINE_LENGTH; i++)
+    if(index < options->inherited_count)
     {
-        buffer[i] = '\0';
+        return options->inherited[index];
     }
 
-    read(client_sockfd, &size, sizeof(uint8_t));
-    read(client_sockfd, word, size);
-    word[size] = '\0';
-    printf("Size: %d\n", size);
-    printf("Word: %s\n", word);
-    strncpy(buffer, word, strlen(word));
+    return open_listener(addr, port, reuse_port, &options->tuning);
 }
 
-#pragma GCC diagnostic pop
-
 /**
- * Closes a socket with the specified file descriptor.
- * @param sockfd the file descriptor of the socket to be closed
+ * Closes the sockets taken over that this server has no slot for, when it runs fewer workers
+ * than the one it replaces. Connections still queued on them are reset once the old workers exit.
+ * @param options the parsed command line options
+ * @param used    how many of the sockets are in use
  */
-static void socket_close(int sockfd)
+static void handoff_close_unused(const struct server_options *options, size_t used)
 {
-    if(close(sockfd) == -1)
+    if(options->inherited_count <= used)
     {
-        perror("error closing socket");
-        exit(EXIT_FAILURE);
+        return;
     }
-}
 
-/**
- * Redirect the standard output (stdout) to the specified file descriptor.
- * @param fd The file descriptor to which stdout should be redirected.
- */
-static void redirect_stdout(int fd)
-{
-    if(dup2(fd, STDOUT_FILENO) == -1)
+    for(size_t i = used; i < options->inherited_count; i++)
     {
-        perror("dup2");
-        close(fd);
-        exit(EXIT_FAILURE);
+        close(options->inherited[i]);
     }
+
+    log_event(LOG_WARN, NULL, "Closed %zu listening sockets this server has no worker for", options->inherited_count - used);
 }
 
 /**
- * Redirects the standard output copy to the original standard output file descriptor.
- * @param stdout_copy A copy file descriptor of standard output
+ * Starts a new server from the same command line and hands it the listening sockets. The binary
+ * is looked up again, so a deploy that replaced it starts the new version. The new server is
+ * forked twice, so it is not this process's child: nothing here reaps it, and it carries on once
+ * this one exits. It reports on the handoff's readiness pipe once it is accepting, which the
+ * caller waits for with handoff_poll or handoff_wait and then passes to handoff_end.
+ * @param options   the parsed command line options
+ * @param listeners the listening sockets to hand over, which must outlive the handoff
+ * @param count     the number of listening sockets
+ * @param handoff   where the handoff in progress is tracked
+ * @return          0 once the new server is started, -1 if it could not be and this one carries on
  */
-static void reset_stdout(int stdout_copy)
+static int handoff_start(const struct server_options *options, const int *listeners, size_t count, struct handoff *handoff)
 {
-    if(dup2(stdout_copy, STDOUT_FILENO) == -1)
+    char  **environment;
+    char   *listeners_env;
+    char    metrics_env[sizeof(HANDOFF_METRICS_ENV) + HANDOFF_FD_LEN];
+    char    ready_env[sizeof(HANDOFF_READY_ENV) + HANDOFF_FD_LEN];
+    size_t  environment_len;
+    size_t  listeners_len;
+    size_t  offset;
+    int    *flags;
+    int     ready_fds[2];
+    pid_t   pid;
+
+    handoff->started = monotonic_microseconds();
+    environment_len  = 0;
+
+    while(environ[environment_len] != NULL)
     {
-        perror("dup2 after execv");
-        close(STDOUT_FILENO);
-        exit(EXIT_FAILURE);
+        environment_len++;
     }
-}
 
-// Command Runner Functions
+    // Everything is built up front, after the fork the child may only make async-signal-safe calls
+    listeners_len = sizeof(HANDOFF_LISTENERS_ENV) + count * HANDOFF_FD_LEN;
+    environment   = (char **)calloc(environment_len + 4, sizeof(*environment));
+    listeners_env = (char *)malloc(listeners_len);
+    flags         = (int *)calloc(count, sizeof(*flags));
 
-/**
- * Split an input string into a command and its arguments.
- * @param input The input string to be split.
- * @param command A pointer to store the command extracted from the input.
- * @param args An array of pointers to store the arguments extracted from the input.
- * @param args_used A pointer to an integer that keeps track of the number of arguments extracted.
- * @param stdout_copy A copy of the original stdout file descriptor
- */
-static void split_input(char *input, char **command, char **args)
-{
-    int        args_count = 0;
-    char      *savePtr;
-    const char delimiter[] = " ";
-    char      *token;
+    if(environment == NULL || listeners_env == NULL || flags == NULL || pipe(ready_fds) == -1)
+    {
+        perror("handoff");
+        free((void *)environment);
+        free(listeners_env);
+        free(flags);
+        return -1;
+    }
 
-    token = strtok_r(input, delimiter, &savePtr);
+    offset = (size_t)snprintf(listeners_env, listeners_len, "%s=", HANDOFF_LISTENERS_ENV);
 
-    while(token != NULL)
+    for(size_t i = 0; i < count; i++)
     {
-        if(args_count == 0)
+        offset += (size_t)snprintf(&listeners_env[offset], listeners_len - offset, i > 0 ? ",%d" : "%d", listeners[i]);
+        flags[i] = fcntl(listeners[i], F_GETFL);
+    }
+
+    snprintf(metrics_env, sizeof(metrics_env), "%s=%d", HANDOFF_METRICS_ENV, options->metrics_fd);
+    snprintf(ready_env, sizeof(ready_env), "%s=%d", HANDOFF_READY_ENV, ready_fds[1]);
+    memcpy((void *)environment, (void *)environ, environment_len * sizeof(*environment));
+    environment[environment_len++] = listeners_env;
+    environment[environment_len++] = ready_env;
+
+    if(options->metrics_fd != -1)
+    {
+        environment[environment_len++] = metrics_env;
+    }
+
+    log_event(LOG_INFO, NULL, "Starting %s and handing it %zu listening sockets", options->argv[0], count);
+    pid = fork();
+
+    if(pid == 0)
+    {
+        sigset_t empty_mask;
+
+        if(fork() != 0)
         {
-            // Set command
-            *command = token;
+            _exit(0);
         }
-        // Set args
-        args[args_count] = token;
 
-        token = strtok_r(NULL, delimiter, &savePtr);
-        args_count++;
+        // The listeners and the pipe have to survive the exec, and the event loop's blocked SIGCHLD must not
+        for(size_t i = 0; i < count; i++)
+        {
+            fcntl(listeners[i], F_SETFD, 0);
+        }
+
+        if(options->metrics_fd != -1)
+        {
+            fcntl(options->metrics_fd, F_SETFD, 0);
+        }
+
+        close(ready_fds[0]);
+        sigemptyset(&empty_mask);
+        sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+        set_pinned(0);
+        environ = environment;
+        execvp(options->argv[0], options->argv);
+        _exit(EXIT_FAILURE);
     }
-    // execv requires for a null terminated list of args
-    args[args_count] = NULL;
+
+    close(ready_fds[1]);
+    free((void *)environment);
+    free(listeners_env);
+
+    if(pid == -1)
+    {
+        perror("fork");
+        close(ready_fds[0]);
+        free(flags);
+        return -1;
+    }
+
+    // The intermediate child exits straight after its own fork
+    while(waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+    {
+    }
+
+    // Only ever read once it is readable or the deadline has passed, the caller never blocks on it
+    if(fcntl(ready_fds[0], F_SETFL, O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+    }
+
+    handoff->ready_fd  = ready_fds[0];
+    handoff->deadline  = handoff->started + (uint64_t)HANDOFF_TIMEOUT * MICROSECONDS_PER_SECOND;
+    handoff->listeners = listeners;
+    handoff->count     = count;
+    handoff->flags     = flags;
+
+    return 0;
 }
 
 /**
- * Find the full path of a binary executable given its command name.
- * @param command The command name to search for, e.g., "ls" or "gcc".
- * @param full_path A buffer to store the full path of the executable if found.
- * @return 0 if the executable is found, -1 if not found or an error occurs.
+ * Checks, without blocking, whether the new server has reported that it is accepting.
+ * @param handoff the handoff in progress
+ * @param now     monotonic microseconds
+ * @param pid     where the new server's process ID is stored, -1 if it failed or timed out
+ * @return        1 once the handoff is decided, 0 while the new server is still starting
  */
-int find_binary_executable(const char *command, char *full_path, int stdout_copy)
+static int handoff_poll(const struct handoff *handoff, uint64_t now, pid_t *pid)
 {
-    const char delimiter[] = ":";
-    char      *path;
-    char       path_copy[LINE_LENGTH];    // Create a copy to not alter the original
-    char      *path_token;
-    char      *savePtr;
+    ssize_t received;
 
-    path = getenv("PATH");
+    received = read(handoff->ready_fd, pid, sizeof(*pid));
 
-    if(path == NULL)
+    if(received == (ssize_t)sizeof(*pid))
     {
-        fprintf(stdout, "PATH environment variable not found.\n");
-        reset_stdout(stdout_copy);
-        return EXIT_FAILURE;
+        return 1;
     }
 
-    strncpy(path_copy, path, strlen(path));
-
-    path_token = strtok_r(path_copy, delimiter, &savePtr);
+    *pid = -1;
 
-    while(path_token != NULL)
+    // EOF means it exited or failed before reporting
+    if(received == -1 && (errno == EAGAIN || errno == EINTR))
     {
-        snprintf(full_path, LINE_LENGTH, "%s/%s", path_token, command);
-        if(access(full_path, X_OK) == 0)    // Checks if the path is an executable file
+        if(now < handoff->deadline)
         {
-            return EXIT_SUCCESS;    // Binary executable found
+            return 0;
         }
-        path_token = strtok_r(NULL, delimiter, &savePtr);
+
+        log_event(LOG_WARN, NULL, "Nothing reported ready within %d seconds", HANDOFF_TIMEOUT);
     }
-    fprintf(stdout, "Command %s was not found.\n", command);
-    reset_stdout(stdout_copy);
-    return EXIT_FAILURE;
+
+    return 1;
 }
 
 /**
- * Execute a new process with the specified binary and arguments.
- * @param full_path The full path to the binary executable to be executed.
- * @param args An array of pointers to the arguments for the new process.
+ * Finishes a handoff once it is decided. If the new server never got ready, the listeners get
+ * back the flags it may have changed and this one carries on.
+ * @param handoff the handoff, whose readiness pipe is closed unless the caller already has
+ * @param pid     the new server's process ID, or -1 if it failed or timed out
+ * @return        0 if the new server took over, -1 if this one carries on
  */
-void execute_process(const char *full_path, char **args)
+static int handoff_end(struct handoff *handoff, pid_t pid)
 {
-    pid_t pid = fork();
-    if(pid == -1)
+    if(pid != -1)
     {
-        perror("Error creating child process");
-        exit(EXIT_FAILURE);
+        log_event(LOG_INFO, &(struct log_fields){.present = LOG_PID | LOG_DURATION, .pid = pid, .duration = monotonic_microseconds() - handoff->started}, "The new server is accepting, handing over to it");
     }
-    else if(pid == 0)
+    else
     {
-        // Child process
-        execv(full_path, args);
+        log_event(LOG_ERROR, NULL, "The new server did not get ready, carrying on");
+
+        // The new server may have changed whether accept blocks before it failed
+        for(size_t i = 0; i < handoff->count; i++)
+        {
+            if(handoff->flags[i] != -1 && handoff->listeners[i] != -1)
+            {
+                fcntl(handoff->listeners[i], F_SETFL, handoff->flags[i]);
+            }
+        }
     }
-    else
+
+    handoff_cancel(handoff);
+
+    return pid != -1 ? 0 : -1;
+}
+
+/**
+ * Stops tracking a handoff, leaving the new server to carry on or fail on its own. Used as is
+ * when this server exits before the new one has reported.
+ * @param handoff the handoff
+ */
+static void handoff_cancel(struct handoff *handoff)
+{
+    if(handoff->ready_fd != -1)
     {
-        // Parent process
-        int status;
-        waitpid(pid, &status, 0);
-        if(WIFEXITED(status))
+        close(handoff->ready_fd);
+        handoff->ready_fd = -1;
+    }
+
+    free(handoff->flags);
+    handoff->flags = NULL;
+}
+
+/**
+ * Waits for a process ID on a readiness pipe, for up to HANDOFF_TIMEOUT. SIGINT gives up.
+ * @param ready_fd the read end of the pipe
+ * @param pid      where the process ID is stored
+ * @return         0 once one arrived, -1 on EOF, a timeout or SIGINT
+ */
+static int handoff_wait(int ready_fd, pid_t *pid)
+{
+    struct pollfd pfd;
+    uint64_t      deadline;
+
+    deadline = monotonic_microseconds() + (uint64_t)HANDOFF_TIMEOUT * MICROSECONDS_PER_SECOND;
+
+    while(!exit_flag)
+    {
+        uint64_t now;
+        int      ready;
+
+        now = monotonic_microseconds();
+
+        if(now >= deadline)
+        {
+            log_event(LOG_WARN, NULL, "Nothing reported ready within %d seconds", HANDOFF_TIMEOUT);
+            return -1;
+        }
+
+        pfd.fd      = ready_fd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        ready       = poll(&pfd, 1, (int)((deadline - now) / MICROSECONDS_PER_MILLISECOND) + 1);
+
+        if(ready == -1 && errno != EINTR)
+        {
+            perror("poll");
+            return -1;
+        }
+
+        if(ready > 0)
         {
-            printf("Child process exited with status: %d\n", WEXITSTATUS(status));
+            return read(ready_fd, pid, sizeof(*pid)) == (ssize_t)sizeof(*pid) ? 0 : -1;
         }
     }
+
+    return -1;
 }
 
 /**
- * Free the memory allocated for the command and its arguments.
- * @param command The pointer to the command string that needs to be freed.
- * @param args An array of pointers to the arguments that need to be freed.
- * @param args_used The number of arguments stored in the 'args' array.
+ * Logs how long startup took and tells the server being replaced, if there is one, that this one
+ * is accepting so it can stop and drain. The path cache and warm pools are filled by the time
+ * this is called, so the first clients never wait on them.
+ * @param ready_fd the write end of the readiness pipe, or -1 when no server is being replaced
+ * @param started  monotonic microseconds when the process started
  */
-//static void free_memory(char *command, char **args, int args_used)
-//{
-//    free(command);
-//    for(int i = 0; i < args_used; i++)
-//    {
-//        if(args[i] != NULL)
-//        {
-//            //            free(args[i]);
-//        }
-//    }
-//    printf("Memory deallocated\n");
-//}
+static void handoff_ready(int ready_fd, uint64_t started)
+{
+    if(ready_fd != -1)
+    {
+        pid_t pid;
+
+        pid = getpid();
+
+        if(write(ready_fd, &pid, sizeof(pid)) != (ssize_t)sizeof(pid))
+        {
+            perror("write");
+        }
+
+        close(ready_fd);
+    }
+
+    log_event(LOG_INFO, &(struct log_fields){.present = LOG_DURATION, .duration = monotonic_microseconds() - started}, "Ready to accept");
+}
 
 // Signal Handling Functions
 
@@ -662,6 +12235,53 @@ static void setup_signal_handler(void)
         perror("sigaction");
         exit(EXIT_FAILURE);
     }
+
+    // SIGTERM stops accepting and exits once the requests in flight are done, SIGUSR2 hands the listeners to a new server first
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = sigterm_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+
+    if(sigaction(SIGTERM, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = sigusr2_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+
+    if(sigaction(SIGUSR2, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+
+    // A client that disconnects mid-response should fail the write, not kill the server.
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = SIG_IGN;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+
+    if(sigaction(SIGPIPE, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
 }
 
 #pragma GCC diagnostic push
@@ -676,4 +12296,22 @@ static void sigint_handler(int signum)
     exit_flag = 1;
 }
 
+/**
+ * Signal handler function for SIGTERM, which drains the server instead of stopping it outright.
+ * @param signum the signal number, SIGTERM in this context
+ */
+static void sigterm_handler(int signum)
+{
+    drain_flag = 1;
+}
+
+/**
+ * Signal handler function for SIGUSR2, which starts a new server and hands it the listeners.
+ * @param signum the signal number, SIGUSR2 in this context
+ */
+static void sigusr2_handler(int signum)
+{
+    reload_flag = 1;
+}
+
 #pragma GCC diagnostic pop